@@ -0,0 +1,341 @@
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "androidcmd.h"
+#include "metrics.h"
+#include "network.h"
+#include "trace.h"
+#include "manualcommands.h"
+
+#define MAX_EVENTS 16
+
+// Only the server's thread writes, so a plain load and store will do.
+AndroidCommandStats androidCommandStats;
+
+typedef struct
+{
+	LineReader	reader;		// reader.fd is -1 when the slot is free.
+	int			manual;		// Holds manual control.
+} AndroidClient;
+
+static int listenTag;
+
+static int epollfd = -1;
+static int listenfd = -1;
+static AndroidClient clients[ANDROID_MAX_CLIENTS];
+static AndroidClient *manualClient = NULL;
+static AndroidCommandHandlers handlers;
+
+// FNV-1a, seeded so that every manual command has its own slot in
+// manualCommands. Must match gen-manual-commands.py.
+static unsigned int manualCommandSlot( const char *name )
+{
+	uint32_t hash = MANUAL_COMMAND_SEED;
+	while( *name != '\0' )
+	{
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619U;
+	}
+	return hash >> ( 32 - MANUAL_COMMAND_TABLE_BITS );
+}
+
+static void dispatchManualCommand( const char *line )
+{
+	const ManualCommand *command = &manualCommands[manualCommandSlot( line )];
+	if( command->name != NULL && strcmp( command->name, line ) == 0 )
+	{
+		TRACE_INSTANT( command->name, NULL, 0, NULL, 0 );
+		command->handler();
+		COUNT( androidCommandStats.manualCommands );
+		printf( "Recv :: %s\n", line );
+	}
+	else
+	{
+		COUNT( androidCommandStats.rejected );
+		fprintf( stderr, "Unrecognized Android command: %s\n", line );
+	}
+}
+
+// "list <count> <lat> <lon> ...".
+static void parseWaypointList( const char *line )
+{
+	static GpsPoint waypoints[ANDROID_MAX_WAYPOINTS];
+
+	char *end;
+	long count = strtol( line + 4, &end, 10 );
+	if( end == line + 4 || count < 0 )
+	{
+		COUNT( androidCommandStats.rejected );
+		fprintf( stderr, "Malformed waypoint list '%s'.\n", line );
+		return;
+	}
+	if( count > ANDROID_MAX_WAYPOINTS )
+	{
+		fprintf( stderr, "Waypoint list too long, keeping the first %d.\n", ANDROID_MAX_WAYPOINTS );
+		count = ANDROID_MAX_WAYPOINTS;
+	}
+
+	printf( "%s\n", line );
+	unsigned int i;
+	for( i = 0; i < count; i++ )
+	{
+		char *next;
+		waypoints[i].latitude = strtod( end, &next );
+		waypoints[i].longitude = strtod( next, &end );
+		if( end == next )
+		{
+			fprintf( stderr, "Waypoint list '%s' has only %u points.\n", line, i );
+			break;
+		}
+		printf( "%lf %lf\n", waypoints[i].latitude, waypoints[i].longitude );
+	}
+
+	COUNT( androidCommandStats.routes );
+	TRACE_INSTANT( "android.route", "waypoints", i, NULL, 0 );
+	if( handlers.route != NULL )
+	{
+		handlers.route( waypoints, i, handlers.arg );
+	}
+}
+
+static void handleMessage( AndroidClient *client, const char *line )
+{
+	COUNT( androidCommandStats.messages );
+	if( client->manual )
+	{
+		dispatchManualCommand( line );
+	}
+	else if( strcmp( line, "manual" ) == 0 )
+	{
+		if( handlers.manualStart == NULL )
+		{
+			COUNT( androidCommandStats.rejected );
+			printf( "Manual control isn't available.\n" );
+			return;
+		}
+		if( manualClient != NULL )
+		{
+			COUNT( androidCommandStats.rejected );
+			printf( "Another Android device already has manual control.\n" );
+			return;
+		}
+
+		// Getting commands from Android device, go into slave mode.
+		client->manual = 1;
+		manualClient = client;
+		handlers.manualStart( handlers.arg );
+	}
+	else if( strncmp( line, "list", 4 ) == 0 )
+	{
+		parseWaypointList( line );
+	}
+	else if( line[0] != '\0' )
+	{
+		COUNT( androidCommandStats.rejected );
+		printf( "Unrecognized string \'%s\'.\n", line );
+	}
+}
+
+static void closeClient( AndroidClient *client )
+{
+	printf( "Android client disconnected\n" );
+	epoll_ctl( epollfd, EPOLL_CTL_DEL, client->reader.fd, NULL );
+	close( client->reader.fd );
+	client->reader.fd = -1;
+	atomic_fetch_sub_explicit( &androidCommandStats.clients, 1, memory_order_relaxed );
+
+	// When the manual client goes away, hand control back.
+	if( client == manualClient )
+	{
+		manualClient = NULL;
+		client->manual = 0;
+		if( handlers.manualEnd != NULL )
+		{
+			handlers.manualEnd( handlers.arg );
+		}
+	}
+}
+
+static void readFromClient( AndroidClient *client )
+{
+	ssize_t size = lineReaderFill( &client->reader );
+	if( size < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+	{
+		return;
+	}
+	if( size < 0 )
+	{
+		printf( "recv() failure, errno = %d\n", errno );
+		closeClient( client );
+		return;
+	}
+
+	char *line;
+	while( ( line = lineReaderNext( &client->reader ) ) != NULL )
+	{
+		handleMessage( client, line );
+	}
+
+	if( client->reader.eof )
+	{
+		closeClient( client );
+	}
+}
+
+static void acceptClients()
+{
+	for(;;)
+	{
+		int fd = accept4( listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC );
+		if( fd < 0 )
+		{
+			if( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR )
+			{
+				printf( "Android command server: accept() failure, errno = %d\n", errno );
+			}
+			return;
+		}
+
+		AndroidClient *client = NULL;
+		unsigned int i;
+		for( i = 0; i < ANDROID_MAX_CLIENTS; i++ )
+		{
+			if( clients[i].reader.fd < 0 )
+			{
+				client = &clients[i];
+				break;
+			}
+		}
+		if( client == NULL )
+		{
+			printf( "Android command server full, refusing client.\n" );
+			close( fd );
+			continue;
+		}
+
+		lineReaderInit( &client->reader, fd );
+		client->manual = 0;
+
+		struct epoll_event ev;
+		ev.events = EPOLLIN | EPOLLRDHUP;
+		ev.data.ptr = client;
+		epoll_ctl( epollfd, EPOLL_CTL_ADD, fd, &ev );
+		atomic_fetch_add_explicit( &androidCommandStats.clients, 1, memory_order_relaxed );
+	}
+}
+
+int androidCommandServerOpen( const char *port, const AndroidCommandHandlers *commandHandlers )
+{
+	struct sockaddr_in myaddr;
+	unsigned int i;
+
+	handlers = *commandHandlers;
+	for( i = 0; i < ANDROID_MAX_CLIENTS; i++ )
+	{
+		clients[i].reader.fd = -1;
+	}
+
+	listenfd = socket( PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+	if( listenfd == -1 )
+	{
+		printf( "Android command server: socket() failure, errno = %d\n", errno );
+		exit( EXIT_FAILURE );
+	}
+
+	int yes = 1;
+	if( setsockopt( listenfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof( int ) ) == -1 )
+	{
+		printf( "Android command server: setsockopt() failure, errno = %d\n", errno );
+		close( listenfd );
+		exit( EXIT_FAILURE );
+	}
+
+	myaddr.sin_family = AF_INET;
+	myaddr.sin_port = htons( atoi( port ) );
+	myaddr.sin_addr.s_addr = htonl( INADDR_ANY );
+	memset( &( myaddr.sin_zero ), '\0', 8 );
+
+	if( bind( listenfd, (struct sockaddr *)&myaddr, sizeof( struct sockaddr ) ) == -1 )
+	{
+		printf( "Android command server: bind() failure, errno = %d\n", errno );
+		close( listenfd );
+		exit( EXIT_FAILURE );
+	}
+
+	if( listen( listenfd, 10 ) == -1 )
+	{
+		printf( "Android command server: listen() failure, errno = %d\n", errno );
+		close( listenfd );
+		exit( EXIT_FAILURE );
+	}
+
+	epollfd = epoll_create1( EPOLL_CLOEXEC );
+	if( epollfd < 0 )
+	{
+		printf( "Android command server: epoll_create1() failure, errno = %d\n", errno );
+		exit( EXIT_FAILURE );
+	}
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = &listenTag;
+	epoll_ctl( epollfd, EPOLL_CTL_ADD, listenfd, &ev );
+
+	return epollfd;
+}
+
+void androidCommandServerDispatch( int timeoutMs )
+{
+	struct epoll_event events[MAX_EVENTS];
+	int count = epoll_wait( epollfd, events, MAX_EVENTS, timeoutMs );
+
+	int i;
+	for( i = 0; i < count; i++ )
+	{
+		if( events[i].data.ptr == &listenTag )
+		{
+			acceptClients();
+			continue;
+		}
+
+		AndroidClient *client = events[i].data.ptr;
+		if( client->reader.fd >= 0 )
+		{
+			readFromClient( client );
+		}
+	}
+}
+
+void *androidCommandServer( void *arg )
+{
+	traceThreadName( "android" );
+	androidCommandServerOpen( ANDROID_COMMAND_PORT, (const AndroidCommandHandlers *)arg );
+
+	for(;;)
+	{
+		androidCommandServerDispatch( -1 );
+	}
+
+	pthread_exit( NULL );
+}
+
+void registerAndroidCommandMetrics()
+{
+	AndroidCommandStats *s = &androidCommandStats;
+
+	metricsGauge( "argps_android_clients", NULL, "Android command clients connected.", &s->clients );
+	metricsCounter( "argps_android_messages_total", NULL, "Lines received from Android command clients.", &s->messages );
+	metricsCounter( "argps_android_routes_total", NULL, "Waypoint lists received.", &s->routes );
+	metricsCounter( "argps_android_manual_commands_total", NULL, "Manual commands sent to the drone.", &s->manualCommands );
+	metricsCounter( "argps_android_rejected_total", NULL, "Unrecognised or malformed Android messages.", &s->rejected );
+}
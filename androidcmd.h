@@ -0,0 +1,55 @@
+#ifndef _ANDROID_CMD_H_
+#define _ANDROID_CMD_H_
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "gpsutil.h"
+
+#define ANDROID_MAX_CLIENTS 8
+#define ANDROID_MAX_WAYPOINTS 20	// Most waypoints accepted in one list, as many as the autopilot flies.
+
+// Android devices keep one TCP connection open and send newline-terminated
+// messages on it:
+//   "list <count> <lat> <lon> ..."	replaces the route;
+//   "manual"						takes manual control until the device disconnects;
+//   "cmd <command>"				a manual control command, see manualcommands.h.
+// Only one device at a time can hold manual control, and none if
+// manualStart is NULL.
+typedef struct
+{
+	void	( *route )( const GpsPoint *waypoints, unsigned int count, void *arg );
+	void	( *manualStart )( void *arg );
+	void	( *manualEnd )( void *arg );
+	void	*arg;
+} AndroidCommandHandlers;
+
+// Written by the server's thread, readable from anywhere.
+typedef struct
+{
+	_Atomic uint64_t	clients;		// Devices connected now.
+	_Atomic uint64_t	messages;		// Lines received.
+	_Atomic uint64_t	routes;			// Waypoint lists accepted.
+	_Atomic uint64_t	manualCommands;	// Manual commands sent to the drone.
+	_Atomic uint64_t	rejected;		// Unrecognised or malformed messages.
+} AndroidCommandStats;
+
+extern AndroidCommandStats androidCommandStats;
+
+// Opens the Android command server on port. Every client is served from one
+// non-blocking epoll set, whose fd is returned so it can be nested in another
+// event loop. Manual commands are sent to the drone from the dispatching
+// thread itself. Exits on failure.
+int androidCommandServerOpen( const char *port, const AndroidCommandHandlers *handlers );
+
+// Waits up to timeoutMs (-1 forever) for activity and handles it.
+void androidCommandServerDispatch( int timeoutMs );
+
+// Thread function: arg is an AndroidCommandHandlers, which must outlive the
+// thread. Opens the server on ANDROID_COMMAND_PORT and runs it.
+void *androidCommandServer( void *arg );
+
+// Exports androidCommandStats through the metrics registry.
+void registerAndroidCommandMetrics();
+
+#endif
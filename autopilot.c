@@ -0,0 +1,558 @@
+#define _GNU_SOURCE
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <math.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "autopilot.h"
+#include "command.h"
+#include "metrics.h"
+#include "timeutil.h"
+#include "trace.h"
+
+#define QUEUE_MASK ( AUTOPILOT_QUEUE_SIZE - 1 )
+
+static const char *stateNames[NUM_AUTOPILOT_STATES] =
+{
+	"idle", "takeoff", "enroute", "arrive", "land", "manual"
+};
+
+static const char *eventNames[NUM_AUTOPILOT_EVENTS] =
+{
+	"route", "manual start", "manual end", "land", "stop"
+};
+
+static int isTicking( AutopilotState state )
+{
+	return state != AUTOPILOT_IDLE && state != AUTOPILOT_MANUAL;
+}
+
+// Runs the tick timer only in states that do something on it.
+static void setTicking( Autopilot *autopilot, int ticking )
+{
+	struct itimerspec spec;
+	memset( &spec, 0, sizeof( spec ) );
+	if( ticking )
+	{
+		// Absolute start time, so that tick n is due at exactly
+		// tickStart + n * periodNs and lateness can be measured against it.
+		autopilot->tickStart = monotonicNs();
+		autopilot->tickCount = 0;
+		autopilot->lastTick = 0;
+
+		uint64_t first = autopilot->tickStart + autopilot->periodNs;
+		spec.it_value.tv_sec = first / NSEC_PER_SEC;
+		spec.it_value.tv_nsec = first % NSEC_PER_SEC;
+		spec.it_interval.tv_sec = autopilot->periodNs / NSEC_PER_SEC;
+		spec.it_interval.tv_nsec = autopilot->periodNs % NSEC_PER_SEC;
+	}
+	timerfd_settime( autopilot->timerfd, TFD_TIMER_ABSTIME, &spec, NULL );
+}
+
+// Leaves the current state and runs the entry action of the new one.
+static void enterState( Autopilot *autopilot, AutopilotState state )
+{
+	AutopilotState prev = atomic_load( &autopilot->state );
+	if( !autopilot->quiet )
+	{
+		printf( "Autopilot %s: %s -> %s\n", autopilot->link->name, stateNames[prev], stateNames[state] );
+	}
+	TRACE_INSTANT( "autopilot.state", "from", prev, "to", state );
+
+	atomic_store( &autopilot->state, state );
+	autopilot->stateEntered = monotonicNs();
+
+	switch( state )
+	{
+	case AUTOPILOT_TAKEOFF:
+		droneLinkTakeOff( autopilot->link );
+		break;
+	case AUTOPILOT_ARRIVE:
+		droneLinkHover( autopilot->link );
+		break;
+	case AUTOPILOT_LAND:
+		droneLinkLand( autopilot->link );
+		break;
+	default:
+		break;
+	}
+
+	setTicking( autopilot, isTicking( state ) );
+}
+
+static void handleEvent( Autopilot *autopilot, const AutopilotEvent *event )
+{
+	AutopilotState state = atomic_load( &autopilot->state );
+	if( !autopilot->quiet )
+	{
+		printf( "Autopilot %s: %s event in %s\n", autopilot->link->name, eventNames[event->type], stateNames[state] );
+	}
+	TRACE_INSTANT( "autopilot.event", "type", event->type, "state", state );
+
+	switch( event->type )
+	{
+	case AUTOPILOT_EVENT_ROUTE:
+		memcpy( autopilot->waypoints, event->waypoints, event->numWaypoints * sizeof( GpsPoint ) );
+		autopilot->numWaypoints = event->numWaypoints;
+		autopilot->currWaypoint = 0;
+		if( state == AUTOPILOT_IDLE && autopilot->numWaypoints > 0 )
+		{
+			enterState( autopilot, AUTOPILOT_TAKEOFF );
+		}
+		else if( state == AUTOPILOT_ARRIVE || state == AUTOPILOT_LAND )
+		{
+			// Already airborne, or at least not yet down: head straight off.
+			enterState( autopilot, autopilot->numWaypoints > 0 ? AUTOPILOT_ENROUTE : AUTOPILOT_LAND );
+		}
+		else if( state == AUTOPILOT_ENROUTE && autopilot->numWaypoints == 0 )
+		{
+			enterState( autopilot, AUTOPILOT_LAND );
+		}
+		// In takeoff and manual the new route is picked up later.
+		break;
+
+	case AUTOPILOT_EVENT_MANUAL_START:
+		if( state != AUTOPILOT_MANUAL )
+		{
+			enterState( autopilot, AUTOPILOT_MANUAL );
+		}
+		break;
+
+	case AUTOPILOT_EVENT_MANUAL_END:
+		if( state == AUTOPILOT_MANUAL )
+		{
+			// Taking off when already flying does nothing, so resuming the
+			// route always starts with a takeoff.
+			enterState( autopilot, autopilot->currWaypoint < autopilot->numWaypoints ? AUTOPILOT_TAKEOFF : AUTOPILOT_LAND );
+		}
+		break;
+
+	case AUTOPILOT_EVENT_LAND:
+		if( state != AUTOPILOT_IDLE && state != AUTOPILOT_LAND )
+		{
+			autopilot->currWaypoint = autopilot->numWaypoints;
+			enterState( autopilot, AUTOPILOT_LAND );
+		}
+		break;
+
+	case AUTOPILOT_EVENT_STOP:
+		autopilot->currWaypoint = autopilot->numWaypoints;
+		if( state != AUTOPILOT_IDLE )
+		{
+			enterState( autopilot, AUTOPILOT_IDLE );
+		}
+		break;
+
+	default:
+		break;
+	}
+}
+
+// One control period of flying towards the current waypoint.
+static void steer( Autopilot *autopilot )
+{
+	pthread_mutex_lock( &autopilot->queueMutex );
+	GpsPoint currFix = autopilot->currFix;
+	GpsPoint prevFix = autopilot->prevFix;
+	pthread_mutex_unlock( &autopilot->queueMutex );
+
+	if( isnan( currFix.latitude ) || isnan( currFix.longitude ) )
+	{
+		droneLinkHover( autopilot->link );	// No idea where we are, wait for a fix.
+		return;
+	}
+
+	GpsPoint destination = autopilot->waypoints[autopilot->currWaypoint];
+	double distance = getDistance( currFix, destination );
+	if( distance <= LOCATION_EPSILON )
+	{
+		enterState( autopilot, AUTOPILOT_ARRIVE );
+		return;
+	}
+
+	// Positive error means we point clockwise of where we want to go.
+	double desiredHeading = getBearing( currFix, destination );
+	double currHeading = getHeading( currFix, prevFix );
+	double headingError = fmod( currHeading - desiredHeading + 540.0, 360.0 ) - 180.0;
+	TRACE_INSTANT( "autopilot.steer", "distance", distance, "headingError", headingError );
+
+	// Each PCMD replaces every set point of the last one, so turning and
+	// going forward have to be one command: a rotate on its own would stop
+	// the drone, and with it the fixes the heading is worked out from.
+	if( fabs( headingError ) > HEADING_EPSILON )
+	{
+		droneLinkMove( autopilot->link, 0, -AUTOPILOT_FORWARD_SPEED, 0, ( headingError < 0 ) ? AUTOPILOT_TURN_SPEED : -AUTOPILOT_TURN_SPEED );
+	}
+	else
+	{
+		droneLinkForward( autopilot->link );
+	}
+}
+
+static void tick( Autopilot *autopilot )
+{
+	uint64_t inState = monotonicNs() - autopilot->stateEntered;
+
+	TRACE_BEGIN( "autopilot.tick" );
+	switch( atomic_load( &autopilot->state ) )
+	{
+	case AUTOPILOT_TAKEOFF:
+		if( inState >= AUTOPILOT_TAKEOFF_MS * NSEC_PER_MSEC )
+		{
+			enterState( autopilot, autopilot->currWaypoint < autopilot->numWaypoints ? AUTOPILOT_ENROUTE : AUTOPILOT_LAND );
+		}
+		break;
+
+	case AUTOPILOT_ENROUTE:
+		steer( autopilot );
+		break;
+
+	case AUTOPILOT_ARRIVE:
+		if( inState >= AUTOPILOT_ARRIVE_MS * NSEC_PER_MSEC )
+		{
+			autopilot->currWaypoint++;
+			enterState( autopilot, autopilot->currWaypoint < autopilot->numWaypoints ? AUTOPILOT_ENROUTE : AUTOPILOT_LAND );
+		}
+		break;
+
+	case AUTOPILOT_LAND:
+		if( inState >= AUTOPILOT_LAND_MS * NSEC_PER_MSEC )
+		{
+			enterState( autopilot, AUTOPILOT_IDLE );
+		}
+		break;
+
+	default:
+		break;
+	}
+	TRACE_END_ARGS( "autopilot.tick", "state", atomic_load( &autopilot->state ), NULL, 0 );
+}
+
+// Called on each timer expiration, expirations being the number of periods
+// that elapsed since the last one.
+static void recordTick( Autopilot *autopilot, uint64_t expirations )
+{
+	AutopilotTiming *timing = &autopilot->timing;
+	uint64_t now = monotonicNs();
+
+	autopilot->tickCount += expirations;
+	uint64_t due = autopilot->tickStart + autopilot->tickCount * autopilot->periodNs;
+	histogramRecordLocal( &timing->lateness, ( now > due ) ? now - due : 0 );
+	// Recorded as the distance from nominal: the histogram buckets are
+	// relative, so the period itself would hide microseconds of error.
+	if( autopilot->lastTick != 0 && expirations == 1 )
+	{
+		uint64_t period = now - autopilot->lastTick;
+		histogramRecordLocal( &timing->jitter, ( period > autopilot->periodNs ) ? period - autopilot->periodNs : autopilot->periodNs - period );
+	}
+	autopilot->lastTick = now;
+
+	COUNT( timing->ticks );
+	if( expirations > 1 )
+	{
+		ADD( timing->missed, expirations - 1 );
+	}
+}
+
+int autopilotInit( Autopilot *autopilot, const AutopilotConfig *config )
+{
+	memset( autopilot, 0, sizeof( *autopilot ) );
+	autopilot->config.rate = AUTOPILOT_DEFAULT_RATE;
+	autopilot->config.priority = 0;
+	autopilot->config.cpu = -1;
+	if( config != NULL )
+	{
+		autopilot->config = *config;
+	}
+	if( autopilot->config.rate <= 0 )
+	{
+		fprintf( stderr, "Invalid autopilot rate %f Hz.\n", autopilot->config.rate );
+		exit( EXIT_FAILURE );
+	}
+	autopilot->periodNs = (uint64_t)( NSEC_PER_SEC / autopilot->config.rate );
+	autopilot->link = &droneLink;
+
+	pthread_mutex_init( &autopilot->queueMutex, NULL );
+	atomic_init( &autopilot->state, AUTOPILOT_IDLE );
+	autopilot->currFix.latitude = NAN;
+	autopilot->currFix.longitude = NAN;
+	autopilot->prevFix = autopilot->currFix;
+
+	autopilot->eventfd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+	autopilot->timerfd = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC );
+	autopilot->epollfd = epoll_create1( EPOLL_CLOEXEC );
+	if( autopilot->eventfd < 0 || autopilot->timerfd < 0 || autopilot->epollfd < 0 )
+	{
+		fprintf( stderr, "Couldn't set up the autopilot, errno = %d.\n", errno );
+		exit( EXIT_FAILURE );
+	}
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.fd = autopilot->eventfd;
+	epoll_ctl( autopilot->epollfd, EPOLL_CTL_ADD, autopilot->eventfd, &ev );
+	ev.data.fd = autopilot->timerfd;
+	epoll_ctl( autopilot->epollfd, EPOLL_CTL_ADD, autopilot->timerfd, &ev );
+
+	return autopilot->epollfd;
+}
+
+int autopilotPost( Autopilot *autopilot, const AutopilotEvent *event )
+{
+	pthread_mutex_lock( &autopilot->queueMutex );
+	if( autopilot->queueLength == AUTOPILOT_QUEUE_SIZE )
+	{
+		pthread_mutex_unlock( &autopilot->queueMutex );
+		fprintf( stderr, "Autopilot event queue full, dropping %s event.\n", eventNames[event->type] );
+		return -1;
+	}
+
+	autopilot->queue[( autopilot->queueHead + autopilot->queueLength ) & QUEUE_MASK] = *event;
+	autopilot->queueLength++;
+	pthread_mutex_unlock( &autopilot->queueMutex );
+
+	uint64_t one = 1;
+	if( write( autopilot->eventfd, &one, sizeof( one ) ) < 0 )
+	{
+		// Only fails if the counter is saturated, which already means "wake up".
+	}
+	return 0;
+}
+
+int autopilotPostType( Autopilot *autopilot, AutopilotEventType type )
+{
+	AutopilotEvent event;
+	event.type = type;
+	event.numWaypoints = 0;
+	return autopilotPost( autopilot, &event );
+}
+
+void autopilotSafetyEvent( const DroneStateEvent *event, void *arg )
+{
+	Autopilot *autopilot = (Autopilot *)arg;
+	if( !event->set )
+	{
+		return;
+	}
+
+	if( event->bit == DRONE_STATE_VBAT_LOW )
+	{
+		if( !autopilot->quiet )
+		{
+			printf( "Autopilot %s: battery low, landing.\n", autopilot->link->name );
+		}
+		autopilotPostType( autopilot, AUTOPILOT_EVENT_LAND );
+	}
+	else if( event->bit == DRONE_STATE_EMERGENCY )
+	{
+		if( !autopilot->quiet )
+		{
+			printf( "Autopilot %s: drone reported an emergency, stopping.\n", autopilot->link->name );
+		}
+		autopilotPostType( autopilot, AUTOPILOT_EVENT_STOP );
+	}
+}
+
+int autopilotPostRoute( Autopilot *autopilot, const GpsPoint *waypoints, unsigned int count )
+{
+	AutopilotEvent event;
+	if( count > AUTOPILOT_MAX_WAYPOINTS )
+	{
+		fprintf( stderr, "Route too long, keeping the first %d waypoints.\n", AUTOPILOT_MAX_WAYPOINTS );
+		count = AUTOPILOT_MAX_WAYPOINTS;
+	}
+
+	event.type = AUTOPILOT_EVENT_ROUTE;
+	event.numWaypoints = count;
+	memcpy( event.waypoints, waypoints, count * sizeof( GpsPoint ) );
+	return autopilotPost( autopilot, &event );
+}
+
+void autopilotUpdateFix( Autopilot *autopilot, const GpsPoint *fix )
+{
+	pthread_mutex_lock( &autopilot->queueMutex );
+	autopilot->prevFix = autopilot->currFix;
+	autopilot->currFix = *fix;
+	pthread_mutex_unlock( &autopilot->queueMutex );
+}
+
+static void handleEvents( Autopilot *autopilot )
+{
+	for(;;)
+	{
+		AutopilotEvent event;
+		pthread_mutex_lock( &autopilot->queueMutex );
+		if( autopilot->queueLength == 0 )
+		{
+			pthread_mutex_unlock( &autopilot->queueMutex );
+			break;
+		}
+		event = autopilot->queue[autopilot->queueHead];
+		autopilot->queueHead = ( autopilot->queueHead + 1 ) & QUEUE_MASK;
+		autopilot->queueLength--;
+		pthread_mutex_unlock( &autopilot->queueMutex );
+
+		handleEvent( autopilot, &event );
+	}
+}
+
+void autopilotDispatch( Autopilot *autopilot, int timeoutMs )
+{
+	struct epoll_event events[2];
+	int count = epoll_wait( autopilot->epollfd, events, 2, timeoutMs );
+	uint64_t value;
+
+	int i;
+	for( i = 0; i < count; i++ )
+	{
+		if( events[i].data.fd == autopilot->eventfd )
+		{
+			if( read( autopilot->eventfd, &value, sizeof( value ) ) < 0 )
+			{
+				continue;
+			}
+			handleEvents( autopilot );
+		}
+		else if( events[i].data.fd == autopilot->timerfd )
+		{
+			// Missed ticks are not made up, the next tick just acts on newer data.
+			if( read( autopilot->timerfd, &value, sizeof( value ) ) > 0 )
+			{
+				recordTick( autopilot, value );
+				tick( autopilot );
+			}
+		}
+	}
+}
+
+uint64_t autopilotStep( Autopilot *autopilot )
+{
+	// Straight to the queue, a lock is cheaper than reading the eventfd.
+	// Left readable, it only costs autopilotDispatch() an empty pass.
+	handleEvents( autopilot );
+	if( !isTicking( atomic_load( &autopilot->state ) ) )
+	{
+		return UINT64_MAX;
+	}
+
+	uint64_t now = monotonicNs();
+	uint64_t due = autopilot->tickStart + ( autopilot->tickCount + 1 ) * autopilot->periodNs;
+	if( now < due )
+	{
+		return due;
+	}
+
+	recordTick( autopilot, ( now - autopilot->tickStart ) / autopilot->periodNs - autopilot->tickCount );
+	tick( autopilot );
+	if( !isTicking( atomic_load( &autopilot->state ) ) )
+	{
+		return UINT64_MAX;
+	}
+	return autopilot->tickStart + ( autopilot->tickCount + 1 ) * autopilot->periodNs;
+}
+
+void autopilotClose( Autopilot *autopilot )
+{
+	close( autopilot->epollfd );
+	close( autopilot->timerfd );
+	close( autopilot->eventfd );
+	pthread_mutex_destroy( &autopilot->queueMutex );
+}
+
+void autopilotConfigureThread( Autopilot *autopilot )
+{
+	if( autopilot->config.priority > 0 )
+	{
+		struct sched_param param;
+		param.sched_priority = autopilot->config.priority;
+		int error = pthread_setschedparam( pthread_self(), SCHED_FIFO, &param );
+		if( error != 0 )
+		{
+			fprintf( stderr, "Couldn't give the autopilot SCHED_FIFO priority %d, errno = %d.\n", param.sched_priority, error );
+		}
+	}
+
+	if( autopilot->config.cpu >= 0 )
+	{
+		cpu_set_t cpus;
+		CPU_ZERO( &cpus );
+		CPU_SET( autopilot->config.cpu, &cpus );
+		int error = pthread_setaffinity_np( pthread_self(), sizeof( cpus ), &cpus );
+		if( error != 0 )
+		{
+			fprintf( stderr, "Couldn't pin the autopilot to CPU %d, errno = %d.\n", autopilot->config.cpu, error );
+		}
+	}
+}
+
+void *autopilotRun( void *arg )
+{
+	Autopilot *autopilot = (Autopilot *)arg;
+
+	traceThreadName( "autopilot" );
+	autopilotConfigureThread( autopilot );
+
+	for(;;)
+	{
+		autopilotDispatch( autopilot, -1 );
+	}
+
+	pthread_exit( NULL );
+}
+
+AutopilotState autopilotState( Autopilot *autopilot )
+{
+	return atomic_load( &autopilot->state );
+}
+
+const char *autopilotStateName( AutopilotState state )
+{
+	return stateNames[state];
+}
+
+void printAutopilot( FILE *out, Autopilot *autopilot )
+{
+	AutopilotState state = autopilotState( autopilot );
+	fprintf( out, "autopilot: %s for %.1f s, waypoint %u of %u\n",
+		stateNames[state],
+		( monotonicNs() - autopilot->stateEntered ) / (double)NSEC_PER_SEC,
+		autopilot->currWaypoint, autopilot->numWaypoints );
+
+	AutopilotTiming *timing = &autopilot->timing;
+	fprintf( out, "autopilot: %.1f Hz, %llu ticks, %llu missed\n",
+		autopilot->config.rate,
+		(unsigned long long)atomic_load( &timing->ticks ), (unsigned long long)atomic_load( &timing->missed ) );
+	fprintf( out, "autopilot: period jitter p50 %.1f us, p99 %.1f us, max %.1f us\n",
+		histogramPercentile( &timing->jitter, 0.50 ) / (double)NSEC_PER_USEC,
+		histogramPercentile( &timing->jitter, 0.99 ) / (double)NSEC_PER_USEC,
+		atomic_load( &timing->jitter.max ) / (double)NSEC_PER_USEC );
+	fprintf( out, "autopilot: wakeup lateness p50 %.1f us, p99 %.1f us, max %.1f us\n",
+		histogramPercentile( &timing->lateness, 0.50 ) / (double)NSEC_PER_USEC,
+		histogramPercentile( &timing->lateness, 0.99 ) / (double)NSEC_PER_USEC,
+		atomic_load( &timing->lateness.max ) / (double)NSEC_PER_USEC );
+}
+
+static double readState( void *arg )
+{
+	return autopilotState( (Autopilot *)arg );
+}
+
+void registerAutopilotMetrics( Autopilot *autopilot )
+{
+	AutopilotTiming *timing = &autopilot->timing;
+
+	metricsGaugeReader( "argps_autopilot_state", NULL,
+		"0 idle, 1 takeoff, 2 enroute, 3 arrive, 4 land, 5 manual.", readState, autopilot );
+	metricsCounter( "argps_autopilot_ticks_total", NULL, "Control loop ticks run.", &timing->ticks );
+	metricsCounter( "argps_autopilot_missed_ticks_total", NULL, "Control loop periods that passed without a tick.", &timing->missed );
+	metricsHistogram( "argps_autopilot_jitter_seconds", NULL, "Distance of each tick period from nominal.", &timing->jitter, 1e-9 );
+	metricsHistogram( "argps_autopilot_lateness_seconds", NULL, "Wakeup after the scheduled tick time.", &timing->lateness, 1e-9 );
+}
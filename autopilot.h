@@ -0,0 +1,155 @@
+#ifndef _AUTOPILOT_H_
+#define _AUTOPILOT_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "gpsutil.h"
+#include "histogram.h"
+#include "command.h"
+#include "dronestate.h"
+
+#define AUTOPILOT_MAX_WAYPOINTS 20
+#define AUTOPILOT_QUEUE_SIZE 16			// Pending events. Must be a power of two.
+#define AUTOPILOT_DEFAULT_RATE 10.0	// Control loop rate in Hz while flying a route.
+#define AUTOPILOT_TAKEOFF_MS 3000		// Time allowed to climb before heading off.
+#define AUTOPILOT_ARRIVE_MS 1000		// Hover at each waypoint before the next.
+#define AUTOPILOT_LAND_MS 5000			// Time allowed to land before going idle.
+#define AUTOPILOT_FORWARD_SPEED 0.1f	// Pitch set point while turning, same as droneForward().
+#define AUTOPILOT_TURN_SPEED 0.8f		// Yaw set point, same as droneRotateLeft() and droneRotateRight().
+#define AUTOPILOT_SAFETY_EVENTS ( DRONE_STATE_VBAT_LOW | DRONE_STATE_EMERGENCY )
+
+// Idle and manual send nothing and block on the event queue; every other
+// state runs on the fixed-rate tick timer.
+//
+//   idle     --route-->          takeoff --time--> enroute --at waypoint--> arrive
+//   arrive   --time, more left--> enroute
+//   arrive   --time, route done--> land --time--> idle
+//   any      --manual start-->   manual
+//   manual   --manual end-->     takeoff if the route isn't done, otherwise land
+//   flying   --land-->           land
+//   any      --stop-->           idle
+typedef enum
+{
+	AUTOPILOT_IDLE,
+	AUTOPILOT_TAKEOFF,
+	AUTOPILOT_ENROUTE,
+	AUTOPILOT_ARRIVE,
+	AUTOPILOT_LAND,
+	AUTOPILOT_MANUAL,
+	NUM_AUTOPILOT_STATES
+} AutopilotState;
+
+typedef enum
+{
+	AUTOPILOT_EVENT_ROUTE,			// Fly a new route, replacing any current one.
+	AUTOPILOT_EVENT_MANUAL_START,	// An operator took manual control.
+	AUTOPILOT_EVENT_MANUAL_END,		// The operator let go.
+	AUTOPILOT_EVENT_LAND,			// Land now, e.g. low battery.
+	AUTOPILOT_EVENT_STOP,			// Stop sending anything, e.g. emergency.
+	NUM_AUTOPILOT_EVENTS
+} AutopilotEventType;
+
+typedef struct
+{
+	AutopilotEventType	type;
+	unsigned int		numWaypoints;		// Route events only.
+	GpsPoint			waypoints[AUTOPILOT_MAX_WAYPOINTS];
+} AutopilotEvent;
+
+// How the control thread is run. Priority and cpu are applied by
+// autopilotRun() to its own thread.
+typedef struct
+{
+	double	rate;			// Control loop rate, Hz.
+	int		priority;		// SCHED_FIFO priority, 0 to stay SCHED_OTHER.
+	int		cpu;			// CPU to pin the thread to, -1 for any.
+} AutopilotConfig;
+
+// Tick timing, written only by the autopilot thread.
+typedef struct
+{
+	_Atomic uint64_t	ticks;
+	_Atomic uint64_t	missed;		// Periods that passed without a tick.
+	Histogram			jitter;		// |time between ticks - period|, nanoseconds.
+	Histogram			lateness;	// Wakeup after the scheduled tick time, nanoseconds.
+} AutopilotTiming;
+
+typedef struct
+{
+	// Event queue, filled from any thread. The eventfd counts pending events.
+	pthread_mutex_t		queueMutex;
+	AutopilotEvent		queue[AUTOPILOT_QUEUE_SIZE];
+	unsigned int		queueHead;
+	unsigned int		queueLength;
+	int					eventfd;
+
+	// Latest GPS fixes, also written from other threads under queueMutex.
+	GpsPoint			currFix;
+	GpsPoint			prevFix;
+
+	// Everything below belongs to the autopilot thread.
+	DroneLink			*link;		// Where commands go, droneLink unless changed after init.
+	int					quiet;		// Don't print events and state changes.
+	AutopilotConfig		config;
+	uint64_t			periodNs;
+	uint64_t			tickStart;	// When the timer was armed.
+	uint64_t			tickCount;	// Periods since then.
+	uint64_t			lastTick;
+	AutopilotTiming		timing;
+	int					timerfd;
+	int					epollfd;
+	_Atomic int			state;		// AutopilotState, atomic so others can read it.
+	_Atomic uint64_t	stateEntered;	// monotonicNs() of the last transition.
+	GpsPoint			waypoints[AUTOPILOT_MAX_WAYPOINTS];
+	unsigned int		numWaypoints;
+	unsigned int		currWaypoint;
+} Autopilot;
+
+// Sets up the queue and timer. Returns an epoll fd covering both, readable
+// whenever autopilotDispatch() has something to do. config may be NULL for
+// the defaults. Exits on failure.
+int autopilotInit( Autopilot *autopilot, const AutopilotConfig *config );
+
+// Queue an event from any thread. Returns 0, or -1 if the queue was full.
+int autopilotPost( Autopilot *autopilot, const AutopilotEvent *event );
+int autopilotPostType( Autopilot *autopilot, AutopilotEventType type );
+int autopilotPostRoute( Autopilot *autopilot, const GpsPoint *waypoints, unsigned int count );
+
+// Drone state handler, arg is an Autopilot: subscribe it to
+// AUTOPILOT_SAFETY_EVENTS so a low battery lands the drone and an
+// emergency stops the autopilot as soon as navdata reports them, rather
+// than waiting for the autopilot to notice.
+void autopilotSafetyEvent( const DroneStateEvent *event, void *arg );
+
+// Records a new GPS fix, from any thread.
+void autopilotUpdateFix( Autopilot *autopilot, const GpsPoint *fix );
+
+// Waits up to timeoutMs (-1 forever) for events or the tick and handles them.
+void autopilotDispatch( Autopilot *autopilot, int timeoutMs );
+
+// autopilotDispatch() without waiting or the timer, for simulations that
+// step monotonicNs() themselves: handles queued events, then runs the
+// tick if it is due. Returns when the next tick is due, or UINT64_MAX in
+// states that don't tick.
+uint64_t autopilotStep( Autopilot *autopilot );
+
+// Frees what autopilotInit() opened. The autopilot must not be in use.
+void autopilotClose( Autopilot *autopilot );
+
+// Applies the configured priority and CPU affinity to the calling thread.
+void autopilotConfigureThread( Autopilot *autopilot );
+
+// Thread function, arg is an Autopilot set up with autopilotInit(). Calls
+// autopilotConfigureThread() first.
+void *autopilotRun( void *arg );
+
+AutopilotState autopilotState( Autopilot *autopilot );
+const char *autopilotStateName( AutopilotState state );
+void printAutopilot( FILE *out, Autopilot *autopilot );
+// Exports the state and tick timing through the metrics registry.
+void registerAutopilotMetrics( Autopilot *autopilot );
+
+#endif
@@ -14,133 +14,507 @@
 #include <unistd.h>
 #include <syslog.h>
 #include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <poll.h>
+#include <sys/timerfd.h>
 #include <stdio.h>
 
 #include "command.h"
+#include "metrics.h"
+#include "network.h"
+#include "timeutil.h"
+#include "trace.h"
 
-// Externs so they can be used in main.c as needed.
-unsigned int droneSeqNum = 1;
-int droneCmdSock;
-struct sockaddr_in droneCmdAddr;
+// Extern so it can be opened in main.c.
+DroneLink droneLink =
+{
+	.sock = -1,
+	.seq = 1,
+	.sendMutex = PTHREAD_MUTEX_INITIALIZER
+};
+
+// Per-thread command counters. Each block is only written by its owning
+// thread and is pushed onto statsList the first time that thread sends,
+// so recording a command never takes a lock.
+typedef struct CommandThreadStats
+{
+	_Atomic uint64_t			sent[NUM_COMMAND_TYPES];
+	_Atomic uint64_t			errors[NUM_COMMAND_TYPES];
+	Histogram					latency[NUM_COMMAND_TYPES];
+	struct CommandThreadStats	*next;
+} CommandThreadStats;
+
+static __thread CommandThreadStats *threadStats = NULL;
+static CommandThreadStats *_Atomic statsList = NULL;
+
+static const char *commandTypeNames[NUM_COMMAND_TYPES] =
+{
+	"takeoff", "land", "hover", "up", "down", "forward", "back",
+	"left", "right", "rotateleft", "rotateright", "move", "config", "keepalive", "other"
+};
 
-void sendCommand( const char *cmd )
+static CommandThreadStats *getThreadStats()
 {
-	if( sendto( droneCmdSock, cmd, MAX_COMMAND_LEN, 0, (struct sockaddr *)&droneCmdAddr, sizeof( droneCmdAddr ) ) < 0 )
+	if( threadStats == NULL )
 	{
-		fprintf( stderr, "Error sending command to drone.\n" );
-		exit( EXIT_FAILURE );
+		threadStats = calloc( 1, sizeof( CommandThreadStats ) );
+		if( threadStats == NULL )
+		{
+			fprintf( stderr, "Couldn't allocate command statistics.\n" );
+			exit( EXIT_FAILURE );
+		}
+
+		CommandThreadStats *head = atomic_load( &statsList );
+		do
+		{
+			threadStats->next = head;
+		} while( !atomic_compare_exchange_weak( &statsList, &head, threadStats ) );
 	}
+
+	return threadStats;
 }
 
-void droneTakeOff()
+int droneLinkOpen( DroneLink *link, const char *ip, const char *port )
+{
+	link->sock = createUdpClientConnection( ip, port, &link->addr );
+	if( link->sock < 0 )
+	{
+		return -1;
+	}
+
+	inet_ntop( AF_INET, &link->addr.sin_addr, link->name, sizeof( link->name ) );
+	atomic_init( &link->seq, 1 );
+	atomic_init( &link->lastSent, 0 );
+	pthread_mutex_init( &link->sendMutex, NULL );
+	link->sink = NULL;
+	link->sinkArg = NULL;
+	return 0;
+}
+
+void droneLinkOpenSink( DroneLink *link, const char *name, void ( *sink )( const char *cmd, size_t length, void *arg ), void *arg )
+{
+	memset( link, 0, sizeof( *link ) );
+	link->sock = -1;
+	snprintf( link->name, sizeof( link->name ), "%s", name );
+	atomic_init( &link->seq, 1 );
+	atomic_init( &link->lastSent, 0 );
+	pthread_mutex_init( &link->sendMutex, NULL );
+	link->sink = sink;
+	link->sinkArg = arg;
+}
+
+// Sends "AT*<name>=<seq>,<args>\r", or "AT*<name>=<seq>\r" if args is NULL.
+static int sendTypedCommand( DroneLink *link, CommandType type, uint64_t enqueued, const char *name, const char *args )
 {
+	CommandThreadStats *stats = getThreadStats();
+	_Atomic uint64_t *counter;
 	char cmd[MAX_COMMAND_LEN];
+	int result = 0;
+
+	TRACE_BEGIN( "command.send" );
+	pthread_mutex_lock( &link->sendMutex );
+	unsigned int seq = atomic_fetch_add_explicit( &link->seq, 1, memory_order_relaxed );
+	int length = ( args != NULL )
+		? snprintf( cmd, MAX_COMMAND_LEN, "AT*%s=%u,%s\r", name, seq, args )
+		: snprintf( cmd, MAX_COMMAND_LEN, "AT*%s=%u\r", name, seq );
+	ssize_t sent = length;
+	if( link->sink != NULL )
+	{
+		link->sink( cmd, length, link->sinkArg );
+	}
+	else
+	{
+		sent = sendto( link->sock, cmd, length, 0, (struct sockaddr *)&link->addr, sizeof( link->addr ) );
+	}
+	pthread_mutex_unlock( &link->sendMutex );
+
+	if( sent < 0 )
+	{
+		fprintf( stderr, "Error sending command to drone %s, errno = %d.\n", link->name, errno );
+		counter = &stats->errors[type];
+		result = -1;
+	}
+	else
+	{
+		uint64_t now = monotonicNs();
+		atomic_store_explicit( &link->lastSent, now, memory_order_relaxed );
+		histogramRecordLocal( &stats->latency[type], now - enqueued );
+		counter = &stats->sent[type];
+	}
+
+	atomic_store_explicit( counter, atomic_load_explicit( counter, memory_order_relaxed ) + 1, memory_order_relaxed );
+	TRACE_END_ARGS( "command.send", "type", type, "seq", seq );
+	return result;
+}
+
+int droneLinkSend( DroneLink *link, CommandType type, const char *name, const char *args )
+{
+	return sendTypedCommand( link, type, monotonicNs(), name, args );
+}
+
+int sendCommand( const char *name, const char *args )
+{
+	return sendTypedCommand( &droneLink, CMD_OTHER, monotonicNs(), name, args );
+}
+
+const char *commandTypeName( CommandType type )
+{
+	return commandTypeNames[type];
+}
+
+void getCommandStats( CommandStats *stats )
+{
+	memset( stats, 0, sizeof( *stats ) );
+	stats->sampledAt = monotonicNs();
+
+	CommandThreadStats *curr;
+	for( curr = atomic_load( &statsList ); curr != NULL; curr = curr->next )
+	{
+		unsigned int type;
+		for( type = 0; type < NUM_COMMAND_TYPES; type++ )
+		{
+			stats->sent[type] += atomic_load_explicit( &curr->sent[type], memory_order_relaxed );
+			stats->errors[type] += atomic_load_explicit( &curr->errors[type], memory_order_relaxed );
+			histogramMerge( &stats->latency[type], &curr->latency[type] );
+		}
+	}
+}
+
+void printCommandStats( FILE *out )
+{
+	// Kept between calls so rates cover the interval since the last print.
+	static CommandStats prev;
+	static CommandStats curr;
+
+	getCommandStats( &curr );
+	double interval = ( prev.sampledAt == 0 ) ? 0 : ( curr.sampledAt - prev.sampledAt ) / (double)NSEC_PER_SEC;
+
+	fprintf( out, "%-12s %10s %8s %10s %10s %10s %10s\n", "command", "sent", "errors", "rate/s", "p50 us", "p99 us", "max us" );
+	unsigned int type;
+	for( type = 0; type < NUM_COMMAND_TYPES; type++ )
+	{
+		if( curr.sent[type] == 0 && curr.errors[type] == 0 )
+		{
+			continue;
+		}
+
+		double rate = ( interval > 0 ) ? ( curr.sent[type] - prev.sent[type] ) / interval : 0;
+		fprintf( out, "%-12s %10llu %8llu %10.1f %10.1f %10.1f %10.1f\n",
+			commandTypeName( type ),
+			(unsigned long long)curr.sent[type],
+			(unsigned long long)curr.errors[type],
+			rate,
+			histogramPercentile( &curr.latency[type], 0.50 ) / (double)NSEC_PER_USEC,
+			histogramPercentile( &curr.latency[type], 0.99 ) / (double)NSEC_PER_USEC,
+			atomic_load( &curr.latency[type].max ) / (double)NSEC_PER_USEC );
+	}
+
+	prev = curr;
+}
+
+void droneLinkTakeOff( DroneLink *link )
+{
+	uint64_t enqueued = monotonicNs();
 	
-	snprintf( cmd, MAX_COMMAND_LEN, "AT*REF=%u,290718208\r", droneSeqNum++ );
-	sendCommand( cmd );
+	sendTypedCommand( link, CMD_TAKEOFF, enqueued, "REF", "290718208" );
 }
-void droneLand()
+void droneLinkLand( DroneLink *link )
 {
-	char cmd[MAX_COMMAND_LEN];
+	uint64_t enqueued = monotonicNs();
 
-	snprintf( cmd, MAX_COMMAND_LEN, "AT*REF=%u,290717696\r", droneSeqNum++ );
-	sendCommand( cmd );
+	sendTypedCommand( link, CMD_LAND, enqueued, "REF", "290717696" );
 }
 
-void droneHover()
+void droneLinkHover( DroneLink *link )
 {
-	char cmd[MAX_COMMAND_LEN];
+	uint64_t enqueued = monotonicNs();
 
-	snprintf( cmd, MAX_COMMAND_LEN, "AT*PCMD=%u,1,0,0,0,0\r", droneSeqNum++ );
-	sendCommand( cmd );
+	sendTypedCommand( link, CMD_HOVER, enqueued, "PCMD", "1,0,0,0,0" );
 }
 
-void droneUp()
+void droneLinkUp( DroneLink *link )
 {
-	char cmd[MAX_COMMAND_LEN];
+	uint64_t enqueued = monotonicNs();
 
-	snprintf( cmd, MAX_COMMAND_LEN, "AT*PCMD=%u,1,0,0,1045220557,0\r", droneSeqNum++ );
-	sendCommand( cmd );
+	sendTypedCommand( link, CMD_UP, enqueued, "PCMD", "1,0,0,1045220557,0" );
 }
 
-void droneDown()
+void droneLinkDown( DroneLink *link )
 {
-	char cmd[MAX_COMMAND_LEN];
+	uint64_t enqueued = monotonicNs();
 
-	snprintf( cmd, MAX_COMMAND_LEN, "AT*PCMD=%u,1,0,0,-1102263091,0\r", droneSeqNum++ );
-	sendCommand( cmd );
+	sendTypedCommand( link, CMD_DOWN, enqueued, "PCMD", "1,0,0,-1102263091,0" );
 }
 
-void droneForward()
+void droneLinkForward( DroneLink *link )
 {
-	char cmd[MAX_COMMAND_LEN];
+	uint64_t enqueued = monotonicNs();
 
-	snprintf( cmd, MAX_COMMAND_LEN, "AT*PCMD=%u,1,0,-1102263091,0,0\r", droneSeqNum++ );
-	sendCommand( cmd );
+	sendTypedCommand( link, CMD_FORWARD, enqueued, "PCMD", "1,0,-1102263091,0,0" );
 }
 
-void droneBack()
+void droneLinkBack( DroneLink *link )
 {
-	char cmd[MAX_COMMAND_LEN];
+	uint64_t enqueued = monotonicNs();
 
-	snprintf( cmd, MAX_COMMAND_LEN, "AT*PCMD=%u,1,0,1045220557,0,0\r", droneSeqNum++ );
-	sendCommand( cmd );
+	sendTypedCommand( link, CMD_BACK, enqueued, "PCMD", "1,0,1045220557,0,0" );
 }
 
-void droneLeft()
+void droneLinkLeft( DroneLink *link )
 {
-	char cmd[MAX_COMMAND_LEN];
+	uint64_t enqueued = monotonicNs();
 
-	snprintf( cmd, MAX_COMMAND_LEN, "AT*PCMD=%u,1,-1102263091,0,0,0\r", droneSeqNum++ );
-	sendCommand( cmd );
+	sendTypedCommand( link, CMD_LEFT, enqueued, "PCMD", "1,-1102263091,0,0,0" );
 }
 
-void droneRight()
+void droneLinkRight( DroneLink *link )
 {
-	char cmd[MAX_COMMAND_LEN];
+	uint64_t enqueued = monotonicNs();
 
-	snprintf( cmd, MAX_COMMAND_LEN, "AT*PCMD=%u,1,1045220557,0,0,0\r", droneSeqNum++ );
-	sendCommand( cmd );
+	sendTypedCommand( link, CMD_RIGHT, enqueued, "PCMD", "1,1045220557,0,0,0" );
 }
 
-void droneRotateLeft()
+void droneLinkRotateLeft( DroneLink *link )
 {
-	char cmd[MAX_COMMAND_LEN];
+	uint64_t enqueued = monotonicNs();
 
-	snprintf( cmd, MAX_COMMAND_LEN, "AT*PCMD=%u,1,0,0,0,-1085485875\r", droneSeqNum++ );
-	sendCommand( cmd );
+	sendTypedCommand( link, CMD_ROTATE_LEFT, enqueued, "PCMD", "1,0,0,0,-1085485875" );
 }
 
-void droneRotateRight()
+void droneLinkRotateRight( DroneLink *link )
 {
-	char cmd[MAX_COMMAND_LEN];
+	uint64_t enqueued = monotonicNs();
 
-	snprintf( cmd, MAX_COMMAND_LEN, "AT*PCMD=%u,1,0,0,0,1061997773\r", droneSeqNum++ );
-	sendCommand( cmd );
+	sendTypedCommand( link, CMD_ROTATE_RIGHT, enqueued, "PCMD", "1,0,0,0,1061997773" );
 }
 
-void navdataInit()
+// AT commands carry floats as the decimal value of their IEEE-754 bits.
+static int32_t floatBits( float value )
 {
-  char cmd[MAX_COMMAND_LEN];
+	int32_t bits;
+	memcpy( &bits, &value, sizeof( bits ) );
+	return bits;
+}
+
+void droneLinkMove( DroneLink *link, float roll, float pitch, float gaz, float yaw )
+{
+	char args[MAX_COMMAND_LEN];
+	uint64_t enqueued = monotonicNs();
+
+	snprintf( args, MAX_COMMAND_LEN, "1,%d,%d,%d,%d",
+		floatBits( roll ), floatBits( pitch ), floatBits( gaz ), floatBits( yaw ) );
+	sendTypedCommand( link, CMD_MOVE, enqueued, "PCMD", args );
+}
+
+void droneLinkEnableDemo( DroneLink *link )
+{
+  uint64_t enqueued = monotonicNs();
 
   // stop bootstrap mode
-  snprintf( cmd, MAX_COMMAND_LEN, "AT*CONFIG=%d,\"general:navdata_demo\",\"TRUE\"\r", droneSeqNum++ );
-  sendCommand( cmd );
+  sendTypedCommand( link, CMD_CONFIG, enqueued, "CONFIG", "\"general:navdata_demo\",\"TRUE\"" );
     
   // send ack to start navdata
-  snprintf( cmd, MAX_COMMAND_LEN, "AT*CTRL=%d,0\r", droneSeqNum++ );
-  sendCommand( cmd );
-  
+  enqueued = monotonicNs();
+  sendTypedCommand( link, CMD_CONFIG, enqueued, "CTRL", "0" );
+}
+
+void droneLinkNavdataInit( DroneLink *link )
+{
+  droneLinkEnableDemo( link );
+
   // send command to trim sensors
-  snprintf( cmd, MAX_COMMAND_LEN, "AT*FTRIM=%d,\r", droneSeqNum++ );
-  sendCommand( cmd );
+  uint64_t enqueued = monotonicNs();
+  sendTypedCommand( link, CMD_CONFIG, enqueued, "FTRIM", "" );
 }
 
-void navdataKeepAlive()
+void droneLinkKeepAlive( DroneLink *link )
 {
-  char cmd[MAX_COMMAND_LEN];
+  uint64_t enqueued = monotonicNs();
 
   // send watchdog if no command is sent to command port, so as to prevent drone from entering hover mode
-  snprintf( cmd, MAX_COMMAND_LEN, "AT*COMWDG=%d\r", droneSeqNum++ );
-  sendCommand( cmd );
+  sendTypedCommand( link, CMD_KEEPALIVE, enqueued, "COMWDG", NULL );
+}
+
+void droneTakeOff()
+{
+	droneLinkTakeOff( &droneLink );
+}
+
+void droneLand()
+{
+	droneLinkLand( &droneLink );
+}
+
+void droneHover()
+{
+	droneLinkHover( &droneLink );
+}
+
+void droneUp()
+{
+	droneLinkUp( &droneLink );
+}
+
+void droneDown()
+{
+	droneLinkDown( &droneLink );
+}
+
+void droneForward()
+{
+	droneLinkForward( &droneLink );
+}
+
+void droneBack()
+{
+	droneLinkBack( &droneLink );
+}
+
+void droneLeft()
+{
+	droneLinkLeft( &droneLink );
+}
+
+void droneRight()
+{
+	droneLinkRight( &droneLink );
+}
+
+void droneRotateLeft()
+{
+	droneLinkRotateLeft( &droneLink );
+}
+
+void droneRotateRight()
+{
+	droneLinkRotateRight( &droneLink );
+}
+
+void droneMove( float roll, float pitch, float gaz, float yaw )
+{
+	droneLinkMove( &droneLink, roll, pitch, gaz, yaw );
+}
+
+void navdataEnableDemo()
+{
+	droneLinkEnableDemo( &droneLink );
+}
+
+void navdataInit()
+{
+	droneLinkNavdataInit( &droneLink );
+}
+
+void navdataKeepAlive()
+{
+	droneLinkKeepAlive( &droneLink );
+}
+
+int createKeepAliveTimer()
+{
+	int timerfd = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC );
+	if( timerfd < 0 )
+	{
+		fprintf( stderr, "Couldn't create keepalive timer, errno = %d.\n", errno );
+		exit( EXIT_FAILURE );
+	}
+
+	// Fire straight away; the first expiry works out when the next one is due.
+	struct itimerspec spec;
+	memset( &spec, 0, sizeof( spec ) );
+	spec.it_value.tv_nsec = 1;
+	timerfd_settime( timerfd, 0, &spec, NULL );
+
+	return timerfd;
+}
+
+void handleKeepAliveTimer( int timerfd )
+{
+	uint64_t expirations;
+	if( read( timerfd, &expirations, sizeof( expirations ) ) < 0 && errno != EAGAIN )
+	{
+		fprintf( stderr, "Keepalive timer read failure, errno = %d.\n", errno );
+	}
+
+	// Real sends only bump droneLink.lastSent, they never touch the timer.
+	// Instead, when the timer fires early we just push it out to one idle
+	// period after the most recent send.
+	uint64_t now = monotonicNs();
+	uint64_t last = atomic_load_explicit( &droneLink.lastSent, memory_order_relaxed );
+	if( now - last >= KEEPALIVE_IDLE_MS * NSEC_PER_MSEC )
+	{
+		navdataKeepAlive();
+		last = now;		// Even if the send failed, don't retry in a tight loop.
+	}
+
+	uint64_t deadline = last + KEEPALIVE_IDLE_MS * NSEC_PER_MSEC;
+	struct itimerspec spec;
+	memset( &spec, 0, sizeof( spec ) );
+	spec.it_value.tv_sec = deadline / NSEC_PER_SEC;
+	spec.it_value.tv_nsec = deadline % NSEC_PER_SEC;
+	timerfd_settime( timerfd, TFD_TIMER_ABSTIME, &spec, NULL );
+}
+
+void *commandKeepAlive( void *arg )
+{
+	traceThreadName( "keepalive" );
+	int timerfd = createKeepAliveTimer();
+	struct pollfd pfd;
+	pfd.fd = timerfd;
+	pfd.events = POLLIN;
+
+	for(;;)
+	{
+		if( poll( &pfd, 1, -1 ) < 0 )
+		{
+			if( errno == EINTR )
+			{
+				continue;
+			}
+			fprintf( stderr, "Keepalive poll() failure, errno = %d.\n", errno );
+			exit( EXIT_FAILURE );
+		}
+
+		handleKeepAliveTimer( timerfd );
+	}
+
+	close( timerfd );
+	pthread_exit( NULL );
+}
+
+static void collectCommandMetrics( FILE *out, void *arg )
+{
+	// Only the metrics server renders, one scrape at a time.
+	static CommandStats stats;
+	char labels[64];
+	unsigned int type;
+
+	getCommandStats( &stats );
+
+	metricsWriteHeader( out, "argps_commands_sent_total", METRIC_COUNTER, "AT commands sent, by kind." );
+	for( type = 0; type < NUM_COMMAND_TYPES; type++ )
+	{
+		snprintf( labels, sizeof( labels ), "type=\"%s\"", commandTypeName( type ) );
+		metricsWriteSample( out, "argps_commands_sent_total", labels, stats.sent[type] );
+	}
+
+	metricsWriteHeader( out, "argps_command_errors_total", METRIC_COUNTER, "AT commands that couldn't be sent, by kind." );
+	for( type = 0; type < NUM_COMMAND_TYPES; type++ )
+	{
+		snprintf( labels, sizeof( labels ), "type=\"%s\"", commandTypeName( type ) );
+		metricsWriteSample( out, "argps_command_errors_total", labels, stats.errors[type] );
+	}
+
+	metricsWriteHeader( out, "argps_command_latency_seconds", METRIC_HISTOGRAM, "drone*() call to sendto() return, by kind." );
+	for( type = 0; type < NUM_COMMAND_TYPES; type++ )
+	{
+		snprintf( labels, sizeof( labels ), "type=\"%s\"", commandTypeName( type ) );
+		metricsWriteHistogram( out, "argps_command_latency_seconds", labels, &stats.latency[type], 1e-9 );
+	}
+}
+
+void registerCommandMetrics()
+{
+	metricsCollector( collectCommandMetrics, NULL );
 }
@@ -3,14 +3,95 @@
 
 #define MAX_COMMAND_LEN 80
 
+// The drone drops into hover if it hears nothing for 2 s. The keepalive
+// timer sends AT*COMWDG only once no other command has gone out for this
+// long, which leaves plenty of margin for a lost datagram or two.
+#define KEEPALIVE_IDLE_MS 500
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "histogram.h"
+
+// One drone's command channel. The drone ignores any command whose sequence
+// number is lower than one it has already seen, so every thread sending to
+// it takes the next number from seq and sends under sendMutex.
+typedef struct
+{
+	int						sock;
+	struct sockaddr_in		addr;
+	char					name[INET_ADDRSTRLEN];	// Drone IP, for messages.
+	_Atomic unsigned int	seq;		// Next AT sequence number.
+	_Atomic uint64_t		lastSent;	// monotonicNs() of the last successful send.
+	pthread_mutex_t			sendMutex;
+
+	// If set, commands are handed to sink instead of the socket, e.g. to
+	// a simulated drone in the same process.
+	void					( *sink )( const char *cmd, size_t length, void *arg );
+	void					*sinkArg;
+} DroneLink;
+
+// The drone the drone*() and navdata*() functions talk to. Extern so
+// main.c can open it.
+extern DroneLink droneLink;
+
+// Kinds of command tracked separately in the command statistics.
+typedef enum
+{
+	CMD_TAKEOFF,
+	CMD_LAND,
+	CMD_HOVER,
+	CMD_UP,
+	CMD_DOWN,
+	CMD_FORWARD,
+	CMD_BACK,
+	CMD_LEFT,
+	CMD_RIGHT,
+	CMD_ROTATE_LEFT,
+	CMD_ROTATE_RIGHT,
+	CMD_MOVE,
+	CMD_CONFIG,
+	CMD_KEEPALIVE,
+	CMD_OTHER,
+	NUM_COMMAND_TYPES
+} CommandType;
 
-// Externs so they can be used in main.c.
-extern unsigned int droneSeqNumber;
-extern int droneCmdSock;
-extern struct sockaddr_in droneCmdAddr;
+// Totals over every thread that has sent a command. Latency is measured
+// from the moment a drone*() function is called to the return of sendto().
+typedef struct
+{
+	uint64_t	sent[NUM_COMMAND_TYPES];
+	uint64_t	errors[NUM_COMMAND_TYPES];
+	Histogram	latency[NUM_COMMAND_TYPES];	// Nanoseconds.
+	uint64_t	sampledAt;					// monotonicNs() when the snapshot was taken.
+} CommandStats;
 
-void sendCommand( const char *cmd );
+// Opens a UDP socket for commands to ip:port. Returns 0, or -1 if the
+// socket couldn't be created or ip isn't a dotted quad.
+int droneLinkOpen( DroneLink *link, const char *ip, const char *port );
+// Sets up a link without a socket that hands every command to sink, on
+// the sending thread. name stands in for the IP in messages.
+void droneLinkOpenSink( DroneLink *link, const char *name, void ( *sink )( const char *cmd, size_t length, void *arg ), void *arg );
+
+// Sends "AT*<name>=<seq>,<args>\r" (no ",<args>" if args is NULL) with the
+// link's next sequence number. All commands from every thread share the
+// counter and go out in sequence order. Returns 0 on success, -1 if the
+// datagram couldn't be sent.
+int droneLinkSend( DroneLink *link, CommandType type, const char *name, const char *args );
+// droneLinkSend() to the main drone, counted as CMD_OTHER.
+int sendCommand( const char *name, const char *args );
+
+// Merges the per-thread counters. Never blocks the threads sending commands.
+void getCommandStats( CommandStats *stats );
+// Prints totals, rates since the previous call, and latency percentiles.
+void printCommandStats( FILE *out );
+// Exports the merged command statistics through the metrics registry.
+void registerCommandMetrics();
+const char *commandTypeName( CommandType type );
 
 void droneInit();
 void droneTakeOff();
@@ -24,9 +105,39 @@ void droneLeft();
 void droneRight();
 void droneRotateLeft();
 void droneRotateRight();
+// Progressive command with arbitrary set points, each from -1.0 to 1.0.
+// Positive roll goes right, positive pitch goes back, positive gaz climbs
+// and positive yaw turns clockwise.
+void droneMove( float roll, float pitch, float gaz, float yaw );
 
+// Switches navdata out of bootstrap mode, acknowledges, then flat trims.
+// Only call navdataInit() on the ground; navdataEnableDemo() skips the trim.
 void navdataInit();
+void navdataEnableDemo();
 void navdataKeepAlive();
 
-#endif
+// The same commands for any drone. The functions above use droneLink.
+void droneLinkTakeOff( DroneLink *link );
+void droneLinkLand( DroneLink *link );
+void droneLinkHover( DroneLink *link );
+void droneLinkUp( DroneLink *link );
+void droneLinkDown( DroneLink *link );
+void droneLinkForward( DroneLink *link );
+void droneLinkBack( DroneLink *link );
+void droneLinkLeft( DroneLink *link );
+void droneLinkRight( DroneLink *link );
+void droneLinkRotateLeft( DroneLink *link );
+void droneLinkRotateRight( DroneLink *link );
+void droneLinkMove( DroneLink *link, float roll, float pitch, float gaz, float yaw );
+void droneLinkNavdataInit( DroneLink *link );
+void droneLinkEnableDemo( DroneLink *link );
+void droneLinkKeepAlive( DroneLink *link );
 
+// Idle-aware watchdog keepalive for droneLink. createKeepAliveTimer()
+// returns a non-blocking timerfd; call handleKeepAliveTimer() whenever it
+// is readable. commandKeepAlive() is a thread function doing both.
+int createKeepAliveTimer();
+void handleKeepAliveTimer( int timerfd );
+void *commandKeepAlive( void *arg );
+
+#endif
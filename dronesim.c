@@ -0,0 +1,416 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "dronesim.h"
+#include "navdata.h"
+#include "dronestate.h"
+
+#define PI 3.14159265358979323846
+#define EARTH_RADIUS_M 6371000.0
+
+// Major control states reported in the top half of navdata_demo_t.ctrl_state.
+#define CTRL_LANDED 2
+#define CTRL_FLYING 3
+#define CTRL_HOVERING 4
+#define CTRL_TAKEOFF 6
+#define CTRL_LANDING 8
+
+// AT*REF bits.
+#define REF_TAKEOFF ( 1 << 9 )
+#define REF_EMERGENCY ( 1 << 8 )
+
+void droneSimInit( DroneSim *sim, GpsPoint origin, uint64_t seed )
+{
+	memset( sim, 0, sizeof( *sim ) );
+	sim->origin = origin;
+	sim->battery = 100.0;
+	sim->random = seed ? seed : 1;
+}
+
+static float bitsToFloat( int32_t bits )
+{
+	float value;
+	memcpy( &value, &bits, sizeof( value ) );
+	return value;
+}
+
+// Parses a single AT command without its trailing \r.
+static void handleAtCommand( DroneSim *sim, const char *cmd )
+{
+	char name[16];
+	unsigned int seq;
+	int consumed = 0;
+
+	if( sscanf( cmd, "AT*%15[A-Z]=%u%n", name, &seq, &consumed ) < 2 )
+	{
+		sim->commandsRejected++;
+		return;
+	}
+
+	// Like the drone: drop anything older than what we've seen, unless the
+	// sender restarted from 1.
+	if( seq <= sim->lastAtSeq && seq != 1 )
+	{
+		sim->commandsRejected++;
+		return;
+	}
+	sim->lastAtSeq = seq;
+	sim->lastCommand = sim->time;
+	sim->commandsAccepted++;
+
+	const char *args = cmd + consumed;
+	if( *args == ',' )
+	{
+		args++;
+	}
+
+	if( strcmp( name, "REF" ) == 0 )
+	{
+		int ref = atoi( args );
+		if( ref & REF_EMERGENCY )
+		{
+			sim->emergency = !sim->emergency;
+		}
+		if( ( ref & REF_TAKEOFF ) && !sim->flying && !sim->emergency )
+		{
+			sim->flying = 1;
+			sim->takingOff = 1;
+			sim->landing = 0;
+		}
+		else if( !( ref & REF_TAKEOFF ) && sim->flying )
+		{
+			sim->landing = 1;
+			sim->takingOff = 0;
+		}
+	}
+	else if( strcmp( name, "PCMD" ) == 0 )
+	{
+		int flag;
+		int32_t roll, pitch, gaz, yaw;
+		if( sscanf( args, "%d,%d,%d,%d,%d", &flag, &roll, &pitch, &gaz, &yaw ) == 5 && ( flag & 1 ) )
+		{
+			sim->roll = bitsToFloat( roll );
+			sim->pitch = bitsToFloat( pitch );
+			sim->gaz = bitsToFloat( gaz );
+			sim->yawCmd = bitsToFloat( yaw );
+		}
+		else
+		{
+			sim->roll = sim->pitch = sim->gaz = sim->yawCmd = 0;
+		}
+	}
+	else if( strcmp( name, "CONFIG" ) == 0 )
+	{
+		if( strstr( args, "general:navdata_demo" ) != NULL && strstr( args, "TRUE" ) != NULL )
+		{
+			sim->demo = 1;
+		}
+	}
+	// COMWDG, CTRL and FTRIM only need to feed the watchdog, done above.
+}
+
+void droneSimCommand( DroneSim *sim, const char *datagram, size_t length )
+{
+	char cmd[256];
+	size_t start = 0;
+	size_t i;
+
+	for( i = 0; i <= length; i++ )
+	{
+		if( i == length || datagram[i] == '\r' || datagram[i] == '\0' )
+		{
+			size_t len = i - start;
+			if( len > 0 && len < sizeof( cmd ) )
+			{
+				memcpy( cmd, &datagram[start], len );
+				cmd[len] = '\0';
+				handleAtCommand( sim, cmd );
+			}
+			if( i < length && datagram[i] == '\0' )
+			{
+				break;
+			}
+			start = i + 1;
+		}
+	}
+}
+
+static double clampUnit( double value )
+{
+	if( value > 1.0 )
+	{
+		return 1.0;
+	}
+	if( value < -1.0 )
+	{
+		return -1.0;
+	}
+	return value;
+}
+
+void droneSimStep( DroneSim *sim, double dt )
+{
+	sim->time += dt;
+
+	if( sim->emergency )
+	{
+		sim->flying = 0;
+	}
+	if( !sim->flying )
+	{
+		sim->vx = sim->vy = sim->vz = 0;
+		sim->yawRate = 0;
+		sim->z = 0;
+		return;
+	}
+
+	sim->battery -= 100.0 * dt / SIM_FLIGHT_TIME;
+	if( sim->battery < 0 )
+	{
+		sim->battery = 0;
+	}
+
+	// Without commands the drone holds position, as the real one does.
+	int watchdog = ( sim->time - sim->lastCommand ) > SIM_WATCHDOG;
+	double roll = watchdog ? 0 : clampUnit( sim->roll );
+	double pitch = watchdog ? 0 : clampUnit( sim->pitch );
+	double gaz = watchdog ? 0 : clampUnit( sim->gaz );
+	double yawCmd = watchdog ? 0 : clampUnit( sim->yawCmd );
+
+	// Yaw rate lags the set point.
+	sim->yawRate += ( yawCmd * SIM_MAX_YAW_RATE - sim->yawRate ) * fmin( 1.0, dt / SIM_YAW_TAU );
+	sim->yaw += sim->yawRate * dt;
+	while( sim->yaw >= 180.0 )
+	{
+		sim->yaw -= 360.0;
+	}
+	while( sim->yaw < -180.0 )
+	{
+		sim->yaw += 360.0;
+	}
+
+	// Negative pitch flies forward, positive roll flies right.
+	double forward = -pitch * SIM_MAX_SPEED;
+	double right = roll * SIM_MAX_SPEED;
+	if( sim->takingOff || sim->landing )
+	{
+		forward = right = 0;
+	}
+
+	double heading = sim->yaw * PI / 180.0;
+	double targetVx = forward * sin( heading ) + right * cos( heading );
+	double targetVy = forward * cos( heading ) - right * sin( heading );
+	double lag = fmin( 1.0, dt / SIM_SPEED_TAU );
+	sim->vx += ( targetVx - sim->vx ) * lag;
+	sim->vy += ( targetVy - sim->vy ) * lag;
+
+	if( sim->takingOff )
+	{
+		sim->vz = SIM_TAKEOFF_RATE;
+		if( sim->z >= SIM_TAKEOFF_HEIGHT )
+		{
+			sim->takingOff = 0;
+			sim->vz = 0;
+		}
+	}
+	else if( sim->landing )
+	{
+		sim->vz = -SIM_LANDING_RATE;
+	}
+	else
+	{
+		sim->vz = gaz * SIM_MAX_CLIMB;
+	}
+
+	sim->x += sim->vx * dt;
+	sim->y += sim->vy * dt;
+	sim->z += sim->vz * dt;
+
+	if( sim->z <= 0 && sim->landing )
+	{
+		sim->z = 0;
+		sim->flying = 0;
+		sim->landing = 0;
+		sim->vx = sim->vy = sim->vz = 0;
+		sim->yawRate = 0;
+	}
+	if( sim->z < 0 )
+	{
+		sim->z = 0;
+	}
+}
+
+static uint32_t simState( DroneSim *sim )
+{
+	uint32_t state = sim->demo ? DRONE_STATE_NAVDATA_DEMO : DRONE_STATE_NAVDATA_BOOTSTRAP;
+	if( sim->flying )
+	{
+		state |= DRONE_STATE_FLYING;
+	}
+	if( sim->battery < SIM_LOW_BATTERY )
+	{
+		state |= DRONE_STATE_VBAT_LOW;
+	}
+	if( sim->emergency )
+	{
+		state |= DRONE_STATE_EMERGENCY;
+	}
+	if( ( sim->time - sim->lastCommand ) > SIM_WATCHDOG )
+	{
+		state |= DRONE_STATE_COM_WATCHDOG;
+	}
+	return state;
+}
+
+static uint32_t simCtrlState( DroneSim *sim )
+{
+	uint32_t major = CTRL_LANDED;
+	if( sim->takingOff )
+	{
+		major = CTRL_TAKEOFF;
+	}
+	else if( sim->landing )
+	{
+		major = CTRL_LANDING;
+	}
+	else if( sim->flying )
+	{
+		major = ( fabs( sim->vx ) + fabs( sim->vy ) > 0.1 ) ? CTRL_FLYING : CTRL_HOVERING;
+	}
+	return major << 16;
+}
+
+// Standard normal deviate from the simulator's own generator.
+static double gaussian( DroneSim *sim )
+{
+	double u[2];
+	int i;
+	for( i = 0; i < 2; i++ )
+	{
+		sim->random = sim->random * 6364136223846793005ULL + 1442695040888963407ULL;
+		u[i] = ( ( sim->random >> 11 ) + 0.5 ) / 9007199254740992.0;
+	}
+	return sqrt( -2.0 * log( u[0] ) ) * cos( 2.0 * PI * u[1] );
+}
+
+GpsPoint droneSimPosition( DroneSim *sim )
+{
+	double x = sim->x;
+	double y = sim->y;
+	if( sim->gpsNoise > 0 )
+	{
+		x += gaussian( sim ) * sim->gpsNoise;
+		y += gaussian( sim ) * sim->gpsNoise;
+	}
+
+	GpsPoint point;
+	point.latitude = sim->origin.latitude + ( y / EARTH_RADIUS_M ) * 180.0 / PI;
+	point.longitude = sim->origin.longitude + ( x / ( EARTH_RADIUS_M * cos( sim->origin.latitude * PI / 180.0 ) ) ) * 180.0 / PI;
+	return point;
+}
+
+size_t droneSimNavdata( DroneSim *sim, uint8_t *buffer, size_t size )
+{
+	// Real demo blocks are 148 bytes; the fields we don't model stay zero.
+	const size_t demoSize = 148;
+	size_t needed = sizeof( navdata_header_t ) + demoSize + sizeof( navdata_magneto_t ) + sizeof( navdata_gps_t ) + sizeof( navdata_cks_t );
+	if( size < needed )
+	{
+		return 0;
+	}
+	memset( buffer, 0, needed );
+
+	navdata_header_t header;
+	header.header = NAVDATA_HEADER_MAGIC;
+	header.state = simState( sim );
+	header.seq = ++sim->navdataSeq;
+	header.vision = 0;
+	memcpy( buffer, &header, sizeof( header ) );
+	size_t length = sizeof( header );
+
+	if( sim->demo )
+	{
+		navdata_demo_t demo;
+		memset( &demo, 0, sizeof( demo ) );
+		demo.id = NAVDATA_DEMO_TAG;
+		demo.size = demoSize;
+		demo.ctrl_state = simCtrlState( sim );
+		demo.vbat_flying_percentage = (uint32_t)sim->battery;
+		demo.theta = (float)( clampUnit( sim->pitch ) * SIM_MAX_TILT );
+		demo.phi = (float)( clampUnit( sim->roll ) * SIM_MAX_TILT );
+		demo.psi = (float)( sim->yaw * 1000.0 );
+		demo.altitude = (int32_t)( sim->z * 100.0 );
+		demo.vx = (float)( sim->vx * 1000.0 );
+		demo.vy = (float)( sim->vy * 1000.0 );
+		demo.vz = (float)( sim->vz * 1000.0 );
+		memcpy( buffer + length, &demo, sizeof( demo ) );
+		length += demoSize;
+
+		navdata_magneto_t magneto;
+		memset( &magneto, 0, sizeof( magneto ) );
+		magneto.id = NAVDATA_MAGNETO_TAG;
+		magneto.size = sizeof( magneto );
+		magneto.heading_fusion_unwrapped = (float)sim->yaw;
+		magneto.magneto_calibration_ok = 1;
+		memcpy( buffer + length, &magneto, sizeof( magneto ) );
+		length += sizeof( magneto );
+
+		GpsPoint position = droneSimPosition( sim );
+		navdata_gps_t gps;
+		memset( &gps, 0, sizeof( gps ) );
+		gps.id = NAVDATA_GPS_TAG;
+		gps.size = sizeof( gps );
+		gps.latitude = position.latitude;
+		gps.longitude = position.longitude;
+		gps.elevation = sim->z;
+		gps.hdop = 0.9;
+		gps.data_available = 1;
+		gps.lat0 = sim->origin.latitude;
+		gps.lon0 = sim->origin.longitude;
+		gps.speed = (float)hypot( sim->vx, sim->vy );
+		gps.degree = (float)( atan2( sim->vx, sim->vy ) * 180.0 / PI );
+		memcpy( buffer + length, &gps, sizeof( gps ) );
+		length += sizeof( gps );
+	}
+
+	uint32_t sum = 0;
+	size_t i;
+	for( i = 0; i < length; i++ )
+	{
+		sum += buffer[i];
+	}
+
+	navdata_cks_t cks;
+	cks.id = NAVDATA_CKS_TAG;
+	cks.size = sizeof( cks );
+	cks.cks = sum;
+	memcpy( buffer + length, &cks, sizeof( cks ) );
+	return length + sizeof( cks );
+}
+
+size_t droneSimNmea( DroneSim *sim, char *buffer, size_t size )
+{
+	GpsPoint position = droneSimPosition( sim );
+	double lat = fabs( position.latitude );
+	double lon = fabs( position.longitude );
+	unsigned int seconds = (unsigned int)sim->time;
+
+	char body[128];
+	snprintf( body, sizeof( body ), "GPGGA,%02u%02u%05.2f,%02d%07.4f,%c,%03d%07.4f,%c,1,08,0.9,%.1f,M,0.0,M,,",
+		( seconds / 3600 ) % 24, ( seconds / 60 ) % 60, fmod( sim->time, 60.0 ),
+		(int)lat, ( lat - (int)lat ) * 60.0, position.latitude < 0 ? 'S' : 'N',
+		(int)lon, ( lon - (int)lon ) * 60.0, position.longitude < 0 ? 'W' : 'E',
+		sim->z );
+
+	unsigned char checksum = 0;
+	const char *c;
+	for( c = body; *c != '\0'; c++ )
+	{
+		checksum ^= (unsigned char)*c;
+	}
+
+	int length = snprintf( buffer, size, "$%s*%02X\r\n", body, checksum );
+	return ( length < 0 || (size_t)length >= size ) ? 0 : (size_t)length;
+}
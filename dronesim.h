@@ -0,0 +1,76 @@
+#ifndef _DRONE_SIM_H_
+#define _DRONE_SIM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "gpsutil.h"
+
+// Rough AR.Drone 2.0 figures, good enough to close the loop off-hardware.
+#define SIM_MAX_SPEED 5.0			// m/s at full pitch or roll.
+#define SIM_MAX_CLIMB 1.0			// m/s at full gaz.
+#define SIM_MAX_YAW_RATE 100.0		// Degrees/s at full yaw.
+#define SIM_MAX_TILT 12000.0		// Milli-degrees of pitch/roll at full set point.
+#define SIM_SPEED_TAU 0.5			// Seconds, first-order lag of horizontal speed.
+#define SIM_YAW_TAU 0.1				// Seconds, first-order lag of yaw rate.
+#define SIM_TAKEOFF_HEIGHT 1.0		// Meters.
+#define SIM_TAKEOFF_RATE 0.7		// m/s.
+#define SIM_LANDING_RATE 0.5		// m/s.
+#define SIM_WATCHDOG 2.0			// Seconds without commands before hovering.
+#define SIM_FLIGHT_TIME 720.0		// Seconds of flight on a full battery.
+#define SIM_LOW_BATTERY 20.0		// Percent.
+
+typedef struct
+{
+	GpsPoint	origin;			// Take-off point, position (0, 0).
+	double		time;			// Simulated seconds since droneSimInit().
+
+	// Local frame: x east, y north, z up, in meters. Yaw in degrees,
+	// clockwise from north, -180 to 180 like the real navdata psi.
+	double		x, y, z;
+	double		vx, vy, vz;
+	double		yaw;
+	double		yawRate;
+
+	// Latest progressive command set points, each -1.0 to 1.0.
+	double		roll, pitch, gaz, yawCmd;
+
+	int			flying;
+	int			takingOff;
+	int			landing;
+	int			emergency;
+	int			demo;			// Navdata demo mode configured, otherwise bootstrap.
+	double		battery;		// Percent.
+	double		lastCommand;	// time of the last accepted AT command.
+
+	uint32_t	lastAtSeq;		// Highest AT sequence number accepted.
+	uint32_t	navdataSeq;
+	uint64_t	commandsAccepted;
+	uint64_t	commandsRejected;	// Stale sequence numbers or unparsable commands.
+
+	// Optional GPS noise, standard deviation in meters, from a seeded LCG
+	// so that simulations are reproducible.
+	double		gpsNoise;
+	uint64_t	random;
+} DroneSim;
+
+void droneSimInit( DroneSim *sim, GpsPoint origin, uint64_t seed );
+
+// Feeds one command datagram, which may hold several \r-terminated AT commands.
+void droneSimCommand( DroneSim *sim, const char *datagram, size_t length );
+
+// Advances the model by dt seconds.
+void droneSimStep( DroneSim *sim, double dt );
+
+// Writes the navdata packet the drone would send now: header, demo,
+// magnetometer and GPS options and the checksum, or only the header and
+// checksum while still in bootstrap mode. Returns the packet length.
+size_t droneSimNavdata( DroneSim *sim, uint8_t *buffer, size_t size );
+
+// Writes a $GPGGA sentence for the current position, with \r\n.
+size_t droneSimNmea( DroneSim *sim, char *buffer, size_t size );
+
+// Current position, with GPS noise if configured.
+GpsPoint droneSimPosition( DroneSim *sim );
+
+#endif
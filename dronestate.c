@@ -0,0 +1,107 @@
+#include <string.h>
+
+#include "dronestate.h"
+
+static const char *stateBitNames[32] =
+{
+	"FLY MASK",
+	"VIDEO MASK",
+	"VISION MASK",
+	"CONTROL ALGO",
+	"ALTITUDE CONTROL ALGO",
+	"USER feedback",
+	"Control command ACK",
+	"Trim command ACK",
+	"Trim running",
+	"Trim result",
+	"Navdata demo",
+	"Navdata bootstrap",
+	"Motors status",
+	"Communication Lost",
+	"problem with gyrometers",
+	"VBat low",
+	"VBat high",
+	"Timer elapsed",
+	"Power",
+	"Angles",
+	"Wind",
+	"Ultrasonic sensor",
+	"Cutout system detection",
+	"PIC Version number OK",
+	"ATCodec thread",
+	"Navdata thread",
+	"Video thread",
+	"Acquisition thread",
+	"CTRL watchdog",
+	"ADC Watchdog",
+	"Communication Watchdog",
+	"Emergency landing"
+};
+
+void droneStateInit( DroneStateDecoder *decoder )
+{
+	memset( decoder, 0, sizeof( *decoder ) );
+}
+
+int droneStateSubscribe( DroneStateDecoder *decoder, uint32_t mask, DroneStateHandler handler, void *arg )
+{
+	if( decoder->numSubscribers >= MAX_DRONE_STATE_SUBSCRIBERS )
+	{
+		return -1;
+	}
+
+	DroneStateSubscriber *subscriber = &decoder->subscribers[decoder->numSubscribers++];
+	subscriber->mask = mask;
+	subscriber->handler = handler;
+	subscriber->arg = arg;
+	return 0;
+}
+
+void droneStateUpdate( DroneStateDecoder *decoder, uint32_t state, uint64_t time )
+{
+	uint32_t changed = state ^ decoder->previous;
+	if( changed == 0 )
+	{
+		return;
+	}
+	decoder->previous = state;
+
+	DroneStateEvent event;
+	event.state = state;
+	event.time = time;
+
+	unsigned int i;
+	for( i = 0; i < decoder->numSubscribers; i++ )
+	{
+		DroneStateSubscriber *subscriber = &decoder->subscribers[i];
+		uint32_t pending = changed & subscriber->mask;
+		while( pending != 0 )
+		{
+			event.bit = pending & -pending;
+			event.set = ( state & event.bit ) != 0;
+			pending &= pending - 1;
+			subscriber->handler( &event, subscriber->arg );
+		}
+	}
+}
+
+const char *droneStateBitName( uint32_t bit )
+{
+	if( bit == 0 )
+	{
+		return "none";
+	}
+
+	return stateBitNames[__builtin_ctz( bit )];
+}
+
+void printDroneState( FILE *out, uint32_t state )
+{
+	fprintf( out, "drone's state:\n" );
+
+	unsigned int i;
+	for( i = 0; i < 32; i++ )
+	{
+		fprintf( out, "\t%13d:%s\n", ( state & ( 1U << i ) ) != 0, stateBitNames[i] );
+	}
+}
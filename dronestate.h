@@ -0,0 +1,81 @@
+#ifndef _DRONE_STATE_H_
+#define _DRONE_STATE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+// Bits of the navdata header state word.
+#define DRONE_STATE_FLYING				( 1U << 0 )
+#define DRONE_STATE_VIDEO				( 1U << 1 )
+#define DRONE_STATE_VISION				( 1U << 2 )
+#define DRONE_STATE_CONTROL_ALGO		( 1U << 3 )
+#define DRONE_STATE_ALTITUDE_CONTROL	( 1U << 4 )
+#define DRONE_STATE_USER_FEEDBACK		( 1U << 5 )
+#define DRONE_STATE_COMMAND_ACK			( 1U << 6 )
+#define DRONE_STATE_TRIM_ACK			( 1U << 7 )
+#define DRONE_STATE_TRIM_RUNNING		( 1U << 8 )
+#define DRONE_STATE_TRIM_RESULT			( 1U << 9 )
+#define DRONE_STATE_NAVDATA_DEMO		( 1U << 10 )
+#define DRONE_STATE_NAVDATA_BOOTSTRAP	( 1U << 11 )
+#define DRONE_STATE_MOTORS				( 1U << 12 )
+#define DRONE_STATE_COM_LOST			( 1U << 13 )
+#define DRONE_STATE_GYRO_PROBLEM		( 1U << 14 )
+#define DRONE_STATE_VBAT_LOW			( 1U << 15 )
+#define DRONE_STATE_VBAT_HIGH			( 1U << 16 )
+#define DRONE_STATE_TIMER_ELAPSED		( 1U << 17 )
+#define DRONE_STATE_POWER				( 1U << 18 )
+#define DRONE_STATE_ANGLES_OUT_OF_RANGE	( 1U << 19 )
+#define DRONE_STATE_WIND				( 1U << 20 )
+#define DRONE_STATE_ULTRASOUND			( 1U << 21 )
+#define DRONE_STATE_CUTOUT				( 1U << 22 )
+#define DRONE_STATE_PIC_VERSION			( 1U << 23 )
+#define DRONE_STATE_ATCODEC_THREAD		( 1U << 24 )
+#define DRONE_STATE_NAVDATA_THREAD		( 1U << 25 )
+#define DRONE_STATE_VIDEO_THREAD		( 1U << 26 )
+#define DRONE_STATE_ACQUISITION_THREAD	( 1U << 27 )
+#define DRONE_STATE_CTRL_WATCHDOG		( 1U << 28 )
+#define DRONE_STATE_ADC_WATCHDOG		( 1U << 29 )
+#define DRONE_STATE_COM_WATCHDOG		( 1U << 30 )
+#define DRONE_STATE_EMERGENCY			( 1U << 31 )
+
+#define MAX_DRONE_STATE_SUBSCRIBERS 8
+
+// One state bit changing between consecutive navdata packets.
+typedef struct
+{
+	uint32_t	bit;		// One of the DRONE_STATE_* masks.
+	int			set;		// 1 if the bit turned on, 0 if it turned off.
+	uint32_t	state;		// The whole new state word.
+	uint64_t	time;		// Receive time of the packet, monotonicNs() clock.
+} DroneStateEvent;
+
+typedef void (*DroneStateHandler)( const DroneStateEvent *event, void *arg );
+
+typedef struct
+{
+	uint32_t			mask;
+	DroneStateHandler	handler;
+	void				*arg;
+} DroneStateSubscriber;
+
+typedef struct
+{
+	uint32_t				previous;
+	unsigned int			numSubscribers;
+	DroneStateSubscriber	subscribers[MAX_DRONE_STATE_SUBSCRIBERS];
+} DroneStateDecoder;
+
+void droneStateInit( DroneStateDecoder *decoder );
+
+// Calls handler for every change of a bit in mask. Subscribe before the
+// navdata thread starts. Returns 0, or -1 if there are too many subscribers.
+int droneStateSubscribe( DroneStateDecoder *decoder, uint32_t mask, DroneStateHandler handler, void *arg );
+
+// Diffs a new state word against the previous one and emits events for
+// the bits that changed. Unchanged packets cost one XOR and one branch.
+void droneStateUpdate( DroneStateDecoder *decoder, uint32_t state, uint64_t time );
+
+const char *droneStateBitName( uint32_t bit );
+void printDroneState( FILE *out, uint32_t state );
+
+#endif
@@ -1,8 +1,13 @@
+#define _GNU_SOURCE
+
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <math.h>
 #include <arpa/inet.h>
@@ -15,16 +20,39 @@
 #include <syslog.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include <pthread.h>
+#include <getopt.h>
+
+#include "network.h"
+#include "telemetry.h"
+#include "histogram.h"
+#include "metrics.h"
+#include "timeutil.h"
 
 #define MAX_BUFFER_SIZE 1024
+#define LOAD_DEFAULT_RATE 10.0		// Messages per second on each command connection.
+#define LOAD_DEFAULT_SECONDS 10
+#define LOAD_MAX_SCRIPT 256			// Lines kept from a script file.
+#define LOAD_MAX_EVENTS 256
+#define LOAD_MAX_TICK_MS 20			// Longest pacing tick, shorter for higher rates.
+#define LOAD_RECONNECT_MS 100		// Wait before reconnecting a dropped connection.
+#define LOAD_FLOOD_BATCH 64			// Messages per wakeup on an unpaced connection.
 
 void printUsage();
 void runTcpClient( const char *port );
 void runUdpClient( const char *port );
+void runLoad( int argc, char **argv );
 
 int main( int argc, char **argv )
 {
+	if( argc >= 2 && strcmp( argv[1], "load" ) == 0 )
+	{
+		runLoad( argc - 1, argv + 1 );
+		return 0;
+	}
+
 	if( argc != 3 )
 	{
 		printUsage();
@@ -50,9 +78,25 @@ int main( int argc, char **argv )
 
 void printUsage()
 {
-	printf( "Usage: ./dummylcient <protocol> <port number>\n" );
+	printf( "Usage: ./dummyclient <protocol> <port number>\n" );
 	printf( "<protocol> = tcp or udp.\n" );
 	printf( "Creates dummy client that just sends integers to the desired port.\n" );
+	printf( "\n" );
+	printf( "Usage: ./dummyclient load [options]\n" );
+	printf( "Opens many Android style connections to main and reports connect latency,\n" );
+	printf( "throughput and errors. Manual commands really fly the drone main talks to.\n" );
+	printf( "  -c <count>   Command connections, default 8.\n" );
+	printf( "  -g <count>   GPS update subscribers, default 8.\n" );
+	printf( "  -r <rate>    Messages per second on each command connection, default %.0f.\n", LOAD_DEFAULT_RATE );
+	printf( "               0 sends as fast as the server takes them.\n" );
+	printf( "  -s <file>    Script of messages to replay, one per line, # for comments.\n" );
+	printf( "               Each connection loops over it. By default it sends a route,\n" );
+	printf( "               asks for manual control and moves around.\n" );
+	printf( "  -u <rate>    GPS update rate subscribers ask for, default every fix.\n" );
+	printf( "  -b           Subscribers ask for binary frames instead of text.\n" );
+	printf( "  -d <seconds> How long to run, default %d, 0 until interrupted.\n", LOAD_DEFAULT_SECONDS );
+	printf( "  -a <ip>      Address of main, default 127.0.0.1.\n" );
+	printf( "  -w <count>   Worker threads, default 1.\n" );
 }
 
 void runTcpClient( const char *port )
@@ -157,3 +201,709 @@ void runUdpClient( const char *port )
 	}
 }
 
+
+// Android traffic a command connection loops over unless -s gives a script.
+// Only one connection gets manual control; the rest are told someone else
+// has it and their cmd lines are rejected, which is load all the same.
+static const char *defaultScript[] =
+{
+	"list 2 38.954352 -95.252811 38.955252 -95.252811",
+	"manual",
+	"cmd moveforward",
+	"cmd turnleft",
+	"cmd moveback",
+	"cmd turnright",
+	"cmd moveup",
+	"cmd movedown",
+};
+
+typedef struct
+{
+	int			gps;			// Subscribes to GPS updates instead of sending commands.
+	int			fd;				// -1 while waiting to reconnect.
+	int			connecting;
+	int			watchingOut;	// Registered for EPOLLOUT.
+	uint64_t	connectStart;
+	uint64_t	reconnectAt;
+	uint64_t	paceStart;		// When the connection started sending.
+	uint64_t	paced;			// Messages since paceStart, sent or skipped.
+	unsigned int	line;		// Script line being sent.
+	size_t		lineOffset;		// Bytes of it already sent.
+	char		frame[TELEMETRY_FRAME_MAX];	// Start of a binary frame split across reads.
+	size_t		frameLength;
+} LoadConnection;
+
+// Written by one worker, read by the main thread for progress lines.
+typedef struct
+{
+	_Atomic uint64_t	open;
+	_Atomic uint64_t	connects;
+	_Atomic uint64_t	connectFailures;
+	_Atomic uint64_t	disconnects;		// Closed by the server or by a failed send.
+	_Atomic uint64_t	messages;
+	_Atomic uint64_t	bytesSent;
+	_Atomic uint64_t	stalls;				// Sends that found the socket buffer full.
+	_Atomic uint64_t	skipped;			// Messages dropped to keep the backlog under a second.
+	_Atomic uint64_t	updates;
+	_Atomic uint64_t	bytesReceived;
+	_Atomic uint64_t	badFrames;
+	Histogram			connectLatency;		// Nanoseconds from connect() to established.
+} LoadStats;
+
+typedef struct
+{
+	unsigned int		index;
+	pthread_t			thread;
+	int					epollfd;
+	int					timerfd;
+	LoadConnection		*connections;
+	unsigned int		numConnections;
+	LoadStats			stats;
+} LoadWorker;
+
+static struct
+{
+	struct sockaddr_in	commandAddr;
+	struct sockaddr_in	gpsAddr;
+	double				rate;
+	double				gpsRate;
+	int					binary;
+	char				*script[LOAD_MAX_SCRIPT];	// Lines with their "\n".
+	size_t				scriptLengths[LOAD_MAX_SCRIPT];
+	unsigned int		scriptLines;
+	_Atomic int			running;
+} load;
+
+static void addScriptLine( const char *line )
+{
+	if( load.scriptLines == LOAD_MAX_SCRIPT )
+	{
+		fprintf( stderr, "Script longer than %d lines, keeping the first %d.\n", LOAD_MAX_SCRIPT, LOAD_MAX_SCRIPT );
+		return;
+	}
+
+	size_t length = strlen( line );
+	char *copy = malloc( length + 2 );
+	if( copy == NULL )
+	{
+		fprintf( stderr, "Couldn't allocate script.\n" );
+		exit( EXIT_FAILURE );
+	}
+	memcpy( copy, line, length );
+	copy[length] = '\n';
+	copy[length + 1] = '\0';
+
+	load.script[load.scriptLines] = copy;
+	load.scriptLengths[load.scriptLines] = length + 1;
+	load.scriptLines++;
+}
+
+static void readScript( const char *path )
+{
+	FILE *file = fopen( path, "r" );
+	if( file == NULL )
+	{
+		fprintf( stderr, "Couldn't open %s, errno = %d.\n", path, errno );
+		exit( EXIT_FAILURE );
+	}
+
+	char line[MAX_BUFFER_SIZE];
+	while( fgets( line, sizeof( line ), file ) != NULL )
+	{
+		line[strcspn( line, "\r\n" )] = '\0';
+		if( line[0] != '\0' && line[0] != '#' )
+		{
+			addScriptLine( line );
+		}
+	}
+	fclose( file );
+
+	if( load.scriptLines == 0 )
+	{
+		fprintf( stderr, "%s has no messages.\n", path );
+		exit( EXIT_FAILURE );
+	}
+}
+
+static void watchConnection( LoadWorker *worker, LoadConnection *conn, int op, int out )
+{
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLRDHUP | ( out ? EPOLLOUT : 0 );
+	ev.data.ptr = conn;
+	if( epoll_ctl( worker->epollfd, op, conn->fd, &ev ) < 0 )
+	{
+		fprintf( stderr, "Load worker %u epoll_ctl() failure, errno = %d.\n", worker->index, errno );
+		exit( EXIT_FAILURE );
+	}
+	conn->watchingOut = out;
+}
+
+static void closeConnection( LoadWorker *worker, LoadConnection *conn, uint64_t now )
+{
+	epoll_ctl( worker->epollfd, EPOLL_CTL_DEL, conn->fd, NULL );
+	close( conn->fd );
+	conn->fd = -1;
+	conn->reconnectAt = now + LOAD_RECONNECT_MS * NSEC_PER_MSEC;
+	if( conn->connecting )
+	{
+		conn->connecting = 0;
+		COUNT( worker->stats.connectFailures );
+	}
+	else
+	{
+		ADD( worker->stats.open, -1 );
+		COUNT( worker->stats.disconnects );
+	}
+}
+
+static void sendScript( LoadWorker *worker, LoadConnection *conn, uint64_t now );
+
+static void connected( LoadWorker *worker, LoadConnection *conn, uint64_t now )
+{
+	histogramRecordLocal( &worker->stats.connectLatency, now - conn->connectStart );
+	COUNT( worker->stats.connects );
+	COUNT( worker->stats.open );
+	conn->connecting = 0;
+
+	if( conn->gps )
+	{
+		// A fresh socket has room for a couple of short requests.
+		char requests[64];
+		int length = 0;
+		if( load.gpsRate > 0 )
+		{
+			length += snprintf( requests + length, sizeof( requests ) - length, "rate %g\n", load.gpsRate );
+		}
+		if( load.binary )
+		{
+			length += snprintf( requests + length, sizeof( requests ) - length, "format binary\n" );
+		}
+		conn->frameLength = 0;
+		watchConnection( worker, conn, EPOLL_CTL_MOD, 0 );
+		if( length > 0 && send( conn->fd, requests, length, MSG_NOSIGNAL ) != length )
+		{
+			closeConnection( worker, conn, now );
+		}
+		return;
+	}
+
+	conn->paceStart = now;
+	conn->paced = 0;
+	conn->line = 0;
+	conn->lineOffset = 0;
+	watchConnection( worker, conn, EPOLL_CTL_MOD, load.rate <= 0 );
+	sendScript( worker, conn, now );
+}
+
+static void startConnection( LoadWorker *worker, LoadConnection *conn, uint64_t now )
+{
+	conn->connectStart = now;
+	conn->connecting = 1;
+	conn->fd = socket( AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+	if( conn->fd < 0 )
+	{
+		fprintf( stderr, "Load worker %u socket() failure, errno = %d.\n", worker->index, errno );
+		conn->connecting = 0;
+		conn->reconnectAt = now + LOAD_RECONNECT_MS * NSEC_PER_MSEC;
+		COUNT( worker->stats.connectFailures );
+		return;
+	}
+
+	// Messages are small and each one should go out as soon as it's sent.
+	int yes = 1;
+	setsockopt( conn->fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof( yes ) );
+
+	const struct sockaddr_in *addr = conn->gps ? &load.gpsAddr : &load.commandAddr;
+	watchConnection( worker, conn, EPOLL_CTL_ADD, 1 );
+	if( connect( conn->fd, (const struct sockaddr *)addr, sizeof( *addr ) ) == 0 )
+	{
+		connected( worker, conn, now );
+	}
+	else if( errno != EINPROGRESS )
+	{
+		closeConnection( worker, conn, now );
+	}
+}
+
+// Sends the script lines that are due, keeping at most a second's worth of
+// backlog when the server falls behind. Unpaced connections send a batch
+// per wakeup until the socket is full.
+static void sendScript( LoadWorker *worker, LoadConnection *conn, uint64_t now )
+{
+	uint64_t due = conn->paced + LOAD_FLOOD_BATCH;
+	if( load.rate > 0 )
+	{
+		due = (uint64_t)( ( now - conn->paceStart ) * load.rate / NSEC_PER_SEC );
+		uint64_t backlog = (uint64_t)ceil( load.rate );
+		if( due > conn->paced + backlog )
+		{
+			ADD( worker->stats.skipped, due - backlog - conn->paced );
+			conn->paced = due - backlog;
+		}
+	}
+
+	while( conn->paced < due )
+	{
+		const char *line = load.script[conn->line];
+		size_t length = load.scriptLengths[conn->line];
+
+		ssize_t size = send( conn->fd, line + conn->lineOffset, length - conn->lineOffset, MSG_NOSIGNAL );
+		if( size < 0 )
+		{
+			if( errno == EAGAIN || errno == EWOULDBLOCK )
+			{
+				COUNT( worker->stats.stalls );
+				if( !conn->watchingOut )
+				{
+					watchConnection( worker, conn, EPOLL_CTL_MOD, 1 );
+				}
+				return;
+			}
+			closeConnection( worker, conn, now );
+			return;
+		}
+
+		ADD( worker->stats.bytesSent, size );
+		conn->lineOffset += size;
+		if( conn->lineOffset == length )
+		{
+			COUNT( worker->stats.messages );
+			conn->lineOffset = 0;
+			conn->line = ( conn->line + 1 ) % load.scriptLines;
+			conn->paced++;
+		}
+	}
+
+	// Paced connections only wait for EPOLLOUT after filling the socket.
+	if( load.rate > 0 && conn->watchingOut )
+	{
+		watchConnection( worker, conn, EPOLL_CTL_MOD, 0 );
+	}
+}
+
+// Counts "%lf %lf\n" lines, or whole frames when subscribed to binary.
+static void countUpdates( LoadWorker *worker, LoadConnection *conn, const char *data, size_t size )
+{
+	if( !load.binary )
+	{
+		const char *end = data + size;
+		while( ( data = memchr( data, '\n', end - data ) ) != NULL )
+		{
+			COUNT( worker->stats.updates );
+			data++;
+		}
+		return;
+	}
+
+	while( size > 0 )
+	{
+		size_t take = TELEMETRY_FRAME_MAX - conn->frameLength;
+		if( take > size )
+		{
+			take = size;
+		}
+		memcpy( conn->frame + conn->frameLength, data, take );
+		conn->frameLength += take;
+		data += take;
+		size -= take;
+
+		while( conn->frameLength >= sizeof( TelemetryFrameHeader ) )
+		{
+			TelemetryFrameHeader header;
+			memcpy( &header, conn->frame, sizeof( header ) );
+			size_t length = ntohs( header.length );
+			if( ntohs( header.magic ) != TELEMETRY_FRAME_MAGIC || length < sizeof( header ) || length > TELEMETRY_FRAME_MAX )
+			{
+				// Lost track of the framing, start again at the next read.
+				COUNT( worker->stats.badFrames );
+				conn->frameLength = 0;
+				return;
+			}
+			if( conn->frameLength < length )
+			{
+				break;
+			}
+
+			COUNT( worker->stats.updates );
+			conn->frameLength -= length;
+			memmove( conn->frame, conn->frame + length, conn->frameLength );
+		}
+	}
+}
+
+static void readConnection( LoadWorker *worker, LoadConnection *conn, uint64_t now )
+{
+	char buffer[4096];
+	for(;;)
+	{
+		ssize_t size = recv( conn->fd, buffer, sizeof( buffer ), 0 );
+		if( size < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+		{
+			return;
+		}
+		if( size <= 0 )
+		{
+			closeConnection( worker, conn, now );
+			return;
+		}
+
+		ADD( worker->stats.bytesReceived, size );
+		if( conn->gps )
+		{
+			countUpdates( worker, conn, buffer, size );
+		}
+	}
+}
+
+static void handleConnection( LoadWorker *worker, LoadConnection *conn, uint32_t events, uint64_t now )
+{
+	if( conn->connecting )
+	{
+		int error = 0;
+		socklen_t length = sizeof( error );
+		if( getsockopt( conn->fd, SOL_SOCKET, SO_ERROR, &error, &length ) < 0 || error != 0 )
+		{
+			closeConnection( worker, conn, now );
+		}
+		else if( events & ( EPOLLOUT | EPOLLERR | EPOLLHUP ) )
+		{
+			connected( worker, conn, now );
+		}
+		return;
+	}
+
+	if( events & ( EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR ) )
+	{
+		readConnection( worker, conn, now );
+	}
+	if( conn->fd >= 0 && !conn->gps && ( events & EPOLLOUT ) )
+	{
+		sendScript( worker, conn, now );
+	}
+}
+
+static void *loadWorkerRun( void *arg )
+{
+	LoadWorker *worker = arg;
+	struct epoll_event events[LOAD_MAX_EVENTS];
+
+	// Tick about twice per message so pacing stays smooth, but not so often
+	// that slow connections cost more than they send.
+	uint64_t tick = NSEC_PER_MSEC;
+	if( load.rate > 0 && NSEC_PER_SEC / load.rate / 2 > tick )
+	{
+		tick = NSEC_PER_SEC / load.rate / 2;
+	}
+	if( tick > LOAD_MAX_TICK_MS * NSEC_PER_MSEC )
+	{
+		tick = LOAD_MAX_TICK_MS * NSEC_PER_MSEC;
+	}
+	struct itimerspec spec;
+	spec.it_interval.tv_sec = tick / NSEC_PER_SEC;
+	spec.it_interval.tv_nsec = tick % NSEC_PER_SEC;
+	spec.it_value = spec.it_interval;
+	timerfd_settime( worker->timerfd, 0, &spec, NULL );
+
+	uint64_t now = monotonicNs();
+	unsigned int i;
+	for( i = 0; i < worker->numConnections; i++ )
+	{
+		startConnection( worker, &worker->connections[i], now );
+	}
+
+	while( atomic_load_explicit( &load.running, memory_order_relaxed ) )
+	{
+		int count = epoll_wait( worker->epollfd, events, LOAD_MAX_EVENTS, 100 );
+		if( count < 0 )
+		{
+			if( errno == EINTR )
+			{
+				continue;
+			}
+			fprintf( stderr, "Load worker %u epoll_wait() failure, errno = %d.\n", worker->index, errno );
+			exit( EXIT_FAILURE );
+		}
+
+		now = monotonicNs();
+		int ticked = 0;
+		int e;
+		for( e = 0; e < count; e++ )
+		{
+			if( events[e].data.ptr == NULL )
+			{
+				uint64_t expirations;
+				if( read( worker->timerfd, &expirations, sizeof( expirations ) ) > 0 )
+				{
+					ticked = 1;
+				}
+				continue;
+			}
+			LoadConnection *conn = events[e].data.ptr;
+			if( conn->fd >= 0 )
+			{
+				handleConnection( worker, conn, events[e].events, now );
+			}
+		}
+
+		if( !ticked )
+		{
+			continue;
+		}
+		for( i = 0; i < worker->numConnections; i++ )
+		{
+			LoadConnection *conn = &worker->connections[i];
+			if( conn->fd < 0 )
+			{
+				if( now >= conn->reconnectAt )
+				{
+					startConnection( worker, conn, now );
+				}
+			}
+			else if( !conn->gps && !conn->connecting && load.rate > 0 && !conn->watchingOut )
+			{
+				sendScript( worker, conn, now );
+			}
+		}
+	}
+
+	for( i = 0; i < worker->numConnections; i++ )
+	{
+		if( worker->connections[i].fd >= 0 )
+		{
+			close( worker->connections[i].fd );
+		}
+	}
+	return NULL;
+}
+
+static void sumLoadStats( LoadWorker *workers, unsigned int numWorkers, LoadStats *total )
+{
+	memset( total, 0, sizeof( *total ) );
+	unsigned int i;
+	for( i = 0; i < numWorkers; i++ )
+	{
+		LoadStats *stats = &workers[i].stats;
+		ADD( total->open, atomic_load( &stats->open ) );
+		ADD( total->connects, atomic_load( &stats->connects ) );
+		ADD( total->connectFailures, atomic_load( &stats->connectFailures ) );
+		ADD( total->disconnects, atomic_load( &stats->disconnects ) );
+		ADD( total->messages, atomic_load( &stats->messages ) );
+		ADD( total->bytesSent, atomic_load( &stats->bytesSent ) );
+		ADD( total->stalls, atomic_load( &stats->stalls ) );
+		ADD( total->skipped, atomic_load( &stats->skipped ) );
+		ADD( total->updates, atomic_load( &stats->updates ) );
+		ADD( total->bytesReceived, atomic_load( &stats->bytesReceived ) );
+		ADD( total->badFrames, atomic_load( &stats->badFrames ) );
+		histogramMerge( &total->connectLatency, &stats->connectLatency );
+	}
+}
+
+static void printLoadSummary( const LoadStats *total, double seconds, unsigned int connections )
+{
+	uint64_t attempts = total->connects + total->connectFailures;
+	printf( "Connects: %llu of %llu attempts (%.2f%% failed), latency p50 %.3f ms p99 %.3f ms max %.3f ms.\n",
+		(unsigned long long)total->connects, (unsigned long long)attempts,
+		( attempts > 0 ) ? 100.0 * total->connectFailures / attempts : 0.0,
+		histogramPercentile( &total->connectLatency, 0.5 ) / 1e6,
+		histogramPercentile( &total->connectLatency, 0.99 ) / 1e6,
+		total->connectLatency.max / 1e6 );
+	printf( "Commands: %llu messages (%.1f/s), %.1f KB/s, %llu stalls, %llu skipped.\n",
+		(unsigned long long)total->messages, total->messages / seconds, total->bytesSent / seconds / 1024,
+		(unsigned long long)total->stalls, (unsigned long long)total->skipped );
+	printf( "GPS: %llu updates (%.1f/s), %.1f KB/s received, %llu bad frames.\n",
+		(unsigned long long)total->updates, total->updates / seconds, total->bytesReceived / seconds / 1024,
+		(unsigned long long)total->badFrames );
+	printf( "Disconnects: %llu (%.2f per connection), %llu of %u connections open at the end.\n",
+		(unsigned long long)total->disconnects, (double)total->disconnects / connections,
+		(unsigned long long)total->open, connections );
+}
+
+static void parseAddress( const char *ip, const char *port, struct sockaddr_in *addr )
+{
+	memset( addr, 0, sizeof( *addr ) );
+	addr->sin_family = AF_INET;
+	addr->sin_port = htons( atoi( port ) );
+	if( inet_aton( ip, &addr->sin_addr ) == 0 )
+	{
+		fprintf( stderr, "Bad address %s.\n", ip );
+		exit( EXIT_FAILURE );
+	}
+}
+
+void runLoad( int argc, char **argv )
+{
+	unsigned int commandClients = 8;
+	unsigned int gpsClients = 8;
+	unsigned int numWorkers = 1;
+	unsigned int seconds = LOAD_DEFAULT_SECONDS;
+	const char *ip = "127.0.0.1";
+	const char *scriptPath = NULL;
+	int opt;
+
+	load.rate = LOAD_DEFAULT_RATE;
+	while( ( opt = getopt( argc, argv, "c:g:r:s:u:bd:a:w:h" ) ) != -1 )
+	{
+		switch( opt )
+		{
+		case 'c':
+			commandClients = atoi( optarg );
+			break;
+		case 'g':
+			gpsClients = atoi( optarg );
+			break;
+		case 'r':
+			load.rate = atof( optarg );
+			break;
+		case 's':
+			scriptPath = optarg;
+			break;
+		case 'u':
+			load.gpsRate = atof( optarg );
+			break;
+		case 'b':
+			load.binary = 1;
+			break;
+		case 'd':
+			seconds = atoi( optarg );
+			break;
+		case 'a':
+			ip = optarg;
+			break;
+		case 'w':
+			numWorkers = atoi( optarg );
+			break;
+		default:
+			printUsage();
+			exit( ( opt == 'h' ) ? EXIT_SUCCESS : EXIT_FAILURE );
+		}
+	}
+
+	unsigned int connections = commandClients + gpsClients;
+	if( connections == 0 || numWorkers == 0 )
+	{
+		printUsage();
+		exit( EXIT_FAILURE );
+	}
+	if( numWorkers > connections )
+	{
+		numWorkers = connections;
+	}
+
+	if( scriptPath != NULL )
+	{
+		readScript( scriptPath );
+	}
+	else
+	{
+		unsigned int i;
+		for( i = 0; i < sizeof( defaultScript ) / sizeof( defaultScript[0] ); i++ )
+		{
+			addScriptLine( defaultScript[i] );
+		}
+	}
+
+	parseAddress( ip, ANDROID_COMMAND_PORT, &load.commandAddr );
+	parseAddress( ip, ANDROID_GPS_UPDATE_PORT, &load.gpsAddr );
+	unsigned int needed = connections + numWorkers * 2 + 64;
+	unsigned long allowed = raiseFileLimit( needed );
+	if( allowed < needed )
+	{
+		fprintf( stderr, "Only %lu file descriptors allowed, the load needs about %u.\n", allowed, needed );
+	}
+
+	// Workers leave the signals to this thread.
+	sigset_t signals;
+	sigemptyset( &signals );
+	sigaddset( &signals, SIGINT );
+	sigaddset( &signals, SIGTERM );
+	pthread_sigmask( SIG_BLOCK, &signals, NULL );
+
+	LoadWorker *workers = calloc( numWorkers, sizeof( LoadWorker ) );
+	if( workers == NULL )
+	{
+		fprintf( stderr, "Couldn't allocate load workers.\n" );
+		exit( EXIT_FAILURE );
+	}
+
+	atomic_store( &load.running, 1 );
+	unsigned int i;
+	for( i = 0; i < numWorkers; i++ )
+	{
+		LoadWorker *worker = &workers[i];
+		worker->index = i;
+		worker->numConnections = connections / numWorkers + ( i < connections % numWorkers );
+		worker->connections = calloc( worker->numConnections, sizeof( LoadConnection ) );
+		worker->epollfd = epoll_create1( EPOLL_CLOEXEC );
+		worker->timerfd = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC );
+		if( worker->connections == NULL || worker->epollfd < 0 || worker->timerfd < 0 )
+		{
+			fprintf( stderr, "Couldn't set up load worker %u, errno = %d.\n", i, errno );
+			exit( EXIT_FAILURE );
+		}
+
+		// Spread both kinds of connection over the workers.
+		unsigned int c;
+		for( c = 0; c < worker->numConnections; c++ )
+		{
+			worker->connections[c].fd = -1;
+			worker->connections[c].gps = ( c * numWorkers + i >= commandClients );
+		}
+
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		epoll_ctl( worker->epollfd, EPOLL_CTL_ADD, worker->timerfd, &ev );
+		histogramReset( &worker->stats.connectLatency );
+	}
+
+	char rate[32];
+	snprintf( rate, sizeof( rate ), ( load.rate > 0 ) ? "%g messages/s each" : "full speed", load.rate );
+	printf( "Load on %s: %u command connections at %s, %u GPS subscribers, %u workers.\n",
+		ip, commandClients, rate, gpsClients, numWorkers );
+
+	uint64_t start = monotonicNs();
+	for( i = 0; i < numWorkers; i++ )
+	{
+		if( pthread_create( &workers[i].thread, NULL, loadWorkerRun, &workers[i] ) != 0 )
+		{
+			fprintf( stderr, "Couldn't start load worker %u.\n", i );
+			exit( EXIT_FAILURE );
+		}
+	}
+
+	// A progress line a second until the time is up or we're interrupted.
+	static LoadStats total;
+	uint64_t lastMessages = 0;
+	uint64_t lastUpdates = 0;
+	uint64_t elapsed = 0;
+	while( seconds == 0 || elapsed < seconds )
+	{
+		struct timespec timeout = { 1, 0 };
+		if( sigtimedwait( &signals, NULL, &timeout ) > 0 )
+		{
+			break;
+		}
+		elapsed++;
+
+		sumLoadStats( workers, numWorkers, &total );
+		printf( "%4llus: %llu/%u open, %llu messages/s, %llu updates/s, %llu failed connects, %llu disconnects, %llu stalls.\n",
+			(unsigned long long)elapsed, (unsigned long long)total.open, connections,
+			(unsigned long long)( total.messages - lastMessages ), (unsigned long long)( total.updates - lastUpdates ),
+			(unsigned long long)total.connectFailures, (unsigned long long)total.disconnects,
+			(unsigned long long)total.stalls );
+		fflush( stdout );
+		lastMessages = total.messages;
+		lastUpdates = total.updates;
+	}
+
+	atomic_store( &load.running, 0 );
+	for( i = 0; i < numWorkers; i++ )
+	{
+		pthread_join( workers[i].thread, NULL );
+	}
+
+	double duration = ( monotonicNs() - start ) / 1e9;
+	sumLoadStats( workers, numWorkers, &total );
+	printf( "Ran %.1f s.\n", duration );
+	printLoadSummary( &total, duration, connections );
+}
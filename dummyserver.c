@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <sys/wait.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -13,15 +15,67 @@
 #include <syslog.h>
 #include <string.h>
 #include <stdio.h>
+#include <poll.h>
+#include <math.h>
+#include <termios.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+
+#include "network.h"
+#include "navdata.h"
+#include "dronesim.h"
+#include "command.h"
+#include "timeutil.h"
 
 #define MAX_BUFFER_SIZE 1024
+#define SIM_NMEA_RATE 5			// GPS fixes per second written to the pty.
+#define SIM_DEFAULT_RATE 15		// Navdata packets per second, the demo mode rate.
+#define SIM_MAX_FLEET 4096
+#define LATENCY_DEFAULT_FIXES 200
+#define LATENCY_DEFAULT_RATE 5		// Fixes per second in latency mode.
+#define LATENCY_STEP 10.0			// Meters between fixes in latency mode.
+#define LATENCY_START_TIMEOUT 20	// Seconds to wait for main and the autopilot.
+#define CAPTURE_BATCH 64			// Datagrams per recvmmsg() in capture mode.
+#define CAPTURE_SOCKET_BUFFER ( 4 << 20 )
+#define CAPTURE_MAX_SENDERS 64		// Senders whose sequence numbers are checked.
+#define CAPTURE_MAX_TYPES 32
+#define CAPTURE_MAX_REPORTS 10		// Problems printed, the rest are only counted.
+#define CAPTURE_REPORT_LEN 80		// Bytes of a bad datagram printed.
+#define CAPTURE_MAGIC "ARGPSCAP1\n"
 
 void printUsage();
 void runTcpServer( const char *port );
 void runUdpServer( const char *port );
+void runSimulator( const char *rate );
+void runFleetSimulator( const char *rate, const char *count, const char *firstIp );
+void runLatencyBench( const char *fixes, const char *rate );
+void runCapture( const char *port, const char *path );
 
 int main( int argc, char **argv )
 {
+	if( ( argc == 3 || argc == 4 ) && strcmp( argv[1], "capture" ) == 0 )
+	{
+		runCapture( argv[2], ( argc == 4 ) ? argv[3] : NULL );
+		return 0;
+	}
+
+	if( argc >= 2 && argc <= 4 && strcmp( argv[1], "latency" ) == 0 )
+	{
+		runLatencyBench( ( argc >= 3 ) ? argv[2] : NULL, ( argc == 4 ) ? argv[3] : NULL );
+		return 0;
+	}
+
+	if( argc == 4 || argc == 5 )
+	{
+		if( strcmp( argv[1], "fleet" ) != 0 )
+		{
+			printUsage();
+			exit( EXIT_FAILURE );
+		}
+		runFleetSimulator( argv[2], argv[3], ( argc == 5 ) ? argv[4] : DRONE_IP );
+		return 0;
+	}
+
 	if( argc != 3 )
 	{
 		printUsage();
@@ -36,6 +90,10 @@ int main( int argc, char **argv )
 	{
 		runUdpServer( argv[2] );
 	}
+	else if( strcmp( argv[1], "sim" ) == 0 )
+	{
+		runSimulator( argv[2] );
+	}
 	else
 	{
 		printUsage();
@@ -51,6 +109,29 @@ void printUsage()
 	printf( "<protocol> = tcp or udp.\n" );
 	printf( "Creates a dummy server for testing that listens on the given port\n" );
 	printf( "for incoming connections, and prints any data it receives to STDOUT.\n" );
+	printf( "\n" );
+	printf( "Usage: ./dummyserver sim <navdata rate in Hz>\n" );
+	printf( "Simulates the drone: takes AT commands on UDP %s, streams navdata\n", DRONE_COMMAND_PORT );
+	printf( "from UDP %d to whoever tickles it, and writes $GPGGA fixes to a pty\n", DRONE_NAVDATA_PORT );
+	printf( "whose name is printed at startup, for usbgps to read.\n" );
+	printf( "\n" );
+	printf( "Usage: ./dummyserver fleet <navdata rate in Hz> <count> [first ip]\n" );
+	printf( "Simulates count drones at consecutive addresses from first ip (default\n" );
+	printf( "%s), each on the usual ports, for main -f. Use 127.0.0.x to run\n", DRONE_IP );
+	printf( "a fleet on one machine. No GPS pty.\n" );
+	printf( "\n" );
+	printf( "Usage: ./dummyserver latency [fixes] [fixes per second]\n" );
+	printf( "Measures the time from a $GPGGA line written to the GPS pty to the\n" );
+	printf( "first AT*PCMD from main that steers by it, for fixes fixes (default\n" );
+	printf( "%d) at %d per second. Plays the drone on UDP %s and sends main a\n", LATENCY_DEFAULT_FIXES, LATENCY_DEFAULT_RATE, DRONE_COMMAND_PORT );
+	printf( "route on TCP %s. See start-latency-bench.sh.\n", ANDROID_COMMAND_PORT );
+	printf( "\n" );
+	printf( "Usage: ./dummyserver capture <port number> [capture file]\n" );
+	printf( "Takes AT commands on the UDP port like udp mode, but checks them instead\n" );
+	printf( "of printing them: every command well formed, sequence numbers going up.\n" );
+	printf( "Prints per command rates every second and totals on Ctrl-C, exiting\n" );
+	printf( "with failure if anything was wrong. Optionally writes every datagram\n" );
+	printf( "with its receive time to the capture file.\n" );
 }
 
 void runTcpServer( const char *port )
@@ -192,3 +273,886 @@ void runUdpServer( const char *port )
 	close( sockfd );
 }
 
+static int bindUdpSocketAt( struct in_addr addr, int port )
+{
+	struct sockaddr_in myaddr;
+
+	int sockfd = socket( AF_INET, SOCK_DGRAM, IPPROTO_UDP );
+	if( sockfd == -1 )
+	{
+		fprintf( stderr, "socket() failure, errno = %d.\n", errno );
+		exit( EXIT_FAILURE );
+	}
+
+	memset( (char *)&myaddr, 0, sizeof( myaddr ) );
+	myaddr.sin_family = AF_INET;
+	myaddr.sin_port = htons( port );
+	myaddr.sin_addr = addr;
+
+	if( bind( sockfd, (struct sockaddr *)&myaddr, sizeof( myaddr ) ) == -1 )
+	{
+		fprintf( stderr, "bind() failure on %s port %d, errno = %d.\n", inet_ntoa( addr ), port, errno );
+		exit( EXIT_FAILURE );
+	}
+
+	return sockfd;
+}
+
+static int bindUdpSocket( int port )
+{
+	struct in_addr any;
+	any.s_addr = htonl( INADDR_ANY );
+	return bindUdpSocketAt( any, port );
+}
+
+// Opens a pty pair for the simulated GPS. The slave is kept open and raw so
+// writes to the master never fail while usbgps isn't attached yet.
+static int openGpsPty( int *slavefd )
+{
+	int masterfd = posix_openpt( O_RDWR | O_NOCTTY );
+	if( masterfd < 0 || grantpt( masterfd ) < 0 || unlockpt( masterfd ) < 0 )
+	{
+		fprintf( stderr, "Couldn't create pty, errno = %d.\n", errno );
+		exit( EXIT_FAILURE );
+	}
+
+	*slavefd = open( ptsname( masterfd ), O_RDWR | O_NOCTTY );
+	if( *slavefd >= 0 )
+	{
+		struct termios tio;
+		tcgetattr( *slavefd, &tio );
+		cfmakeraw( &tio );
+		tcsetattr( *slavefd, TCSANOW, &tio );
+	}
+
+	fcntl( masterfd, F_SETFL, O_NONBLOCK );
+	return masterfd;
+}
+
+void runSimulator( const char *rate )
+{
+	int hz = atoi( rate );
+	if( hz <= 0 )
+	{
+		hz = SIM_DEFAULT_RATE;
+	}
+
+	int cmdfd = bindUdpSocket( atoi( DRONE_COMMAND_PORT ) );
+	int navfd = bindUdpSocket( DRONE_NAVDATA_PORT );
+	int slavefd;
+	int ptyfd = openGpsPty( &slavefd );
+
+	DroneSim sim;
+	GpsPoint origin;
+	origin.latitude = 38.954352;	// Allen Fieldhouse, like main's default waypoint.
+	origin.longitude = -95.252811;
+	droneSimInit( &sim, origin, 1 );
+
+	printf( "Simulating drone: commands on UDP %s, navdata at %d Hz on UDP %d.\n", DRONE_COMMAND_PORT, hz, DRONE_NAVDATA_PORT );
+	printf( "NMEA fixes on %s\n", ptsname( ptyfd ) );
+	fflush( stdout );
+
+	struct sockaddr_in client;
+	int haveClient = 0;
+	uint64_t period = NSEC_PER_SEC / hz;
+	uint64_t last = monotonicNs();
+	uint64_t nextTick = last + period;
+	uint64_t nextFix = last;
+	uint64_t nextReport = last + NSEC_PER_SEC;
+
+	for(;;)
+	{
+		uint64_t now = monotonicNs();
+		struct pollfd pfds[2];
+		pfds[0].fd = cmdfd;
+		pfds[0].events = POLLIN;
+		pfds[1].fd = navfd;
+		pfds[1].events = POLLIN;
+
+		int timeout = ( nextTick > now ) ? (int)( ( nextTick - now ) / NSEC_PER_MSEC ) : 0;
+		if( poll( pfds, 2, timeout ) < 0 && errno != EINTR )
+		{
+			fprintf( stderr, "poll() failure, errno = %d.\n", errno );
+			exit( EXIT_FAILURE );
+		}
+
+		char buffer[MAX_BUFFER_SIZE];
+		if( pfds[0].revents & POLLIN )
+		{
+			int size = recv( cmdfd, buffer, sizeof( buffer ), 0 );
+			if( size > 0 )
+			{
+				droneSimCommand( &sim, buffer, size );
+			}
+		}
+
+		uint8_t packet[NAVDATA_MAX_PACKET_SIZE];
+		if( pfds[1].revents & POLLIN )
+		{
+			// Any datagram on the navdata port is a tickle; answer it straight away.
+			socklen_t len = sizeof( client );
+			if( recvfrom( navfd, buffer, sizeof( buffer ), 0, (struct sockaddr *)&client, &len ) >= 0 )
+			{
+				haveClient = 1;
+				size_t size = droneSimNavdata( &sim, packet, sizeof( packet ) );
+				sendto( navfd, packet, size, 0, (struct sockaddr *)&client, sizeof( client ) );
+			}
+		}
+
+		now = monotonicNs();
+		if( now < nextTick )
+		{
+			continue;
+		}
+
+		droneSimStep( &sim, ( now - last ) / (double)NSEC_PER_SEC );
+		last = now;
+		nextTick += period;
+		if( nextTick < now )
+		{
+			nextTick = now + period;	// Fell behind, don't try to catch up in a burst.
+		}
+
+		if( haveClient )
+		{
+			size_t size = droneSimNavdata( &sim, packet, sizeof( packet ) );
+			sendto( navfd, packet, size, 0, (struct sockaddr *)&client, sizeof( client ) );
+		}
+
+		if( now >= nextFix )
+		{
+			char sentence[128];
+			size_t size = droneSimNmea( &sim, sentence, sizeof( sentence ) );
+			if( write( ptyfd, sentence, size ) < 0 && errno != EAGAIN )
+			{
+				fprintf( stderr, "pty write failure, errno = %d.\n", errno );
+			}
+			nextFix = now + NSEC_PER_SEC / SIM_NMEA_RATE;
+		}
+
+		if( now >= nextReport )
+		{
+			printf( "t=%.1f pos=(%.1f, %.1f, %.1f) m yaw=%.1f battery=%.0f%% %s, %llu commands, %llu rejected\n",
+				sim.time, sim.x, sim.y, sim.z, sim.yaw, sim.battery, sim.flying ? "flying" : "landed",
+				(unsigned long long)sim.commandsAccepted, (unsigned long long)sim.commandsRejected );
+			fflush( stdout );
+			nextReport = now + NSEC_PER_SEC;
+		}
+	}
+}
+
+// One drone of a simulated fleet.
+typedef struct
+{
+	DroneSim			sim;
+	int					cmdfd;
+	int					navfd;
+	struct sockaddr_in	client;
+	int					haveClient;
+} FleetSim;
+
+// Like runSimulator(), for many drones from one epoll loop: drone i listens
+// on first ip + i. The epoll data is the drone index times two, plus one
+// for the navdata socket.
+void runFleetSimulator( const char *rate, const char *count, const char *firstIp )
+{
+	int hz = atoi( rate );
+	if( hz <= 0 )
+	{
+		hz = SIM_DEFAULT_RATE;
+	}
+
+	unsigned int numDrones = atoi( count );
+	struct in_addr first;
+	if( numDrones == 0 || numDrones > SIM_MAX_FLEET || inet_aton( firstIp, &first ) == 0 )
+	{
+		printUsage();
+		exit( EXIT_FAILURE );
+	}
+
+	FleetSim *drones = calloc( numDrones, sizeof( FleetSim ) );
+	int epollfd = epoll_create1( EPOLL_CLOEXEC );
+	if( drones == NULL || epollfd < 0 )
+	{
+		fprintf( stderr, "Couldn't set up the fleet simulator, errno = %d.\n", errno );
+		exit( EXIT_FAILURE );
+	}
+
+	GpsPoint origin;
+	origin.latitude = 38.954352;
+	origin.longitude = -95.252811;
+
+	unsigned int i;
+	for( i = 0; i < numDrones; i++ )
+	{
+		FleetSim *drone = &drones[i];
+		struct in_addr addr;
+		addr.s_addr = htonl( ntohl( first.s_addr ) + i );
+
+		droneSimInit( &drone->sim, origin, i + 1 );
+		drone->cmdfd = bindUdpSocketAt( addr, atoi( DRONE_COMMAND_PORT ) );
+		drone->navfd = bindUdpSocketAt( addr, DRONE_NAVDATA_PORT );
+
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.u64 = (uint64_t)i * 2;
+		epoll_ctl( epollfd, EPOLL_CTL_ADD, drone->cmdfd, &ev );
+		ev.data.u64 = (uint64_t)i * 2 + 1;
+		epoll_ctl( epollfd, EPOLL_CTL_ADD, drone->navfd, &ev );
+	}
+
+	printf( "Simulating %u drones from %s, navdata at %d Hz.\n", numDrones, firstIp, hz );
+	fflush( stdout );
+
+	uint64_t period = NSEC_PER_SEC / hz;
+	uint64_t last = monotonicNs();
+	uint64_t nextTick = last + period;
+	uint64_t nextReport = last + NSEC_PER_SEC;
+
+	for(;;)
+	{
+		uint64_t now = monotonicNs();
+		struct epoll_event events[64];
+		int timeout = ( nextTick > now ) ? (int)( ( nextTick - now ) / NSEC_PER_MSEC ) : 0;
+		int ready = epoll_wait( epollfd, events, 64, timeout );
+		if( ready < 0 && errno != EINTR )
+		{
+			fprintf( stderr, "epoll_wait() failure, errno = %d.\n", errno );
+			exit( EXIT_FAILURE );
+		}
+
+		char buffer[MAX_BUFFER_SIZE];
+		uint8_t packet[NAVDATA_MAX_PACKET_SIZE];
+		int e;
+		for( e = 0; e < ready; e++ )
+		{
+			FleetSim *drone = &drones[events[e].data.u64 / 2];
+			if( events[e].data.u64 % 2 == 0 )
+			{
+				int size;
+				while( ( size = recv( drone->cmdfd, buffer, sizeof( buffer ), MSG_DONTWAIT ) ) > 0 )
+				{
+					droneSimCommand( &drone->sim, buffer, size );
+				}
+			}
+			else
+			{
+				socklen_t len = sizeof( drone->client );
+				if( recvfrom( drone->navfd, buffer, sizeof( buffer ), MSG_DONTWAIT, (struct sockaddr *)&drone->client, &len ) >= 0 )
+				{
+					drone->haveClient = 1;
+					size_t size = droneSimNavdata( &drone->sim, packet, sizeof( packet ) );
+					sendto( drone->navfd, packet, size, 0, (struct sockaddr *)&drone->client, sizeof( drone->client ) );
+				}
+			}
+		}
+
+		now = monotonicNs();
+		if( now < nextTick )
+		{
+			continue;
+		}
+
+		double dt = ( now - last ) / (double)NSEC_PER_SEC;
+		for( i = 0; i < numDrones; i++ )
+		{
+			FleetSim *drone = &drones[i];
+			droneSimStep( &drone->sim, dt );
+			if( drone->haveClient )
+			{
+				size_t size = droneSimNavdata( &drone->sim, packet, sizeof( packet ) );
+				sendto( drone->navfd, packet, size, 0, (struct sockaddr *)&drone->client, sizeof( drone->client ) );
+			}
+		}
+		last = now;
+		nextTick += period;
+		if( nextTick < now )
+		{
+			nextTick = now + period;
+		}
+
+		if( now >= nextReport )
+		{
+			unsigned int flying = 0;
+			uint64_t accepted = 0;
+			uint64_t rejected = 0;
+			for( i = 0; i < numDrones; i++ )
+			{
+				flying += drones[i].sim.flying;
+				accepted += drones[i].sim.commandsAccepted;
+				rejected += drones[i].sim.commandsRejected;
+			}
+			printf( "t=%.1f %u of %u flying, %llu commands, %llu rejected\n",
+				drones[0].sim.time, flying, numDrones, (unsigned long long)accepted, (unsigned long long)rejected );
+			fflush( stdout );
+			nextReport = now + NSEC_PER_SEC;
+		}
+	}
+}
+
+// Connects to main's Android command port, retrying until main is up.
+static int connectAndroidCommands( uint64_t deadline )
+{
+	struct sockaddr_in addr;
+	memset( &addr, 0, sizeof( addr ) );
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons( atoi( ANDROID_COMMAND_PORT ) );
+	addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+
+	while( monotonicNs() < deadline )
+	{
+		int sockfd = socket( AF_INET, SOCK_STREAM, 0 );
+		if( sockfd < 0 )
+		{
+			fprintf( stderr, "socket() failure, errno = %d.\n", errno );
+			exit( EXIT_FAILURE );
+		}
+		if( connect( sockfd, (struct sockaddr *)&addr, sizeof( addr ) ) == 0 )
+		{
+			return sockfd;
+		}
+		close( sockfd );
+		usleep( 100000 );
+	}
+
+	fprintf( stderr, "main never opened port %s.\n", ANDROID_COMMAND_PORT );
+	exit( EXIT_FAILURE );
+}
+
+// Pitch and yaw of the first AT*PCMD in the datagram, as the float bit
+// patterns the protocol uses. Returns 0 if there is none.
+static int parsePcmd( const char *datagram, int *pitch, int *yaw )
+{
+	const char *pcmd = strstr( datagram, "AT*PCMD=" );
+	unsigned int seq;
+	int flag, roll, gaz;
+	return pcmd != NULL && sscanf( pcmd + 8, "%u,%d,%d,%d,%d,%d", &seq, &flag, &roll, pitch, &gaz, yaw ) == 6;
+}
+
+static int compareLatency( const void *a, const void *b )
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return ( x > y ) - ( x < y );
+}
+
+static double latencyPercentile( const uint64_t *sorted, unsigned int count, double fraction )
+{
+	unsigned int index = (unsigned int)ceil( fraction * count );
+	return sorted[index > 0 ? index - 1 : 0] / 1e6;
+}
+
+// The fixes zig-zag north, alternately north-east and north-west of the
+// last, towards a waypoint far to the north. So every fix flips which way
+// main's autopilot has to turn, and the first rotate PCMD the other way
+// after a fix is written can only have come from that fix. Each latency
+// covers the pty, usbgps, main's GPS reader and the wait for the next
+// autopilot tick, up to the datagram arriving here. Fix times are
+// jittered by up to a quarter period, so they don't stay in phase with the
+// ticks and the wait is sampled over the whole tick period.
+void runLatencyBench( const char *fixes, const char *rate )
+{
+	unsigned int numFixes = ( fixes != NULL ) ? atoi( fixes ) : LATENCY_DEFAULT_FIXES;
+	int hz = ( rate != NULL ) ? atoi( rate ) : LATENCY_DEFAULT_RATE;
+	if( numFixes == 0 || hz <= 0 )
+	{
+		printUsage();
+		exit( EXIT_FAILURE );
+	}
+
+	uint64_t *latencies = calloc( numFixes, sizeof( uint64_t ) );
+	if( latencies == NULL )
+	{
+		fprintf( stderr, "Couldn't allocate %u latencies.\n", numFixes );
+		exit( EXIT_FAILURE );
+	}
+
+	int cmdfd = bindUdpSocket( atoi( DRONE_COMMAND_PORT ) );
+	int slavefd;
+	int ptyfd = openGpsPty( &slavefd );
+
+	// Only used to write the NMEA sentences.
+	DroneSim sim;
+	GpsPoint origin;
+	origin.latitude = 38.954352;
+	origin.longitude = -95.252811;
+	droneSimInit( &sim, origin, 1 );
+
+	printf( "Latency bench: commands on UDP %s, %u fixes at %d per second.\n", DRONE_COMMAND_PORT, numFixes, hz );
+	printf( "NMEA fixes on %s\n", ptsname( ptyfd ) );
+	fflush( stdout );
+
+	uint64_t start = monotonicNs();
+	uint64_t deadline = start + (uint64_t)LATENCY_START_TIMEOUT * NSEC_PER_SEC;
+	int androidfd = connectAndroidCommands( deadline );
+	char route[128];
+	int length = snprintf( route, sizeof( route ), "list 1 %f %f\n", origin.latitude + 1.0, origin.longitude );
+	if( write( androidfd, route, length ) != length )
+	{
+		fprintf( stderr, "Couldn't send main the route, errno = %d.\n", errno );
+		exit( EXIT_FAILURE );
+	}
+	printf( "Route sent, waiting for the autopilot to head off.\n" );
+	fflush( stdout );
+
+	uint64_t period = NSEC_PER_SEC / hz;
+	uint64_t nextFix = monotonicNs();
+	srandom( 1 );
+	uint64_t written = 0;		// monotonicNs() of the fix being waited for, 0 if none.
+	int expectedSign = 0;		// Yaw sign that fix calls for.
+	int enroute = 0;
+	unsigned int sent = 0;
+	unsigned int answered = 0;
+	unsigned int missed = 0;
+	unsigned int step = 0;
+	uint64_t commands = 0;
+
+	while( sent < numFixes || written != 0 )
+	{
+		uint64_t now = monotonicNs();
+		if( !enroute && now >= deadline )
+		{
+			fprintf( stderr, "main never steered; is it running with -g and -a 127.0.0.1?\n" );
+			exit( EXIT_FAILURE );
+		}
+
+		if( now >= nextFix )
+		{
+			if( written != 0 )
+			{
+				missed++;
+				written = 0;
+			}
+			if( enroute && sent == numFixes )
+			{
+				break;
+			}
+
+			// North-east steps turn the heading right of the waypoint, so
+			// the autopilot answers with a left turn, negative yaw.
+			int east = ( step++ % 2 ) == 0;
+			sim.x += ( east ? 1 : -1 ) * LATENCY_STEP * M_SQRT1_2;
+			sim.y += LATENCY_STEP * M_SQRT1_2;
+			sim.time = ( now - start ) / (double)NSEC_PER_SEC;
+
+			char sentence[128];
+			size_t size = droneSimNmea( &sim, sentence, sizeof( sentence ) );
+			uint64_t before = monotonicNs();
+			if( write( ptyfd, sentence, size ) < 0 && errno != EAGAIN )
+			{
+				fprintf( stderr, "pty write failure, errno = %d.\n", errno );
+			}
+			if( enroute )
+			{
+				written = before;
+				expectedSign = east ? -1 : 1;
+				sent++;
+			}
+			nextFix += period * 3 / 4 + random() % ( period / 2 );
+			continue;
+		}
+
+		struct pollfd pfd;
+		pfd.fd = cmdfd;
+		pfd.events = POLLIN;
+		int timeout = (int)( ( nextFix - now + NSEC_PER_MSEC - 1 ) / NSEC_PER_MSEC );
+		if( poll( &pfd, 1, timeout ) <= 0 )
+		{
+			continue;
+		}
+
+		char buffer[MAX_BUFFER_SIZE];
+		int size = recv( cmdfd, buffer, sizeof( buffer ) - 1, 0 );
+		uint64_t received = monotonicNs();
+		if( size <= 0 )
+		{
+			continue;
+		}
+		buffer[size] = '\0';
+		commands++;
+
+		int pitch, yaw;
+		if( !parsePcmd( buffer, &pitch, &yaw ) )
+		{
+			continue;
+		}
+		if( !enroute && pitch != 0 )
+		{
+			// Measure from the next fix: this one may have been in flight.
+			enroute = 1;
+			printf( "Autopilot en route after %.1f s, measuring.\n", ( received - start ) / (double)NSEC_PER_SEC );
+			fflush( stdout );
+		}
+		if( written != 0 && yaw != 0 && ( yaw < 0 ? -1 : 1 ) == expectedSign )
+		{
+			latencies[answered++] = received - written;
+			written = 0;
+		}
+	}
+
+	close( androidfd );
+
+	printf( "%u fixes, %u answered, %u missed, %llu datagrams from main.\n", sent, answered, missed, (unsigned long long)commands );
+	if( answered > 0 )
+	{
+		qsort( latencies, answered, sizeof( uint64_t ), compareLatency );
+		uint64_t sum = 0;
+		unsigned int i;
+		for( i = 0; i < answered; i++ )
+		{
+			sum += latencies[i];
+		}
+		printf( "serial to PCMD latency: p50 %.2f ms, p99 %.2f ms, max %.2f ms, mean %.2f ms\n",
+			latencyPercentile( latencies, answered, 0.5 ), latencyPercentile( latencies, answered, 0.99 ),
+			latencies[answered - 1] / 1e6, sum / (double)answered / 1e6 );
+	}
+	fflush( stdout );
+	free( latencies );
+}
+
+// Capture files start with CAPTURE_MAGIC, then hold one CaptureRecord per
+// datagram followed by its bytes, all in host byte order. Times are kernel
+// receive times, nanoseconds since the epoch.
+typedef struct __attribute__((packed))
+{
+	uint64_t	time;
+	uint32_t	addr;		// Sender, network byte order like sin_addr.
+	uint16_t	port;		// Sender port, network byte order.
+	uint16_t	length;
+} CaptureRecord;
+
+typedef struct
+{
+	struct sockaddr_in	addr;
+	uint32_t			lastSeq;
+	uint64_t			commands;
+} CaptureSender;
+
+typedef struct
+{
+	char		name[16];
+	uint64_t	count;
+	uint64_t	reported;	// count at the previous progress line.
+} CaptureType;
+
+typedef struct
+{
+	uint64_t		datagrams;
+	uint64_t		bytes;
+	uint64_t		commands;
+	uint64_t		malformed;		// Datagrams with a command that doesn't parse or isn't \r-terminated.
+	uint64_t		regressions;	// Sequence numbers not above the sender's last.
+	uint64_t		restarts;		// Sequence back to 1, what a restarted sender does.
+	uint64_t		gaps;			// Sequence numbers skipped, lost or reordered datagrams.
+	uint64_t		batches;
+	CaptureSender	senders[CAPTURE_MAX_SENDERS];
+	unsigned int	numSenders;
+	CaptureType		types[CAPTURE_MAX_TYPES];
+	unsigned int	numTypes;
+} CaptureStats;
+
+static void captureProblem( CaptureStats *stats, const char *what, const struct sockaddr_in *from, const char *detail, size_t length )
+{
+	uint64_t problems = stats->malformed + stats->regressions;
+	if( problems <= CAPTURE_MAX_REPORTS )
+	{
+		printf( "%s from %s:%d: '%.*s'\n", what, inet_ntoa( from->sin_addr ), ntohs( from->sin_port ),
+			(int)( ( length < CAPTURE_REPORT_LEN ) ? length : CAPTURE_REPORT_LEN ), detail );
+		if( problems == CAPTURE_MAX_REPORTS )
+		{
+			printf( "Not reporting any more problems, see the totals.\n" );
+		}
+	}
+}
+
+static CaptureSender *captureSender( CaptureStats *stats, const struct sockaddr_in *from )
+{
+	unsigned int i;
+	for( i = 0; i < stats->numSenders; i++ )
+	{
+		CaptureSender *sender = &stats->senders[i];
+		if( sender->addr.sin_addr.s_addr == from->sin_addr.s_addr && sender->addr.sin_port == from->sin_port )
+		{
+			return sender;
+		}
+	}
+	if( stats->numSenders == CAPTURE_MAX_SENDERS )
+	{
+		return NULL;
+	}
+
+	CaptureSender *sender = &stats->senders[stats->numSenders++];
+	sender->addr = *from;
+	sender->lastSeq = 0;
+	sender->commands = 0;
+	return sender;
+}
+
+static void countCaptureType( CaptureStats *stats, const char *name )
+{
+	unsigned int i;
+	for( i = 0; i < stats->numTypes; i++ )
+	{
+		if( strcmp( stats->types[i].name, name ) == 0 )
+		{
+			stats->types[i].count++;
+			return;
+		}
+	}
+	if( stats->numTypes < CAPTURE_MAX_TYPES )
+	{
+		CaptureType *type = &stats->types[stats->numTypes++];
+		snprintf( type->name, sizeof( type->name ), "%s", name );
+		type->count = 1;
+		type->reported = 0;
+	}
+}
+
+// Checks every \r-terminated "AT*<NAME>=<seq>[,<args>]" in a datagram and
+// that each sender's sequence numbers only go up, by one at a time.
+static void checkDatagram( CaptureStats *stats, const char *data, size_t length, const struct sockaddr_in *from )
+{
+	CaptureSender *sender = captureSender( stats, from );
+	size_t start = 0;
+
+	if( length == 0 || data[length - 1] != '\r' )
+	{
+		stats->malformed++;
+		captureProblem( stats, "Unterminated datagram", from, data, length );
+		return;
+	}
+
+	while( start < length )
+	{
+		const char *cmd = data + start;
+		const char *end = memchr( cmd, '\r', length - start );
+		size_t cmdLength = end - cmd;
+		start += cmdLength + 1;
+
+		char name[16];
+		unsigned int seq;
+		int consumed = 0;
+		char text[MAX_BUFFER_SIZE];
+		memcpy( text, cmd, cmdLength );
+		text[cmdLength] = '\0';
+		if( cmdLength > MAX_COMMAND_LEN || sscanf( text, "AT*%15[A-Z]=%u%n", name, &seq, &consumed ) < 2
+			|| ( text[consumed] != '\0' && text[consumed] != ',' ) )
+		{
+			stats->malformed++;
+			captureProblem( stats, "Malformed command", from, cmd, cmdLength );
+			return;
+		}
+
+		stats->commands++;
+		countCaptureType( stats, name );
+		if( sender == NULL )
+		{
+			continue;
+		}
+
+		if( sender->commands > 0 )
+		{
+			if( seq == 1 && sender->lastSeq != 0 )
+			{
+				stats->restarts++;
+			}
+			else if( seq <= sender->lastSeq )
+			{
+				stats->regressions++;
+				char detail[64];
+				int detailLength = snprintf( detail, sizeof( detail ), "%u after %u", seq, sender->lastSeq );
+				captureProblem( stats, "Sequence regression", from, detail, detailLength );
+				continue;
+			}
+			else
+			{
+				stats->gaps += seq - sender->lastSeq - 1;
+			}
+		}
+		sender->lastSeq = seq;
+		sender->commands++;
+	}
+}
+
+static void printCaptureProgress( CaptureStats *stats, double seconds )
+{
+	printf( "%llu datagrams, %llu commands (", (unsigned long long)stats->datagrams, (unsigned long long)stats->commands );
+	unsigned int i;
+	for( i = 0; i < stats->numTypes; i++ )
+	{
+		CaptureType *type = &stats->types[i];
+		printf( "%s%s %.0f/s", ( i > 0 ) ? ", " : "", type->name, ( type->count - type->reported ) / seconds );
+		type->reported = type->count;
+	}
+	printf( "), %llu malformed, %llu regressions, %llu gaps.\n",
+		(unsigned long long)stats->malformed, (unsigned long long)stats->regressions, (unsigned long long)stats->gaps );
+	fflush( stdout );
+}
+
+// Like udp mode but without a printf per datagram: drains the socket with
+// recvmmsg(), verifies what arrives and prints rates once a second. Exits
+// with EXIT_FAILURE on SIGINT or SIGTERM if anything was malformed or out
+// of sequence, so scripts can run it under load and check the result.
+void runCapture( const char *port, const char *path )
+{
+	int sockfd = bindUdpSocket( atoi( port ) );
+	int size = CAPTURE_SOCKET_BUFFER;
+	if( setsockopt( sockfd, SOL_SOCKET, SO_RCVBUF, &size, sizeof( size ) ) < 0 )
+	{
+		fprintf( stderr, "Couldn't grow the receive buffer, errno = %d.\n", errno );
+	}
+	int yes = 1;
+	setsockopt( sockfd, SOL_SOCKET, SO_TIMESTAMPNS, &yes, sizeof( yes ) );
+
+	FILE *capture = NULL;
+	if( path != NULL )
+	{
+		capture = fopen( path, "wb" );
+		if( capture == NULL )
+		{
+			fprintf( stderr, "Couldn't open %s, errno = %d.\n", path, errno );
+			exit( EXIT_FAILURE );
+		}
+		setvbuf( capture, NULL, _IOFBF, 1 << 20 );
+		fwrite( CAPTURE_MAGIC, 1, strlen( CAPTURE_MAGIC ), capture );
+	}
+
+	sigset_t signals;
+	sigemptyset( &signals );
+	sigaddset( &signals, SIGINT );
+	sigaddset( &signals, SIGTERM );
+	sigprocmask( SIG_BLOCK, &signals, NULL );
+	int sigfd = signalfd( -1, &signals, SFD_CLOEXEC );
+	if( sigfd < 0 )
+	{
+		fprintf( stderr, "signalfd() failure, errno = %d.\n", errno );
+		exit( EXIT_FAILURE );
+	}
+
+	static char buffers[CAPTURE_BATCH][MAX_BUFFER_SIZE];
+	static char control[CAPTURE_BATCH][CMSG_SPACE( sizeof( struct timespec ) )];
+	static struct sockaddr_in from[CAPTURE_BATCH];
+	struct mmsghdr msgs[CAPTURE_BATCH];
+	struct iovec iovecs[CAPTURE_BATCH];
+	static CaptureStats stats;
+
+	printf( "Capturing AT commands on UDP %s%s%s.\n", port, ( path != NULL ) ? " to " : "", ( path != NULL ) ? path : "" );
+	fflush( stdout );
+
+	uint64_t start = monotonicNs();
+	uint64_t lastReport = start;
+	int running = 1;
+	while( running )
+	{
+		struct pollfd fds[2] = { { sockfd, POLLIN, 0 }, { sigfd, POLLIN, 0 } };
+		uint64_t now = monotonicNs();
+		int timeout = ( lastReport + NSEC_PER_SEC > now ) ? ( lastReport + NSEC_PER_SEC - now ) / NSEC_PER_MSEC + 1 : 0;
+		if( poll( fds, 2, timeout ) < 0 && errno != EINTR )
+		{
+			fprintf( stderr, "poll() failure, errno = %d.\n", errno );
+			exit( EXIT_FAILURE );
+		}
+		if( fds[1].revents & POLLIN )
+		{
+			running = 0;
+		}
+
+		// Drain everything queued, a batch per call.
+		int count = CAPTURE_BATCH;
+		while( ( fds[0].revents & POLLIN ) && count == CAPTURE_BATCH )
+		{
+			unsigned int i;
+			memset( msgs, 0, sizeof( msgs ) );
+			for( i = 0; i < CAPTURE_BATCH; i++ )
+			{
+				// One byte short so the datagram can be NUL-terminated for problem reports.
+				iovecs[i].iov_base = buffers[i];
+				iovecs[i].iov_len = MAX_BUFFER_SIZE - 1;
+				msgs[i].msg_hdr.msg_iov = &iovecs[i];
+				msgs[i].msg_hdr.msg_iovlen = 1;
+				msgs[i].msg_hdr.msg_name = &from[i];
+				msgs[i].msg_hdr.msg_namelen = sizeof( from[i] );
+				msgs[i].msg_hdr.msg_control = control[i];
+				msgs[i].msg_hdr.msg_controllen = sizeof( control[i] );
+			}
+
+			count = recvmmsg( sockfd, msgs, CAPTURE_BATCH, MSG_DONTWAIT, NULL );
+			if( count < 0 )
+			{
+				if( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR )
+				{
+					fprintf( stderr, "recvmmsg() failure, errno = %d.\n", errno );
+					exit( EXIT_FAILURE );
+				}
+				break;
+			}
+
+			stats.batches++;
+			uint64_t received = realtimeNs();
+			for( i = 0; i < (unsigned int)count; i++ )
+			{
+				size_t length = msgs[i].msg_len;
+				stats.datagrams++;
+				stats.bytes += length;
+				if( msgs[i].msg_hdr.msg_flags & MSG_TRUNC )
+				{
+					stats.malformed++;
+					captureProblem( &stats, "Oversized datagram", &from[i], buffers[i], length );
+				}
+				else
+				{
+					checkDatagram( &stats, buffers[i], length, &from[i] );
+				}
+
+				if( capture != NULL )
+				{
+					CaptureRecord record;
+					record.time = received;
+					struct cmsghdr *cmsg;
+					for( cmsg = CMSG_FIRSTHDR( &msgs[i].msg_hdr ); cmsg != NULL; cmsg = CMSG_NXTHDR( &msgs[i].msg_hdr, cmsg ) )
+					{
+						if( cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS )
+						{
+							struct timespec ts;
+							memcpy( &ts, CMSG_DATA( cmsg ), sizeof( ts ) );
+							record.time = (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+						}
+					}
+					record.addr = from[i].sin_addr.s_addr;
+					record.port = from[i].sin_port;
+					record.length = length;
+					fwrite( &record, sizeof( record ), 1, capture );
+					fwrite( buffers[i], 1, length, capture );
+				}
+			}
+		}
+
+		now = monotonicNs();
+		if( now >= lastReport + NSEC_PER_SEC || !running )
+		{
+			printCaptureProgress( &stats, ( now - lastReport ) / 1e9 );
+			lastReport = now;
+		}
+	}
+
+	double seconds = ( monotonicNs() - start ) / 1e9;
+	printf( "Captured %llu datagrams (%.0f/s), %llu commands (%.0f/s) from %u senders in %.1f s, %.1f per recvmmsg().\n",
+		(unsigned long long)stats.datagrams, stats.datagrams / seconds, (unsigned long long)stats.commands, stats.commands / seconds,
+		stats.numSenders, seconds, stats.batches ? (double)stats.datagrams / stats.batches : 0.0 );
+	unsigned int i;
+	for( i = 0; i < stats.numTypes; i++ )
+	{
+		printf( "  %-8s %llu\n", stats.types[i].name, (unsigned long long)stats.types[i].count );
+	}
+	printf( "%llu malformed, %llu sequence regressions, %llu restarts, %llu sequence numbers missing.\n",
+		(unsigned long long)stats.malformed, (unsigned long long)stats.regressions,
+		(unsigned long long)stats.restarts, (unsigned long long)stats.gaps );
+
+	if( capture != NULL && fclose( capture ) != 0 )
+	{
+		fprintf( stderr, "Couldn't write %s, errno = %d.\n", path, errno );
+		exit( EXIT_FAILURE );
+	}
+	close( sockfd );
+	exit( ( stats.malformed > 0 || stats.regressions > 0 ) ? EXIT_FAILURE : EXIT_SUCCESS );
+}
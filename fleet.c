@@ -0,0 +1,504 @@
+#define _GNU_SOURCE
+
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "fleet.h"
+#include "metrics.h"
+#include "network.h"
+#include "timeutil.h"
+#include "trace.h"
+
+#define FLEET_MAX_EVENTS 64
+
+// epoll data for a worker: drone index * 2 plus one of these, or the
+// housekeeping tag.
+#define FLEET_NAVDATA 0
+#define FLEET_AUTOPILOT 1
+#define FLEET_HOUSEKEEPING UINT64_MAX
+
+static void openDrone( FleetDrone *drone, unsigned int index, struct in_addr addr, const AutopilotConfig *config )
+{
+	char ip[INET_ADDRSTRLEN];
+	inet_ntop( AF_INET, &addr, ip, sizeof( ip ) );
+
+	drone->index = index;
+	if( droneLinkOpen( &drone->link, ip, DRONE_COMMAND_PORT ) < 0 )
+	{
+		fprintf( stderr, "Couldn't open commands to drone %s.\n", ip );
+		exit( EXIT_FAILURE );
+	}
+
+	struct sockaddr_in navdataAddr;
+	drone->navdataSock = openNavdataSocket( ip, DRONE_NAVDATA_PORT, &navdataAddr );
+	if( drone->navdataSock < 0 )
+	{
+		fprintf( stderr, "Couldn't open navdata from drone %s.\n", ip );
+		exit( EXIT_FAILURE );
+	}
+	enableNavdataTimestamps( drone->navdataSock );
+
+	navdataSessionInit( &drone->session );
+	navdataSessionBind( &drone->session, drone->navdataSock, &navdataAddr, &drone->link );
+	navdataHistoryInit( &drone->history );
+	autopilotInit( &drone->autopilot, config );
+	drone->autopilot.link = &drone->link;
+	droneStateInit( &drone->state );
+	droneStateSubscribe( &drone->state, AUTOPILOT_SAFETY_EVENTS, autopilotSafetyEvent, &drone->autopilot );
+	atomic_init( &drone->packets, 0 );
+	atomic_init( &drone->badPackets, 0 );
+}
+
+static void watch( int epollfd, int fd, uint64_t data )
+{
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.u64 = data;
+	if( epoll_ctl( epollfd, EPOLL_CTL_ADD, fd, &ev ) < 0 )
+	{
+		fprintf( stderr, "Fleet epoll_ctl() failure, errno = %d.\n", errno );
+		exit( EXIT_FAILURE );
+	}
+}
+
+void fleetInit( Fleet *fleet, const char *firstIp, unsigned int count, unsigned int workers, const AutopilotConfig *config )
+{
+	memset( fleet, 0, sizeof( *fleet ) );
+
+	struct in_addr first;
+	if( inet_aton( firstIp, &first ) == 0 )
+	{
+		fprintf( stderr, "Invalid fleet address %s.\n", firstIp );
+		exit( EXIT_FAILURE );
+	}
+	if( count == 0 || count > FLEET_MAX_DRONES )
+	{
+		fprintf( stderr, "A fleet has 1 to %d drones, not %u.\n", FLEET_MAX_DRONES, count );
+		exit( EXIT_FAILURE );
+	}
+
+	long cpus = sysconf( _SC_NPROCESSORS_ONLN );
+	if( cpus < 1 )
+	{
+		cpus = 1;
+	}
+	if( workers == 0 )
+	{
+		workers = cpus;
+	}
+	if( workers > count )
+	{
+		workers = count;
+	}
+
+	fleet->config.rate = FLEET_DEFAULT_RATE;
+	fleet->config.priority = 0;
+	fleet->config.cpu = -1;
+	if( config != NULL )
+	{
+		fleet->config = *config;
+	}
+
+	// Each drone holds five fds (command and navdata sockets, and the
+	// autopilot's eventfd, timerfd and epoll set), which soon passes the
+	// usual soft limit of 1024.
+	unsigned int needed = count * 5 + workers * 2 + 64;
+	unsigned long allowed = raiseFileLimit( needed );
+	if( allowed < needed )
+	{
+		fprintf( stderr, "Only %lu file descriptors allowed, the fleet needs about %u.\n", allowed, needed );
+	}
+
+	fleet->numDrones = count;
+	fleet->numWorkers = workers;
+	fleet->drones = calloc( count, sizeof( FleetDrone ) );
+	fleet->workers = calloc( workers, sizeof( FleetWorker ) );
+	if( fleet->drones == NULL || fleet->workers == NULL )
+	{
+		fprintf( stderr, "Couldn't allocate a fleet of %u drones.\n", count );
+		exit( EXIT_FAILURE );
+	}
+
+	unsigned int i;
+	for( i = 0; i < workers; i++ )
+	{
+		FleetWorker *worker = &fleet->workers[i];
+		worker->fleet = fleet;
+		worker->index = i;
+		worker->cpu = ( workers <= (unsigned int)cpus ) ? (int)i : -1;
+		worker->drones = calloc( ( count + workers - 1 ) / workers, sizeof( FleetDrone * ) );
+		worker->batch = malloc( sizeof( navdata_batch_t ) );
+		worker->epollfd = epoll_create1( EPOLL_CLOEXEC );
+		worker->timerfd = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC );
+		if( worker->drones == NULL || worker->batch == NULL || worker->epollfd < 0 || worker->timerfd < 0 )
+		{
+			fprintf( stderr, "Couldn't set up fleet worker %u, errno = %d.\n", i, errno );
+			exit( EXIT_FAILURE );
+		}
+		watch( worker->epollfd, worker->timerfd, FLEET_HOUSEKEEPING );
+	}
+
+	// Round-robin, so a shard never has more than one drone more than another.
+	for( i = 0; i < count; i++ )
+	{
+		FleetDrone *drone = &fleet->drones[i];
+		FleetWorker *worker = &fleet->workers[i % workers];
+		struct in_addr addr;
+		addr.s_addr = htonl( ntohl( first.s_addr ) + i );
+
+		openDrone( drone, i, addr, &fleet->config );
+		worker->drones[worker->numDrones++] = drone;
+		watch( worker->epollfd, drone->navdataSock, (uint64_t)i * 2 + FLEET_NAVDATA );
+		watch( worker->epollfd, drone->autopilot.epollfd, (uint64_t)i * 2 + FLEET_AUTOPILOT );
+	}
+
+	printf( "Fleet of %u drones from %s on %u workers at %.1f Hz.\n", count, firstIp, workers, fleet->config.rate );
+}
+
+// What main's handleNavdata() does, for one drone of a worker's shard. The
+// GPS option feeds the drone's autopilot directly.
+static void receiveNavdata( FleetWorker *worker, FleetDrone *drone )
+{
+	navdata_batch_t *batch = worker->batch;
+
+	while( receiveNavdataBatch( drone->navdataSock, batch, MSG_DONTWAIT, &worker->navdataStats ) > 0 )
+	{
+		unsigned int i;
+		for( i = 0; i < batch->count; i++ )
+		{
+			navdata_packet_t packet;
+			if( parseNavdata( batch->packets[i].data, batch->packets[i].length, &packet ) != NAVDATA_OK )
+			{
+				COUNT( drone->badPackets );
+				continue;
+			}
+			COUNT( drone->packets );
+			droneStateUpdate( &drone->state, packet.header->state, batch->packets[i].rxTime );
+			navdataSessionPacket( &drone->session, &packet, batch->packets[i].rxTime );
+
+			const navdata_gps_t *gps = navdataGps( &packet );
+			if( gps != NULL && gps->data_available )
+			{
+				GpsPoint fix;
+				fix.latitude = gps->latitude;
+				fix.longitude = gps->longitude;
+				autopilotUpdateFix( &drone->autopilot, &fix );
+			}
+
+			navdataHistoryPushPacket( &drone->history, &packet, batch->packets[i].rxTime );
+		}
+
+		if( batch->count < NAVDATA_BATCH_SIZE )
+		{
+			break;
+		}
+	}
+}
+
+// Navdata retries and loss detection, and the command watchdog of any
+// drone the autopilot isn't already talking to.
+static void housekeeping( FleetWorker *worker )
+{
+	uint64_t expirations;
+	if( read( worker->timerfd, &expirations, sizeof( expirations ) ) < 0 )
+	{
+		return;
+	}
+
+	uint64_t now = monotonicNs();
+	unsigned int i;
+	for( i = 0; i < worker->numDrones; i++ )
+	{
+		FleetDrone *drone = worker->drones[i];
+		navdataSessionTick( &drone->session, now );
+
+		uint64_t last = atomic_load_explicit( &drone->link.lastSent, memory_order_relaxed );
+		if( now - last >= KEEPALIVE_IDLE_MS * NSEC_PER_MSEC )
+		{
+			droneLinkKeepAlive( &drone->link );
+		}
+	}
+}
+
+static void configureWorker( FleetWorker *worker )
+{
+	int priority = worker->fleet->config.priority;
+	if( priority > 0 )
+	{
+		struct sched_param param;
+		param.sched_priority = priority;
+		int error = pthread_setschedparam( pthread_self(), SCHED_FIFO, &param );
+		if( error != 0 )
+		{
+			fprintf( stderr, "Couldn't give fleet worker %u SCHED_FIFO priority %d, errno = %d.\n", worker->index, priority, error );
+		}
+	}
+
+	if( worker->cpu >= 0 )
+	{
+		cpu_set_t cpus;
+		CPU_ZERO( &cpus );
+		CPU_SET( worker->cpu, &cpus );
+		int error = pthread_setaffinity_np( pthread_self(), sizeof( cpus ), &cpus );
+		if( error != 0 )
+		{
+			fprintf( stderr, "Couldn't pin fleet worker %u to CPU %d, errno = %d.\n", worker->index, worker->cpu, error );
+		}
+	}
+}
+
+void *fleetWorkerRun( void *arg )
+{
+	FleetWorker *worker = (FleetWorker *)arg;
+	Fleet *fleet = worker->fleet;
+	struct epoll_event events[FLEET_MAX_EVENTS];
+	char name[TRACE_NAME_LEN];
+
+	snprintf( name, sizeof( name ), "fleet %u", worker->index );
+	traceThreadName( name );
+	configureWorker( worker );
+
+	struct itimerspec spec;
+	memset( &spec, 0, sizeof( spec ) );
+	spec.it_value.tv_nsec = FLEET_HOUSEKEEPING_MS * NSEC_PER_MSEC;
+	spec.it_interval = spec.it_value;
+	timerfd_settime( worker->timerfd, 0, &spec, NULL );
+
+	while( atomic_load_explicit( &fleet->running, memory_order_relaxed ) )
+	{
+		int count = epoll_wait( worker->epollfd, events, FLEET_MAX_EVENTS, FLEET_HOUSEKEEPING_MS );
+		if( count < 0 )
+		{
+			if( errno == EINTR )
+			{
+				continue;
+			}
+			fprintf( stderr, "Fleet worker %u epoll_wait() failure, errno = %d.\n", worker->index, errno );
+			exit( EXIT_FAILURE );
+		}
+
+		uint64_t start = monotonicNs();
+		int i;
+		for( i = 0; i < count; i++ )
+		{
+			uint64_t data = events[i].data.u64;
+			if( data == FLEET_HOUSEKEEPING )
+			{
+				housekeeping( worker );
+				continue;
+			}
+
+			FleetDrone *drone = &fleet->drones[data / 2];
+			if( data % 2 == FLEET_AUTOPILOT )
+			{
+				autopilotDispatch( &drone->autopilot, 0 );
+			}
+			else
+			{
+				receiveNavdata( worker, drone );
+			}
+		}
+		if( count > 0 )
+		{
+			histogramRecordLocal( &worker->busy, monotonicNs() - start );
+		}
+	}
+
+	// Act on anything posted just before the stop, such as a final land.
+	unsigned int i;
+	for( i = 0; i < worker->numDrones; i++ )
+	{
+		autopilotDispatch( &worker->drones[i]->autopilot, 0 );
+	}
+
+	pthread_exit( NULL );
+}
+
+void fleetStart( Fleet *fleet )
+{
+	atomic_store( &fleet->running, 1 );
+
+	unsigned int i;
+	for( i = 0; i < fleet->numWorkers; i++ )
+	{
+		int error = pthread_create( &fleet->workers[i].thread, NULL, fleetWorkerRun, &fleet->workers[i] );
+		if( error != 0 )
+		{
+			fprintf( stderr, "Couldn't start fleet worker %u, errno = %d.\n", i, error );
+			exit( EXIT_FAILURE );
+		}
+	}
+}
+
+void fleetStop( Fleet *fleet )
+{
+	atomic_store( &fleet->running, 0 );
+
+	unsigned int i;
+	for( i = 0; i < fleet->numWorkers; i++ )
+	{
+		pthread_join( fleet->workers[i].thread, NULL );
+	}
+}
+
+unsigned int fleetPostRoute( Fleet *fleet, const GpsPoint *waypoints, unsigned int count )
+{
+	unsigned int failed = 0;
+	unsigned int i;
+	for( i = 0; i < fleet->numDrones; i++ )
+	{
+		if( autopilotPostRoute( &fleet->drones[i].autopilot, waypoints, count ) < 0 )
+		{
+			failed++;
+		}
+	}
+	return failed;
+}
+
+unsigned int fleetPostType( Fleet *fleet, AutopilotEventType type )
+{
+	unsigned int failed = 0;
+	unsigned int i;
+	for( i = 0; i < fleet->numDrones; i++ )
+	{
+		if( autopilotPostType( &fleet->drones[i].autopilot, type ) < 0 )
+		{
+			failed++;
+		}
+	}
+	return failed;
+}
+
+void printFleet( FILE *out, Fleet *fleet )
+{
+	unsigned int states[NUM_AUTOPILOT_STATES] = { 0 };
+	unsigned int streaming = 0;
+	uint64_t ticks = 0;
+	uint64_t missed = 0;
+	uint64_t packets = 0;
+	uint64_t badPackets = 0;
+	// Static, these are too big for the caller's stack.
+	static Histogram jitter;
+	static Histogram lateness;
+
+	histogramReset( &jitter );
+	histogramReset( &lateness );
+
+	unsigned int i;
+	for( i = 0; i < fleet->numDrones; i++ )
+	{
+		FleetDrone *drone = &fleet->drones[i];
+		states[autopilotState( &drone->autopilot )]++;
+		if( navdataSessionState( &drone->session ) == NAVDATA_SESSION_STREAMING )
+		{
+			streaming++;
+		}
+
+		AutopilotTiming *timing = &drone->autopilot.timing;
+		ticks += atomic_load( &timing->ticks );
+		missed += atomic_load( &timing->missed );
+		histogramMerge( &jitter, &timing->jitter );
+		histogramMerge( &lateness, &timing->lateness );
+		packets += atomic_load( &drone->packets );
+		badPackets += atomic_load( &drone->badPackets );
+	}
+
+	fprintf( out, "fleet: %u drones on %u workers, %u with navdata streaming, %llu packets, %llu bad\n",
+		fleet->numDrones, fleet->numWorkers, streaming, (unsigned long long)packets, (unsigned long long)badPackets );
+	fprintf( out, "fleet:" );
+	for( i = 0; i < NUM_AUTOPILOT_STATES; i++ )
+	{
+		fprintf( out, " %u %s", states[i], autopilotStateName( i ) );
+	}
+	fprintf( out, "\n" );
+	fprintf( out, "fleet: %.1f Hz, %llu ticks, %llu missed (%.3f%%)\n",
+		fleet->config.rate, (unsigned long long)ticks, (unsigned long long)missed,
+		( ticks + missed > 0 ) ? 100.0 * missed / ( ticks + missed ) : 0 );
+	fprintf( out, "fleet: period jitter p50 %.1f us, p99 %.1f us, max %.1f us\n",
+		histogramPercentile( &jitter, 0.50 ) / (double)NSEC_PER_USEC,
+		histogramPercentile( &jitter, 0.99 ) / (double)NSEC_PER_USEC,
+		atomic_load( &jitter.max ) / (double)NSEC_PER_USEC );
+	fprintf( out, "fleet: wakeup lateness p50 %.1f us, p99 %.1f us, max %.1f us\n",
+		histogramPercentile( &lateness, 0.50 ) / (double)NSEC_PER_USEC,
+		histogramPercentile( &lateness, 0.99 ) / (double)NSEC_PER_USEC,
+		atomic_load( &lateness.max ) / (double)NSEC_PER_USEC );
+
+	for( i = 0; i < fleet->numWorkers; i++ )
+	{
+		FleetWorker *worker = &fleet->workers[i];
+		fprintf( out, "fleet worker %u: cpu %d, %u drones, %llu wakeups, busy p50 %.1f us, p99 %.1f us, max %.1f us\n",
+			i, worker->cpu, worker->numDrones,
+			(unsigned long long)atomic_load( &worker->busy.total ),
+			histogramPercentile( &worker->busy, 0.50 ) / (double)NSEC_PER_USEC,
+			histogramPercentile( &worker->busy, 0.99 ) / (double)NSEC_PER_USEC,
+			atomic_load( &worker->busy.max ) / (double)NSEC_PER_USEC );
+	}
+}
+
+static void collectFleetMetrics( FILE *out, void *arg )
+{
+	Fleet *fleet = (Fleet *)arg;
+	unsigned int states[NUM_AUTOPILOT_STATES] = { 0 };
+	unsigned int streaming = 0;
+	uint64_t ticks = 0;
+	uint64_t missed = 0;
+	uint64_t packets = 0;
+	// Only the metrics server renders, one scrape at a time.
+	static Histogram lateness;
+	char labels[64];
+
+	histogramReset( &lateness );
+
+	unsigned int i;
+	for( i = 0; i < fleet->numDrones; i++ )
+	{
+		FleetDrone *drone = &fleet->drones[i];
+		states[autopilotState( &drone->autopilot )]++;
+		if( navdataSessionState( &drone->session ) == NAVDATA_SESSION_STREAMING )
+		{
+			streaming++;
+		}
+		ticks += atomic_load( &drone->autopilot.timing.ticks );
+		missed += atomic_load( &drone->autopilot.timing.missed );
+		histogramMerge( &lateness, &drone->autopilot.timing.lateness );
+		packets += atomic_load( &drone->packets );
+	}
+
+	metricsWriteHeader( out, "argps_fleet_drones", METRIC_GAUGE, "Fleet drones by autopilot state." );
+	for( i = 0; i < NUM_AUTOPILOT_STATES; i++ )
+	{
+		snprintf( labels, sizeof( labels ), "state=\"%s\"", autopilotStateName( i ) );
+		metricsWriteSample( out, "argps_fleet_drones", labels, states[i] );
+	}
+	metricsWriteHeader( out, "argps_fleet_navdata_streaming", METRIC_GAUGE, "Fleet drones with navdata streaming." );
+	metricsWriteSample( out, "argps_fleet_navdata_streaming", NULL, streaming );
+	metricsWriteHeader( out, "argps_fleet_navdata_packets_total", METRIC_COUNTER, "Navdata packets parsed over the fleet." );
+	metricsWriteSample( out, "argps_fleet_navdata_packets_total", NULL, packets );
+	metricsWriteHeader( out, "argps_fleet_ticks_total", METRIC_COUNTER, "Control loop ticks over the fleet." );
+	metricsWriteSample( out, "argps_fleet_ticks_total", NULL, ticks );
+	metricsWriteHeader( out, "argps_fleet_missed_ticks_total", METRIC_COUNTER, "Control loop periods that passed without a tick." );
+	metricsWriteSample( out, "argps_fleet_missed_ticks_total", NULL, missed );
+	metricsWriteHeader( out, "argps_fleet_lateness_seconds", METRIC_HISTOGRAM, "Wakeup after the scheduled tick time over the fleet." );
+	metricsWriteHistogram( out, "argps_fleet_lateness_seconds", NULL, &lateness, 1e-9 );
+
+	metricsWriteHeader( out, "argps_fleet_worker_busy_seconds", METRIC_HISTOGRAM, "Time each worker spent per wakeup." );
+	for( i = 0; i < fleet->numWorkers; i++ )
+	{
+		snprintf( labels, sizeof( labels ), "worker=\"%u\"", i );
+		metricsWriteHistogram( out, "argps_fleet_worker_busy_seconds", labels, &fleet->workers[i].busy, 1e-9 );
+	}
+}
+
+void registerFleetMetrics( Fleet *fleet )
+{
+	metricsCollector( collectFleetMetrics, fleet );
+}
@@ -0,0 +1,88 @@
+#ifndef _FLEET_H_
+#define _FLEET_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "command.h"
+#include "navdata.h"
+#include "navhistory.h"
+#include "autopilot.h"
+#include "dronestate.h"
+#include "histogram.h"
+
+#define FLEET_MAX_DRONES 4096
+#define FLEET_DEFAULT_RATE 30.0		// Control loop rate of each drone in fleet mode, Hz.
+#define FLEET_HOUSEKEEPING_MS 50	// How often workers run navdata retries and keepalives.
+
+// Everything main keeps for its one drone, per drone: command link,
+// navdata socket and session, navdata ring, state decoder, and an
+// autopilot holding the route and controller. Owned by exactly one worker
+// once the fleet starts.
+typedef struct
+{
+	unsigned int		index;
+	DroneLink			link;
+	int					navdataSock;
+	navdata_session_t	session;
+	NavdataHistory		history;
+	DroneStateDecoder	state;			// Lands or stops the autopilot on safety events.
+	Autopilot			autopilot;
+	_Atomic uint64_t	packets;		// Navdata packets parsed.
+	_Atomic uint64_t	badPackets;		// Navdata packets that didn't parse.
+} FleetDrone;
+
+struct Fleet;
+
+// One thread serving a shard of the drones from a single epoll set: each
+// drone's navdata socket and autopilot, plus a housekeeping timer.
+typedef struct
+{
+	struct Fleet			*fleet;
+	unsigned int			index;
+	int						cpu;			// CPU the thread is pinned to, -1 for any.
+	pthread_t				thread;
+	int						epollfd;
+	int						timerfd;		// Housekeeping, every FLEET_HOUSEKEEPING_MS.
+	FleetDrone				**drones;
+	unsigned int			numDrones;
+	navdata_batch_t			*batch;
+	navdata_link_stats_t	navdataStats;	// Batch and delivery figures for the shard.
+	Histogram				busy;			// Time spent per wakeup, nanoseconds.
+} FleetWorker;
+
+typedef struct Fleet
+{
+	FleetDrone			*drones;
+	unsigned int		numDrones;
+	FleetWorker			*workers;
+	unsigned int		numWorkers;
+	AutopilotConfig		config;		// Rate of every drone; priority for every worker.
+	_Atomic int			running;
+} Fleet;
+
+// Opens count drones at consecutive addresses from firstIp, each on the
+// standard command and navdata ports, and shards them round-robin over
+// workers threads (0 for one per online CPU). Exits on failure.
+void fleetInit( Fleet *fleet, const char *firstIp, unsigned int count, unsigned int workers, const AutopilotConfig *config );
+
+// Starts the workers, pinned one per CPU when there are no more workers than CPUs.
+void fleetStart( Fleet *fleet );
+// Stops and joins the workers.
+void fleetStop( Fleet *fleet );
+
+// Posts to every drone's autopilot. Returns the number of drones whose queue was full.
+unsigned int fleetPostRoute( Fleet *fleet, const GpsPoint *waypoints, unsigned int count );
+unsigned int fleetPostType( Fleet *fleet, AutopilotEventType type );
+
+// Worker thread function, arg is a FleetWorker.
+void *fleetWorkerRun( void *arg );
+
+// Drone states, tick timing over the whole fleet and per worker load.
+void printFleet( FILE *out, Fleet *fleet );
+// Exports the same through the metrics registry.
+void registerFleetMetrics( Fleet *fleet );
+
+#endif
@@ -0,0 +1,75 @@
+#!/usr/bin/env python3
+# Generates manualcommands.h, the perfect-hash dispatch table for the
+# Android manual control commands. Brute-forces a seed for which the
+# FNV-1a hash in androidcmd.c puts every command in its own slot.
+#
+# Usage: ./gen-manual-commands.py > manualcommands.h
+
+COMMANDS = [
+	( "cmd takeoff", "droneTakeOff" ),
+	( "cmd land", "droneLand" ),
+	( "cmd moveforward", "droneForward" ),
+	( "cmd moveback", "droneBack" ),
+	( "cmd moveleft", "droneLeft" ),
+	( "cmd moveright", "droneRight" ),
+	( "cmd moveup", "droneUp" ),
+	( "cmd movedown", "droneDown" ),
+	( "cmd turnleft", "droneRotateLeft" ),
+	( "cmd turnright", "droneRotateRight" ),
+]
+
+TABLE_BITS = 4		# Table size is 1 << TABLE_BITS, at least len( COMMANDS ).
+TABLE_SIZE = 1 << TABLE_BITS
+
+def fnv1a( seed, text ):
+	h = seed
+	for c in text.encode():
+		h ^= c
+		h = ( h * 16777619 ) & 0xFFFFFFFF
+	return h
+
+# The low bits of FNV-1a only depend on the low bits of the input, so the
+# slot comes from the top bits.
+def slot( seed, text ):
+	return fnv1a( seed, text ) >> ( 32 - TABLE_BITS )
+
+def findSeed():
+	for seed in range( 1, 1 << 32 ):
+		slots = { slot( seed, name ) for name, _ in COMMANDS }
+		if len( slots ) == len( COMMANDS ):
+			return seed
+	raise SystemExit( "no perfect seed for %d slots" % TABLE_SIZE )
+
+seed = findSeed()
+table = [ None ] * TABLE_SIZE
+for name, handler in COMMANDS:
+	table[slot( seed, name )] = ( name, handler )
+
+print( "// Generated by gen-manual-commands.py, do not edit." )
+print( "#ifndef _MANUAL_COMMANDS_H_" )
+print( "#define _MANUAL_COMMANDS_H_" )
+print( "" )
+print( "#include <stddef.h>" )
+print( "" )
+print( "#include \"command.h\"" )
+print( "" )
+print( "#define MANUAL_COMMAND_SEED 0x%08xU" % seed )
+print( "#define MANUAL_COMMAND_TABLE_BITS %d" % TABLE_BITS )
+print( "#define MANUAL_COMMAND_TABLE_SIZE ( 1 << MANUAL_COMMAND_TABLE_BITS )" )
+print( "" )
+print( "typedef struct" )
+print( "{" )
+print( "\tconst char\t*name;" )
+print( "\tvoid\t\t( *handler )();" )
+print( "} ManualCommand;" )
+print( "" )
+print( "static const ManualCommand manualCommands[MANUAL_COMMAND_TABLE_SIZE] =" )
+print( "{" )
+for index, entry in enumerate( table ):
+	if entry is None:
+		print( "\t{ NULL, NULL },\t// %d" % index )
+	else:
+		print( "\t{ \"%s\", %s },\t// %d" % ( entry[0], entry[1], index ) )
+print( "};" )
+print( "" )
+print( "#endif" )
@@ -0,0 +1,136 @@
+#include "histogram.h"
+
+#define SUB_BUCKETS ( 1U << HISTOGRAM_SUB_BITS )
+#define MAX_VALUE ( ( 1ULL << HISTOGRAM_MAX_MAGNITUDE ) - 1 )
+
+void histogramReset( Histogram *h )
+{
+	unsigned int i;
+	for( i = 0; i < HISTOGRAM_BUCKETS; i++ )
+	{
+		atomic_store_explicit( &h->counts[i], 0, memory_order_relaxed );
+	}
+	atomic_store_explicit( &h->total, 0, memory_order_relaxed );
+	atomic_store_explicit( &h->sum, 0, memory_order_relaxed );
+	atomic_store_explicit( &h->max, 0, memory_order_relaxed );
+}
+
+unsigned int histogramBucketIndex( uint64_t value )
+{
+	if( value > MAX_VALUE )
+	{
+		value = MAX_VALUE;
+	}
+	if( value < SUB_BUCKETS )
+	{
+		return (unsigned int)value;
+	}
+
+	unsigned int msb = 63 - __builtin_clzll( value );
+	unsigned int shift = msb - HISTOGRAM_SUB_BITS;
+	return ( ( shift + 1 ) << HISTOGRAM_SUB_BITS ) + (unsigned int)( ( value >> shift ) & ( SUB_BUCKETS - 1 ) );
+}
+
+uint64_t histogramBucketLimit( unsigned int bucket )
+{
+	if( bucket < SUB_BUCKETS )
+	{
+		return bucket;
+	}
+
+	unsigned int shift = ( bucket >> HISTOGRAM_SUB_BITS ) - 1;
+	uint64_t low = (uint64_t)( SUB_BUCKETS + ( bucket & ( SUB_BUCKETS - 1 ) ) ) << shift;
+	return low + ( 1ULL << shift ) - 1;
+}
+
+void histogramRecord( Histogram *h, uint64_t value )
+{
+	atomic_fetch_add_explicit( &h->counts[histogramBucketIndex( value )], 1, memory_order_relaxed );
+	atomic_fetch_add_explicit( &h->total, 1, memory_order_relaxed );
+	atomic_fetch_add_explicit( &h->sum, value, memory_order_relaxed );
+
+	uint64_t max = atomic_load_explicit( &h->max, memory_order_relaxed );
+	while( value > max && !atomic_compare_exchange_weak_explicit( &h->max, &max, value, memory_order_relaxed, memory_order_relaxed ) )
+	{
+	}
+}
+
+void histogramRecordLocal( Histogram *h, uint64_t value )
+{
+	// Single writer, so plain load/store pairs are enough and avoid locked instructions.
+	_Atomic uint64_t *bucket = &h->counts[histogramBucketIndex( value )];
+	atomic_store_explicit( bucket, atomic_load_explicit( bucket, memory_order_relaxed ) + 1, memory_order_relaxed );
+	atomic_store_explicit( &h->total, atomic_load_explicit( &h->total, memory_order_relaxed ) + 1, memory_order_relaxed );
+	atomic_store_explicit( &h->sum, atomic_load_explicit( &h->sum, memory_order_relaxed ) + value, memory_order_relaxed );
+	if( value > atomic_load_explicit( &h->max, memory_order_relaxed ) )
+	{
+		atomic_store_explicit( &h->max, value, memory_order_relaxed );
+	}
+}
+
+void histogramMerge( Histogram *dst, const Histogram *src )
+{
+	unsigned int i;
+	for( i = 0; i < HISTOGRAM_BUCKETS; i++ )
+	{
+		uint64_t count = atomic_load_explicit( &src->counts[i], memory_order_relaxed );
+		if( count != 0 )
+		{
+			atomic_fetch_add_explicit( &dst->counts[i], count, memory_order_relaxed );
+		}
+	}
+	atomic_fetch_add_explicit( &dst->total, atomic_load_explicit( &src->total, memory_order_relaxed ), memory_order_relaxed );
+	atomic_fetch_add_explicit( &dst->sum, atomic_load_explicit( &src->sum, memory_order_relaxed ), memory_order_relaxed );
+
+	uint64_t max = atomic_load_explicit( &src->max, memory_order_relaxed );
+	if( max > atomic_load_explicit( &dst->max, memory_order_relaxed ) )
+	{
+		atomic_store_explicit( &dst->max, max, memory_order_relaxed );
+	}
+}
+
+uint64_t histogramPercentile( const Histogram *h, double fraction )
+{
+	// Sum the buckets rather than trusting total, which may be mid-update.
+	uint64_t total = 0;
+	unsigned int i;
+	for( i = 0; i < HISTOGRAM_BUCKETS; i++ )
+	{
+		total += atomic_load_explicit( &h->counts[i], memory_order_relaxed );
+	}
+	if( total == 0 )
+	{
+		return 0;
+	}
+
+	uint64_t wanted = (uint64_t)( fraction * total + 0.5 );
+	if( wanted == 0 )
+	{
+		wanted = 1;
+	}
+
+	uint64_t max = atomic_load_explicit( &h->max, memory_order_relaxed );
+	uint64_t seen = 0;
+	for( i = 0; i < HISTOGRAM_BUCKETS; i++ )
+	{
+		seen += atomic_load_explicit( &h->counts[i], memory_order_relaxed );
+		if( seen >= wanted )
+		{
+			uint64_t limit = histogramBucketLimit( i );
+			return limit < max ? limit : max;
+		}
+	}
+
+	return max;
+}
+
+uint64_t histogramMean( const Histogram *h )
+{
+	uint64_t total = atomic_load_explicit( &h->total, memory_order_relaxed );
+	if( total == 0 )
+	{
+		return 0;
+	}
+
+	return atomic_load_explicit( &h->sum, memory_order_relaxed ) / total;
+}
@@ -0,0 +1,43 @@
+#ifndef _HISTOGRAM_H_
+#define _HISTOGRAM_H_
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+// Log-linear (HDR style) histogram. Each power of two is split into
+// 2^HISTOGRAM_SUB_BITS linear sub-buckets, so every recorded value is
+// kept to within about 12% of its true value. Values at or above
+// 2^HISTOGRAM_MAX_MAGNITUDE (about 18 minutes when recording ns) are
+// clamped into the last bucket.
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_MAX_MAGNITUDE 40
+#define HISTOGRAM_BUCKETS ( ( HISTOGRAM_MAX_MAGNITUDE - HISTOGRAM_SUB_BITS + 1 ) << HISTOGRAM_SUB_BITS )
+
+typedef struct
+{
+	_Atomic uint64_t	counts[HISTOGRAM_BUCKETS];
+	_Atomic uint64_t	total;
+	_Atomic uint64_t	sum;
+	_Atomic uint64_t	max;
+} Histogram;
+
+void histogramReset( Histogram *h );
+
+// Safe to call from any number of threads at once.
+void histogramRecord( Histogram *h, uint64_t value );
+// Cheaper variant for histograms only ever written by one thread.
+// Readers on other threads still see consistent (if slightly stale) counts.
+void histogramRecordLocal( Histogram *h, uint64_t value );
+
+// Adds the counts of src into dst. src may be written concurrently.
+void histogramMerge( Histogram *dst, const Histogram *src );
+
+unsigned int histogramBucketIndex( uint64_t value );
+// Largest value that lands in the given bucket.
+uint64_t histogramBucketLimit( unsigned int bucket );
+
+// Value at or below which the given fraction (0.0 to 1.0) of samples fall.
+uint64_t histogramPercentile( const Histogram *h, double fraction );
+uint64_t histogramMean( const Histogram *h );
+
+#endif
@@ -19,634 +19,1069 @@
 #include <pthread.h>
 #include <fcntl.h>
 #include <termios.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/resource.h>
 
-#define MAX_NUM_WAYPOINTS 20
 #define MAX_NMEA_SENTENCE_LEN 1024
 #define ENABLE_GPS 0
 #define ENABLE_NAVDATA 0
 
-#define MAX_YAW 180000
-#define MIN_YAW -180000
-
 #include "network.h"
 #include "navdata.h"
 #include "command.h"
 #include "gpsutil.h"
+#include "navhistory.h"
+#include "timeutil.h"
+#include "dronestate.h"
+#include "telemetry.h"
+#include "androidcmd.h"
+#include "autopilot.h"
+#include "reactor.h"
+#include "fleet.h"
+#include "missionsim.h"
+#include "routeopt.h"
+#include "metrics.h"
+#include "trace.h"
+
+// Flies routes from the Android device. Idle until one arrives.
+Autopilot			autopilot;
+// Every drone in fleet mode, instead of the globals below.
+Fleet				fleet;
+
+// Fleet benchmarks fly every drone towards this point, about 1 km north of
+// dummyserver's simulated take-off point, so they stay en route throughout.
+static const GpsPoint fleetBenchmarkRoute[] =
+{
+	{ 38.963352, -95.252811 }
+};
 
-typedef enum { false, true } bool;
-
-// By default, wait for commands from Android device.
-bool				autonomousMode = false;
-bool				programmedMode = false;
+const char			*droneIp = DRONE_IP;	// -a, the first drone's in fleet mode.
+int					useGps = ENABLE_GPS;	// -g, read fixes from usbgps.
+double				routeBudgetMs = -1;		// -o, reorder Android routes; negative flies them as sent.
+unsigned int		routeWorkers = 0;		// Threads reordering them, 0 for one per CPU.
 
-double  netYaw = 0;
-navdata_t navdata_struct;
-bool navdata_ready = false;
+NavdataHistory		navdataHistory;	// Recent navdata samples, written only by the navdata thread.
+navdata_session_t	navdataSession;	// Navdata link state, driven by the navdata thread.
+DroneStateDecoder	droneState;		// Turns navdata state words into change events.
 
 GpsPoint			currGpsFix;		// Current GPS fix. Parsed from GPS device NMEA strings.
 GpsPoint			prevGpsFix;		// Previous GPS fix, used for heading estimation.
 pthread_mutex_t		gpsFixMutex;	// Mutex for accessing curr/prev GpsFix structs.
-
-GpsPoint			waypoints[MAX_NUM_WAYPOINTS];
-unsigned int		numWaypoints = 0;
-unsigned int		currWaypoint = 0;
+_Atomic uint64_t	gpsFixes;		// Fixes read from usbgps with a position.
+_Atomic uint64_t	gpsNoFixes;		// And without one, NaN while the receiver has no fix.
+_Atomic uint64_t	gpsLastFix;		// monotonicNs() of the latest fix with a position, 0 before the first.
 
 pthread_t			gpsPollThread;			// Thread for getting GPS data from device.
 pthread_t			droneAutopilotThread;		// Thread for sending commands to drone.
 pthread_t			droneNavDataThread;		// Thread for receiving NavData from drone.
 pthread_t			androidGpsUpdateThread;	// Thread for sending periodic updates to android.
 pthread_t			androidCommandThread;	// Thread for getting Android directional commands.
+pthread_t			keepAliveThread;		// Thread for keeping the drone's command watchdog fed.
+pthread_t			statsThread;			// Thread for dumping statistics on SIGUSR1 and the trace on SIGUSR2.
+pthread_t			metricsThread;			// Thread serving Prometheus scrapes.
 
 void *gpsPoll( void *arg );
-void *droneAutopilot( void *arg );
-void *sendAndroidGpsUpdates( void *arg );
-void *getAndroidCommands( void *arg );
 void *getNavData( void *arg );
+void *dumpStats( void *arg );
+int connectUsbGps();
+void handleGpsData( int sockfd, void *arg );
+void openNavdata();
+void handleNavdata( int sockfd, void *arg );
+void runThreaded();
+void runReactor();
+void runFleet( unsigned int count, const char *firstIp, unsigned int workers, const AutopilotConfig *config, int seconds );
+int runMissions( unsigned int count, uint64_t firstSeed, unsigned int waypoints, unsigned int workers, const AutopilotConfig *config, int seconds );
+int runRouteBenchmark( unsigned int count, uint64_t seed, unsigned int workers, double budgetMs );
+void printAllStats( FILE *out );
+void printProcessStats( FILE *out );
+void registerMetrics();
+void registerFleetModeMetrics();
+void startMetricsServer();
 
 void printAngles();
 void printState();
-void rotate(double theta);
+void logStateChange( const DroneStateEvent *event, void *arg );
+void printUsage( const char *program );
+void setRoute( const GpsPoint *route, unsigned int count, void *arg );
+void startManualControl( void *arg );
+void endManualControl( void *arg );
+void setFleetRoute( const GpsPoint *route, unsigned int count, void *arg );
+
+// Called from the Android command thread.
+const AndroidCommandHandlers androidCommandHandlers =
+{
+	setRoute,
+	startManualControl,
+	endManualControl,
+	NULL
+};
+
+// Routes go to every drone; manual control only makes sense for one.
+const AndroidCommandHandlers fleetCommandHandlers =
+{
+	setFleetRoute,
+	NULL,
+	NULL,
+	&fleet
+};
 
 int main( int argc, char **argv )
 {
-	pthread_attr_t attr;
-	pthread_attr_init( &attr );
-	pthread_attr_setdetachstate( &attr, PTHREAD_CREATE_JOINABLE );
+	AutopilotConfig autopilotConfig = { AUTOPILOT_DEFAULT_RATE, 0, -1 };
+	int lockMemory = 0;
+	int reactorMode = 0;
+	int rateSet = 0;
+	unsigned int fleetSize = 0;
+	unsigned int fleetWorkers = 0;
+	int fleetSeconds = 0;
+	unsigned int missions = 0;
+	uint64_t missionSeed = 1;
+	unsigned int missionWaypoints = MISSION_DEFAULT_WAYPOINTS;
+	unsigned int routePoints = 0;
+
+	int opt;
+	while( ( opt = getopt( argc, argv, "r:p:c:metgf:a:w:d:s:x:n:o:b:h" ) ) != -1 )
+	{
+		switch( opt )
+		{
+		case 'r':
+			autopilotConfig.rate = atof( optarg );
+			rateSet = 1;
+			break;
+		case 'p':
+			autopilotConfig.priority = atoi( optarg );
+			break;
+		case 'c':
+			autopilotConfig.cpu = atoi( optarg );
+			break;
+		case 'm':
+			lockMemory = 1;
+			break;
+		case 'e':
+			reactorMode = 1;
+			break;
+		case 't':
+			traceEnable( 1 );
+			break;
+		case 'g':
+			useGps = 1;
+			break;
+		case 'f':
+			fleetSize = atoi( optarg );
+			break;
+		case 'a':
+			droneIp = optarg;
+			break;
+		case 'w':
+			fleetWorkers = atoi( optarg );
+			break;
+		case 'd':
+			fleetSeconds = atoi( optarg );
+			break;
+		case 's':
+			missions = atoi( optarg );
+			break;
+		case 'x':
+			missionSeed = strtoull( optarg, NULL, 10 );
+			break;
+		case 'n':
+			missionWaypoints = atoi( optarg );
+			break;
+		case 'o':
+			routeBudgetMs = atof( optarg );
+			break;
+		case 'b':
+			routePoints = atoi( optarg );
+			break;
+		default:
+			printUsage( argv[0] );
+			exit( opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE );
+		}
+	}
 
-	pthread_mutex_init( &gpsFixMutex, NULL );
+	// Keep page faults out of the control loop. Locks everything mapped
+	// now and later, so do it before the threads and their stacks exist.
+	if( lockMemory && mlockall( MCL_CURRENT | MCL_FUTURE ) < 0 )
+	{
+		fprintf( stderr, "mlockall() failure, errno = %d.\n", errno );
+	}
+
+	// In -e mode routes arrive on the one thread that also flies, so keep
+	// the optimiser on it too, and to its first local optimum, well under a
+	// millisecond. Workers would also inherit its priority and CPU.
+	if( reactorMode )
+	{
+		routeWorkers = 1;
+		if( routeBudgetMs > 0 )
+		{
+			printf( "Single-threaded: routes get no time beyond their first local optimum.\n" );
+			routeBudgetMs = 0;
+		}
+	}
+
+	traceThreadName( "main" );
+
+	if( routePoints > 0 )
+	{
+		return runRouteBenchmark( routePoints, missionSeed, fleetWorkers, ( routeBudgetMs >= 0 ) ? routeBudgetMs : ROUTE_DEFAULT_BUDGET_MS );
+	}
+
+	if( missions > 0 )
+	{
+		return runMissions( missions, missionSeed, missionWaypoints, fleetWorkers, &autopilotConfig, fleetSeconds );
+	}
+
+	if( fleetSize > 0 )
+	{
+		if( !rateSet )
+		{
+			autopilotConfig.rate = FLEET_DEFAULT_RATE;
+		}
+		registerFleetModeMetrics();
+		runFleet( fleetSize, droneIp, fleetWorkers, &autopilotConfig, fleetSeconds );
+		return 0;
+	}
 
-	// Note that droneCmdSock and droneCmdAddr are extern globals from command.h.
-	// This socket is used by threads that send piloting commands to the drone, including
+	pthread_mutex_init( &gpsFixMutex, NULL );
+	navdataHistoryInit( &navdataHistory );
+	autopilotInit( &autopilot, &autopilotConfig );
+
+	droneStateInit( &droneState );
+	droneStateSubscribe( &droneState, ~0U, logStateChange, NULL );
+	droneStateSubscribe( &droneState, AUTOPILOT_SAFETY_EVENTS, autopilotSafetyEvent, &autopilot );
+
+	// Block SIGUSR1 and SIGUSR2 before any thread is created so that every
+	// thread inherits the mask and only dumpStats() ever sees them, via sigwait().
+	sigset_t statsSignals;
+	sigemptyset( &statsSignals );
+	sigaddset( &statsSignals, SIGUSR1 );
+	sigaddset( &statsSignals, SIGUSR2 );
+	pthread_sigmask( SIG_BLOCK, &statsSignals, NULL );
+
+	// Note that droneLink is an extern global from command.h.
+	// This link is used by threads that send piloting commands to the drone, including
 	// the autopilot thread and the android command thread.
-	droneCmdSock = createUdpClientConnection( DRONE_IP, DRONE_COMMAND_PORT, &droneCmdAddr );
-	if( droneCmdSock < 0 )
+	if( droneLinkOpen( &droneLink, droneIp, DRONE_COMMAND_PORT ) < 0 )
 	{
-		fprintf( stderr, "couldn't connect to drone at %s.\n", DRONE_IP );
+		fprintf( stderr, "couldn't connect to drone at %s.\n", droneIp );
 		exit( EXIT_FAILURE );
 	}
 	else
 	{
-		printf( "Connected to drone at %s.\n", DRONE_IP );
+		printf( "Connected to drone at %s.\n", droneIp );
 	}
 
-	// Set default waypoint to Allen Fieldhouse.
-	numWaypoints = 1;
-	waypoints[0].latitude = 38.954352;
-	waypoints[0].longitude = -95.252811;
-
 	// Initialize GPS fixes with invalid data.
 	currGpsFix.latitude = NAN;
 	currGpsFix.longitude = NAN;
 	prevGpsFix.latitude = NAN;
 	prevGpsFix.longitude = NAN;
 
-#if ENABLE_GPS
-	pthread_create( &gpsPollThread, &attr, gpsPoll, (void *)NULL );
-#endif
-	pthread_create( &androidGpsUpdateThread, &attr, sendAndroidGpsUpdates, (void *)NULL );
+	telemetrySetNavdataSource( &navdataHistory );
+	telemetryPublishFix( &currGpsFix );
+
+	registerMetrics();
+
+	if( reactorMode )
+	{
+		runReactor();
+	}
+	else
+	{
+		runThreaded();
+	}
+
+	pthread_mutex_destroy( &gpsFixMutex );
+	return 0;
+}
+
+
+// One thread per subsystem, each blocking on its own fds.
+void runThreaded()
+{
+	pthread_attr_t attr;
+	pthread_attr_init( &attr );
+	pthread_attr_setdetachstate( &attr, PTHREAD_CREATE_JOINABLE );
+
+	if( useGps )
+	{
+		pthread_create( &gpsPollThread, &attr, gpsPoll, (void *)NULL );
+	}
+	pthread_create( &androidGpsUpdateThread, &attr, telemetryServer, (void *)NULL );
 #if ENABLE_NAVDATA
 	pthread_create( &droneNavDataThread, &attr, getNavData, (void *)NULL );
 #endif
-	pthread_create( &droneAutopilotThread, &attr, droneAutopilot, (void *)NULL );
-	pthread_create( &androidCommandThread, &attr, getAndroidCommands, (void *)NULL );
+	pthread_create( &keepAliveThread, &attr, commandKeepAlive, (void *)NULL );
+	pthread_create( &droneAutopilotThread, &attr, autopilotRun, (void *)&autopilot );
+	pthread_create( &androidCommandThread, &attr, androidCommandServer, (void *)&androidCommandHandlers );
+	pthread_create( &statsThread, &attr, dumpStats, (void *)NULL );
+	startMetricsServer();
 
 	void *status;
-#if ENABLE_GPS
-	pthread_join( gpsPollThread, &status );
-#endif
+	if( useGps )
+	{
+		pthread_join( gpsPollThread, &status );
+	}
 	pthread_join( androidGpsUpdateThread, &status );
 #if ENABLE_NAVDATA
 	pthread_join( droneNavDataThread, &status );
 #endif
+	pthread_join( keepAliveThread, &status );
 	pthread_join( droneAutopilotThread, &status );
 	pthread_join( androidCommandThread, &status );
 
-	pthread_mutex_destroy( &gpsFixMutex );
 	pthread_attr_destroy( &attr );
-	pthread_exit( NULL );
-	return 0;
 }
 
-void *gpsPoll( void *arg )
+static int reactorRunning = 1;
+
+static void handleSignal( int sigfd, void *arg )
 {
-	struct sockaddr_un saun;
+	struct signalfd_siginfo info;
+	while( read( sigfd, &info, sizeof( info ) ) == sizeof( info ) )
+	{
+		if( info.ssi_signo == SIGUSR1 )
+		{
+			printAllStats( stdout );
+			fflush( stdout );
+		}
+		else if( info.ssi_signo == SIGUSR2 )
+		{
+			traceDumpFile();
+			fflush( stdout );
+		}
+		else
+		{
+			reactorRunning = 0;
+		}
+	}
+}
 
-	saun.sun_family = AF_UNIX;
-	strcpy( saun.sun_path, "serial_rpigps_data" );
+static void dispatchTelemetry( int fd, void *arg )
+{
+	telemetryServerDispatch( 0 );
+}
 
-	int sockfd = socket( AF_UNIX, SOCK_STREAM, 0 );
-	if( sockfd < 0 )
+static void dispatchAndroidCommands( int fd, void *arg )
+{
+	androidCommandServerDispatch( 0 );
+}
+
+static void dispatchAutopilot( int fd, void *arg )
+{
+	autopilotDispatch( (Autopilot *)arg, 0 );
+}
+
+static void dispatchKeepAlive( int fd, void *arg )
+{
+	handleKeepAliveTimer( fd );
+}
+
+// Everything on this one thread, multiplexed by a single epoll set: GPS,
+// navdata, both Android servers, the autopilot and keepalive timers, and
+// signals through a signalfd. Nothing is shared between threads, so there
+// are no context switches between subsystems. SIGINT or SIGTERM print the
+// statistics and return.
+void runReactor()
+{
+	Reactor reactor;
+	reactorInit( &reactor );
+
+	sigset_t signals;
+	sigemptyset( &signals );
+	sigaddset( &signals, SIGUSR1 );
+	sigaddset( &signals, SIGUSR2 );
+	sigaddset( &signals, SIGINT );
+	sigaddset( &signals, SIGTERM );
+	pthread_sigmask( SIG_BLOCK, &signals, NULL );
+	int sigfd = signalfd( -1, &signals, SFD_NONBLOCK | SFD_CLOEXEC );
+	if( sigfd < 0 )
 	{
-		fprintf( stderr, "gpsPoll() socket creation failure, errno = %d.\n", errno );
+		fprintf( stderr, "signalfd() failure, errno = %d.\n", errno );
 		exit( EXIT_FAILURE );
 	}
+	reactorAdd( &reactor, sigfd, handleSignal, NULL );
+	startMetricsServer();
 
-	if( connect( sockfd, (struct sockaddr *)&saun, sizeof( saun ) ) < 0 )
+	if( useGps )
 	{
-		fprintf( stderr, "gpsPoll() couldn't connect to usbgps, errno = %d.\n", errno );
-		exit( EXIT_FAILURE );
+		reactorAdd( &reactor, connectUsbGps(), handleGpsData, NULL );
 	}
+#if ENABLE_NAVDATA
+	openNavdata();
+	reactorAdd( &reactor, navDataSock, handleNavdata, NULL );
+#endif
+	reactorAdd( &reactor, telemetryServerOpen( ANDROID_GPS_UPDATE_PORT ), dispatchTelemetry, NULL );
+	reactorAdd( &reactor, androidCommandServerOpen( ANDROID_COMMAND_PORT, &androidCommandHandlers ), dispatchAndroidCommands, NULL );
+	reactorAdd( &reactor, createKeepAliveTimer(), dispatchKeepAlive, NULL );
+	reactorAdd( &reactor, autopilot.epollfd, dispatchAutopilot, &autopilot );
 
-	for(;;)
-	{
-		char *buffer[MAX_BUFFER_SIZE];
-		if( read( sockfd, buffer, MAX_BUFFER_SIZE ) < 0 )
-		{
-			fprintf( stderr, "Reading GPS data from usbgps failed, errno = %d.\n", errno );
-			close( sockfd );
-			exit( EXIT_FAILURE );
-		}
+	// The control loop's priority and CPU now apply to everything.
+	autopilotConfigureThread( &autopilot );
 
-		pthread_mutex_lock( &gpsFixMutex );
-		prevGpsFix = currGpsFix;
-		memcpy( (char *)&currGpsFix, buffer, sizeof( GpsPoint ) / sizeof( char ) );
-		pthread_mutex_unlock( &gpsFixMutex );
+	printf( "Running in reactor mode.\n" );
+	while( reactorRunning )
+	{
+		int timeoutMs = -1;
+#if ENABLE_NAVDATA
+		navdataSessionTick( &navdataSession, monotonicNs() );
+		timeoutMs = navdataSessionTimeout( &navdataSession, monotonicNs() );
+#endif
+		reactorRunOnce( &reactor, timeoutMs );
 	}
 
-	pthread_exit( NULL );
+	printAllStats( stdout );
+	fflush( stdout );
 }
 
-void *droneAutopilot( void *arg )
+static void handleFleetSignal( int sigfd, void *arg )
 {
-	int i = 0;
-	while( true )
+	struct signalfd_siginfo info;
+	while( read( sigfd, &info, sizeof( info ) ) == sizeof( info ) )
 	{
-		if( autonomousMode )
+		if( info.ssi_signo == SIGUSR1 )
 		{
-			sleep( 3 );
-			droneTakeOff();
-			for( ; currWaypoint < numWaypoints; currWaypoint++ )
-			{
-				GpsPoint destination = waypoints[currWaypoint];
-				while( getDistance( currGpsFix, destination ) > LOCATION_EPSILON )
-				{
-					unsigned int j;
-					for( j = 0; j < 10; j++ )
-					{
-						droneForward();
-					}
-
-					GpsPoint currFix = currGpsFix;
-					GpsPoint prevFix = prevGpsFix;
-
-					double desiredHeading = getBearing( currFix, destination );
-					double currHeading = getHeading( currFix, prevFix );
-					double headingError = ( ( currHeading + 360 ) - ( desiredHeading + 360 ) ) - 720;
-
-					if( fabs( headingError ) > HEADING_EPSILON )
-					{
-						if( headingError < 0 )
-						{
-							droneRotateRight();
-						}
-						else
-						{
-							droneRotateLeft();
-						}
-					}
-				}
-			}
-
-			droneLand();
+			printFleet( stdout, &fleet );
+			printCommandStats( stdout );
+			printProcessStats( stdout );
+			fflush( stdout );
 		}
-		else if ( programmedMode )
+		else if( info.ssi_signo == SIGUSR2 )
 		{
-			if (navdata_ready) {
-				if (i % 2 == 0) {
-					rotate(30);
-					sleep(1);
-				} else {
-					rotate(-30);
-					sleep(1);
-				}
-			}
-		} 
-		i++;
+			traceDumpFile();
+			fflush( stdout );
+		}
+		else
+		{
+			reactorRunning = 0;
+		}
 	}
-
-	pthread_exit( NULL );
 }
 
-void *sendAndroidGpsUpdates( void *arg )
+// Supervises count drones at consecutive addresses from firstIp, sharded
+// over the fleet workers, while this thread serves Android routes (sent to
+// every drone) and signals. With seconds > 0 it is a benchmark instead:
+// every drone flies fleetBenchmarkRoute for that long, then the statistics
+// are printed and the function returns.
+void runFleet( unsigned int count, const char *firstIp, unsigned int workers, const AutopilotConfig *config, int seconds )
 {
-	int handshakeSocket;
-	struct sockaddr_in myaddr;
-
-	handshakeSocket = socket( PF_INET, SOCK_STREAM, 0 );
-	if( handshakeSocket == -1 )
+	Reactor reactor;
+	reactorInit( &reactor );
+
+	sigset_t signals;
+	sigemptyset( &signals );
+	sigaddset( &signals, SIGUSR1 );
+	sigaddset( &signals, SIGUSR2 );
+	sigaddset( &signals, SIGINT );
+	sigaddset( &signals, SIGTERM );
+	pthread_sigmask( SIG_BLOCK, &signals, NULL );
+	int sigfd = signalfd( -1, &signals, SFD_NONBLOCK | SFD_CLOEXEC );
+	if( sigfd < 0 )
 	{
-		printf( "Android GPS update thread: socket() failure, errno = %d\n", errno );
+		fprintf( stderr, "signalfd() failure, errno = %d.\n", errno );
 		exit( EXIT_FAILURE );
 	}
+	reactorAdd( &reactor, sigfd, handleFleetSignal, NULL );
+
+	// The fleet collector reads the drones and workers, so nothing may be
+	// scraped before they exist.
+	fleetInit( &fleet, firstIp, count, workers, config );
+	startMetricsServer();
+	fleetStart( &fleet );
+
+	uint64_t deadline = 0;
+	if( seconds > 0 )
+	{
+		fleetPostRoute( &fleet, fleetBenchmarkRoute, sizeof( fleetBenchmarkRoute ) / sizeof( fleetBenchmarkRoute[0] ) );
+		deadline = monotonicNs() + (uint64_t)seconds * NSEC_PER_SEC;
+	}
+	else
+	{
+		reactorAdd( &reactor, androidCommandServerOpen( ANDROID_COMMAND_PORT, &fleetCommandHandlers ), dispatchAndroidCommands, NULL );
+	}
 
-	int yes = 1;
-	if( setsockopt( handshakeSocket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof( int ) ) == -1 )
+	while( reactorRunning )
 	{
-		printf( "Android GPS update thread: setsockopt() failure, errno = %d\n", errno );
-		close( handshakeSocket );
-		exit( EXIT_FAILURE );
+		int timeoutMs = -1;
+		if( deadline != 0 )
+		{
+			uint64_t now = monotonicNs();
+			if( now >= deadline )
+			{
+				break;
+			}
+			timeoutMs = (int)( ( deadline - now + NSEC_PER_MSEC - 1 ) / NSEC_PER_MSEC );
+		}
+		reactorRunOnce( &reactor, timeoutMs );
 	}
 
-	myaddr.sin_family = AF_INET;
-	myaddr.sin_port = htons( atoi( ANDROID_GPS_UPDATE_PORT ) );
-	myaddr.sin_addr.s_addr = htonl( INADDR_ANY );
-	memset( &( myaddr.sin_zero ), '\0', 8 );
+	// Snapshot before stopping, so the figures cover the drones in flight.
+	printFleet( stdout, &fleet );
+	printCommandStats( stdout );
+	printProcessStats( stdout );
+	fflush( stdout );
 
-	if( bind( handshakeSocket, (struct sockaddr *)&myaddr, sizeof( struct sockaddr ) ) == -1 ) { printf( "Android GPS update thread: bind() failure, errno = %d\n", errno ); close( handshakeSocket );
-		exit( EXIT_FAILURE );
-	}
+	fleetPostType( &fleet, AUTOPILOT_EVENT_LAND );
+	fleetStop( &fleet );
+}
 
-	if( listen( handshakeSocket, 10 ) == -1 )
+// Flies count simulated missions, seeds firstSeed onwards, through the
+// autopilot and command code against dronesim. Each runs on a virtual
+// clock as fast as a CPU allows, spread over workers threads. Returns the
+// exit status: failure if any mission didn't complete.
+int runMissions( unsigned int count, uint64_t firstSeed, unsigned int waypoints, unsigned int workers, const AutopilotConfig *config, int seconds )
+{
+	MissionSpec spec;
+	spec.seed = firstSeed;
+	spec.numWaypoints = waypoints;
+	spec.maxSeconds = ( seconds > 0 ) ? seconds : MISSION_DEFAULT_SECONDS;
+	spec.optimiseRoute = ( routeBudgetMs >= 0 );
+	spec.config = *config;
+
+	MissionResult *results = calloc( count, sizeof( MissionResult ) );
+	if( results == NULL )
 	{
-		printf( "Android GPS update thread: listen() failure, errno = %d\n", errno );
-		close( handshakeSocket );
+		fprintf( stderr, "Couldn't allocate mission results.\n" );
 		exit( EXIT_FAILURE );
 	}
 
-	while( 1 )
-	{
-		struct sockaddr_in theiraddr;
-		socklen_t theiraddr_size = sizeof( struct sockaddr_in );
+	printf( "Simulating %u missions of %u %s waypoints from seed %llu at %.1f Hz.\n",
+		count, waypoints, spec.optimiseRoute ? "reordered" : "random", (unsigned long long)firstSeed, config->rate );
+	fflush( stdout );
 
-		/* Accept the incoming connection request. */
-		int connectionSocket = accept( handshakeSocket, (struct sockaddr *)&theiraddr, &theiraddr_size );
-		if( connectionSocket == -1 )
-		{
-			printf( "Android GPS update thread: accept() failure, errno = %d\n", errno );
-			continue;
-		}
+	uint64_t start = monotonicNs();
+	missionSimRunAll( &spec, firstSeed, count, workers, results );
+	double wallSeconds = ( monotonicNs() - start ) / (double)NSEC_PER_SEC;
 
-		pid_t pid = fork();
-		if( pid < 0 )
-		{
-			fprintf( stderr, "Android command server couldn't fork.\n" );
-			exit( EXIT_FAILURE );
-		}
-		if( pid == 0 )
-		{
-			close( handshakeSocket );	// Child doesn't need this socket.
+	printMissionResults( stdout, results, count, wallSeconds );
+	printCommandStats( stdout );
+	fflush( stdout );
 
-			while( 1 )
-			{
-				sleep( 1 );
-
-				char buffer[MAX_BUFFER_SIZE];
-				snprintf( buffer, MAX_BUFFER_SIZE, "%lf %lf\n", currGpsFix.latitude, currGpsFix.longitude );
-				int size = send( connectionSocket, buffer, strlen( buffer ), 0 );
-				if( size == -1 )
-				{
-					printf( "send() failure, errno = %d\n", errno );
-					close( connectionSocket );
-					exit( EXIT_FAILURE );
-				}
-				else if( size == 0 )
-				{
-					printf( "Android client unsubscribed from GPS updates.\n" );
-					// Client disconnected.
-					break;
-				}
-			}
+	unsigned int i;
+	for( i = 0; i < count; i++ )
+	{
+		if( !results[i].completed )
+		{
+			return EXIT_FAILURE;
 		}
-
-		// Parent no longer needs this socket.
-		close( connectionSocket );
-		sleep( 3 );
 	}
-
-	return 0;
+	return EXIT_SUCCESS;
 }
 
-void *getAndroidCommands( void *arg )
+// Optimises routes through count random points over a square kilometer
+// around dummyserver's take-off point: once with both ends free, once with
+// the first and last points fixed. Prints how much shorter each got, and
+// where the time went.
+// Whether order visits every point exactly once, keeping the ends where
+// options asked for them.
+static int checkRouteOrder( const unsigned int *order, unsigned int count, const RouteOptions *options )
 {
-	int handshakeSocket;
-	struct sockaddr_in myaddr;
-
-	handshakeSocket = socket( PF_INET, SOCK_STREAM, 0 );
-	if( handshakeSocket == -1 )
+	unsigned char *seen = calloc( count, 1 );
+	if( seen == NULL )
 	{
-		printf( "Android command thread: socket() failure, errno = %d\n", errno );
+		fprintf( stderr, "Couldn't allocate route check.\n" );
 		exit( EXIT_FAILURE );
 	}
 
-	int yes = 1;
-	if( setsockopt( handshakeSocket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof( int ) ) == -1 )
+	int valid = 1;
+	unsigned int i;
+	for( i = 0; i < count && valid; i++ )
 	{
-		printf( "Android command thread: setsockopt() failure, errno = %d\n", errno );
-		close( handshakeSocket );
-		exit( EXIT_FAILURE );
+		valid = order[i] < count && !seen[order[i]];
+		if( valid )
+		{
+			seen[order[i]] = 1;
+		}
 	}
+	free( seen );
 
-	myaddr.sin_family = AF_INET;
-	myaddr.sin_port = htons( atoi( ANDROID_COMMAND_PORT ) );
-	myaddr.sin_addr.s_addr = htonl( INADDR_ANY );
-	memset( &( myaddr.sin_zero ), '\0', 8 );
+	if( !valid )
+	{
+		fprintf( stderr, "Route order isn't a permutation: position %u.\n", i - 1 );
+		return 0;
+	}
+	if( ( options->fixedStart && order[0] != 0 ) || ( options->fixedEnd && order[count - 1] != count - 1 ) )
+	{
+		fprintf( stderr, "Route order moved a fixed end.\n" );
+		return 0;
+	}
+	return 1;
+}
 
-	if( bind( handshakeSocket, (struct sockaddr *)&myaddr, sizeof( struct sockaddr ) ) == -1 )
+int runRouteBenchmark( unsigned int count, uint64_t seed, unsigned int workers, double budgetMs )
+{
+	if( count > ROUTE_MAX_POINTS )
 	{
-		printf( "Android command thread: bind() failure, errno = %d\n", errno );
-		close( handshakeSocket );
-		exit( EXIT_FAILURE );
+		fprintf( stderr, "At most %d route points, using that many.\n", ROUTE_MAX_POINTS );
+		count = ROUTE_MAX_POINTS;
 	}
 
-	if( listen( handshakeSocket, 10 ) == -1 )
+	GpsPoint *points = calloc( count, sizeof( GpsPoint ) );
+	unsigned int *order = calloc( count, sizeof( unsigned int ) );
+	if( points == NULL || order == NULL )
 	{
-		printf( "Android command thread: listen() failure, errno = %d\n", errno );
-		close( handshakeSocket );
+		fprintf( stderr, "Couldn't allocate route benchmark.\n" );
 		exit( EXIT_FAILURE );
 	}
 
-	while( 1 )
+	unsigned short state[3] = { seed, seed >> 16, seed >> 32 };
+	unsigned int i;
+	for( i = 0; i < count; i++ )
 	{
-		struct sockaddr_in theiraddr;
-		socklen_t theiraddr_size = sizeof( struct sockaddr_in );
+		points[i].latitude = 38.954352 + ( erand48( state ) - 0.5 ) * 0.009;	// About 1 km.
+		points[i].longitude = -95.252811 + ( erand48( state ) - 0.5 ) * 0.0116;
+	}
 
-		/* Accept the incoming connection request. */
-		int connectionSocket = accept( handshakeSocket, (struct sockaddr *)&theiraddr, &theiraddr_size );
-		if( connectionSocket == -1 )
+	printf( "Ordering %u random points from seed %llu, %.0f ms budget.\n", count, (unsigned long long)seed, budgetMs );
+	int result = EXIT_SUCCESS;
+	int fixed;
+	for( fixed = 0; fixed < 2; fixed++ )
+	{
+		RouteOptions options = { fixed, fixed, workers, budgetMs, seed };
+		RouteStats stats;
+		routeOptimise( points, count, &options, order, &stats );
+		if( !checkRouteOrder( order, count, &options ) )
 		{
-			printf( "Android command thread: accept() failure, errno = %d\n", errno );
-			continue;
+			result = EXIT_FAILURE;
 		}
 
-		char buffer[MAX_BUFFER_SIZE];
-		int size = recv( connectionSocket, buffer, MAX_BUFFER_SIZE, 0 );
-		if( size == -1 )
+		// One point has no length at all, and rounding noise would print
+		// as -0.0.
+		double saving = ( stats.seedLength > 0 ) ? 100.0 * ( 1.0 - stats.length / stats.seedLength ) : 0;
+		if( fabs( saving ) < 0.05 )
 		{
-			printf( "recv() failure, errno = %d\n", errno );
-			close( handshakeSocket );
-			close( connectionSocket );
-			exit( EXIT_FAILURE );
-
+			saving = 0;
 		}
+		printf( "route: %s: %.2f km as given, %.2f km nearest neighbour, %.2f km first local optimum, %.2f km best (%.1f%% under nearest neighbour)\n",
+			fixed ? "fixed ends" : "free ends", stats.givenLength, stats.seedLength, stats.localLength, stats.length, saving );
+		printf( "route: %s: matrix %.1f ms, search %.1f ms, %llu kicks, %llu improved\n",
+			fixed ? "fixed ends" : "free ends", stats.matrixNs / 1e6, stats.searchNs / 1e6,
+			(unsigned long long)stats.kicks, (unsigned long long)stats.improvements );
+	}
 
-		buffer[size] = '\0';
-		if( strcmp( buffer, "manual" ) == 0 )
-		{
-			pid_t pid = fork();
-			if( pid < 0 )
-			{
-				fprintf( stderr, "Android command server couldn't fork.\n" );
-				exit( EXIT_FAILURE );
-			}
-			if( pid == 0 )
-			{
-				close( handshakeSocket );	// Child doesn't need this socket.
-
-				while( 1 )
-				{
-					int size = recv( connectionSocket, buffer, MAX_BUFFER_SIZE, 0 );
-					if( size == -1 )
-					{
-						printf( "recv() failure, errno = %d\n", errno );
-						close( connectionSocket );
-						exit( EXIT_FAILURE );
-					}
-					else if( size == 0 )
-					{
-						printf( "Android client disconnected\n" );
-						// Client disconnected.
-						break;
-					}
-					else
-					{
-						buffer[size] = '\0';
-						printf( "Recv :: %s\n", buffer );
-						if( strcmp( buffer, "cmd takeoff" ) == 0 )
-						{
-							droneTakeOff();
-						}
-						else if( strcmp( buffer, "cmd land" ) == 0 )
-						{
-							droneLand();
-						}
-						else if( strcmp( buffer, "cmd moveforward" ) == 0 )
-						{
-							droneForward();
-						}
-						else if( strcmp( buffer, "cmd moveback" ) == 0 )
-						{
-							droneBack();
-						}
-						else if( strcmp( buffer, "cmd moveleft" ) == 0 )
-						{
-							droneLeft();
-						}
-						else if( strcmp( buffer, "cmd moveright" ) == 0 )
-						{
-							droneRight();
-						}
-						else if( strcmp( buffer, "cmd moveup" ) == 0 )
-						{
-							droneUp();
-						}
-						else if( strcmp( buffer, "cmd movedown" ) == 0 )
-						{
-							droneDown();
-						}
-						else if( strcmp( buffer, "cmd turnleft" ) == 0 )
-						{
-							droneRotateLeft();
-						}
-						else if( strcmp( buffer, "cmd turnright" ) == 0 )
-						{
-							droneRotateRight();
-						}
-						else
-						{
-							fprintf( stderr, "Unrecognized Android command: %s\n", buffer );
-						}
-					}
-				}
-
-				close( connectionSocket );
-				exit( EXIT_SUCCESS );
-			}
-			else
-			{
-				// Parent no longer needs this socket.
-				close( connectionSocket );
+	free( order );
+	free( points );
+	return result;
+}
 
-				// Getting commands from Android device, go into slave mode.
-				autonomousMode = false;
+int connectUsbGps()
+{
+	struct sockaddr_un saun;
 
-				// Wait for currently connected client to disconnect.
-				// This allows only one device to connect at a time.
-				int status;
-				wait( &status );
+	saun.sun_family = AF_UNIX;
+	strcpy( saun.sun_path, "serial_rpigps_data" );
 
-				// When above child terminates, the Android device has disconnected,
-				// fo back to autonomous mode.
-				autonomousMode = true;
-			}
-		}
-		// If the first string wasn't "manual", assume it's a waypoint list.
-		else if( strncmp( buffer, "list", 4 ) == 0 )
-		{
-			currWaypoint = 0;	// Will start navigating at the beginning of this list in droneAutopilot()
-			sscanf( &buffer[4], "%d", &numWaypoints );
-
-			printf( "%s\n", buffer );
-			unsigned int i;
-			unsigned int len = 0;
-			while( buffer[len] != ' ' ) len++;
-			len++;
-			while( buffer[len] != ' ' ) len++;
-			len++;
-			for( i = 0; i < numWaypoints; i++ )
-			{
-				sscanf( &buffer[len], "%lf %lf", &waypoints[i].latitude, &waypoints[i].longitude );
-				while( buffer[len] != ' ' ) len++;
-				len++;
-				while( buffer[len] != ' ' ) len++;
-				len++;
-				printf( "%lf %lf\n", waypoints[i].latitude, waypoints[i].longitude );
-			}
+	int sockfd = socket( AF_UNIX, SOCK_STREAM, 0 );
+	if( sockfd < 0 )
+	{
+		fprintf( stderr, "gpsPoll() socket creation failure, errno = %d.\n", errno );
+		exit( EXIT_FAILURE );
+	}
+
+	if( connect( sockfd, (struct sockaddr *)&saun, sizeof( saun ) ) < 0 )
+	{
+		fprintf( stderr, "gpsPoll() couldn't connect to usbgps, errno = %d.\n", errno );
+		exit( EXIT_FAILURE );
+	}
+
+	return sockfd;
+}
 
-			autonomousMode = true;
+// Reads whatever fixes usbgps has sent and hands the newest to everyone
+// who needs it. The stream can split a fix across reads, so a partial one
+// is kept for the next call.
+void handleGpsData( int sockfd, void *arg )
+{
+	static char buffer[MAX_BUFFER_SIZE];
+	static size_t length = 0;
+
+	TRACE_BEGIN( "gps.fix" );
+	ssize_t size = read( sockfd, buffer + length, sizeof( buffer ) - length );
+	if( size <= 0 )
+	{
+		if( size == 0 )
+		{
+			fprintf( stderr, "usbgps closed the GPS socket.\n" );
 		}
 		else
 		{
-			printf( "Unrecognized string \'%s\'.\n", buffer );
+			fprintf( stderr, "Reading GPS data from usbgps failed, errno = %d.\n", errno );
+		}
+		close( sockfd );
+		exit( EXIT_FAILURE );
+	}
+	length += size;
+
+	size_t records = length / sizeof( GpsPoint );
+	if( records == 0 )
+	{
+		TRACE_END( "gps.fix" );
+		return;
+	}
+
+	size_t valid = 0;
+	size_t i;
+	for( i = 0; i < records; i++ )
+	{
+		GpsPoint record;
+		memcpy( &record, buffer + i * sizeof( GpsPoint ), sizeof( GpsPoint ) );
+		if( !isnan( record.latitude ) )
+		{
+			valid++;
 		}
+	}
 
-		close( connectionSocket );
+	pthread_mutex_lock( &gpsFixMutex );
+	prevGpsFix = currGpsFix;
+	memcpy( (char *)&currGpsFix, buffer + ( records - 1 ) * sizeof( GpsPoint ), sizeof( GpsPoint ) );
+	telemetryPublishFix( &currGpsFix );
+	autopilotUpdateFix( &autopilot, &currGpsFix );
+	GpsPoint fix = currGpsFix;
+	pthread_mutex_unlock( &gpsFixMutex );
+
+	length -= records * sizeof( GpsPoint );
+	memmove( buffer, buffer + records * sizeof( GpsPoint ), length );
+	TRACE_END_ARGS( "gps.fix", "latitude", fix.latitude, "longitude", fix.longitude );
+
+	// Only this thread writes them. A fix without a position leaves the
+	// age growing, so outages show.
+	ADD( gpsFixes, valid );
+	ADD( gpsNoFixes, records - valid );
+	if( valid > 0 )
+	{
+		atomic_store_explicit( &gpsLastFix, monotonicNs(), memory_order_relaxed );
 	}
+}
 
-	return 0;
+void *gpsPoll( void *arg )
+{
+	traceThreadName( "gps" );
+	int sockfd = connectUsbGps();
+
+	for(;;)
+	{
+		handleGpsData( sockfd, NULL );
+	}
+
+	pthread_exit( NULL );
 }
 
-void *getNavData( void *arg ) {
+void openNavdata() {
 	// Note that navDataSock and navDataAddr are extern globals from navdata.h.
-	createNavdataSocket();
+	createNavdataSocket( droneIp );
 	if( navDataSock < 0 )
 	{
-		fprintf( stderr, "Navdata thread couldn't connect to %s.\n", DRONE_IP );
+		fprintf( stderr, "Navdata thread couldn't connect to %s.\n", droneIp );
 		exit( EXIT_FAILURE );
 	}
 	else
 	{
-		printf( "Navdata thread connected to %s.\n", DRONE_IP );
+		printf( "Navdata thread connected to %s.\n", droneIp );
+	}
+
+	enableNavdataTimestamps( navDataSock );
+	navdataSessionInit( &navdataSession );
+}
+
+// Takes whatever navdata has arrived on the (non-blocking) socket.
+void handleNavdata( int sockfd, void *arg ) {
+	// Too big for the thread's stack.
+	static navdata_batch_t batch;
+
+	//receive a burst of packets
+	if (receiveNavdataBatch(sockfd, &batch, MSG_DONTWAIT, &navdataLinkStats) <= 0) {
+		return;
 	}
 
-	// Start up dat navdata
-	tickleNavData();
-	navdataInit();
+	unsigned int i;
+	for (i = 0; i < batch.count; i++) {
+		navdata_packet_t packet;
+		int result = parseNavdata(batch.packets[i].data, batch.packets[i].length, &packet);
+		if (result != NAVDATA_OK) {
+			fprintf(stderr, "Dropped navdata packet, parse error %d.\n", result);
+			continue;
+		}
+
+		trackNavdataSequence(packet.header->seq);
+		droneStateUpdate(&droneState, packet.header->state, batch.packets[i].rxTime);
+		navdataSessionPacket(&navdataSession, &packet, batch.packets[i].rxTime);
+		dispatchNavdataOptions(&packet);
 
-	int navdata_size;
-	socklen_t socketsize;
+		navdataHistoryPushPacket(&navdataHistory, &packet, batch.packets[i].rxTime);
+	}
+}
 
-	socketsize = sizeof(droneAddr_navdata);
+void *getNavData( void *arg ) {
+	traceThreadName( "navdata" );
+	openNavdata();
 
 	for(;;)
 	{
-		navdataKeepAlive();
-		tickleNavData();
+		navdataSessionTick(&navdataSession, monotonicNs());
+
+		// Sleep until a packet arrives or the session has a retry or loss deadline.
+		struct pollfd pfd;
+		pfd.fd = navDataSock;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, navdataSessionTimeout(&navdataSession, monotonicNs())) <= 0) {
+			continue;
+		}
+
+		handleNavdata(navDataSock, NULL);
+	}
+
+	pthread_exit( NULL );
+}
+
+// Context switches and peak RSS, for comparing threaded and reactor modes.
+void printProcessStats( FILE *out )
+{
+	struct rusage usage;
+	getrusage( RUSAGE_SELF, &usage );
+	fprintf( out, "process: %ld voluntary, %ld involuntary context switches, max RSS %ld KiB, CPU %.3f s user %.3f s system\n",
+		usage.ru_nvcsw, usage.ru_nivcsw, usage.ru_maxrss,
+		usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6,
+		usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6 );
+}
+
+void printAllStats( FILE *out )
+{
+	printCommandStats( out );
+	printNavdataLinkStats( out );
+	printNavdataSession( out, &navdataSession );
+	printTelemetryStats( out );
+	printAutopilot( out, &autopilot );
+	printProcessStats( out );
+}
+
+static void collectProcessMetrics( FILE *out, void *arg )
+{
+	struct rusage usage;
+	getrusage( RUSAGE_SELF, &usage );
+
+	metricsWriteHeader( out, "process_cpu_seconds_total", METRIC_COUNTER, "User and system CPU time." );
+	metricsWriteSample( out, "process_cpu_seconds_total", NULL,
+		usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6 );
+	metricsWriteHeader( out, "argps_process_max_rss_bytes", METRIC_GAUGE, "Peak resident set size." );
+	metricsWriteSample( out, "argps_process_max_rss_bytes", NULL, usage.ru_maxrss * 1024.0 );
+	metricsWriteHeader( out, "argps_process_context_switches_total", METRIC_COUNTER, "Context switches, by kind." );
+	metricsWriteSample( out, "argps_process_context_switches_total", "kind=\"voluntary\"", usage.ru_nvcsw );
+	metricsWriteSample( out, "argps_process_context_switches_total", "kind=\"involuntary\"", usage.ru_nivcsw );
+}
+
+static double readGpsFixAge( void *arg )
+{
+	uint64_t last = atomic_load_explicit( &gpsLastFix, memory_order_relaxed );
+	if( last == 0 )
+	{
+		return NAN;
+	}
+	return ( monotonicNs() - last ) / (double)NSEC_PER_SEC;
+}
+
+// Everything printAllStats() prints, for scrapes.
+void registerMetrics()
+{
+	metricsCounter( "argps_gps_fixes_total", "valid=\"true\"", "Fixes read from usbgps, by whether they had a position.", &gpsFixes );
+	metricsCounter( "argps_gps_fixes_total", "valid=\"false\"", NULL, &gpsNoFixes );
+	metricsGaugeReader( "argps_gps_fix_age_seconds", NULL, "Time since the latest fix with a position, NaN before the first.", readGpsFixAge, NULL );
+	registerCommandMetrics();
+	registerNavdataMetrics();
+	registerNavdataSessionMetrics( &navdataSession );
+	registerTelemetryMetrics();
+	registerAndroidCommandMetrics();
+	registerAutopilotMetrics( &autopilot );
+	metricsCollector( collectProcessMetrics, NULL );
+}
+
+// The fleet has no single drone's navdata, autopilot or telemetry.
+void registerFleetModeMetrics()
+{
+	registerFleetMetrics( &fleet );
+	registerCommandMetrics();
+	registerAndroidCommandMetrics();
+	metricsCollector( collectProcessMetrics, NULL );
+}
+
+// Scrapes get their own thread in every mode, so a slow scraper never
+// holds up the reactor. Call after blocking signals, so it inherits the mask.
+void startMetricsServer()
+{
+	pthread_attr_t attr;
+	pthread_attr_init( &attr );
+	pthread_attr_setdetachstate( &attr, PTHREAD_CREATE_DETACHED );
+	pthread_create( &metricsThread, &attr, metricsServer, (void *)MAIN_METRICS_PORT );
+	pthread_attr_destroy( &attr );
+}
 
-		//receive data 
-		navdata_size = recvfrom(navDataSock, &navdata_struct, sizeof(navdata_struct), 0, (struct sockaddr *)&droneAddr_navdata, &socketsize);
+// Prints the statistics each time the process receives SIGUSR1, e.g.
+// "kill -USR1 <pid>", and writes the trace on SIGUSR2. Runs on its own
+// thread so the control loop never pauses while they are gathered.
+void *dumpStats( void *arg )
+{
+	sigset_t statsSignals;
+	sigemptyset( &statsSignals );
+	sigaddset( &statsSignals, SIGUSR1 );
+	sigaddset( &statsSignals, SIGUSR2 );
 
-		if (!navdata_ready && navdata_size > 0) {
-			navdata_ready = true;
-			printf("Navdata READY!\n");
+	for(;;)
+	{
+		int sig;
+		if( sigwait( &statsSignals, &sig ) != 0 )
+		{
+			continue;
 		}
 
+		if( sig == SIGUSR2 )
+		{
+			traceDumpFile();
+		}
+		else
+		{
+			printAllStats( stdout );
+		}
+		fflush( stdout );
 	}
 
 	pthread_exit( NULL );
 }
 
 void printAngles() {
+	NavdataSample sample;
+	if (navdataHistoryLatest(&navdataHistory, &sample) < 0) {
+		return;
+	}
+
 	printf("drone's position:\n");
-	printf("\t%13.3f:%s\n", navdata_struct.navdata_option.theta, "pitch angle");
-	printf("\t%13.3f:%s\n", navdata_struct.navdata_option.phi, "roll  angle");
-	printf("\t%13.3f:%s\n", navdata_struct.navdata_option.psi, "yaw   angle");
+	printf("\t%13.3f:%s\n", sample.theta, "pitch angle");
+	printf("\t%13.3f:%s\n", sample.phi, "roll  angle");
+	printf("\t%13.3f:%s\n", sample.psi, "yaw   angle");
 	printf("\n");
 }
 
 void printState() {
-	printf("drone's state:\n");
-	printf("\t%13d:%s\n",(navdata_struct.navdata_header.state & (1 <<  0))!=0, "FLY MASK");
-	printf("\t%13d:%s\n",(navdata_struct.navdata_header.state & (1 <<  1))!=0, "VIDEO MASK");
-	printf("\t%13d:%s\n",(navdata_struct.navdata_header.state & (1 <<  2))!=0, "VISION MASK");
-	printf("\t%13d:%s\n",(navdata_struct.navdata_header.state & (1 <<  3))!=0, "CONTROL ALGO");
-	printf("\t%13d:%s\n",(navdata_struct.navdata_header.state & (1 <<  4))!=0, "ALTITUDE CONTROL ALGO");
-	printf("\t%13d:%s\n",(navdata_struct.navdata_header.state & (1 <<  5))!=0, "USER feedback");
-	printf("\t%13d:%s\n",(navdata_struct.navdata_header.state & (1 <<  6))!=0, "Control command ACK");
-	printf("\t%13d:%s\n",(navdata_struct.navdata_header.state & (1 <<  7))!=0, "Trim command ACK");
-	printf("\t%13d:%s\n",(navdata_struct.navdata_header.state & (1 <<  8))!=0, "Trim running");
-	printf("\t%13d:%s\n",(navdata_struct.navdata_header.state & (1 <<  9))!=0, "Trim result");
-	printf("\t%13d:%s\n",(navdata_struct.navdata_header.state & (1 << 10))!=0, "Navdata demo");
-	printf("\t%13d:%s\n",(navdata_struct.navdata_header.state & (1 << 11))!=0, "Navdata bootstrap");
-	printf("\t%13d:%s\n",(navdata_struct.navdata_header.state & (1 << 12))!=0, "Motors status");
-	printf("\t%13d:%s\n",(navdata_struct.navdata_header.state & (1 << 13))!=0, "Communication Lost");
-	printf("\t%13d:%s\n",(navdata_struct.navdata_header.state & (1 << 14))!=0, "problem with gyrometers");
-	printf("\t%13d:%s\n",(navdata_struct.navdata_header.state & (1 << 15))!=0, "VBat low");
-	printf("\t%13d:%s\n",(navdata_struct.navdata_header.state & (1 << 16))!=0, "VBat high");
-	printf("\t%13d:%s\n",(navdata_struct.navdata_header.state & (1 << 17))!=0, "Timer elapsed");
-	printf("\t%13d:%s\n",(navdata_struct.navdata_header.state & (1 << 18))!=0, "Power");
-	printf("\t%13d:%s\n",(navdata_struct.navdata_header.state & (1 << 19))!=0, "Angles");
-	printf("\t%13d:%s\n",(navdata_struct.navdata_header.state & (1 << 20))!=0, "Wind");
-	printf("\t%13d:%s\n",(navdata_struct.navdata_header.state & (1 << 21))!=0, "Ultrasonic sensor");
-	printf("\t%13d:%s\n",(navdata_struct.navdata_header.state & (1 << 22))!=0, "Cutout system detection");
-	printf("\t%13d:%s\n",(navdata_struct.navdata_header.state & (1 << 23))!=0, "PIC Version number OK");
-	printf("\t%13d:%s\n",(navdata_struct.navdata_header.state & (1 << 24))!=0, "ATCodec thread");
-	printf("\t%13d:%s\n",(navdata_struct.navdata_header.state & (1 << 25))!=0, "Navdata thread");
-	printf("\t%13d:%s\n",(navdata_struct.navdata_header.state & (1 << 26))!=0, "Video thread");
-	printf("\t%13d:%s\n",(navdata_struct.navdata_header.state & (1 << 27))!=0, "Acquisition thread");
-	printf("\t%13d:%s\n",(navdata_struct.navdata_header.state & (1 << 28))!=0, "CTRL watchdog");
-	printf("\t%13d:%s\n",(navdata_struct.navdata_header.state & (1 << 29))!=0, "ADC Watchdog");
-	printf("\t%13d:%s\n",(navdata_struct.navdata_header.state & (1 << 30))!=0, "Communication Watchdog");
-	printf("\t%13d:%s\n",(navdata_struct.navdata_header.state & (1 << 31))!=0, "Emergency landing");
-}
-
-/**
- * @param theta - number between 0 to 360
- */
-void rotate(double theta) {
-	double initialYaw = navdata_struct.navdata_option.psi;
-	double finalYaw = initialYaw + 1000*theta;
-	double curYaw = initialYaw;
-	printf("Initial: %f\n", initialYaw);
-	printf("Final: %f\n", finalYaw);
-	if (theta > 0) {
-		//Going right
-		while (curYaw < finalYaw && curYaw < MAX_YAW) {
-			//droneRotateRight(); 
-			sleep(1);
-			curYaw = navdata_struct.navdata_option.psi;
-			printf("Cur: %f\n", curYaw);
-		}
-		// Gone past the +180
-		if (finalYaw > MAX_YAW) {
-			finalYaw = MIN_YAW + (finalYaw - MAX_YAW);
-			printf("Overshot going to %f\n", finalYaw);
-			while (curYaw < finalYaw) {
-				//droneRotateRight(); 
-				sleep(1);
-				curYaw = navdata_struct.navdata_option.psi;
-				printf("Cur: %f\n", curYaw);
-			}
-		}
-	} else {
-		//Going left
-		while (curYaw > finalYaw && curYaw > MIN_YAW) {
-			//droneRotateLeft(); 
-			sleep(1);
-			curYaw = navdata_struct.navdata_option.psi;
-			printf("Cur: %f\n", curYaw);
-		}
-		// Gone past the +180
-		if (finalYaw < MIN_YAW) {
-			finalYaw = MAX_YAW + (finalYaw + MIN_YAW);
-			printf("Undershot going to %f\n", finalYaw);
-			while (curYaw < finalYaw) {
-				//droneRotateRight(); 
-				sleep(1);
-				curYaw = navdata_struct.navdata_option.psi;
-				printf("Cur: %f\n", curYaw);
-			}
-		}
+	NavdataSample sample;
+	if (navdataHistoryLatest(&navdataHistory, &sample) < 0) {
+		return;
+	}
+
+	printDroneState(stdout, sample.state);
+}
+
+void logStateChange( const DroneStateEvent *event, void *arg )
+{
+	printf( "Drone state: %s %s.\n", droneStateBitName( event->bit ), event->set ? "set" : "cleared" );
+}
+
+// With -o, reorders a route from Android for the shortest flight, starting
+// from the drone's current fix if fromFix and it has a position. Returns
+// route itself otherwise. Either way only the first AUTOPILOT_MAX_WAYPOINTS,
+// as sent, are kept, and *count is cut to match. Only the Android command
+// thread calls it.
+static const GpsPoint *optimiseRoute( const GpsPoint *route, unsigned int *count, int fromFix )
+{
+	static GpsPoint points[AUTOPILOT_MAX_WAYPOINTS + 1];
+	static GpsPoint ordered[AUTOPILOT_MAX_WAYPOINTS];
+	static unsigned int order[AUTOPILOT_MAX_WAYPOINTS + 1];
+
+	if( *count > AUTOPILOT_MAX_WAYPOINTS )
+	{
+		fprintf( stderr, "Route too long, keeping the first %d waypoints.\n", AUTOPILOT_MAX_WAYPOINTS );
+		*count = AUTOPILOT_MAX_WAYPOINTS;
+	}
+	if( routeBudgetMs < 0 || *count < 2 )
+	{
+		return route;
+	}
+
+	// currGpsFix is NaN before the first fix and whenever the receiver
+	// loses it, and a NaN start makes every length NaN.
+	unsigned int first = 0;
+	if( fromFix )
+	{
+		pthread_mutex_lock( &gpsFixMutex );
+		points[0] = currGpsFix;
+		pthread_mutex_unlock( &gpsFixMutex );
+		first = !isnan( points[0].latitude ) && !isnan( points[0].longitude );
+	}
+	memcpy( &points[first], route, *count * sizeof( GpsPoint ) );
+
+	RouteOptions options = { first, 0, routeWorkers, routeBudgetMs, monotonicNs() };
+	RouteStats stats;
+	routeOptimise( points, *count + first, &options, order, &stats );
+
+	unsigned int i;
+	for( i = 0; i < *count; i++ )
+	{
+		ordered[i] = points[order[first + i]];
 	}
-	netYaw += theta;
+	printf( "Route reordered in %.1f ms: %.0f m as sent, %.0f m now.\n",
+		( stats.matrixNs + stats.searchNs ) / 1e6, stats.givenLength * 1000, stats.length * 1000 );
+	return ordered;
+}
+
+void setRoute( const GpsPoint *route, unsigned int count, void *arg )
+{
+	const GpsPoint *ordered = optimiseRoute( route, &count, useGps );
+	autopilotPostRoute( &autopilot, ordered, count );
+}
+
+// The drones are all in different places, so neither end is fixed.
+void setFleetRoute( const GpsPoint *route, unsigned int count, void *arg )
+{
+	const GpsPoint *ordered = optimiseRoute( route, &count, 0 );
+	fleetPostRoute( (Fleet *)arg, ordered, count );
+}
+
+// Manual commands go out on the same socket and sequence counter as the
+// autopilot's, so handing control back and forth needs no resynchronisation.
+void startManualControl( void *arg )
+{
+	autopilotPostType( &autopilot, AUTOPILOT_EVENT_MANUAL_START );
 }
 
+void endManualControl( void *arg )
+{
+	autopilotPostType( &autopilot, AUTOPILOT_EVENT_MANUAL_END );
+}
+
+void printUsage( const char *program )
+{
+	printf( "Usage: %s [-a ip] [-g] [-r rate] [-p priority] [-c cpu] [-m] [-e] [-t] [-o ms]\n", program );
+	printf( "       %s -f count [-a first ip] [-w workers] [-d seconds] [-r rate] [-p priority] [-m] [-t] [-o ms]\n", program );
+	printf( "  -a ip        drone address, default %s.\n", DRONE_IP );
+	printf( "  -g           read GPS fixes from usbgps.\n" );
+	printf( "  -r rate      autopilot control loop rate in Hz, default %.0f.\n", AUTOPILOT_DEFAULT_RATE );
+	printf( "  -p priority  run the control loop at this SCHED_FIFO priority.\n" );
+	printf( "  -c cpu       pin the control loop to this CPU.\n" );
+	printf( "  -m           lock all memory with mlockall().\n" );
+	printf( "  -e           run everything on one thread from a single epoll loop.\n" );
+	printf( "  -t           record trace events; SIGUSR2 writes them to\n" );
+	printf( "               argps-trace-<pid>.json for chrome://tracing or Perfetto.\n" );
+	printf( "  -o ms        reorder Android routes for the shortest flight, from the\n" );
+	printf( "               current fix with -g, improving for up to ms (%d is a good\n", ROUTE_DEFAULT_BUDGET_MS );
+	printf( "               start; 0 with -e). Fleet and mission modes take it too.\n" );
+	printf( "  -f count     fleet mode: fly count drones at consecutive addresses,\n" );
+	printf( "               %.0f Hz by default. Routes from Android go to every drone.\n", FLEET_DEFAULT_RATE );
+	printf( "  -a ip        address of the first fleet drone.\n" );
+	printf( "  -w workers   fleet worker threads, default one per CPU.\n" );
+	printf( "  -d seconds   fleet benchmark: fly every drone for this long, print\n" );
+	printf( "               the tick timing and exit.\n" );
+	printf( "       %s -s missions [-x seed] [-n waypoints] [-w workers] [-d seconds] [-r rate] [-o ms]\n", program );
+	printf( "  -s missions  fly this many random missions against a simulated drone on\n" );
+	printf( "               a virtual clock, as fast as possible, and exit with failure\n" );
+	printf( "               if any didn't complete. The same seeds give the same flights.\n" );
+	printf( "  -x seed      seed of the first mission, default 1; one more for each next.\n" );
+	printf( "  -n waypoints waypoints per mission, default %d.\n", MISSION_DEFAULT_WAYPOINTS );
+	printf( "  -w workers   mission threads, default one per CPU.\n" );
+	printf( "  -d seconds   simulated time before a mission fails, default %d.\n", MISSION_DEFAULT_SECONDS );
+	printf( "  -o ms        reorder each mission's waypoints from take-off first.\n" );
+	printf( "       %s -b points [-x seed] [-w workers] [-o ms]\n", program );
+	printf( "  -b points    route optimiser benchmark: order this many random points,\n" );
+	printf( "               up to %d, with free and with fixed ends and exit.\n", ROUTE_MAX_POINTS );
+	printf( "  -w workers   optimiser threads, default one per CPU.\n" );
+	printf( "  -o ms        improvement time, default %d.\n", ROUTE_DEFAULT_BUDGET_MS );
+	printf( "Prometheus metrics are served on 127.0.0.1:%s.\n", MAIN_METRICS_PORT );
+}
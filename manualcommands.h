@@ -0,0 +1,39 @@
+// Generated by gen-manual-commands.py, do not edit.
+#ifndef _MANUAL_COMMANDS_H_
+#define _MANUAL_COMMANDS_H_
+
+#include <stddef.h>
+
+#include "command.h"
+
+#define MANUAL_COMMAND_SEED 0x00000025U
+#define MANUAL_COMMAND_TABLE_BITS 4
+#define MANUAL_COMMAND_TABLE_SIZE ( 1 << MANUAL_COMMAND_TABLE_BITS )
+
+typedef struct
+{
+	const char	*name;
+	void		( *handler )();
+} ManualCommand;
+
+static const ManualCommand manualCommands[MANUAL_COMMAND_TABLE_SIZE] =
+{
+	{ "cmd moveback", droneBack },	// 0
+	{ "cmd moveforward", droneForward },	// 1
+	{ "cmd movedown", droneDown },	// 2
+	{ "cmd moveright", droneRight },	// 3
+	{ "cmd moveleft", droneLeft },	// 4
+	{ "cmd moveup", droneUp },	// 5
+	{ "cmd takeoff", droneTakeOff },	// 6
+	{ NULL, NULL },	// 7
+	{ NULL, NULL },	// 8
+	{ NULL, NULL },	// 9
+	{ "cmd land", droneLand },	// 10
+	{ NULL, NULL },	// 11
+	{ NULL, NULL },	// 12
+	{ NULL, NULL },	// 13
+	{ "cmd turnright", droneRotateRight },	// 14
+	{ "cmd turnleft", droneRotateLeft },	// 15
+};
+
+#endif
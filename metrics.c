@@ -0,0 +1,340 @@
+#define _GNU_SOURCE
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "metrics.h"
+
+#define METRICS_REQUEST_SIZE 4096
+
+typedef enum
+{
+	SOURCE_VALUE,		// _Atomic uint64_t
+	SOURCE_READER,		// MetricReader
+	SOURCE_HISTOGRAM,	// Histogram
+	SOURCE_COLLECTOR	// MetricCollector
+} MetricSource;
+
+typedef struct
+{
+	const char			*name;
+	const char			*labels;
+	const char			*help;
+	MetricType			type;
+	MetricSource		source;
+	_Atomic uint64_t	*value;
+	MetricReader		read;
+	MetricCollector		collect;
+	void				*arg;
+	const Histogram		*histogram;
+	double				scale;
+} Metric;
+
+static const char *typeNames[] = { "counter", "gauge", "histogram" };
+
+// Entries are filled in under the mutex, then published by bumping
+// numMetrics, so rendering never takes the lock.
+static Metric metrics[METRICS_MAX];
+static _Atomic unsigned int numMetrics = 0;
+static pthread_mutex_t registerMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void registerMetric( const Metric *metric )
+{
+	pthread_mutex_lock( &registerMutex );
+	unsigned int count = atomic_load_explicit( &numMetrics, memory_order_relaxed );
+	if( count == METRICS_MAX )
+	{
+		pthread_mutex_unlock( &registerMutex );
+		fprintf( stderr, "Metrics registry full, not exporting %s.\n", metric->name ? metric->name : "a collector" );
+		return;
+	}
+
+	metrics[count] = *metric;
+	atomic_store_explicit( &numMetrics, count + 1, memory_order_release );
+	pthread_mutex_unlock( &registerMutex );
+}
+
+void metricsCounter( const char *name, const char *labels, const char *help, _Atomic uint64_t *value )
+{
+	Metric metric = { name, labels, help, METRIC_COUNTER, SOURCE_VALUE, value };
+	registerMetric( &metric );
+}
+
+void metricsGauge( const char *name, const char *labels, const char *help, _Atomic uint64_t *value )
+{
+	Metric metric = { name, labels, help, METRIC_GAUGE, SOURCE_VALUE, value };
+	registerMetric( &metric );
+}
+
+void metricsGaugeReader( const char *name, const char *labels, const char *help, MetricReader read, void *arg )
+{
+	Metric metric = { name, labels, help, METRIC_GAUGE, SOURCE_READER };
+	metric.read = read;
+	metric.arg = arg;
+	registerMetric( &metric );
+}
+
+void metricsHistogram( const char *name, const char *labels, const char *help, const Histogram *histogram, double scale )
+{
+	Metric metric = { name, labels, help, METRIC_HISTOGRAM, SOURCE_HISTOGRAM };
+	metric.histogram = histogram;
+	metric.scale = scale;
+	registerMetric( &metric );
+}
+
+void metricsCollector( MetricCollector collect, void *arg )
+{
+	Metric metric = { NULL, NULL, NULL, METRIC_GAUGE, SOURCE_COLLECTOR };
+	metric.collect = collect;
+	metric.arg = arg;
+	registerMetric( &metric );
+}
+
+void metricsWriteHeader( FILE *out, const char *name, MetricType type, const char *help )
+{
+	fprintf( out, "# HELP %s %s\n", name, help );
+	fprintf( out, "# TYPE %s %s\n", name, typeNames[type] );
+}
+
+// printf() spells these "nan" and "inf", Prometheus wants "NaN" and "+Inf".
+static void formatValue( char *text, size_t size, double value )
+{
+	if( isnan( value ) )
+	{
+		snprintf( text, size, "NaN" );
+	}
+	else if( isinf( value ) )
+	{
+		snprintf( text, size, value > 0 ? "+Inf" : "-Inf" );
+	}
+	else
+	{
+		snprintf( text, size, "%.15g", value );
+	}
+}
+
+void metricsWriteSample( FILE *out, const char *name, const char *labels, double value )
+{
+	char text[32];
+	formatValue( text, sizeof( text ), value );
+
+	if( labels != NULL )
+	{
+		fprintf( out, "%s{%s} %s\n", name, labels, text );
+	}
+	else
+	{
+		fprintf( out, "%s %s\n", name, text );
+	}
+}
+
+// Buckets are cumulative and end at each power of two, where the
+// histogram's own sub-buckets line up exactly, so nothing is estimated.
+void metricsWriteHistogram( FILE *out, const char *name, const char *labels, const Histogram *histogram, double scale )
+{
+	const char *prefix = ( labels != NULL ) ? labels : "";
+	const char *separator = ( labels != NULL ) ? "," : "";
+	char series[256];
+	uint64_t cumulative = 0;
+	unsigned int i;
+
+	for( i = 0; i < HISTOGRAM_BUCKETS; i++ )
+	{
+		cumulative += atomic_load_explicit( &histogram->counts[i], memory_order_relaxed );
+		if( ( i & ( ( 1U << HISTOGRAM_SUB_BITS ) - 1 ) ) == ( 1U << HISTOGRAM_SUB_BITS ) - 1 )
+		{
+			fprintf( out, "%s_bucket{%s%sle=\"%.10g\"} %llu\n", name, prefix, separator,
+				histogramBucketLimit( i ) * scale, (unsigned long long)cumulative );
+		}
+	}
+	fprintf( out, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, prefix, separator, (unsigned long long)cumulative );
+
+	snprintf( series, sizeof( series ), "%s_sum", name );
+	metricsWriteSample( out, series, labels, atomic_load_explicit( &histogram->sum, memory_order_relaxed ) * scale );
+	snprintf( series, sizeof( series ), "%s_count", name );
+	metricsWriteSample( out, series, labels, cumulative );
+}
+
+void metricsRender( FILE *out )
+{
+	unsigned int count = atomic_load_explicit( &numMetrics, memory_order_acquire );
+	const char *family = NULL;
+	unsigned int i;
+
+	for( i = 0; i < count; i++ )
+	{
+		Metric *metric = &metrics[i];
+		if( metric->source == SOURCE_COLLECTOR )
+		{
+			metric->collect( out, metric->arg );
+			family = NULL;
+			continue;
+		}
+
+		if( family == NULL || strcmp( family, metric->name ) != 0 )
+		{
+			metricsWriteHeader( out, metric->name, metric->type, metric->help );
+			family = metric->name;
+		}
+
+		switch( metric->source )
+		{
+		case SOURCE_VALUE:
+			metricsWriteSample( out, metric->name, metric->labels, atomic_load_explicit( metric->value, memory_order_relaxed ) );
+			break;
+		case SOURCE_READER:
+			metricsWriteSample( out, metric->name, metric->labels, metric->read( metric->arg ) );
+			break;
+		case SOURCE_HISTOGRAM:
+			metricsWriteHistogram( out, metric->name, metric->labels, metric->histogram, metric->scale );
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+int metricsServerOpen( const char *port )
+{
+	struct sockaddr_in myaddr;
+
+	int listenfd = socket( PF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+	if( listenfd == -1 )
+	{
+		printf( "Metrics server: socket() failure, errno = %d\n", errno );
+		return -1;
+	}
+
+	int yes = 1;
+	if( setsockopt( listenfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof( int ) ) == -1 )
+	{
+		printf( "Metrics server: setsockopt() failure, errno = %d\n", errno );
+		close( listenfd );
+		return -1;
+	}
+
+	// Local only: anything remote goes through whatever scrapes this.
+	memset( &myaddr, 0, sizeof( myaddr ) );
+	myaddr.sin_family = AF_INET;
+	myaddr.sin_port = htons( atoi( port ) );
+	myaddr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+
+	if( bind( listenfd, (struct sockaddr *)&myaddr, sizeof( myaddr ) ) == -1 )
+	{
+		printf( "Metrics server: bind() failure, errno = %d\n", errno );
+		close( listenfd );
+		return -1;
+	}
+
+	if( listen( listenfd, 8 ) == -1 )
+	{
+		printf( "Metrics server: listen() failure, errno = %d\n", errno );
+		close( listenfd );
+		return -1;
+	}
+
+	return listenfd;
+}
+
+// Reads until the blank line ending the request headers, or the timeout.
+// The request itself doesn't matter: every path gets the metrics.
+static void readRequest( int fd )
+{
+	char request[METRICS_REQUEST_SIZE];
+	size_t length = 0;
+
+	struct timeval timeout;
+	timeout.tv_sec = METRICS_REQUEST_TIMEOUT_MS / 1000;
+	timeout.tv_usec = ( METRICS_REQUEST_TIMEOUT_MS % 1000 ) * 1000;
+	setsockopt( fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof( timeout ) );
+
+	while( length < sizeof( request ) - 1 )
+	{
+		ssize_t size = recv( fd, request + length, sizeof( request ) - 1 - length, 0 );
+		if( size <= 0 )
+		{
+			return;
+		}
+		length += size;
+		request[length] = '\0';
+		if( strstr( request, "\r\n\r\n" ) != NULL || strstr( request, "\n\n" ) != NULL )
+		{
+			return;
+		}
+	}
+}
+
+void metricsServerHandle( int listenfd )
+{
+	int fd = accept4( listenfd, NULL, NULL, SOCK_CLOEXEC );
+	if( fd < 0 )
+	{
+		if( errno != EINTR )
+		{
+			printf( "Metrics server: accept() failure, errno = %d\n", errno );
+		}
+		return;
+	}
+
+	readRequest( fd );
+
+	// Rendered in full first so the reply carries a Content-Length.
+	char *body = NULL;
+	size_t bodyLength = 0;
+	FILE *out = open_memstream( &body, &bodyLength );
+	if( out == NULL )
+	{
+		close( fd );
+		return;
+	}
+	metricsRender( out );
+	fclose( out );
+
+	char header[128];
+	int headerLength = snprintf( header, sizeof( header ),
+		"HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", bodyLength );
+
+	if( send( fd, header, headerLength, MSG_NOSIGNAL ) == headerLength )
+	{
+		size_t sent = 0;
+		while( sent < bodyLength )
+		{
+			ssize_t size = send( fd, body + sent, bodyLength - sent, MSG_NOSIGNAL );
+			if( size <= 0 )
+			{
+				break;
+			}
+			sent += size;
+		}
+	}
+
+	free( body );
+	close( fd );
+}
+
+void *metricsServer( void *arg )
+{
+	int listenfd = metricsServerOpen( (const char *)arg );
+	if( listenfd < 0 )
+	{
+		printf( "Metrics server: not serving metrics on port %s.\n", (const char *)arg );
+		return NULL;
+	}
+
+	for(;;)
+	{
+		metricsServerHandle( listenfd );
+	}
+
+	close( listenfd );
+	pthread_exit( NULL );
+}
@@ -0,0 +1,69 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "histogram.h"
+
+#define METRICS_MAX 256				// Registrations, not samples: a collector counts once.
+#define METRICS_REQUEST_TIMEOUT_MS 1000	// Give up on a scraper that sends no request.
+
+// The registry only holds pointers to counters the subsystems already keep,
+// so recording stays a single atomic add (or a plain store for single
+// writers) on the hot path. Everything is read when a scrape comes in.
+// Recording into a counter only one thread ever writes: a relaxed load and
+// store, which readers on other threads see whole, instead of a locked add.
+#define COUNT( counter ) ADD( counter, 1 )
+#define ADD( counter, n ) atomic_store_explicit( &( counter ), atomic_load_explicit( &( counter ), memory_order_relaxed ) + ( n ), memory_order_relaxed )
+
+typedef enum
+{
+	METRIC_COUNTER,
+	METRIC_GAUGE,
+	METRIC_HISTOGRAM
+} MetricType;
+
+// Computes a gauge at scrape time, e.g. the age of the latest fix.
+typedef double (*MetricReader)( void *arg );
+
+// Writes a whole family with the metricsWrite*() functions, for statistics
+// that have to be merged before they can be read, like per-thread counters.
+typedef void (*MetricCollector)( FILE *out, void *arg );
+
+// Registration. name is a Prometheus metric name, labels either NULL or
+// the inside of the braces, e.g. "type=\"takeoff\"". Register every label
+// set of a name one after the other so the family is written together.
+// Histograms are in whatever unit they were recorded in, times scale
+// (1e-9 turns nanoseconds into the seconds Prometheus expects). Pointers
+// must stay valid for the life of the program. Safe from any thread.
+void metricsCounter( const char *name, const char *labels, const char *help, _Atomic uint64_t *value );
+void metricsGauge( const char *name, const char *labels, const char *help, _Atomic uint64_t *value );
+void metricsGaugeReader( const char *name, const char *labels, const char *help, MetricReader read, void *arg );
+void metricsHistogram( const char *name, const char *labels, const char *help, const Histogram *histogram, double scale );
+void metricsCollector( MetricCollector collect, void *arg );
+
+// For collectors.
+void metricsWriteHeader( FILE *out, const char *name, MetricType type, const char *help );
+void metricsWriteSample( FILE *out, const char *name, const char *labels, double value );
+void metricsWriteHistogram( FILE *out, const char *name, const char *labels, const Histogram *histogram, double scale );
+
+// Writes every registered metric in the Prometheus text exposition format.
+void metricsRender( FILE *out );
+
+// Listens on 127.0.0.1:port for HTTP scrapes. Returns the listening
+// socket, or -1 on failure, e.g. when the port is taken.
+int metricsServerOpen( const char *port );
+
+// Accepts one connection on the listening socket and answers it with
+// metricsRender(), whatever the request. Blocks for at most
+// METRICS_REQUEST_TIMEOUT_MS waiting for the request.
+void metricsServerHandle( int listenfd );
+
+// Thread function, arg is the port as a string. Metrics are optional, so
+// if the port can't be opened it says so and returns, and the process
+// carries on without them.
+void *metricsServer( void *arg );
+
+#endif
@@ -0,0 +1,391 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "missionsim.h"
+#include "command.h"
+#include "dronesim.h"
+#include "dronestate.h"
+#include "navdata.h"
+#include "navhistory.h"
+#include "routeopt.h"
+#include "timeutil.h"
+#include "trace.h"
+
+#define PI 3.14159265358979323846
+#define EARTH_RADIUS_M 6371000.0
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+#define MISSION_EPOCH_NS NSEC_PER_SEC	// Where the virtual clock starts.
+#define MISSION_MAX_REPORTS 10			// Failed missions listed by seed.
+
+// Everything main keeps for its drone, plus the drone itself and the clock.
+typedef struct
+{
+	uint64_t			now;
+	DroneSim			drone;
+	DroneLink			link;
+	Autopilot			autopilot;
+	NavdataHistory		history;
+	DroneStateDecoder	state;
+	uint64_t			digest;
+} Mission;
+
+typedef struct
+{
+	const MissionSpec	*spec;
+	uint64_t			firstSeed;
+	unsigned int		count;
+	_Atomic unsigned int	next;		// Next mission to hand out.
+	MissionResult		*results;
+} MissionQueue;
+
+// Commands reach the simulated drone as soon as they are sent.
+static void deliverCommand( const char *cmd, size_t length, void *arg )
+{
+	Mission *mission = (Mission *)arg;
+	size_t i;
+	for( i = 0; i < length; i++ )
+	{
+		mission->digest = ( mission->digest ^ (uint8_t)cmd[i] ) * FNV_PRIME;
+	}
+	droneSimCommand( &mission->drone, cmd, length );
+}
+
+// What main's handleNavdata() does with one packet, straight from the model.
+static void feedNavdata( Mission *mission )
+{
+	uint8_t buffer[NAVDATA_MAX_PACKET_SIZE];
+	size_t length = droneSimNavdata( &mission->drone, buffer, sizeof( buffer ) );
+
+	navdata_packet_t packet;
+	if( parseNavdata( buffer, length, &packet ) != NAVDATA_OK )
+	{
+		fprintf( stderr, "Simulated navdata didn't parse.\n" );
+		return;
+	}
+	droneStateUpdate( &mission->state, packet.header->state, mission->now );
+	navdataHistoryPushPacket( &mission->history, &packet, mission->now );
+}
+
+// Uniform in [0, 1) from a splitmix64 sequence.
+static double nextRandom( uint64_t *state )
+{
+	uint64_t z = ( *state += 0x9e3779b97f4a7c15ULL );
+	z = ( z ^ ( z >> 30 ) ) * 0xbf58476d1ce4e5b9ULL;
+	z = ( z ^ ( z >> 27 ) ) * 0x94d049bb133111ebULL;
+	z ^= z >> 31;
+	return ( z >> 11 ) * ( 1.0 / 9007199254740992.0 );
+}
+
+// Waypoints spread evenly over a disc around origin.
+static void randomRoute( uint64_t seed, GpsPoint origin, GpsPoint *waypoints, unsigned int count )
+{
+	uint64_t state = seed;
+	unsigned int i;
+	for( i = 0; i < count; i++ )
+	{
+		double r = MISSION_RADIUS * sqrt( nextRandom( &state ) );
+		double angle = 2.0 * PI * nextRandom( &state );
+		double north = r * cos( angle );
+		double east = r * sin( angle );
+		waypoints[i].latitude = origin.latitude + ( north / EARTH_RADIUS_M ) * 180.0 / PI;
+		waypoints[i].longitude = origin.longitude + ( east / ( EARTH_RADIUS_M * cos( origin.latitude * PI / 180.0 ) ) ) * 180.0 / PI;
+	}
+}
+
+// From take-off, on this thread and with no time budget, so the order
+// depends only on the waypoints.
+static void reorderRoute( GpsPoint origin, GpsPoint *waypoints, unsigned int count )
+{
+	GpsPoint points[AUTOPILOT_MAX_WAYPOINTS + 1];
+	unsigned int order[AUTOPILOT_MAX_WAYPOINTS + 1];
+	RouteOptions options = { 1, 0, 1, 0, 0 };
+
+	points[0] = origin;
+	memcpy( &points[1], waypoints, count * sizeof( GpsPoint ) );
+	routeOptimise( points, count + 1, &options, order, NULL );
+
+	unsigned int i;
+	for( i = 0; i < count; i++ )
+	{
+		waypoints[i] = points[order[i + 1]];
+	}
+}
+
+static uint64_t threadCpuNs()
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_THREAD_CPUTIME_ID, &ts );
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t earliest( uint64_t a, uint64_t b )
+{
+	return ( a < b ) ? a : b;
+}
+
+void missionSimRun( const MissionSpec *spec, MissionResult *result )
+{
+	uint64_t cpuStart = threadCpuNs();
+	Mission *mission = calloc( 1, sizeof( Mission ) );
+	if( mission == NULL )
+	{
+		fprintf( stderr, "Couldn't allocate mission.\n" );
+		exit( EXIT_FAILURE );
+	}
+
+	// From here on monotonicNs() on this thread, and so every timestamp in
+	// the autopilot, command and navdata code, reads mission->now.
+	mission->now = MISSION_EPOCH_NS;
+	mission->digest = FNV_OFFSET;
+	setThreadClock( &mission->now );
+
+	GpsPoint origin = { 38.954352, -95.252811 };	// Allen Fieldhouse, like dummyserver.
+	droneSimInit( &mission->drone, origin, spec->seed );
+	mission->drone.gpsNoise = MISSION_GPS_NOISE;
+	droneLinkOpenSink( &mission->link, "sim", deliverCommand, mission );
+	autopilotInit( &mission->autopilot, &spec->config );
+	mission->autopilot.link = &mission->link;
+	mission->autopilot.quiet = 1;
+	navdataHistoryInit( &mission->history );
+	droneStateInit( &mission->state );
+	droneStateSubscribe( &mission->state, AUTOPILOT_SAFETY_EVENTS, autopilotSafetyEvent, &mission->autopilot );
+
+	GpsPoint waypoints[AUTOPILOT_MAX_WAYPOINTS];
+	unsigned int numWaypoints = ( spec->numWaypoints < AUTOPILOT_MAX_WAYPOINTS ) ? spec->numWaypoints : AUTOPILOT_MAX_WAYPOINTS;
+	randomRoute( spec->seed, origin, waypoints, numWaypoints );
+	if( spec->optimiseRoute )
+	{
+		reorderRoute( origin, waypoints, numWaypoints );
+	}
+
+	// What the navdata session does once the drone answers, then the route
+	// arriving from Android.
+	droneLinkEnableDemo( &mission->link );
+	autopilotPostRoute( &mission->autopilot, waypoints, numWaypoints );
+
+	uint64_t start = mission->now;
+	uint64_t end = start + (uint64_t)( spec->maxSeconds * NSEC_PER_SEC );
+	uint64_t navdataPeriod = NSEC_PER_SEC / MISSION_NAVDATA_RATE;
+	uint64_t fixPeriod = NSEC_PER_SEC / MISSION_GPS_RATE;
+	uint64_t nextNavdata = start;
+	uint64_t nextFix = start;
+	uint64_t nextTick = autopilotStep( &mission->autopilot );
+
+	AutopilotState last = autopilotState( &mission->autopilot );
+	unsigned int reached = 0;
+	double distance = 0;
+	int done = 0;
+
+	// Jump from one scheduled event to the next, moving the drone in
+	// between. Nothing depends on how long any of it really takes.
+	while( mission->now < end && !done )
+	{
+		uint64_t keepAlive = atomic_load_explicit( &mission->link.lastSent, memory_order_relaxed ) + KEEPALIVE_IDLE_MS * NSEC_PER_MSEC;
+		uint64_t next = earliest( earliest( nextTick, nextNavdata ), earliest( nextFix, earliest( keepAlive, end ) ) );
+
+		while( mission->now < next )
+		{
+			uint64_t step = earliest( next - mission->now, MISSION_PHYSICS_MS * NSEC_PER_MSEC );
+			double x = mission->drone.x;
+			double y = mission->drone.y;
+			droneSimStep( &mission->drone, step / (double)NSEC_PER_SEC );
+			distance += hypot( mission->drone.x - x, mission->drone.y - y );
+			mission->now += step;
+		}
+
+		if( mission->now >= nextNavdata )
+		{
+			feedNavdata( mission );
+			nextNavdata += navdataPeriod;
+		}
+		if( mission->now >= nextFix )
+		{
+			GpsPoint fix = droneSimPosition( &mission->drone );
+			autopilotUpdateFix( &mission->autopilot, &fix );
+			nextFix += fixPeriod;
+		}
+		if( mission->now >= keepAlive )
+		{
+			droneLinkKeepAlive( &mission->link );
+		}
+		nextTick = autopilotStep( &mission->autopilot );
+
+		AutopilotState state = autopilotState( &mission->autopilot );
+		if( state == AUTOPILOT_ARRIVE && last != AUTOPILOT_ARRIVE )
+		{
+			reached++;
+		}
+		done = ( state == AUTOPILOT_IDLE );
+		last = state;
+	}
+
+	result->seed = spec->seed;
+	result->reached = reached;
+	result->completed = done && reached == numWaypoints && !mission->drone.flying && !mission->drone.emergency;
+	result->seconds = ( mission->now - start ) / (double)NSEC_PER_SEC;
+	result->distance = distance;
+	result->battery = 100.0 - mission->drone.battery;
+	result->commands = mission->drone.commandsAccepted;
+	result->ticks = atomic_load( &mission->autopilot.timing.ticks );
+	result->digest = mission->digest;
+
+	autopilotClose( &mission->autopilot );
+	setThreadClock( NULL );
+	free( mission );
+	result->cpuNs = threadCpuNs() - cpuStart;
+}
+
+static void *missionWorkerRun( void *arg )
+{
+	MissionQueue *queue = (MissionQueue *)arg;
+	traceThreadName( "mission" );
+
+	for(;;)
+	{
+		unsigned int i = atomic_fetch_add( &queue->next, 1 );
+		if( i >= queue->count )
+		{
+			break;
+		}
+
+		MissionSpec spec = *queue->spec;
+		spec.seed = queue->firstSeed + i;
+		missionSimRun( &spec, &queue->results[i] );
+	}
+	return NULL;
+}
+
+void missionSimRunAll( const MissionSpec *spec, uint64_t firstSeed, unsigned int count, unsigned int workers, MissionResult *results )
+{
+	if( workers == 0 )
+	{
+		long cpus = sysconf( _SC_NPROCESSORS_ONLN );
+		workers = ( cpus > 0 ) ? cpus : 1;
+	}
+	if( workers > count )
+	{
+		workers = count;
+	}
+
+	MissionQueue queue;
+	queue.spec = spec;
+	queue.firstSeed = firstSeed;
+	queue.count = count;
+	queue.results = results;
+	atomic_init( &queue.next, 0 );
+
+	pthread_t *threads = calloc( workers, sizeof( pthread_t ) );
+	if( threads == NULL )
+	{
+		fprintf( stderr, "Couldn't allocate mission workers.\n" );
+		exit( EXIT_FAILURE );
+	}
+
+	unsigned int i;
+	for( i = 0; i < workers; i++ )
+	{
+		if( pthread_create( &threads[i], NULL, missionWorkerRun, &queue ) != 0 )
+		{
+			fprintf( stderr, "Couldn't start mission worker %u.\n", i );
+			exit( EXIT_FAILURE );
+		}
+	}
+	for( i = 0; i < workers; i++ )
+	{
+		pthread_join( threads[i], NULL );
+	}
+	free( threads );
+}
+
+static int compareDouble( const void *a, const void *b )
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	return ( x > y ) - ( x < y );
+}
+
+// p50, p99 and max of one field over all missions.
+static void printSpread( FILE *out, const char *label, const char *unit, double *values, unsigned int count )
+{
+	qsort( values, count, sizeof( double ), compareDouble );
+	fprintf( out, "%s p50 %.1f%s, p99 %.1f%s, max %.1f%s\n", label,
+		values[( count - 1 ) / 2], unit, values[(unsigned int)ceil( 0.99 * count ) - 1], unit, values[count - 1], unit );
+}
+
+void printMissionResults( FILE *out, const MissionResult *results, unsigned int count, double wallSeconds )
+{
+	if( count == 0 )
+	{
+		return;
+	}
+
+	double *values = calloc( count, sizeof( double ) );
+	if( values == NULL )
+	{
+		fprintf( stderr, "Couldn't allocate mission statistics.\n" );
+		return;
+	}
+
+	unsigned int completed = 0;
+	double simSeconds = 0;
+	double cpuSeconds = 0;
+	uint64_t commands = 0;
+	uint64_t ticks = 0;
+	uint64_t digest = FNV_OFFSET;
+	unsigned int i;
+	for( i = 0; i < count; i++ )
+	{
+		completed += results[i].completed;
+		simSeconds += results[i].seconds;
+		cpuSeconds += results[i].cpuNs / (double)NSEC_PER_SEC;
+		commands += results[i].commands;
+		ticks += results[i].ticks;
+		digest = ( digest ^ results[i].digest ) * FNV_PRIME;
+	}
+
+	fprintf( out, "missions: %u flown, %u completed, %u failed\n", count, completed, count - completed );
+	fprintf( out, "missions: %.1f simulated hours in %.2f s, %.0fx real time, %.1f missions/s\n",
+		simSeconds / 3600.0, wallSeconds, simSeconds / wallSeconds, count / wallSeconds );
+	fprintf( out, "missions: %.1f us of CPU per simulated second, %llu ticks, %llu commands\n",
+		cpuSeconds / simSeconds * 1e6, (unsigned long long)ticks, (unsigned long long)commands );
+
+	for( i = 0; i < count; i++ )
+	{
+		values[i] = results[i].seconds;
+	}
+	printSpread( out, "missions: duration", " s", values, count );
+	for( i = 0; i < count; i++ )
+	{
+		values[i] = results[i].distance;
+	}
+	printSpread( out, "missions: distance", " m", values, count );
+	for( i = 0; i < count; i++ )
+	{
+		values[i] = results[i].battery;
+	}
+	printSpread( out, "missions: battery used", "%", values, count );
+	free( values );
+
+	// Equal digests mean every mission sent exactly the same commands.
+	fprintf( out, "missions: digest %016llx\n", (unsigned long long)digest );
+
+	unsigned int reported = 0;
+	for( i = 0; i < count && reported < MISSION_MAX_REPORTS; i++ )
+	{
+		if( !results[i].completed )
+		{
+			fprintf( out, "missions: seed %llu failed, %u waypoints reached in %.1f s\n",
+				(unsigned long long)results[i].seed, results[i].reached, results[i].seconds );
+			reported++;
+		}
+	}
+}
@@ -0,0 +1,56 @@
+#ifndef _MISSION_SIM_H_
+#define _MISSION_SIM_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "gpsutil.h"
+#include "autopilot.h"
+
+#define MISSION_DEFAULT_WAYPOINTS 4
+#define MISSION_DEFAULT_SECONDS 1800	// Simulated time before a mission counts as stuck.
+#define MISSION_RADIUS 25.0			// Meters from take-off that waypoints are drawn within.
+#define MISSION_GPS_NOISE 0.0			// Meters, standard deviation of the simulated fixes.
+#define MISSION_GPS_RATE 5				// Fixes per second, like usbgps.
+#define MISSION_NAVDATA_RATE 15			// Packets per second, the demo mode rate.
+#define MISSION_PHYSICS_MS 5			// Longest step of the drone model.
+
+// One simulated mission: a seeded random route flown by the real
+// autopilot, command and navdata code against dronesim, on a virtual
+// clock that jumps straight to the next thing that happens. The same seed
+// and config always give the same commands, bit for bit.
+typedef struct
+{
+	uint64_t		seed;
+	unsigned int	numWaypoints;
+	double			maxSeconds;
+	int				optimiseRoute;	// Reorder the waypoints from take-off first, see routeopt.h.
+	AutopilotConfig	config;
+} MissionSpec;
+
+typedef struct
+{
+	uint64_t		seed;
+	int				completed;		// Every waypoint reached and landed.
+	unsigned int	reached;		// Waypoints reached.
+	double			seconds;		// Simulated time until landed, or maxSeconds.
+	double			distance;		// Meters flown.
+	double			battery;		// Percent used.
+	uint64_t		commands;		// AT commands the drone accepted.
+	uint64_t		ticks;			// Autopilot ticks.
+	uint64_t		digest;			// FNV-1a of every command sent, for comparing runs.
+	uint64_t		cpuNs;			// CPU time the simulation took.
+} MissionResult;
+
+// Flies one mission on the calling thread. Each thread may run one at a time.
+void missionSimRun( const MissionSpec *spec, MissionResult *result );
+
+// Runs count missions with seeds firstSeed, firstSeed + 1, ... over workers
+// threads (0 for one per online CPU). results must hold count entries and
+// come out in seed order whatever the thread count.
+void missionSimRunAll( const MissionSpec *spec, uint64_t firstSeed, unsigned int count, unsigned int workers, MissionResult *results );
+
+// Totals, percentiles and the missions that failed.
+void printMissionResults( FILE *out, const MissionResult *results, unsigned int count, double wallSeconds );
+
+#endif
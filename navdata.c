@@ -1,43 +1,74 @@
+#define _GNU_SOURCE
+
 #include <unistd.h>
 #include <netdb.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/socket.h>
 #include "navdata.h"
+#include "metrics.h"
 #include "network.h"
+#include "timeutil.h"
+#include "trace.h"
+#include "command.h"
 
 // Externs
 int navDataSock;
 struct sockaddr_in droneAddr_navdata;
-struct sockaddr_in clientAddr_navdata;
+navdata_link_stats_t navdataLinkStats;
+
+static int      navdataSeqValid = 0;
+static uint32_t navdataLastSeq = 0;
 
-void createNavdataSocket() {
+int openNavdataSocket( const char *ip, int port, struct sockaddr_in *droneAddr ) {
   struct hostent      *h;
-  h = gethostbyname(DRONE_IP);
+  struct sockaddr_in   clientAddr;
+  h = gethostbyname(ip);
+  if (h == NULL) {
+    printf("%s: unknown host\n", ip);
+    return -1;
+  }
 
   // create structure for ardrone address & port
-  droneAddr_navdata.sin_family = h->h_addrtype;
-  droneAddr_navdata.sin_port   = htons(DRONE_NAVDATA_PORT);
-  memcpy((char *) &(droneAddr_navdata.sin_addr.s_addr), h->h_addr_list[0], h->h_length);
+  memset(droneAddr, 0, sizeof(*droneAddr));
+  droneAddr->sin_family = h->h_addrtype;
+  droneAddr->sin_port   = htons(port);
+  memcpy((char *) &(droneAddr->sin_addr.s_addr), h->h_addr_list[0], h->h_length);
   
   // create structure for this client
-  clientAddr_navdata.sin_family = AF_INET;
-  clientAddr_navdata.sin_addr.s_addr = htonl(INADDR_ANY);
-  clientAddr_navdata.sin_port = htons(0);
+  memset(&clientAddr, 0, sizeof(clientAddr));
+  clientAddr.sin_family = AF_INET;
+  clientAddr.sin_addr.s_addr = htonl(INADDR_ANY);
+  clientAddr.sin_port = htons(0);
   
   // socket creation for NAV_PORT
-  navDataSock = socket(AF_INET,SOCK_DGRAM,0);
-  if(navDataSock<0) {
-    printf("%s: cannot open socket \n", h->h_addr_list[0]);
-    exit(1);
+  int sock = socket(AF_INET,SOCK_DGRAM,0);
+  if(sock<0) {
+    printf("%s: cannot open socket \n", ip);
+    return -1;
   }
   
   // bind client's the port and address
-  if(bind(navDataSock, (struct sockaddr *) &clientAddr_navdata, sizeof(clientAddr_navdata))<0) {
-    printf("%d: cannot bind port\n", DRONE_NAVDATA_PORT);
+  if(bind(sock, (struct sockaddr *) &clientAddr, sizeof(clientAddr))<0) {
+    printf("%d: cannot bind port\n", port);
+    close(sock);
+    return -1;
+  }
+
+  // the session state machine polls with timeouts, never block in recv
+  fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+  return sock;
+}
+
+void createNavdataSocket( const char *ip ) {
+  navDataSock = openNavdataSocket(ip, DRONE_NAVDATA_PORT, &droneAddr_navdata);
+  if(navDataSock<0) {
     exit(1);
   }
-  
 }
 
 void sendNavData( char *cmd )
@@ -54,3 +85,429 @@ void tickleNavData()
   // tickle drone's port: drone send one packe of navdata in navdata_demo mode
   sendNavData ("\x01\x00");
 }
+
+void tickleNavdataSocket( int sock, const struct sockaddr_in *droneAddr )
+{
+  // a lost tickle is retried by the session, so don't give up on the whole fleet
+  if (sendto(sock, "\x01\x00", 2, 0, (const struct sockaddr *) droneAddr, sizeof(*droneAddr)) < 0) {
+    fprintf(stderr, "Error tickling navdata, errno = %d.\n", errno);
+  }
+}
+
+typedef struct {
+  navdata_option_handler_t  handler;
+  void                     *arg;
+} navdata_handler_entry_t;
+
+static navdata_handler_entry_t navdataHandlers[NAVDATA_NUM_TAGS];
+static uint32_t navdataHandlerMask = 0;
+
+static int parsePacket( const uint8_t *buffer, size_t length, navdata_packet_t *packet ) {
+  memset(packet, 0, sizeof(*packet));
+
+  if (length < sizeof(navdata_header_t)) {
+    return NAVDATA_BAD_HEADER;
+  }
+  packet->header = (const navdata_header_t *) buffer;
+  packet->length = length;
+  if (packet->header->header != NAVDATA_HEADER_MAGIC) {
+    return NAVDATA_BAD_HEADER;
+  }
+
+  // the checksum is a plain byte sum, so accumulate it as the options are walked
+  uint32_t sum = 0;
+  size_t offset;
+  for (offset = 0; offset < sizeof(navdata_header_t); offset++) {
+    sum += buffer[offset];
+  }
+
+  while (offset + sizeof(navdata_option_t) <= length) {
+    const navdata_option_t *option = (const navdata_option_t *) (buffer + offset);
+    uint16_t size = option->size;
+
+    if (size < sizeof(navdata_option_t) || offset + size > length) {
+      return NAVDATA_TRUNCATED;
+    }
+
+    if (option->id == NAVDATA_CKS_TAG) {
+      if (size < sizeof(navdata_cks_t)) {
+        return NAVDATA_TRUNCATED;
+      }
+      packet->cks = (const navdata_cks_t *) option;
+      return packet->cks->cks == sum ? NAVDATA_OK : NAVDATA_BAD_CHECKSUM;
+    }
+
+    if (option->id < NAVDATA_NUM_TAGS) {
+      packet->options[option->id] = option;
+      packet->present |= 1U << option->id;
+    }
+
+    size_t end = offset + size;
+    for (; offset < end; offset++) {
+      sum += buffer[offset];
+    }
+  }
+
+  return NAVDATA_BAD_CHECKSUM;
+}
+
+int parseNavdata( const uint8_t *buffer, size_t length, navdata_packet_t *packet ) {
+  TRACE_BEGIN("navdata.parse");
+  int result = parsePacket(buffer, length, packet);
+  TRACE_END_ARGS("navdata.parse", "seq", packet->header != NULL ? packet->header->seq : 0, "result", result);
+  return result;
+}
+
+const void *navdataOption( const navdata_packet_t *packet, uint16_t tag, size_t minSize ) {
+  if (tag >= NAVDATA_NUM_TAGS) {
+    return NULL;
+  }
+
+  const navdata_option_t *option = packet->options[tag];
+  if (option == NULL || option->size < minSize) {
+    return NULL;
+  }
+
+  return option;
+}
+
+const navdata_demo_t *navdataDemo( const navdata_packet_t *packet ) {
+  return navdataOption(packet, NAVDATA_DEMO_TAG, sizeof(navdata_demo_t));
+}
+
+const navdata_raw_measures_t *navdataRawMeasures( const navdata_packet_t *packet ) {
+  return navdataOption(packet, NAVDATA_RAW_MEASURES_TAG, sizeof(navdata_raw_measures_t));
+}
+
+const navdata_magneto_t *navdataMagneto( const navdata_packet_t *packet ) {
+  return navdataOption(packet, NAVDATA_MAGNETO_TAG, sizeof(navdata_magneto_t));
+}
+
+const navdata_gps_t *navdataGps( const navdata_packet_t *packet ) {
+  return navdataOption(packet, NAVDATA_GPS_TAG, sizeof(navdata_gps_t));
+}
+
+const navdata_cks_t *navdataChecksum( const navdata_packet_t *packet ) {
+  return packet->cks;
+}
+
+int registerNavdataOptionHandler( uint16_t tag, navdata_option_handler_t handler, void *arg ) {
+  if (tag >= NAVDATA_NUM_TAGS) {
+    return -1;
+  }
+
+  navdataHandlers[tag].handler = handler;
+  navdataHandlers[tag].arg = arg;
+  if (handler != NULL) {
+    navdataHandlerMask |= 1U << tag;
+  } else {
+    navdataHandlerMask &= ~(1U << tag);
+  }
+
+  return 0;
+}
+
+void dispatchNavdataOptions( const navdata_packet_t *packet ) {
+  uint32_t pending = packet->present & navdataHandlerMask;
+
+  while (pending != 0) {
+    unsigned int tag = __builtin_ctz(pending);
+    pending &= pending - 1;
+    navdataHandlers[tag].handler(packet->options[tag], packet, navdataHandlers[tag].arg);
+  }
+}
+
+int enableNavdataTimestamps( int sock ) {
+  int yes = 1;
+  if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &yes, sizeof(yes)) < 0) {
+    fprintf(stderr, "Couldn't enable navdata timestamps, errno = %d.\n", errno);
+    return -1;
+  }
+  return 0;
+}
+
+int receiveNavdataBatch( int sock, navdata_batch_t *batch, int flags, navdata_link_stats_t *stats ) {
+  struct mmsghdr msgs[NAVDATA_BATCH_SIZE];
+  struct iovec iovecs[NAVDATA_BATCH_SIZE];
+  char control[NAVDATA_BATCH_SIZE][CMSG_SPACE(sizeof(struct timespec))];
+  unsigned int i;
+
+  memset(msgs, 0, sizeof(msgs));
+  for (i = 0; i < NAVDATA_BATCH_SIZE; i++) {
+    iovecs[i].iov_base = batch->packets[i].data;
+    iovecs[i].iov_len = NAVDATA_MAX_PACKET_SIZE;
+    msgs[i].msg_hdr.msg_iov = &iovecs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    msgs[i].msg_hdr.msg_control = control[i];
+    msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+  }
+
+  // MSG_WAITFORONE blocks for the first packet only, then takes whatever else is queued
+  int count = recvmmsg(sock, msgs, NAVDATA_BATCH_SIZE, flags | MSG_WAITFORONE, NULL);
+  if (count <= 0) {
+    batch->count = 0;
+    return count;
+  }
+
+  // kernel timestamps are CLOCK_REALTIME, move them onto the monotonic clock
+  uint64_t monoNow = monotonicNs();
+  uint64_t offset = realtimeNs() - monoNow;
+
+  for (i = 0; i < (unsigned int) count; i++) {
+    navdata_rx_packet_t *packet = &batch->packets[i];
+    packet->length = msgs[i].msg_len;
+    packet->rxTime = monoNow;
+
+    struct cmsghdr *cmsg;
+    for (cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg)) {
+      if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+        struct timespec ts;
+        memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+        uint64_t rx = (uint64_t) ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec - offset;
+        if (rx <= monoNow) {
+          packet->rxTime = rx;
+        }
+      }
+    }
+
+    histogramRecordLocal(&stats->delivery, monoNow - packet->rxTime);
+  }
+
+  batch->count = count;
+  TRACE_INSTANT("navdata.receive", "packets", count, NULL, 0);
+  atomic_fetch_add_explicit(&stats->batches, 1, memory_order_relaxed);
+  histogramRecordLocal(&stats->batchSize, count);
+  return count;
+}
+
+void trackNavdataSequence( uint32_t seq ) {
+  atomic_fetch_add_explicit(&navdataLinkStats.received, 1, memory_order_relaxed);
+
+  if (!navdataSeqValid) {
+    navdataSeqValid = 1;
+    navdataLastSeq = seq;
+    return;
+  }
+
+  if (seq == navdataLastSeq) {
+    atomic_fetch_add_explicit(&navdataLinkStats.duplicates, 1, memory_order_relaxed);
+  } else if (seq > navdataLastSeq) {
+    atomic_fetch_add_explicit(&navdataLinkStats.dropped, seq - navdataLastSeq - 1, memory_order_relaxed);
+    navdataLastSeq = seq;
+  } else if (navdataLastSeq - seq > NAVDATA_SEQ_RESET_WINDOW) {
+    atomic_fetch_add_explicit(&navdataLinkStats.restarts, 1, memory_order_relaxed);
+    navdataLastSeq = seq;
+  } else {
+    // a late packet fills a gap that was already counted as a drop
+    atomic_fetch_add_explicit(&navdataLinkStats.reordered, 1, memory_order_relaxed);
+    if (atomic_load_explicit(&navdataLinkStats.dropped, memory_order_relaxed) > 0) {
+      atomic_fetch_sub_explicit(&navdataLinkStats.dropped, 1, memory_order_relaxed);
+    }
+  }
+}
+
+void recordNavdataAge( uint64_t rxTime ) {
+  histogramRecord(&navdataLinkStats.age, monotonicNs() - rxTime);
+}
+
+void printNavdataLinkStats( FILE *out ) {
+  navdata_link_stats_t *s = &navdataLinkStats;
+  uint64_t received = atomic_load(&s->received);
+  uint64_t dropped = atomic_load(&s->dropped);
+  double loss = (received + dropped) > 0 ? 100.0 * dropped / (received + dropped) : 0;
+
+  fprintf(out, "navdata: %llu received, %llu dropped (%.2f%%), %llu reordered, %llu duplicates, %llu restarts\n",
+    (unsigned long long) received, (unsigned long long) dropped, loss,
+    (unsigned long long) atomic_load(&s->reordered), (unsigned long long) atomic_load(&s->duplicates),
+    (unsigned long long) atomic_load(&s->restarts));
+  fprintf(out, "navdata: %llu batches, mean %llu packets, max %llu\n",
+    (unsigned long long) atomic_load(&s->batches), (unsigned long long) histogramMean(&s->batchSize),
+    (unsigned long long) atomic_load(&s->batchSize.max));
+  fprintf(out, "navdata: delivery p50 %.1f us, p99 %.1f us; age at use p50 %.1f ms, p99 %.1f ms, max %.1f ms\n",
+    histogramPercentile(&s->delivery, 0.50) / (double) NSEC_PER_USEC,
+    histogramPercentile(&s->delivery, 0.99) / (double) NSEC_PER_USEC,
+    histogramPercentile(&s->age, 0.50) / (double) NSEC_PER_MSEC,
+    histogramPercentile(&s->age, 0.99) / (double) NSEC_PER_MSEC,
+    atomic_load(&s->age.max) / (double) NSEC_PER_MSEC);
+}
+
+static const char *navdataSessionStateNames[] = {
+  "init", "bootstrap", "demo", "streaming", "lost"
+};
+
+static void setSessionState( navdata_session_t *session, navdata_session_state_t state ) {
+  navdata_session_state_t old = atomic_load(&session->state);
+  if (old != state) {
+    printf("Navdata session %s: %s -> %s\n", session->link->name, navdataSessionStateNames[old], navdataSessionStateNames[state]);
+    atomic_store(&session->state, state);
+  }
+}
+
+// Schedules the next retry and doubles the delay for the one after.
+static void backOff( navdata_session_t *session, uint64_t now ) {
+  session->nextRetry = now + session->retryDelay;
+  session->retryDelay *= 2;
+  if (session->retryDelay > NAVDATA_RETRY_MAX_MS * NSEC_PER_MSEC) {
+    session->retryDelay = NAVDATA_RETRY_MAX_MS * NSEC_PER_MSEC;
+  }
+}
+
+static void resetBackOff( navdata_session_t *session ) {
+  session->retryDelay = NAVDATA_RETRY_MIN_MS * NSEC_PER_MSEC;
+}
+
+static void tickle( navdata_session_t *session ) {
+  if (session->sock < 0) {
+    tickleNavData();
+  } else {
+    tickleNavdataSocket(session->sock, &session->droneAddr);
+  }
+}
+
+static void requestDemo( navdata_session_t *session, uint64_t now ) {
+  if (session->trimmed) {
+    droneLinkEnableDemo(session->link);
+  } else {
+    droneLinkNavdataInit(session->link);
+    session->trimmed = 1;
+  }
+  backOff(session, now);
+}
+
+void navdataSessionInit( navdata_session_t *session ) {
+  memset(session, 0, sizeof(*session));
+  atomic_store(&session->state, NAVDATA_SESSION_INIT);
+  resetBackOff(session);
+  session->sock = -1;
+  session->link = &droneLink;
+}
+
+void navdataSessionBind( navdata_session_t *session, int sock, const struct sockaddr_in *droneAddr, DroneLink *link ) {
+  session->sock = sock;
+  session->droneAddr = *droneAddr;
+  session->link = link;
+}
+
+void navdataSessionTick( navdata_session_t *session, uint64_t now ) {
+  navdata_session_state_t state = atomic_load(&session->state);
+
+  switch (state) {
+  case NAVDATA_SESSION_INIT:
+    session->attemptStart = now;
+    tickle(session);
+    backOff(session, now);
+    setSessionState(session, NAVDATA_SESSION_BOOTSTRAP);
+    break;
+
+  case NAVDATA_SESSION_STREAMING:
+    if (now - session->lastPacket >= NAVDATA_LOST_MS * NSEC_PER_MSEC) {
+      atomic_fetch_add(&session->reconnects, 1);
+      session->attemptStart = now;
+      resetBackOff(session);
+      tickle(session);
+      backOff(session, now);
+      setSessionState(session, NAVDATA_SESSION_LOST);
+    }
+    break;
+
+  case NAVDATA_SESSION_BOOTSTRAP:
+  case NAVDATA_SESSION_LOST:
+    if (now >= session->nextRetry) {
+      tickle(session);
+      backOff(session, now);
+    }
+    break;
+
+  case NAVDATA_SESSION_DEMO:
+    if (now >= session->nextRetry) {
+      requestDemo(session, now);
+    }
+    break;
+  }
+}
+
+void navdataSessionPacket( navdata_session_t *session, const navdata_packet_t *packet, uint64_t now ) {
+  navdata_session_state_t state = atomic_load(&session->state);
+  session->lastPacket = now;
+
+  if (state == NAVDATA_SESSION_STREAMING) {
+    return;
+  }
+
+  if (navdataDemo(packet) != NULL) {
+    uint64_t elapsed = now - session->attemptStart;
+    atomic_store(&session->timeToFirstNavdata, elapsed);
+    printf("Navdata %s streaming after %.1f ms.\n", session->link->name, elapsed / (double) NSEC_PER_MSEC);
+    resetBackOff(session);
+    setSessionState(session, NAVDATA_SESSION_STREAMING);
+  } else if (state != NAVDATA_SESSION_DEMO) {
+    // the drone answers, but only with bootstrap packets: ask for demo navdata
+    resetBackOff(session);
+    requestDemo(session, now);
+    setSessionState(session, NAVDATA_SESSION_DEMO);
+  }
+}
+
+int navdataSessionTimeout( navdata_session_t *session, uint64_t now ) {
+  navdata_session_state_t state = atomic_load(&session->state);
+  uint64_t due;
+
+  if (state == NAVDATA_SESSION_INIT) {
+    return 0;
+  } else if (state == NAVDATA_SESSION_STREAMING) {
+    due = session->lastPacket + NAVDATA_LOST_MS * NSEC_PER_MSEC;
+  } else {
+    due = session->nextRetry;
+  }
+
+  if (due <= now) {
+    return 0;
+  }
+  // round up so we don't wake just before the deadline
+  return (int) ((due - now + NSEC_PER_MSEC - 1) / NSEC_PER_MSEC);
+}
+
+navdata_session_state_t navdataSessionState( navdata_session_t *session ) {
+  return atomic_load(&session->state);
+}
+
+const char *navdataSessionStateName( navdata_session_state_t state ) {
+  return navdataSessionStateNames[state];
+}
+
+void printNavdataSession( FILE *out, navdata_session_t *session ) {
+  fprintf(out, "navdata session: %s, %llu reconnects, last time to first navdata %.1f ms\n",
+    navdataSessionStateNames[atomic_load(&session->state)],
+    (unsigned long long) atomic_load(&session->reconnects),
+    atomic_load(&session->timeToFirstNavdata) / (double) NSEC_PER_MSEC);
+}
+
+void registerNavdataMetrics() {
+  navdata_link_stats_t *s = &navdataLinkStats;
+
+  metricsCounter("argps_navdata_received_total", NULL, "Navdata packets with a valid header.", &s->received);
+  metricsCounter("argps_navdata_dropped_total", NULL, "Navdata packets never seen, from sequence gaps.", &s->dropped);
+  metricsCounter("argps_navdata_reordered_total", NULL, "Navdata packets older than one already seen.", &s->reordered);
+  metricsCounter("argps_navdata_duplicates_total", NULL, "Navdata packets repeating the last sequence number.", &s->duplicates);
+  metricsCounter("argps_navdata_restarts_total", NULL, "Times the drone restarted its navdata sequence.", &s->restarts);
+  metricsCounter("argps_navdata_batches_total", NULL, "recvmmsg() calls that returned navdata.", &s->batches);
+  metricsHistogram("argps_navdata_batch_packets", NULL, "Packets per recvmmsg() call.", &s->batchSize, 1.0);
+  metricsHistogram("argps_navdata_delivery_seconds", NULL, "Kernel receive to parse.", &s->delivery, 1e-9);
+  metricsHistogram("argps_navdata_age_seconds", NULL, "Kernel receive to use by a consumer.", &s->age, 1e-9);
+}
+
+static double readSessionState( void *arg ) {
+  return atomic_load(&((navdata_session_t *) arg)->state);
+}
+
+static double readTimeToFirstNavdata( void *arg ) {
+  return atomic_load(&((navdata_session_t *) arg)->timeToFirstNavdata) / (double) NSEC_PER_SEC;
+}
+
+void registerNavdataSessionMetrics( navdata_session_t *session ) {
+  metricsGaugeReader("argps_navdata_session_state", NULL,
+    "0 init, 1 bootstrap, 2 demo, 3 streaming, 4 lost.", readSessionState, session);
+  metricsCounter("argps_navdata_reconnects_total", NULL, "Times navdata was lost and re-requested.", &session->reconnects);
+  metricsGaugeReader("argps_navdata_time_to_first_seconds", NULL,
+    "Tickle to first demo packet, most recent attempt.", readTimeToFirstNavdata, session);
+}
@@ -3,23 +3,61 @@
 
 #define MAX_MSG_LEN 80
 
+#define NAVDATA_HEADER_MAGIC     0x55667788
+#define NAVDATA_MAX_PACKET_SIZE  4096      // full navdata mode packets are well under this
+
+// Option block ('tag') identifiers, as numbered by the AR.Drone 2.0 firmware.
+#define NAVDATA_DEMO_TAG          0
+#define NAVDATA_RAW_MEASURES_TAG  2
+#define NAVDATA_MAGNETO_TAG       22
+#define NAVDATA_GPS_TAG           27
+#define NAVDATA_CKS_TAG           0xFFFF
+#define NAVDATA_NUM_TAGS          32       // tags below this get a slot in navdata_packet_t
+
+// Session timing.
+#define NAVDATA_LOST_MS           300      // silence after which a streaming link is lost
+#define NAVDATA_RETRY_MIN_MS      50       // first retry delay while (re)connecting
+#define NAVDATA_RETRY_MAX_MS      2000     // retry delays double up to this
+
+// Return values of parseNavdata().
+#define NAVDATA_OK                0
+#define NAVDATA_BAD_HEADER        -1       // too short or wrong magic
+#define NAVDATA_TRUNCATED         -2       // an option runs past the end of the packet
+#define NAVDATA_BAD_CHECKSUM      -3       // checksum block missing or wrong
+
+#define NAVDATA_BATCH_SIZE        16       // packets drained per recvmmsg() call
+#define NAVDATA_SEQ_RESET_WINDOW  1000     // a backwards jump larger than this is a drone restart
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include <netinet/in.h>
 
 #include <netdb.h>
 
+#include "histogram.h"
+#include "command.h"
+
 typedef float   float32_t;
 
 extern int navDataSock;
 extern struct sockaddr_in droneAddr_navdata;
-extern struct sockaddr_in clientAddr_navdata;
 
 void sendNavData( char *cmd );
-void createNavdataSocket();
+void createNavdataSocket( const char *ip );
 void tickleNavData();
+// The same for any drone: returns a non-blocking socket bound to an
+// ephemeral port with droneAddr filled in, or -1 on failure.
+int openNavdataSocket( const char *ip, int port, struct sockaddr_in *droneAddr );
+void tickleNavdataSocket( int sock, const struct sockaddr_in *droneAddr );
 //void receiveNavData();
 
+// All navdata structures are views laid directly over the received bytes,
+// so they are packed and never assume alignment.
+
 // navdata header
-typedef struct _navdata_header_t {
+typedef struct __attribute__((packed)) _navdata_header_t {
   uint32_t    header;                   // header:55667788 
   uint32_t    state;                    // the state of the drone 
   uint32_t    seq;                      // sequence number 
@@ -27,7 +65,7 @@ typedef struct _navdata_header_t {
 } navdata_header_t;
 
 // navdata option, demo mode
-typedef struct _navdata_demo_t {
+typedef struct __attribute__((packed)) _navdata_demo_t {
   uint16_t    id;                        // Navdata block ('option') identifier 
   uint16_t    size;                      // set this to the size of this structure 
   
@@ -53,4 +91,205 @@ typedef struct _navdata_t {
   navdata_demo_t       navdata_option;  // navdata option 
 } navdata_t;
 
+// generic option block, every option starts with this
+typedef struct __attribute__((packed)) _navdata_option_t {
+  uint16_t    id;                       // Navdata block ('option') identifier
+  uint16_t    size;                     // size of the whole block, including id and size
+  uint8_t     data[];
+} navdata_option_t;
+
+// navdata option, raw sensor measures
+typedef struct __attribute__((packed)) _navdata_raw_measures_t {
+  uint16_t    id;
+  uint16_t    size;
+
+  uint16_t    raw_accs[3];              // filtered accelerometers
+  int16_t     raw_gyros[3];             // filtered gyrometers
+  int16_t     raw_gyros_110[2];         // gyrometers x/y 110 deg/s
+  uint32_t    vbat_raw;                 // battery voltage raw (mV)
+  uint16_t    us_debut_echo;
+  uint16_t    us_fin_echo;
+  uint16_t    us_association_echo;
+  uint16_t    us_distance_echo;
+  uint16_t    us_courbe_temps;
+  uint16_t    us_courbe_valeur;
+  uint16_t    us_courbe_ref;
+  uint16_t    flag_echo_ini;
+  uint16_t    nb_echo;
+  uint32_t    sum_echo;
+  int32_t     alt_temp_raw;             // ultrasound altitude (mm)
+  int16_t     gradient;
+} navdata_raw_measures_t;
+
+// navdata option, magnetometer
+typedef struct __attribute__((packed)) _navdata_magneto_t {
+  uint16_t    id;
+  uint16_t    size;
+
+  int16_t     mx;
+  int16_t     my;
+  int16_t     mz;
+  float32_t   magneto_raw[3];           // magneto in the body frame, in mG
+  float32_t   magneto_rectified[3];
+  float32_t   magneto_offset[3];
+  float32_t   heading_unwrapped;
+  float32_t   heading_gyro_unwrapped;
+  float32_t   heading_fusion_unwrapped;
+  char        magneto_calibration_ok;
+  uint32_t    magneto_state;
+  float32_t   magneto_radius;
+  float32_t   error_mean;
+  float32_t   error_var;
+} navdata_magneto_t;
+
+// navdata option, GPS (flight recorder firmware 2.4+). Only the leading,
+// documented part of the block is described; the rest is left unparsed.
+typedef struct __attribute__((packed)) _navdata_gps_t {
+  uint16_t    id;
+  uint16_t    size;
+
+  double      latitude;
+  double      longitude;
+  double      elevation;
+  double      hdop;
+  int32_t     data_available;
+  uint8_t     reserved0[8];
+  double      lat0;
+  double      lon0;
+  double      lat_fuse;
+  double      lon_fuse;
+  uint32_t    gps_state;
+  uint8_t     reserved1[40];
+  double      vdop;
+  double      pdop;
+  float32_t   speed;
+  uint32_t    last_frame_timestamp;
+  float32_t   degree;
+  float32_t   degree_mag;
+} navdata_gps_t;
+
+// navdata option, checksum. Always the last block of a packet.
+typedef struct __attribute__((packed)) _navdata_cks_t {
+  uint16_t    id;
+  uint16_t    size;
+
+  uint32_t    cks;                      // sum of every byte before this block
+} navdata_cks_t;
+
+// A parsed packet. Nothing is copied: every pointer points into the
+// buffer handed to parseNavdata(), which must outlive the packet.
+typedef struct _navdata_packet_t {
+  const navdata_header_t   *header;
+  const navdata_option_t   *options[NAVDATA_NUM_TAGS];   // indexed by tag, NULL if absent
+  const navdata_cks_t      *cks;
+  uint32_t                  present;                     // bit n set when options[n] is present
+  size_t                    length;
+} navdata_packet_t;
+
+// Walks the option blocks of a received packet and verifies its checksum.
+// Returns NAVDATA_OK or one of the NAVDATA_BAD_* / NAVDATA_TRUNCATED codes.
+int parseNavdata( const uint8_t *buffer, size_t length, navdata_packet_t *packet );
+
+// Typed views. Each returns NULL if the block is absent or too short.
+const void *navdataOption( const navdata_packet_t *packet, uint16_t tag, size_t minSize );
+const navdata_demo_t *navdataDemo( const navdata_packet_t *packet );
+const navdata_raw_measures_t *navdataRawMeasures( const navdata_packet_t *packet );
+const navdata_magneto_t *navdataMagneto( const navdata_packet_t *packet );
+const navdata_gps_t *navdataGps( const navdata_packet_t *packet );
+const navdata_cks_t *navdataChecksum( const navdata_packet_t *packet );
+
+// Option handler registration. dispatchNavdataOptions() only calls
+// handlers for tags that are both registered and present, so options
+// nobody listens for cost a single mask test per packet.
+typedef void (*navdata_option_handler_t)( const navdata_option_t *option, const navdata_packet_t *packet, void *arg );
+int registerNavdataOptionHandler( uint16_t tag, navdata_option_handler_t handler, void *arg );
+void dispatchNavdataOptions( const navdata_packet_t *packet );
+
+// One received datagram together with its kernel receive timestamp.
+typedef struct _navdata_rx_packet_t {
+  uint8_t     data[NAVDATA_MAX_PACKET_SIZE];
+  size_t      length;
+  uint64_t    rxTime;                   // kernel receive time, on the monotonicNs() clock
+} navdata_rx_packet_t;
+
+typedef struct _navdata_batch_t {
+  navdata_rx_packet_t  packets[NAVDATA_BATCH_SIZE];
+  unsigned int         count;
+} navdata_batch_t;
+
+// Link quality counters, written by the navdata thread and readable from anywhere.
+typedef struct _navdata_link_stats_t {
+  _Atomic uint64_t    received;         // packets with a valid header
+  _Atomic uint64_t    dropped;          // packets never seen, from gaps in header.seq
+  _Atomic uint64_t    reordered;        // packets older than one already seen
+  _Atomic uint64_t    duplicates;       // packets repeating the last seq
+  _Atomic uint64_t    restarts;         // seq jumped far backwards, the drone restarted navdata
+  _Atomic uint64_t    batches;          // recvmmsg() calls that returned data
+  Histogram           batchSize;        // packets per recvmmsg() call
+  Histogram           delivery;         // kernel receive to parse, ns
+  Histogram           age;              // kernel receive to use by a consumer, ns
+} navdata_link_stats_t;
+
+extern navdata_link_stats_t navdataLinkStats;
+
+// Asks the kernel to timestamp every datagram received on sock.
+int enableNavdataTimestamps( int sock );
+// Waits for at least one packet, then drains up to NAVDATA_BATCH_SIZE with a
+// single recvmmsg(). Pass MSG_DONTWAIT in flags to return immediately instead.
+// Batch and delivery figures go into stats, normally &navdataLinkStats,
+// which only one thread may pass. Returns the number of packets received,
+// or -1 with errno set.
+int receiveNavdataBatch( int sock, navdata_batch_t *batch, int flags, navdata_link_stats_t *stats );
+// Updates the loss/reorder counters from a packet's header sequence number.
+void trackNavdataSequence( uint32_t seq );
+// Consumers call this with a sample's rxTime when they act on it.
+void recordNavdataAge( uint64_t rxTime );
+void printNavdataLinkStats( FILE *out );
+// Exports navdataLinkStats through the metrics registry.
+void registerNavdataMetrics();
+
+// Navdata session states.
+//   INIT       nothing sent yet
+//   BOOTSTRAP  port tickled, waiting for the first packet
+//   DEMO       navdata_demo requested, waiting for the first demo packet
+//   STREAMING  demo packets arriving
+//   LOST       nothing received for NAVDATA_LOST_MS, re-tickling with backoff
+typedef enum {
+  NAVDATA_SESSION_INIT,
+  NAVDATA_SESSION_BOOTSTRAP,
+  NAVDATA_SESSION_DEMO,
+  NAVDATA_SESSION_STREAMING,
+  NAVDATA_SESSION_LOST
+} navdata_session_state_t;
+
+typedef struct _navdata_session_t {
+  _Atomic int         state;            // a navdata_session_state_t, readable from any thread
+  uint64_t            attemptStart;     // when the current (re)connection attempt began
+  uint64_t            lastPacket;
+  uint64_t            nextRetry;
+  uint64_t            retryDelay;
+  int                 trimmed;          // flat trim is only sent on the first connection
+  _Atomic uint64_t    reconnects;
+  _Atomic uint64_t    timeToFirstNavdata;   // ns, for the most recent attempt
+  int                 sock;             // navdata socket, -1 for navDataSock
+  struct sockaddr_in  droneAddr;
+  DroneLink          *link;             // where demo requests go
+} navdata_session_t;
+
+// Initialises a session for the main drone: navDataSock and droneLink.
+void navdataSessionInit( navdata_session_t *session );
+// Points an initialised session at another drone.
+void navdataSessionBind( navdata_session_t *session, int sock, const struct sockaddr_in *droneAddr, DroneLink *link );
+// Runs retries and loss detection. Call whenever the poll() timeout expires.
+void navdataSessionTick( navdata_session_t *session, uint64_t now );
+// Advances the session for a packet that parsed successfully.
+void navdataSessionPacket( navdata_session_t *session, const navdata_packet_t *packet, uint64_t now );
+// Milliseconds until navdataSessionTick() next has work, for poll().
+int navdataSessionTimeout( navdata_session_t *session, uint64_t now );
+navdata_session_state_t navdataSessionState( navdata_session_t *session );
+const char *navdataSessionStateName( navdata_session_state_t state );
+void printNavdataSession( FILE *out, navdata_session_t *session );
+// Exports the session state and reconnects through the metrics registry.
+void registerNavdataSessionMetrics( navdata_session_t *session );
+
 #endif
@@ -0,0 +1,176 @@
+#include <string.h>
+#include <time.h>
+
+#include "navhistory.h"
+#include "timeutil.h"
+
+#define SLOT_MASK ( NAVDATA_HISTORY_SIZE - 1 )
+
+void navdataHistoryInit( NavdataHistory *history )
+{
+	memset( history, 0, sizeof( *history ) );
+
+	pthread_condattr_t attr;
+	pthread_condattr_init( &attr );
+	pthread_condattr_setclock( &attr, CLOCK_MONOTONIC );
+	pthread_cond_init( &history->waitCond, &attr );
+	pthread_condattr_destroy( &attr );
+	pthread_mutex_init( &history->waitMutex, NULL );
+}
+
+void navdataHistoryPush( NavdataHistory *history, const NavdataSample *sample )
+{
+	uint64_t position = atomic_load_explicit( &history->head, memory_order_relaxed );
+	NavdataHistorySlot *slot = &history->slots[position & SLOT_MASK];
+
+	atomic_store_explicit( &slot->version, 2 * position + 1, memory_order_relaxed );
+	atomic_thread_fence( memory_order_release );
+	slot->sample = *sample;
+	atomic_store_explicit( &slot->version, 2 * position + 2, memory_order_release );
+
+	atomic_store_explicit( &history->head, position + 1, memory_order_seq_cst );
+
+	// Pairs with the increment in navdataHistoryWait(): either the waiter
+	// sees the new head, or we see the waiter and wake it.
+	if( atomic_load_explicit( &history->waiters, memory_order_seq_cst ) > 0 )
+	{
+		pthread_mutex_lock( &history->waitMutex );
+		pthread_cond_broadcast( &history->waitCond );
+		pthread_mutex_unlock( &history->waitMutex );
+	}
+}
+
+int navdataHistoryPushPacket( NavdataHistory *history, const navdata_packet_t *packet, uint64_t rxTime )
+{
+	const navdata_demo_t *demo = navdataDemo( packet );
+	if( demo == NULL )
+	{
+		return -1;
+	}
+
+	NavdataSample sample;
+	sample.rxTime = rxTime;
+	sample.seq = packet->header->seq;
+	sample.state = packet->header->state;
+	sample.ctrlState = demo->ctrl_state;
+	sample.battery = demo->vbat_flying_percentage;
+	sample.theta = demo->theta;
+	sample.phi = demo->phi;
+	sample.psi = demo->psi;
+	sample.altitude = demo->altitude;
+	sample.vx = demo->vx;
+	sample.vy = demo->vy;
+	sample.vz = demo->vz;
+	navdataHistoryPush( history, &sample );
+	return 0;
+}
+
+uint64_t navdataHistoryCount( NavdataHistory *history )
+{
+	return atomic_load_explicit( &history->head, memory_order_acquire );
+}
+
+// Copies sample number position out of its slot. Returns 0 on success,
+// or -1 if the producer has already reused the slot for a newer sample.
+static int readSlot( NavdataHistory *history, uint64_t position, NavdataSample *out )
+{
+	NavdataHistorySlot *slot = &history->slots[position & SLOT_MASK];
+	uint64_t complete = 2 * position + 2;
+
+	for(;;)
+	{
+		uint64_t before = atomic_load_explicit( &slot->version, memory_order_acquire );
+		if( before > complete )
+		{
+			return -1;
+		}
+		if( before != complete )
+		{
+			continue;	// Still being written, which takes nanoseconds.
+		}
+
+		*out = slot->sample;
+		atomic_thread_fence( memory_order_acquire );
+		if( atomic_load_explicit( &slot->version, memory_order_relaxed ) == before )
+		{
+			return 0;
+		}
+	}
+}
+
+int navdataHistoryLatest( NavdataHistory *history, NavdataSample *out )
+{
+	for(;;)
+	{
+		uint64_t head = navdataHistoryCount( history );
+		if( head == 0 )
+		{
+			return -1;
+		}
+
+		// Only fails if we were lapped, in which case there is a newer head.
+		if( readSlot( history, head - 1, out ) == 0 )
+		{
+			return 0;
+		}
+	}
+}
+
+size_t navdataHistoryWindow( NavdataHistory *history, uint64_t from, uint64_t to, NavdataSample *out, size_t max )
+{
+	uint64_t head = navdataHistoryCount( history );
+	uint64_t oldest = ( head > NAVDATA_HISTORY_SIZE ) ? head - NAVDATA_HISTORY_SIZE : 0;
+	size_t count = 0;
+
+	// Walk backwards from the newest sample, filling out from the end.
+	uint64_t position;
+	for( position = head; position > oldest && count < max; position-- )
+	{
+		NavdataSample sample;
+		if( readSlot( history, position - 1, &sample ) < 0 || sample.rxTime < from )
+		{
+			break;
+		}
+		if( sample.rxTime <= to )
+		{
+			out[max - 1 - count] = sample;
+			count++;
+		}
+	}
+
+	if( count < max )
+	{
+		memmove( out, &out[max - count], count * sizeof( NavdataSample ) );
+	}
+
+	return count;
+}
+
+uint64_t navdataHistoryWait( NavdataHistory *history, uint64_t seen, int timeoutMs )
+{
+	uint64_t head = navdataHistoryCount( history );
+	if( head > seen )
+	{
+		return head;
+	}
+
+	uint64_t deadline = monotonicNs() + (uint64_t)timeoutMs * NSEC_PER_MSEC;
+	struct timespec ts;
+	ts.tv_sec = deadline / NSEC_PER_SEC;
+	ts.tv_nsec = deadline % NSEC_PER_SEC;
+
+	atomic_fetch_add_explicit( &history->waiters, 1, memory_order_seq_cst );
+	pthread_mutex_lock( &history->waitMutex );
+	while( ( head = atomic_load_explicit( &history->head, memory_order_seq_cst ) ) <= seen )
+	{
+		if( pthread_cond_timedwait( &history->waitCond, &history->waitMutex, &ts ) != 0 )
+		{
+			head = navdataHistoryCount( history );
+			break;
+		}
+	}
+	pthread_mutex_unlock( &history->waitMutex );
+	atomic_fetch_sub_explicit( &history->waiters, 1, memory_order_seq_cst );
+
+	return head;
+}
@@ -0,0 +1,80 @@
+#ifndef _NAV_HISTORY_H_
+#define _NAV_HISTORY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "navdata.h"
+
+// Number of samples kept. Must be a power of two. At the 200 Hz full
+// navdata rate this is a little over a second of history, at the 15 Hz
+// demo rate about 17 seconds.
+#define NAVDATA_HISTORY_SIZE 256
+
+// A decoded navdata packet: the header fields plus the demo option.
+typedef struct
+{
+	uint64_t	rxTime;			// Kernel receive time, monotonicNs() clock.
+	uint32_t	seq;			// Navdata header sequence number.
+	uint32_t	state;			// Drone state bitfield.
+	uint32_t	ctrlState;		// Flying state (landed, flying, hovering, etc.).
+	uint32_t	battery;		// Battery percentage.
+	float		theta;			// Pitch, milli-degrees.
+	float		phi;			// Roll, milli-degrees.
+	float		psi;			// Yaw, milli-degrees, -180000 to 180000.
+	int32_t		altitude;		// Centimeters.
+	float		vx;				// Estimated linear velocities.
+	float		vy;
+	float		vz;
+} NavdataSample;
+
+// Slot versions follow the seqlock pattern but also encode which sample
+// the slot holds: 2n + 1 while sample n is being written, 2n + 2 once it
+// is complete. A reader that sees anything else knows it was lapped.
+typedef struct
+{
+	_Atomic uint64_t	version;
+	NavdataSample		sample;
+} NavdataHistorySlot;
+
+// Single-producer, multi-consumer ring of navdata samples. Readers never
+// lock and never block the producer; they retry if a slot changes under them.
+typedef struct
+{
+	NavdataHistorySlot	slots[NAVDATA_HISTORY_SIZE];
+	_Atomic uint64_t	head;		// Number of samples ever pushed.
+
+	// Only used to wake consumers blocked in navdataHistoryWait(). The
+	// producer skips the mutex entirely while nobody is waiting.
+	_Atomic int			waiters;
+	pthread_mutex_t		waitMutex;
+	pthread_cond_t		waitCond;
+} NavdataHistory;
+
+void navdataHistoryInit( NavdataHistory *history );
+
+// Only one thread may push.
+void navdataHistoryPush( NavdataHistory *history, const NavdataSample *sample );
+
+// Pushes the header and demo option of a parsed packet received at rxTime.
+// Returns 0, or -1 if the packet has no demo option and nothing was pushed.
+int navdataHistoryPushPacket( NavdataHistory *history, const navdata_packet_t *packet, uint64_t rxTime );
+
+// Number of samples pushed so far.
+uint64_t navdataHistoryCount( NavdataHistory *history );
+
+// Copies the newest sample into out. Returns 0, or -1 if nothing was pushed yet.
+int navdataHistoryLatest( NavdataHistory *history, NavdataSample *out );
+
+// Copies samples received between from and to (inclusive, monotonicNs()
+// clock) into out, oldest first, at most max of them. Returns the number
+// copied. Only the most recent NAVDATA_HISTORY_SIZE samples are available.
+size_t navdataHistoryWindow( NavdataHistory *history, uint64_t from, uint64_t to, NavdataSample *out, size_t max );
+
+// Blocks until more than seen samples have been pushed or timeoutMs passes.
+// Returns the current sample count, which the caller passes back in next time.
+uint64_t navdataHistoryWait( NavdataHistory *history, uint64_t seen, int timeoutMs );
+
+#endif
@@ -1,6 +1,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netdb.h>
@@ -17,7 +18,24 @@
 #include <stdio.h>
 #include <pthread.h>
 
-#define MAX_BUFFER_SIZE 1024
+#include "network.h"
+
+unsigned long raiseFileLimit( unsigned long needed )
+{
+	struct rlimit limit;
+	if( getrlimit( RLIMIT_NOFILE, &limit ) < 0 )
+	{
+		return needed;	// Nothing to go on, so don't warn.
+	}
+	if( limit.rlim_cur >= needed )
+	{
+		return limit.rlim_cur;
+	}
+
+	struct rlimit raised = limit;
+	raised.rlim_cur = ( limit.rlim_max == RLIM_INFINITY || limit.rlim_max > needed ) ? needed : limit.rlim_max;
+	return setrlimit( RLIMIT_NOFILE, &raised ) < 0 ? limit.rlim_cur : raised.rlim_cur;
+}
 
 int createTcpClientConnection( const char *hostname, const char *port )
 {
@@ -85,3 +103,92 @@ int createUdpClientConnection( const char *hostname, const char *port, struct so
 	return sockfd;
 }
 
+
+void lineReaderInit( LineReader *reader, int fd )
+{
+	reader->fd = fd;
+	reader->start = 0;
+	reader->length = 0;
+	reader->eof = 0;
+	reader->discarding = 0;
+}
+
+ssize_t lineReaderFill( LineReader *reader )
+{
+	// Move the partial line, if any, to the front.
+	reader->length -= reader->start;
+	memmove( reader->buffer, reader->buffer + reader->start, reader->length );
+	reader->start = 0;
+
+	// One byte is always kept free for the terminating NUL. A full buffer
+	// is part of one line, and the rest of it goes too.
+	if( reader->length == MAX_BUFFER_SIZE - 1 )
+	{
+		fprintf( stderr, "Discarding a message longer than %d bytes.\n", MAX_BUFFER_SIZE - 1 );
+		reader->length = 0;
+		reader->discarding = 1;
+	}
+
+	ssize_t size;
+	do
+	{
+		size = recv( reader->fd, reader->buffer + reader->length, MAX_BUFFER_SIZE - 1 - reader->length, 0 );
+	} while( size < 0 && errno == EINTR );
+
+	if( size > 0 )
+	{
+		reader->length += size;
+		if( reader->discarding )
+		{
+			char *newline = memchr( reader->buffer, '\n', reader->length );
+			if( newline == NULL )
+			{
+				reader->length = 0;
+			}
+			else
+			{
+				reader->discarding = 0;
+				reader->length -= newline + 1 - reader->buffer;
+				memmove( reader->buffer, newline + 1, reader->length );
+			}
+		}
+	}
+	else if( size == 0 )
+	{
+		reader->eof = 1;
+	}
+
+	return size;
+}
+
+char *lineReaderNext( LineReader *reader )
+{
+	if( reader->start >= reader->length )
+	{
+		return NULL;
+	}
+
+	char *line = reader->buffer + reader->start;
+	char *newline = memchr( line, '\n', reader->length - reader->start );
+	if( newline == NULL )
+	{
+		if( !reader->eof )
+		{
+			return NULL;
+		}
+		newline = reader->buffer + reader->length;	// Unterminated last line.
+	}
+
+	*newline = '\0';
+	reader->start = newline - reader->buffer;
+	if( reader->start < reader->length )
+	{
+		reader->start++;
+	}
+	if( newline > line && newline[-1] == '\r' )
+	{
+		newline[-1] = '\0';
+	}
+
+	return line;
+}
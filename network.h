@@ -9,8 +9,43 @@
 #define ANDROID_COMMAND_PORT "5558"		// Port the android device sends commands from.
 #define ANDROID_GPS_UPDATE_PORT "5559"	// Port the android devices listens on for GPS updates.
 
+#define MAIN_METRICS_PORT "9560"		// Prometheus scrapes of main, on localhost.
+#define USBGPS_METRICS_PORT "9561"		// Prometheus scrapes of usbgps, on localhost.
+
 #define MAX_BUFFER_SIZE 1024
 
+#include <sys/types.h>
+#include <netinet/in.h>
+
+// Reassembles newline-framed messages from a stream socket, however TCP
+// happens to split or coalesce them.
+typedef struct
+{
+	int		fd;
+	char	buffer[MAX_BUFFER_SIZE];
+	size_t	start;		// First byte not yet returned by lineReaderNext().
+	size_t	length;		// Bytes in buffer.
+	int		eof;		// The peer closed the connection.
+	int		discarding;	// Skipping the rest of an overlong line.
+} LineReader;
+
+void lineReaderInit( LineReader *reader, int fd );
+
+// Reads whatever the socket has, blocking only if the socket does. Returns
+// the number of bytes read, 0 at end of stream, or -1 with errno set.
+// Invalidates lines returned by lineReaderNext(), so take them all first.
+// A line longer than the buffer is discarded whole, up to its "\n".
+ssize_t lineReaderFill( LineReader *reader );
+
+// Returns the next complete line, NUL-terminated and without its "\n" or
+// "\r\n", or NULL if there is none yet. At end of stream an unterminated
+// last line is returned too.
+char *lineReaderNext( LineReader *reader );
+
+// Raises the soft limit on open files to needed, as far as the hard limit
+// allows. Returns the soft limit now in force.
+unsigned long raiseFileLimit( unsigned long needed );
+
 int createTcpClientConnection( const char *hostname, const char *port );	// port number as string
 int createUdpClientConnection( const char *hostname, const char *port, struct sockaddr_in *theiraddr );
 
@@ -0,0 +1,68 @@
+#include <sys/epoll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "reactor.h"
+
+#define MAX_EVENTS 32
+
+void reactorInit( Reactor *reactor )
+{
+	reactor->numEntries = 0;
+	reactor->epollfd = epoll_create1( EPOLL_CLOEXEC );
+	if( reactor->epollfd < 0 )
+	{
+		fprintf( stderr, "Reactor epoll_create1() failure, errno = %d.\n", errno );
+		exit( EXIT_FAILURE );
+	}
+}
+
+int reactorAdd( Reactor *reactor, int fd, ReactorHandler handler, void *arg )
+{
+	if( reactor->numEntries == REACTOR_MAX_HANDLERS )
+	{
+		fprintf( stderr, "Reactor full, can't add fd %d.\n", fd );
+		return -1;
+	}
+
+	ReactorEntry *entry = &reactor->entries[reactor->numEntries];
+	entry->fd = fd;
+	entry->handler = handler;
+	entry->arg = arg;
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = entry;
+	if( epoll_ctl( reactor->epollfd, EPOLL_CTL_ADD, fd, &ev ) < 0 )
+	{
+		fprintf( stderr, "Reactor couldn't add fd %d, errno = %d.\n", fd, errno );
+		return -1;
+	}
+
+	reactor->numEntries++;
+	return 0;
+}
+
+int reactorRunOnce( Reactor *reactor, int timeoutMs )
+{
+	struct epoll_event events[MAX_EVENTS];
+	int count = epoll_wait( reactor->epollfd, events, MAX_EVENTS, timeoutMs );
+	if( count < 0 )
+	{
+		if( errno != EINTR )
+		{
+			fprintf( stderr, "Reactor epoll_wait() failure, errno = %d.\n", errno );
+		}
+		return 0;
+	}
+
+	int i;
+	for( i = 0; i < count; i++ )
+	{
+		ReactorEntry *entry = events[i].data.ptr;
+		entry->handler( entry->fd, entry->arg );
+	}
+
+	return count;
+}
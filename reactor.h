@@ -0,0 +1,36 @@
+#ifndef _REACTOR_H_
+#define _REACTOR_H_
+
+#define REACTOR_MAX_HANDLERS 32
+
+// Called when fd is readable (or hung up, or in error).
+typedef void (*ReactorHandler)( int fd, void *arg );
+
+typedef struct
+{
+	int				fd;
+	ReactorHandler	handler;
+	void			*arg;
+} ReactorEntry;
+
+// Single-threaded readiness loop over one epoll set. Subsystems that keep
+// their own epoll set are added by that fd, with a handler that dispatches
+// it without blocking.
+typedef struct
+{
+	int				epollfd;
+	unsigned int	numEntries;
+	ReactorEntry	entries[REACTOR_MAX_HANDLERS];
+} Reactor;
+
+// Exits on failure.
+void reactorInit( Reactor *reactor );
+
+// Returns 0, or -1 if the reactor is full or epoll refused the fd.
+int reactorAdd( Reactor *reactor, int fd, ReactorHandler handler, void *arg );
+
+// Waits up to timeoutMs (-1 forever) and runs the handlers of every ready
+// fd. Returns the number of handlers run.
+int reactorRunOnce( Reactor *reactor, int timeoutMs );
+
+#endif
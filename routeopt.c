@@ -0,0 +1,713 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "routeopt.h"
+#include "timeutil.h"
+
+// The open path is searched as a closed tour through one extra node, the
+// free end, which stands between the path's last point and its first.
+// Fixed points are tied to it by making every other edge to it cost
+// ROUTE_FAR, more than any move could save, so no improving move unties them.
+#define ROUTE_FAR 1.0e5f		// Kilometers, exact in a float.
+#define ROUTE_EPSILON 1e-7		// Kilometers; smaller gains are rounding.
+#define ROUTE_MAX_SEGMENT 3		// Or-opt moves runs of up to this many points.
+#define ROUTE_KICK_SEGMENT 25	// Longest run a kick swaps.
+
+#define PI 3.14159265358979323846
+#define EARTH_RADIUS 6371.0		// Kilometers, as in gpsutil.c.
+
+typedef struct
+{
+	const GpsPoint		*points;
+	unsigned int		count;
+	const RouteOptions	*options;
+	double				*latitudes;	// Radians.
+	double				*longitudes;
+	double				*cosines;	// Of the latitudes.
+	unsigned int		size;		// count + 1, the free end being node count.
+	float				*dist;		// size x size.
+	unsigned int		*near;		// size x numNear, nearest first.
+	unsigned int		numNear;
+	unsigned int		workers;
+	uint64_t			deadline;	// monotonicNs() to stop kicking at.
+} RouteProblem;
+
+typedef struct
+{
+	RouteProblem	*problem;
+	unsigned int	index;
+	pthread_t		thread;
+	unsigned int	*tour;		// Position to node.
+	unsigned int	*pos;		// Node to position.
+	unsigned int	*best;
+	unsigned int	*queue;		// Nodes whose moves are worth trying again, in a ring.
+	unsigned char	*queued;
+	unsigned int	head;
+	unsigned int	pending;
+	double			length;		// Of tour, including edges to the free end.
+	double			bestLength;
+	double			seedLength;
+	double			localLength;
+	uint64_t		kicks;
+	uint64_t		improvements;
+	uint64_t		random;
+} RouteWorker;
+
+static void *allocate( size_t count, size_t size )
+{
+	void *memory = calloc( count, size );
+	if( memory == NULL )
+	{
+		fprintf( stderr, "Couldn't allocate route optimiser.\n" );
+		exit( EXIT_FAILURE );
+	}
+	return memory;
+}
+
+static inline double distance( const RouteProblem *problem, unsigned int a, unsigned int b )
+{
+	return problem->dist[(size_t)a * problem->size + b];
+}
+
+// splitmix64.
+static uint64_t nextRandom( uint64_t *state )
+{
+	uint64_t z = ( *state += 0x9e3779b97f4a7c15ULL );
+	z = ( z ^ ( z >> 30 ) ) * 0xbf58476d1ce4e5b9ULL;
+	z = ( z ^ ( z >> 27 ) ) * 0x94d049bb133111ebULL;
+	return z ^ ( z >> 31 );
+}
+
+// The free end's distances, which depend only on which ends are fixed.
+static float freeEndDistance( const RouteProblem *problem, unsigned int point )
+{
+	const RouteOptions *options = problem->options;
+	if( !options->fixedStart && !options->fixedEnd )
+	{
+		return 0;
+	}
+	if( ( options->fixedStart && point == 0 ) || ( options->fixedEnd && point == problem->count - 1 ) )
+	{
+		return 0;
+	}
+	return ROUTE_FAR;
+}
+
+// Fills row i of the matrix right of the diagonal, and its mirror below.
+// getDistance()'s haversine, with each point's trigonometry done once.
+static void buildDistances( RouteProblem *problem, unsigned int i )
+{
+	size_t size = problem->size;
+	float *dist = problem->dist;
+	unsigned int j;
+
+	dist[i * size + i] = 0;
+	if( i == problem->count )
+	{
+		return;
+	}
+	for( j = i + 1; j < problem->count; j++ )
+	{
+		double sinLat = sin( ( problem->latitudes[j] - problem->latitudes[i] ) / 2 );
+		double sinLon = sin( ( problem->longitudes[j] - problem->longitudes[i] ) / 2 );
+		double a = sinLat * sinLat + sinLon * sinLon * problem->cosines[i] * problem->cosines[j];
+		float d = EARTH_RADIUS * 2 * atan2( sqrt( a ), sqrt( 1 - a ) );
+		dist[i * size + j] = d;
+		dist[j * size + i] = d;
+	}
+	dist[i * size + problem->count] = freeEndDistance( problem, i );
+	dist[problem->count * size + i] = freeEndDistance( problem, i );
+}
+
+// Insertion into a short sorted list beats sorting the whole row.
+static void buildNeighbours( RouteProblem *problem, unsigned int i )
+{
+	const float *row = &problem->dist[(size_t)i * problem->size];
+	unsigned int *near = &problem->near[(size_t)i * problem->numNear];
+	unsigned int found = 0;
+	unsigned int j;
+
+	for( j = 0; j < problem->size; j++ )
+	{
+		if( j == i || ( found == problem->numNear && row[j] >= row[near[found - 1]] ) )
+		{
+			continue;
+		}
+		unsigned int k = ( found < problem->numNear ) ? found++ : found - 1;
+		while( k > 0 && row[near[k - 1]] > row[j] )
+		{
+			near[k] = near[k - 1];
+			k--;
+		}
+		near[k] = j;
+	}
+}
+
+// Rows are split between workers, interleaved so the short ones at the
+// bottom of the triangle are shared too.
+static void *buildMatrix( void *arg )
+{
+	RouteWorker *worker = (RouteWorker *)arg;
+	RouteProblem *problem = worker->problem;
+	unsigned int i;
+	for( i = worker->index; i < problem->size; i += problem->workers )
+	{
+		buildDistances( problem, i );
+	}
+	return NULL;
+}
+
+static void *buildLists( void *arg )
+{
+	RouteWorker *worker = (RouteWorker *)arg;
+	RouteProblem *problem = worker->problem;
+	unsigned int i;
+	for( i = worker->index; i < problem->size; i += problem->workers )
+	{
+		buildNeighbours( problem, i );
+	}
+	return NULL;
+}
+
+static inline unsigned int successor( const RouteWorker *worker, unsigned int node )
+{
+	unsigned int p = worker->pos[node] + 1;
+	return worker->tour[( p == worker->problem->size ) ? 0 : p];
+}
+
+static inline unsigned int predecessor( const RouteWorker *worker, unsigned int node )
+{
+	unsigned int p = worker->pos[node];
+	return worker->tour[( p == 0 ) ? worker->problem->size - 1 : p - 1];
+}
+
+static inline unsigned int wrap( const RouteWorker *worker, unsigned int position )
+{
+	return position % worker->problem->size;
+}
+
+// Forward distance from position from to position to.
+static inline unsigned int span( const RouteWorker *worker, unsigned int from, unsigned int to )
+{
+	return ( to + worker->problem->size - from ) % worker->problem->size;
+}
+
+// Reverses the run from position from forward to position to, inclusive.
+static void reverse( RouteWorker *worker, unsigned int from, unsigned int to )
+{
+	unsigned int steps = ( span( worker, from, to ) + 1 ) / 2;
+	unsigned int i = from;
+	unsigned int j = to;
+	while( steps-- > 0 )
+	{
+		unsigned int a = worker->tour[i];
+		unsigned int b = worker->tour[j];
+		worker->tour[i] = b;
+		worker->pos[b] = i;
+		worker->tour[j] = a;
+		worker->pos[a] = j;
+		i = ( i + 1 == worker->problem->size ) ? 0 : i + 1;
+		j = ( j == 0 ) ? worker->problem->size - 1 : j - 1;
+	}
+}
+
+// A reversal and its complement give the same tour; do the shorter.
+static void reverseShorter( RouteWorker *worker, unsigned int from, unsigned int to )
+{
+	if( 2 * ( span( worker, from, to ) + 1 ) > worker->problem->size )
+	{
+		reverse( worker, wrap( worker, to + 1 ), wrap( worker, from + worker->problem->size - 1 ) );
+	}
+	else
+	{
+		reverse( worker, from, to );
+	}
+}
+
+static void push( RouteWorker *worker, unsigned int node )
+{
+	if( !worker->queued[node] )
+	{
+		worker->queued[node] = 1;
+		worker->queue[wrap( worker, worker->head + worker->pending )] = node;
+		worker->pending++;
+	}
+}
+
+static unsigned int pop( RouteWorker *worker )
+{
+	unsigned int node = worker->queue[worker->head];
+	worker->head = wrap( worker, worker->head + 1 );
+	worker->pending--;
+	worker->queued[node] = 0;
+	return node;
+}
+
+// Replaces edges a-b and c-d with a-c and b-d, where b and d are a's and
+// c's successors (forward) or predecessors (!forward).
+static int tryTwoOpt( RouteWorker *worker, unsigned int a, int forward )
+{
+	const RouteProblem *problem = worker->problem;
+	unsigned int b = forward ? successor( worker, a ) : predecessor( worker, a );
+	double ab = distance( problem, a, b );
+	const unsigned int *near = &problem->near[(size_t)a * problem->numNear];
+	unsigned int k;
+
+	for( k = 0; k < problem->numNear; k++ )
+	{
+		unsigned int c = near[k];
+		double ac = distance( problem, a, c );
+		// The list is sorted, so no later c can pay for a longer a-c.
+		if( ab - ac <= ROUTE_EPSILON )
+		{
+			break;
+		}
+		unsigned int d = forward ? successor( worker, c ) : predecessor( worker, c );
+		if( c == b || d == a )
+		{
+			continue;
+		}
+
+		double delta = ac + distance( problem, b, d ) - ab - distance( problem, c, d );
+		if( delta < -ROUTE_EPSILON )
+		{
+			if( forward )
+			{
+				reverseShorter( worker, worker->pos[b], worker->pos[c] );
+			}
+			else
+			{
+				reverseShorter( worker, worker->pos[c], worker->pos[b] );
+			}
+			worker->length += delta;
+			push( worker, a );
+			push( worker, b );
+			push( worker, c );
+			push( worker, d );
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Moves the run of length points starting at position first to between c
+// and its successor e, reversed if that is shorter. Done as three
+// reversals over the run and whichever side of it is shorter to reach c.
+static void moveSegment( RouteWorker *worker, unsigned int first, unsigned int length, unsigned int c, int reversed )
+{
+	unsigned int last = wrap( worker, first + length - 1 );
+	unsigned int k = worker->pos[c];
+	unsigned int after = span( worker, last, k );			// Points from the run's end up to c.
+	unsigned int before = span( worker, k, first ) - 1;		// Points from c's successor to the run.
+
+	if( after <= before )
+	{
+		// run B e -> B run e
+		reverse( worker, first, k );
+		reverse( worker, first, wrap( worker, first + after - 1 ) );
+		if( !reversed )
+		{
+			reverse( worker, wrap( worker, first + after ), k );
+		}
+	}
+	else
+	{
+		// c B run -> c run B
+		unsigned int start = wrap( worker, k + 1 );
+		reverse( worker, start, last );
+		reverse( worker, wrap( worker, start + length ), last );
+		if( !reversed )
+		{
+			reverse( worker, start, wrap( worker, start + length - 1 ) );
+		}
+	}
+}
+
+// Or-opt: moves a run of up to ROUTE_MAX_SEGMENT points that starts or
+// ends at a to between two points near either of its ends.
+static int tryOrOpt( RouteWorker *worker, unsigned int a )
+{
+	const RouteProblem *problem = worker->problem;
+	unsigned int length;
+
+	for( length = 1; length <= ROUTE_MAX_SEGMENT && length + 3 <= problem->size; length++ )
+	{
+		unsigned int side;
+		for( side = 0; side < ( length > 1 ? 2 : 1 ); side++ )
+		{
+			unsigned int first = ( side == 0 ) ? worker->pos[a] : wrap( worker, worker->pos[a] + problem->size - length + 1 );
+			unsigned int s1 = worker->tour[first];
+			unsigned int s2 = worker->tour[wrap( worker, first + length - 1 )];
+			unsigned int p = predecessor( worker, s1 );
+			unsigned int n = successor( worker, s2 );
+			double removed = distance( problem, p, s1 ) + distance( problem, s2, n ) - distance( problem, p, n );
+			if( removed <= ROUTE_EPSILON )
+			{
+				continue;
+			}
+
+			unsigned int end;
+			for( end = 0; end < 2; end++ )
+			{
+				unsigned int from = end ? s2 : s1;
+				const unsigned int *near = &problem->near[(size_t)from * problem->numNear];
+				unsigned int k;
+				for( k = 0; k < problem->numNear; k++ )
+				{
+					unsigned int c = near[k];
+					if( c == p || span( worker, first, worker->pos[c] ) < length )
+					{
+						continue;
+					}
+
+					unsigned int e = successor( worker, c );
+					double ce = distance( problem, c, e );
+					double straight = distance( problem, c, s1 ) + distance( problem, s2, e ) - ce;
+					double reversed = distance( problem, c, s2 ) + distance( problem, s1, e ) - ce;
+					double added = ( reversed < straight ) ? reversed : straight;
+					if( added - removed < -ROUTE_EPSILON )
+					{
+						moveSegment( worker, first, length, c, reversed < straight );
+						worker->length += added - removed;
+						push( worker, p );
+						push( worker, n );
+						push( worker, s1 );
+						push( worker, s2 );
+						push( worker, c );
+						push( worker, e );
+						return 1;
+					}
+				}
+			}
+		}
+	}
+	return 0;
+}
+
+// Improves until no node queued has a move that helps.
+static void localSearch( RouteWorker *worker )
+{
+	while( worker->pending > 0 )
+	{
+		unsigned int a = pop( worker );
+		if( !tryTwoOpt( worker, a, 1 ) && !tryTwoOpt( worker, a, 0 ) )
+		{
+			tryOrOpt( worker, a );
+		}
+	}
+}
+
+static double tourLength( const RouteWorker *worker )
+{
+	double length = 0;
+	unsigned int i;
+	for( i = 0; i < worker->problem->size; i++ )
+	{
+		length += distance( worker->problem, worker->tour[i], worker->tour[wrap( worker, i + 1 )] );
+	}
+	return length;
+}
+
+// Nearest neighbour from the free end. Every worker but the first sometimes
+// takes the second nearest instead, so they start from different routes.
+static void seedTour( RouteWorker *worker )
+{
+	const RouteProblem *problem = worker->problem;
+	unsigned int held = problem->options->fixedEnd ? problem->count - 1 : problem->size;
+	unsigned int current = problem->count;
+	unsigned int i;
+
+	// queued doubles as the visited flags until the search starts.
+	worker->queued[current] = 1;
+	worker->tour[0] = current;
+	for( i = 1; i < problem->size; i++ )
+	{
+		unsigned int nearest = problem->size;
+		unsigned int second = problem->size;
+		unsigned int j;
+		for( j = 0; j < problem->count; j++ )
+		{
+			if( worker->queued[j] || ( j == held && i < problem->count ) )
+			{
+				continue;
+			}
+			if( nearest == problem->size || distance( problem, current, j ) < distance( problem, current, nearest ) )
+			{
+				second = nearest;
+				nearest = j;
+			}
+			else if( second == problem->size || distance( problem, current, j ) < distance( problem, current, second ) )
+			{
+				second = j;
+			}
+		}
+
+		// Not on the first step, which must take a fixed start.
+		if( worker->index > 0 && i > 1 && second < problem->size && ( nextRandom( &worker->random ) & 3 ) == 0 )
+		{
+			nearest = second;
+		}
+		worker->tour[i] = nearest;
+		worker->queued[nearest] = 1;
+		current = nearest;
+	}
+
+	memset( worker->queued, 0, problem->size );
+	for( i = 0; i < problem->size; i++ )
+	{
+		worker->pos[worker->tour[i]] = i;
+	}
+	worker->length = tourLength( worker );
+}
+
+// Swaps two short adjacent runs somewhere in the tour, a move the local
+// search can't undo in one step, to get it out of its current optimum.
+static void kick( RouteWorker *worker )
+{
+	const RouteProblem *problem = worker->problem;
+	unsigned int i = nextRandom( &worker->random ) % problem->size;
+	unsigned int lengthB = 1 + nextRandom( &worker->random ) % ROUTE_KICK_SEGMENT;
+	unsigned int lengthC = 1 + nextRandom( &worker->random ) % ROUTE_KICK_SEGMENT;
+	while( lengthB + lengthC + 2 > problem->size )
+	{
+		if( lengthB > lengthC )
+		{
+			lengthB--;
+		}
+		else
+		{
+			lengthC--;
+		}
+	}
+
+	unsigned int a = worker->tour[i];
+	unsigned int b1 = worker->tour[wrap( worker, i + 1 )];
+	unsigned int b2 = worker->tour[wrap( worker, i + lengthB )];
+	unsigned int c1 = worker->tour[wrap( worker, i + lengthB + 1 )];
+	unsigned int c2 = worker->tour[wrap( worker, i + lengthB + lengthC )];
+	unsigned int d = worker->tour[wrap( worker, i + lengthB + lengthC + 1 )];
+
+	// a B C d -> a C B d
+	worker->length += distance( problem, a, c1 ) + distance( problem, c2, b1 ) + distance( problem, b2, d )
+		- distance( problem, a, b1 ) - distance( problem, b2, c1 ) - distance( problem, c2, d );
+	reverse( worker, wrap( worker, i + 1 ), wrap( worker, i + lengthB + lengthC ) );
+	reverse( worker, wrap( worker, i + 1 ), wrap( worker, i + lengthC ) );
+	reverse( worker, wrap( worker, i + lengthC + 1 ), wrap( worker, i + lengthB + lengthC ) );
+
+	push( worker, a );
+	push( worker, b1 );
+	push( worker, b2 );
+	push( worker, c1 );
+	push( worker, c2 );
+	push( worker, d );
+}
+
+static void *searchRun( void *arg )
+{
+	RouteWorker *worker = (RouteWorker *)arg;
+	RouteProblem *problem = worker->problem;
+	unsigned int i;
+
+	worker->tour = allocate( problem->size, sizeof( unsigned int ) );
+	worker->pos = allocate( problem->size, sizeof( unsigned int ) );
+	worker->best = allocate( problem->size, sizeof( unsigned int ) );
+	worker->queue = allocate( problem->size, sizeof( unsigned int ) );
+	worker->queued = allocate( problem->size, sizeof( unsigned char ) );
+
+	seedTour( worker );
+	worker->seedLength = worker->length;
+	for( i = 0; i < problem->size; i++ )
+	{
+		push( worker, worker->tour[i] );
+	}
+	localSearch( worker );
+	worker->localLength = worker->length;
+	worker->bestLength = worker->length;
+	memcpy( worker->best, worker->tour, problem->size * sizeof( unsigned int ) );
+
+	// Keep a kicked tour only if it ends up shorter, otherwise go back.
+	while( monotonicNs() < problem->deadline )
+	{
+		kick( worker );
+		localSearch( worker );
+		worker->kicks++;
+
+		if( worker->length < worker->bestLength - ROUTE_EPSILON )
+		{
+			memcpy( worker->best, worker->tour, problem->size * sizeof( unsigned int ) );
+			worker->bestLength = worker->length;
+			worker->improvements++;
+		}
+		else
+		{
+			memcpy( worker->tour, worker->best, problem->size * sizeof( unsigned int ) );
+			for( i = 0; i < problem->size; i++ )
+			{
+				worker->pos[worker->tour[i]] = i;
+			}
+			worker->length = worker->bestLength;
+		}
+	}
+	return NULL;
+}
+
+// Runs function on every worker, the first on the calling thread.
+static void runWorkers( RouteWorker *workers, unsigned int count, void *( *function )( void * ) )
+{
+	unsigned int i;
+	for( i = 1; i < count; i++ )
+	{
+		if( pthread_create( &workers[i].thread, NULL, function, &workers[i] ) != 0 )
+		{
+			fprintf( stderr, "Couldn't start route optimiser worker %u.\n", i );
+			exit( EXIT_FAILURE );
+		}
+	}
+	function( &workers[0] );
+	for( i = 1; i < count; i++ )
+	{
+		pthread_join( workers[i].thread, NULL );
+	}
+}
+
+void routeOptimise( const GpsPoint *points, unsigned int count, const RouteOptions *options, unsigned int *order, RouteStats *stats )
+{
+	RouteStats ignored;
+	if( stats == NULL )
+	{
+		stats = &ignored;
+	}
+	memset( stats, 0, sizeof( RouteStats ) );
+
+	unsigned int i;
+	for( i = 0; i < count; i++ )
+	{
+		order[i] = i;
+	}
+	stats->givenLength = routeLength( points, order, count );
+	stats->seedLength = stats->localLength = stats->length = stats->givenLength;
+	if( count < 3 )
+	{
+		return;
+	}
+
+	RouteProblem problem;
+	problem.points = points;
+	problem.count = count;
+	problem.options = options;
+	problem.size = count + 1;
+	problem.numNear = ( ROUTE_NEIGHBOURS < count ) ? ROUTE_NEIGHBOURS : count;
+	problem.workers = options->workers;
+	if( problem.workers == 0 )
+	{
+		long cpus = sysconf( _SC_NPROCESSORS_ONLN );
+		problem.workers = ( cpus > 0 ) ? cpus : 1;
+	}
+	if( problem.workers > problem.size )
+	{
+		problem.workers = problem.size;
+	}
+	problem.dist = allocate( (size_t)problem.size * problem.size, sizeof( float ) );
+	problem.near = allocate( (size_t)problem.size * problem.numNear, sizeof( unsigned int ) );
+
+	problem.latitudes = allocate( count, sizeof( double ) );
+	problem.longitudes = allocate( count, sizeof( double ) );
+	problem.cosines = allocate( count, sizeof( double ) );
+	for( i = 0; i < count; i++ )
+	{
+		problem.latitudes[i] = points[i].latitude * PI / 180.0;
+		problem.longitudes[i] = points[i].longitude * PI / 180.0;
+		problem.cosines[i] = cos( problem.latitudes[i] );
+	}
+
+	RouteWorker *workers = allocate( problem.workers, sizeof( RouteWorker ) );
+	for( i = 0; i < problem.workers; i++ )
+	{
+		workers[i].problem = &problem;
+		workers[i].index = i;
+		workers[i].random = options->seed + i;
+	}
+
+	uint64_t start = monotonicNs();
+	runWorkers( workers, problem.workers, buildMatrix );
+	runWorkers( workers, problem.workers, buildLists );
+	uint64_t built = monotonicNs();
+	problem.deadline = built + (uint64_t)( options->budgetMs * 1e6 );
+	runWorkers( workers, problem.workers, searchRun );
+	stats->matrixNs = built - start;
+	stats->searchNs = monotonicNs() - built;
+
+	// Lengths so far include the edges to the free end, ROUTE_FAR when
+	// only one end is tied to it.
+	double offset = ( options->fixedStart != options->fixedEnd ) ? ROUTE_FAR : 0;
+	RouteWorker *best = &workers[0];
+	stats->localLength = workers[0].localLength - offset;
+	stats->seedLength = workers[0].seedLength - offset;
+	for( i = 0; i < problem.workers; i++ )
+	{
+		if( workers[i].bestLength < best->bestLength )
+		{
+			best = &workers[i];
+		}
+		if( workers[i].localLength - offset < stats->localLength )
+		{
+			stats->localLength = workers[i].localLength - offset;
+		}
+		stats->kicks += workers[i].kicks;
+		stats->improvements += workers[i].improvements;
+	}
+
+	// Cut the tour open at the free end, then turn it round if a fixed end
+	// came out on the wrong side.
+	unsigned int cut = 0;
+	while( best->best[cut] != count )
+	{
+		cut++;
+	}
+	for( i = 0; i < count; i++ )
+	{
+		order[i] = best->best[( cut + 1 + i ) % problem.size];
+	}
+	if( ( options->fixedStart && order[0] != 0 ) || ( !options->fixedStart && options->fixedEnd && order[count - 1] != count - 1 ) )
+	{
+		for( i = 0; i < count / 2; i++ )
+		{
+			unsigned int swap = order[i];
+			order[i] = order[count - 1 - i];
+			order[count - 1 - i] = swap;
+		}
+	}
+	stats->length = routeLength( points, order, count );
+
+	for( i = 0; i < problem.workers; i++ )
+	{
+		free( workers[i].tour );
+		free( workers[i].pos );
+		free( workers[i].best );
+		free( workers[i].queue );
+		free( workers[i].queued );
+	}
+	free( workers );
+	free( problem.near );
+	free( problem.dist );
+	free( problem.cosines );
+	free( problem.longitudes );
+	free( problem.latitudes );
+}
+
+double routeLength( const GpsPoint *points, const unsigned int *order, unsigned int count )
+{
+	double length = 0;
+	unsigned int i;
+	for( i = 1; i < count; i++ )
+	{
+		length += getDistance( points[order[i - 1]], points[order[i]] );
+	}
+	return length;
+}
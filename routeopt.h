@@ -0,0 +1,47 @@
+#ifndef _ROUTE_OPT_H_
+#define _ROUTE_OPT_H_
+
+#include <stdint.h>
+
+#include "gpsutil.h"
+
+#define ROUTE_MAX_POINTS 5000		// Largest route optimised; the distance matrix grows as its square.
+#define ROUTE_NEIGHBOURS 10			// Nearest points each improving move is tried against.
+#define ROUTE_DEFAULT_BUDGET_MS 50	// Improvement time for Android routes.
+
+typedef struct
+{
+	int				fixedStart;	// Keep points[0] first.
+	int				fixedEnd;	// Keep points[count - 1] last.
+	unsigned int	workers;	// Threads, 0 for one per online CPU.
+	double			budgetMs;	// Time spent perturbing the first local optima. With 0 the
+								// order depends only on the points, seed and workers.
+	uint64_t		seed;
+} RouteOptions;
+
+// Kilometers, and where the time went.
+typedef struct
+{
+	double		givenLength;	// In the order given.
+	double		seedLength;		// Nearest neighbour, worker 0's.
+	double		localLength;	// Best first local optimum of any worker.
+	double		length;			// In the order returned.
+	uint64_t	kicks;			// Perturbations tried by every worker.
+	uint64_t	improvements;	// Of them, those that shortened a worker's best.
+	uint64_t	matrixNs;		// Distance matrix and neighbour lists.
+	uint64_t	searchNs;		// Construction and improvement.
+} RouteStats;
+
+// Orders points for the shortest open path through all of them: the drone
+// doesn't come back to the first. Each worker seeds a route by nearest
+// neighbour (randomised on all but the first), improves it with 2-opt and
+// Or-opt moves over a precomputed distance matrix until neither helps, then
+// kicks it with segment swaps and improves again until the budget runs out.
+// The best route of any worker wins. Writes count indices into points to
+// order. count must be at most ROUTE_MAX_POINTS; stats may be NULL.
+void routeOptimise( const GpsPoint *points, unsigned int count, const RouteOptions *options, unsigned int *order, RouteStats *stats );
+
+// Kilometers along points in order, without coming back.
+double routeLength( const GpsPoint *points, const unsigned int *order, unsigned int count );
+
+#endif
@@ -0,0 +1,25 @@
+# Measures the latency from a $GPGGA line on the serial port to the PCMD
+# main sends because of it, all on this machine: dummyserver writes fixes
+# to a pty and plays the drone, usbgps reads the pty, and main flies.
+# Usage: ./start-latency-bench.sh [fixes] [fixes per second] [main options]
+# e.g.   ./start-latency-bench.sh 300 5 -e -r 50
+FIXES=${1:-200}
+RATE=${2:-5}
+shift $(( $# < 2 ? $# : 2 ))
+
+rm -f serial_rpigps_data latency.out
+./dummyserver latency $FIXES $RATE > latency.out &
+BENCH=$!
+until grep -q "NMEA fixes on" latency.out; do sleep 0.1; done
+PTY=$(sed -n 's/NMEA fixes on //p' latency.out)
+
+./usbgps $PTY < /dev/null > /dev/null &
+GPS=$!
+until [ -S serial_rpigps_data ]; do sleep 0.1; done
+
+./main -a 127.0.0.1 -g "$@" > latency-main.out &
+MAIN=$!
+
+wait $BENCH
+kill $MAIN $GPS 2> /dev/null
+cat latency.out
@@ -0,0 +1,706 @@
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <math.h>
+
+#include "telemetry.h"
+#include "metrics.h"
+#include "network.h"
+#include "timeutil.h"
+#include "trace.h"
+
+#define MAX_EVENTS 32
+
+typedef enum
+{
+	FORMAT_TEXT,
+	FORMAT_BINARY
+} TelemetryFormat;
+
+typedef struct
+{
+	int			fd;				// -1 when the slot is free.
+	char		out[TELEMETRY_CLIENT_BUFFER];
+	size_t		start;			// First unsent byte in out.
+	size_t		length;			// Unsent bytes from start.
+	int			wantWrite;		// EPOLLOUT currently enabled.
+
+	char		request[TELEMETRY_REQUEST_LEN];
+	size_t		requestLength;
+
+	uint64_t	minInterval;	// Nanoseconds between updates, 0 for every fix.
+	uint64_t	lastSent;		// monotonicNs() of the last update.
+	uint64_t	generation;		// Fix generation last sent.
+	TelemetryFormat	format;
+	int			needKeyframe;	// Switched format since the last update.
+	int			negotiated;		// Sent a request, or had its chance to.
+} TelemetryClient;
+
+TelemetryStats telemetryStats;
+
+// Tags for the epoll entries that aren't clients.
+static int listenTag;
+static int timerTag;
+static int wakeTag;
+
+static int epollfd = -1;
+static int listenfd = -1;
+static int timerfd = -1;
+static _Atomic int wakefd = -1;	// Published last by the server thread, read by publishers on any thread.
+static TelemetryClient clients[TELEMETRY_MAX_CLIENTS];
+
+static NavdataHistory *navdataSource = NULL;
+
+// Written by telemetryPublishFix() from any thread.
+static GpsPoint latestFix;
+static uint64_t latestPublished;
+static uint64_t latestRealtime;
+static uint64_t latestGeneration = 0;
+static pthread_mutex_t latestFixMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// The server thread's copy of the latest fix, encoded once per generation
+// in each format. The delta frame is only valid for clients that were sent
+// the previous generation.
+static uint64_t currentGeneration = 0;
+static uint64_t currentPublished;
+static char currentText[MAX_BUFFER_SIZE];
+static size_t currentTextLength = 0;
+static uint8_t currentKeyframe[TELEMETRY_FRAME_MAX];
+static size_t currentKeyframeLength = 0;
+static uint8_t currentDelta[TELEMETRY_FRAME_MAX];
+static size_t currentDeltaLength = 0;
+
+// Coordinates of the previous generation, the base for delta frames.
+static int previousValid = 0;
+static int32_t previousLatitude;
+static int32_t previousLongitude;
+
+void telemetrySetNavdataSource( NavdataHistory *history )
+{
+	navdataSource = history;
+}
+
+void telemetryPublishFix( const GpsPoint *fix )
+{
+	pthread_mutex_lock( &latestFixMutex );
+	latestFix = *fix;
+	latestPublished = monotonicNs();
+	latestRealtime = realtimeNs();
+	latestGeneration++;
+	uint64_t generation = latestGeneration;
+	pthread_mutex_unlock( &latestFixMutex );
+	TRACE_INSTANT( "telemetry.publish", "generation", generation, NULL, 0 );
+
+	atomic_fetch_add( &telemetryStats.published, 1 );
+
+	// Before the server is open there is nobody to wake; it picks the fix
+	// up when it starts.
+	int fd = atomic_load_explicit( &wakefd, memory_order_acquire );
+	if( fd >= 0 )
+	{
+		uint64_t one = 1;
+		if( write( fd, &one, sizeof( one ) ) < 0 )
+		{
+			// Only fails if the counter is saturated, which already means "wake up".
+		}
+	}
+}
+
+static void closeClient( TelemetryClient *client )
+{
+	epoll_ctl( epollfd, EPOLL_CTL_DEL, client->fd, NULL );
+	close( client->fd );
+	client->fd = -1;
+	atomic_fetch_sub_explicit( &telemetryStats.clients, 1, memory_order_relaxed );
+}
+
+static void setWantWrite( TelemetryClient *client, int want )
+{
+	if( client->wantWrite == want )
+	{
+		return;
+	}
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLRDHUP | ( want ? EPOLLOUT : 0 );
+	ev.data.ptr = client;
+	epoll_ctl( epollfd, EPOLL_CTL_MOD, client->fd, &ev );
+	client->wantWrite = want;
+}
+
+// Sends as much queued output as the socket takes without blocking.
+// Returns -1 if the client went away and was closed.
+static int flushClient( TelemetryClient *client )
+{
+	while( client->length > 0 )
+	{
+		ssize_t sent = send( client->fd, client->out + client->start, client->length, MSG_DONTWAIT | MSG_NOSIGNAL );
+		if( sent < 0 )
+		{
+			if( errno == EAGAIN || errno == EWOULDBLOCK )
+			{
+				break;
+			}
+			if( errno == EINTR )
+			{
+				continue;
+			}
+			printf( "Android client unsubscribed from GPS updates.\n" );
+			closeClient( client );
+			return -1;
+		}
+
+		client->start += sent;
+		client->length -= sent;
+	}
+
+	if( client->length == 0 )
+	{
+		client->start = 0;
+	}
+	setWantWrite( client, client->length > 0 );
+	return 0;
+}
+
+// Queues data for a client and tries to send it. A client that can't keep
+// up is dropped rather than allowed to hold up everyone else. Returns -1
+// if the client was closed.
+static int queueToClient( TelemetryClient *client, const char *data, size_t length )
+{
+	if( client->start + client->length + length > TELEMETRY_CLIENT_BUFFER )
+	{
+		memmove( client->out, client->out + client->start, client->length );
+		client->start = 0;
+	}
+	if( client->length + length > TELEMETRY_CLIENT_BUFFER )
+	{
+		printf( "Android client too slow for GPS updates, dropping it.\n" );
+		atomic_fetch_add( &telemetryStats.dropped, 1 );
+		closeClient( client );
+		return -1;
+	}
+
+	memcpy( client->out + client->start + client->length, data, length );
+	client->length += length;
+	return flushClient( client );
+}
+
+static uint8_t *put16( uint8_t *p, uint16_t value )
+{
+	p[0] = value >> 8;
+	p[1] = value;
+	return p + 2;
+}
+
+static uint8_t *put32( uint8_t *p, uint32_t value )
+{
+	p = put16( p, value >> 16 );
+	return put16( p, value );
+}
+
+static uint8_t *put64( uint8_t *p, uint64_t value )
+{
+	p = put32( p, value >> 32 );
+	return put32( p, value );
+}
+
+// Zigzag maps small negative and positive changes alike to small varints.
+static uint8_t *putVarint( uint8_t *p, int32_t value )
+{
+	uint32_t zigzag = ( (uint32_t)value << 1 ) ^ (uint32_t)( value >> 31 );
+	while( zigzag >= 0x80 )
+	{
+		*p++ = ( zigzag & 0x7F ) | 0x80;
+		zigzag >>= 7;
+	}
+	*p++ = zigzag;
+	return p;
+}
+
+// Encodes a binary frame into buffer. With delta set the coordinates are
+// written relative to previousLatitude/previousLongitude. Returns the length.
+static size_t encodeFrame( uint8_t *buffer, uint64_t generation, uint64_t time, int valid, int32_t latitude, int32_t longitude,
+	const NavdataSample *navdata, int delta )
+{
+	uint8_t flags = delta ? 0 : TELEMETRY_KEYFRAME;
+	uint8_t *p = buffer + sizeof( TelemetryFrameHeader );
+
+	if( valid )
+	{
+		flags |= TELEMETRY_POSITION;
+		if( delta )
+		{
+			// encodeCurrent() has checked that both changes fit.
+			p = putVarint( p, (int32_t)( (int64_t)latitude - previousLatitude ) );
+			p = putVarint( p, (int32_t)( (int64_t)longitude - previousLongitude ) );
+		}
+		else
+		{
+			p = put32( p, latitude );
+			p = put32( p, longitude );
+		}
+	}
+
+	if( navdata != NULL )
+	{
+		flags |= TELEMETRY_ALTITUDE | TELEMETRY_BATTERY | TELEMETRY_ATTITUDE;
+		p = put32( p, navdata->altitude );
+		*p++ = navdata->battery;
+		p = put16( p, (int16_t)( navdata->theta / 10 ) );
+		p = put16( p, (int16_t)( navdata->phi / 10 ) );
+		p = put16( p, (int16_t)( navdata->psi / 10 ) );
+	}
+
+	size_t length = p - buffer;
+	p = put16( buffer, TELEMETRY_FRAME_MAGIC );
+	*p++ = TELEMETRY_FRAME_VERSION;
+	*p++ = flags;
+	p = put16( p, length );
+	p = put16( p, generation );
+	put64( p, time / NSEC_PER_USEC );
+	return length;
+}
+
+// Builds every encoding of the newest fix. Called with latestFixMutex held.
+static void encodeCurrent()
+{
+	currentTextLength = snprintf( currentText, sizeof( currentText ), "%lf %lf\n", latestFix.latitude, latestFix.longitude );
+
+	int valid = !isnan( latestFix.latitude ) && !isnan( latestFix.longitude );
+	int32_t latitude = valid ? (int32_t)lround( latestFix.latitude * TELEMETRY_COORD_SCALE ) : 0;
+	int32_t longitude = valid ? (int32_t)lround( latestFix.longitude * TELEMETRY_COORD_SCALE ) : 0;
+
+	NavdataSample sample;
+	const NavdataSample *navdata = NULL;
+	if( navdataSource != NULL && navdataHistoryLatest( navdataSource, &sample ) == 0
+		&& monotonicNs() - sample.rxTime < TELEMETRY_NAVDATA_MAX_AGE_MS * NSEC_PER_MSEC )
+	{
+		navdata = &sample;
+	}
+
+	// Crossing the antimeridian changes longitude by almost 3.6e9, more
+	// than an int32 delta holds.
+	int64_t latitudeChange = (int64_t)latitude - previousLatitude;
+	int64_t longitudeChange = (int64_t)longitude - previousLongitude;
+	int deltaFits = latitudeChange >= INT32_MIN && latitudeChange <= INT32_MAX
+		&& longitudeChange >= INT32_MIN && longitudeChange <= INT32_MAX;
+
+	currentKeyframeLength = encodeFrame( currentKeyframe, latestGeneration, latestRealtime, valid, latitude, longitude, navdata, 0 );
+	if( valid && previousValid && deltaFits )
+	{
+		currentDeltaLength = encodeFrame( currentDelta, latestGeneration, latestRealtime, valid, latitude, longitude, navdata, 1 );
+	}
+	else
+	{
+		currentDeltaLength = 0;		// No delta to send, everyone gets a keyframe.
+	}
+
+	previousValid = valid;
+	previousLatitude = latitude;
+	previousLongitude = longitude;
+}
+
+static void sendUpdate( TelemetryClient *client, uint64_t now )
+{
+	int fresh = client->generation != currentGeneration;
+	if( fresh && client->generation != 0 && currentGeneration - client->generation > 1 )
+	{
+		atomic_fetch_add( &telemetryStats.coalesced, currentGeneration - client->generation - 1 );
+	}
+
+	const void *update = currentText;
+	size_t length = currentTextLength;
+	if( client->format == FORMAT_BINARY )
+	{
+		if( currentDeltaLength > 0 && !client->needKeyframe && client->generation + 1 == currentGeneration )
+		{
+			update = currentDelta;
+			length = currentDeltaLength;
+			atomic_fetch_add( &telemetryStats.deltas, 1 );
+		}
+		else
+		{
+			update = currentKeyframe;
+			length = currentKeyframeLength;
+			atomic_fetch_add( &telemetryStats.keyframes, 1 );
+		}
+	}
+
+	client->lastSent = now;
+	client->generation = currentGeneration;
+	client->needKeyframe = 0;
+	if( queueToClient( client, update, length ) < 0 )
+	{
+		return;
+	}
+
+	atomic_fetch_add( &telemetryStats.sent, 1 );
+	atomic_fetch_add( &telemetryStats.bytes, length );
+	TRACE_INSTANT( "telemetry.send", "generation", currentGeneration, "bytes", length );
+	if( fresh && client->length == 0 )
+	{
+		histogramRecordLocal( &telemetryStats.latency, monotonicNs() - currentPublished );
+	}
+}
+
+// Sends every client whatever is due and arms the timer for the next
+// client that has to wait, either for its rate limit or for a refresh.
+static void serviceClients()
+{
+	pthread_mutex_lock( &latestFixMutex );
+	if( latestGeneration != currentGeneration )
+	{
+		currentGeneration = latestGeneration;
+		currentPublished = latestPublished;
+		encodeCurrent();
+	}
+	pthread_mutex_unlock( &latestFixMutex );
+
+	if( currentGeneration == 0 )
+	{
+		return;		// Nothing published yet.
+	}
+
+	uint64_t now = monotonicNs();
+	uint64_t nextDue = UINT64_MAX;
+
+	unsigned int i;
+	for( i = 0; i < TELEMETRY_MAX_CLIENTS; i++ )
+	{
+		TelemetryClient *client = &clients[i];
+		if( client->fd < 0 )
+		{
+			continue;
+		}
+
+		// A new client's first update waits until it has asked for a format
+		// and rate, or until TELEMETRY_NEGOTIATE_MS after it connected.
+		int pending = client->generation != currentGeneration;
+		uint64_t due;
+		if( !client->negotiated )
+		{
+			due = client->lastSent + TELEMETRY_NEGOTIATE_MS * NSEC_PER_MSEC;
+			client->negotiated = due <= now;
+		}
+		else
+		{
+			due = client->lastSent + ( pending ? client->minInterval : TELEMETRY_REFRESH_MS * NSEC_PER_MSEC );
+		}
+		if( ( client->negotiated && client->generation == 0 ) || due <= now )
+		{
+			sendUpdate( client, now );
+			if( client->fd < 0 )
+			{
+				continue;
+			}
+			due = now + TELEMETRY_REFRESH_MS * NSEC_PER_MSEC;
+		}
+
+		if( due < nextDue )
+		{
+			nextDue = due;
+		}
+	}
+
+	struct itimerspec spec;
+	memset( &spec, 0, sizeof( spec ) );
+	if( nextDue != UINT64_MAX )
+	{
+		spec.it_value.tv_sec = nextDue / NSEC_PER_SEC;
+		spec.it_value.tv_nsec = nextDue % NSEC_PER_SEC;
+	}
+	timerfd_settime( timerfd, TFD_TIMER_ABSTIME, &spec, NULL );
+}
+
+static void acceptClients()
+{
+	for(;;)
+	{
+		int fd = accept4( listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC );
+		if( fd < 0 )
+		{
+			if( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR )
+			{
+				printf( "Android GPS update server: accept() failure, errno = %d\n", errno );
+			}
+			return;
+		}
+
+		TelemetryClient *client = NULL;
+		unsigned int i;
+		for( i = 0; i < TELEMETRY_MAX_CLIENTS; i++ )
+		{
+			if( clients[i].fd < 0 )
+			{
+				client = &clients[i];
+				break;
+			}
+		}
+		if( client == NULL )
+		{
+			printf( "Android GPS update server full, refusing client.\n" );
+			close( fd );
+			continue;
+		}
+
+		client->fd = fd;
+		client->start = 0;
+		client->length = 0;
+		client->wantWrite = 0;
+		client->requestLength = 0;
+		client->minInterval = 0;
+		client->lastSent = monotonicNs();
+		client->generation = 0;
+		client->format = FORMAT_TEXT;
+		client->needKeyframe = 0;
+		client->negotiated = 0;
+
+		struct epoll_event ev;
+		ev.events = EPOLLIN | EPOLLRDHUP;
+		ev.data.ptr = client;
+		epoll_ctl( epollfd, EPOLL_CTL_ADD, fd, &ev );
+		atomic_fetch_add_explicit( &telemetryStats.clients, 1, memory_order_relaxed );
+	}
+}
+
+static void handleRequest( TelemetryClient *client, const char *request )
+{
+	double rate;
+	if( sscanf( request, "rate %lf", &rate ) == 1 )
+	{
+		client->minInterval = ( rate > 0 ) ? (uint64_t)( NSEC_PER_SEC / rate ) : 0;
+	}
+	else if( strcmp( request, "format binary" ) == 0 )
+	{
+		client->format = FORMAT_BINARY;
+		client->needKeyframe = 1;
+	}
+	else if( strcmp( request, "format text" ) == 0 )
+	{
+		client->format = FORMAT_TEXT;
+	}
+}
+
+// Reads and acts on request lines, and watches for hangups.
+static void readFromClient( TelemetryClient *client )
+{
+	for(;;)
+	{
+		char *end = client->request + client->requestLength;
+		size_t space = TELEMETRY_REQUEST_LEN - 1 - client->requestLength;
+		ssize_t size = recv( client->fd, end, space, MSG_DONTWAIT );
+		if( size < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+		{
+			return;
+		}
+		if( size < 0 && errno == EINTR )
+		{
+			continue;
+		}
+		if( size <= 0 )
+		{
+			printf( "Android client unsubscribed from GPS updates.\n" );
+			closeClient( client );
+			return;
+		}
+
+		client->requestLength += size;
+		client->request[client->requestLength] = '\0';
+
+		char *line = client->request;
+		char *newline;
+		while( ( newline = strchr( line, '\n' ) ) != NULL )
+		{
+			*newline = '\0';
+			handleRequest( client, line );
+			client->negotiated = 1;
+			line = newline + 1;
+		}
+
+		client->requestLength -= line - client->request;
+		memmove( client->request, line, client->requestLength );
+		if( client->requestLength == TELEMETRY_REQUEST_LEN - 1 )
+		{
+			client->requestLength = 0;	// Overlong line, discard it.
+		}
+	}
+}
+
+int telemetryServerOpen( const char *port )
+{
+	struct sockaddr_in myaddr;
+	unsigned int i;
+
+	for( i = 0; i < TELEMETRY_MAX_CLIENTS; i++ )
+	{
+		clients[i].fd = -1;
+	}
+
+	listenfd = socket( PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+	if( listenfd == -1 )
+	{
+		printf( "Android GPS update server: socket() failure, errno = %d\n", errno );
+		exit( EXIT_FAILURE );
+	}
+
+	int yes = 1;
+	if( setsockopt( listenfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof( int ) ) == -1 )
+	{
+		printf( "Android GPS update server: setsockopt() failure, errno = %d\n", errno );
+		close( listenfd );
+		exit( EXIT_FAILURE );
+	}
+
+	myaddr.sin_family = AF_INET;
+	myaddr.sin_port = htons( atoi( port ) );
+	myaddr.sin_addr.s_addr = htonl( INADDR_ANY );
+	memset( &( myaddr.sin_zero ), '\0', 8 );
+
+	if( bind( listenfd, (struct sockaddr *)&myaddr, sizeof( struct sockaddr ) ) == -1 )
+	{
+		printf( "Android GPS update server: bind() failure, errno = %d\n", errno );
+		close( listenfd );
+		exit( EXIT_FAILURE );
+	}
+
+	if( listen( listenfd, 128 ) == -1 )
+	{
+		printf( "Android GPS update server: listen() failure, errno = %d\n", errno );
+		close( listenfd );
+		exit( EXIT_FAILURE );
+	}
+
+	timerfd = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC );
+	int fd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+	epollfd = epoll_create1( EPOLL_CLOEXEC );
+	if( epollfd < 0 || timerfd < 0 || fd < 0 )
+	{
+		printf( "Android GPS update server: epoll/timerfd/eventfd failure, errno = %d\n", errno );
+		exit( EXIT_FAILURE );
+	}
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = &listenTag;
+	epoll_ctl( epollfd, EPOLL_CTL_ADD, listenfd, &ev );
+	ev.data.ptr = &timerTag;
+	epoll_ctl( epollfd, EPOLL_CTL_ADD, timerfd, &ev );
+	ev.data.ptr = &wakeTag;
+	epoll_ctl( epollfd, EPOLL_CTL_ADD, fd, &ev );
+
+	// Publishers may start writing as soon as they see it.
+	atomic_store_explicit( &wakefd, fd, memory_order_release );
+
+	return epollfd;
+}
+
+void telemetryServerDispatch( int timeoutMs )
+{
+	struct epoll_event events[MAX_EVENTS];
+	int count = epoll_wait( epollfd, events, MAX_EVENTS, timeoutMs );
+	int service = 0;
+	uint64_t value;
+
+	int i;
+	for( i = 0; i < count; i++ )
+	{
+		if( events[i].data.ptr == &listenTag )
+		{
+			acceptClients();
+			service = 1;
+		}
+		else if( events[i].data.ptr == &timerTag )
+		{
+			if( read( timerfd, &value, sizeof( value ) ) > 0 )
+			{
+				service = 1;
+			}
+		}
+		else if( events[i].data.ptr == &wakeTag )
+		{
+			if( read( atomic_load_explicit( &wakefd, memory_order_relaxed ), &value, sizeof( value ) ) > 0 )
+			{
+				service = 1;
+			}
+		}
+		else
+		{
+			TelemetryClient *client = events[i].data.ptr;
+			if( client->fd < 0 )
+			{
+				continue;	// Closed earlier in this batch.
+			}
+			if( events[i].events & ( EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR ) )
+			{
+				readFromClient( client );
+				service = 1;	// A new rate may make an update due now.
+			}
+			if( client->fd >= 0 && ( events[i].events & EPOLLOUT ) )
+			{
+				flushClient( client );
+			}
+		}
+	}
+
+	if( service )
+	{
+		serviceClients();
+	}
+}
+
+void *telemetryServer( void *arg )
+{
+	traceThreadName( "telemetry" );
+	telemetryServerOpen( ANDROID_GPS_UPDATE_PORT );
+
+	for(;;)
+	{
+		telemetryServerDispatch( -1 );
+	}
+
+	pthread_exit( NULL );
+}
+
+void printTelemetryStats( FILE *out )
+{
+	TelemetryStats *s = &telemetryStats;
+
+	fprintf( out, "telemetry: %llu clients, %llu fixes published, %llu updates sent, %llu coalesced, %llu clients dropped\n",
+		(unsigned long long)atomic_load( &s->clients ),
+		(unsigned long long)atomic_load( &s->published ), (unsigned long long)atomic_load( &s->sent ),
+		(unsigned long long)atomic_load( &s->coalesced ), (unsigned long long)atomic_load( &s->dropped ) );
+	fprintf( out, "telemetry: %llu bytes sent, %llu binary keyframes, %llu binary deltas\n",
+		(unsigned long long)atomic_load( &s->bytes ),
+		(unsigned long long)atomic_load( &s->keyframes ), (unsigned long long)atomic_load( &s->deltas ) );
+	fprintf( out, "telemetry: fix to socket p50 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+		histogramPercentile( &s->latency, 0.50 ) / (double)NSEC_PER_MSEC,
+		histogramPercentile( &s->latency, 0.99 ) / (double)NSEC_PER_MSEC,
+		atomic_load( &s->latency.max ) / (double)NSEC_PER_MSEC );
+}
+
+void registerTelemetryMetrics()
+{
+	TelemetryStats *s = &telemetryStats;
+
+	metricsGauge( "argps_telemetry_clients", NULL, "Android GPS update clients connected.", &s->clients );
+	metricsCounter( "argps_telemetry_fixes_published_total", NULL, "GPS fixes handed to the telemetry server.", &s->published );
+	metricsCounter( "argps_telemetry_updates_sent_total", NULL, "Updates written to Android clients.", &s->sent );
+	metricsCounter( "argps_telemetry_sent_bytes_total", NULL, "Bytes of those updates.", &s->bytes );
+	metricsCounter( "argps_telemetry_binary_updates_total", "kind=\"keyframe\"", "Binary updates by encoding.", &s->keyframes );
+	metricsCounter( "argps_telemetry_binary_updates_total", "kind=\"delta\"", "Binary updates by encoding.", &s->deltas );
+	metricsCounter( "argps_telemetry_coalesced_total", NULL, "Fixes a rate-limited client never saw.", &s->coalesced );
+	metricsCounter( "argps_telemetry_clients_dropped_total", NULL, "Clients dropped for not keeping up.", &s->dropped );
+	metricsHistogram( "argps_telemetry_latency_seconds", NULL, "Fix publish to send() return.", &s->latency, 1e-9 );
+}
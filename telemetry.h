@@ -0,0 +1,103 @@
+#ifndef _TELEMETRY_H_
+#define _TELEMETRY_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "gpsutil.h"
+#include "histogram.h"
+#include "navhistory.h"
+
+#define TELEMETRY_MAX_CLIENTS 64
+#define TELEMETRY_CLIENT_BUFFER 4096	// Bytes queued for a client before it counts as too slow.
+#define TELEMETRY_REQUEST_LEN 64		// Longest request line a client may send.
+#define TELEMETRY_NEGOTIATE_MS 100		// How long a new client's first update waits for its requests.
+
+// Clients get each fix as soon as it is published, at most as often as the
+// rate they asked for. With no new fix, the latest one is repeated this often
+// so that subscribers can tell the server is alive.
+#define TELEMETRY_REFRESH_MS 1000
+
+// Subscribers may send "rate <Hz>\n" at any time, usually right after
+// connecting, to cap how often they are sent updates. Fixes arriving faster
+// than that are coalesced and the client gets only the latest. Rate 0, the
+// default, sends every fix.
+//
+// "format binary\n" switches a subscriber from the "%lf %lf\n" text lines
+// to binary frames, "format text\n" switches it back. All multi-byte fields
+// are big-endian. Each frame is a TelemetryFrameHeader followed by:
+//   - if TELEMETRY_POSITION: latitude then longitude in 1e-7 degrees, either
+//     as two int32 (TELEMETRY_KEYFRAME) or as two zigzag LEB128 varints
+//     holding the change since the previous frame;
+//   - if TELEMETRY_ALTITUDE: int32 altitude in centimeters;
+//   - if TELEMETRY_BATTERY: uint8 battery percentage;
+//   - if TELEMETRY_ATTITUDE: int16 pitch, roll and yaw in centidegrees.
+// A client only gets a delta frame if it received the previous fix, so one
+// that was rate limited, just subscribed or just switched format gets a
+// keyframe instead. So does everyone when a change doesn't fit in an
+// int32, as when crossing 180 degrees longitude. Every frame is encoded
+// once and shared by all clients.
+#define TELEMETRY_FRAME_MAGIC 0x4754	// "GT"
+#define TELEMETRY_FRAME_VERSION 1
+#define TELEMETRY_FRAME_MAX 64
+
+#define TELEMETRY_KEYFRAME 0x01
+#define TELEMETRY_POSITION 0x02
+#define TELEMETRY_ALTITUDE 0x04
+#define TELEMETRY_BATTERY 0x08
+#define TELEMETRY_ATTITUDE 0x10
+
+#define TELEMETRY_COORD_SCALE 1e7
+#define TELEMETRY_NAVDATA_MAX_AGE_MS 1000	// Older navdata is left out of frames.
+
+typedef struct __attribute__((packed))
+{
+	uint16_t	magic;
+	uint8_t		version;
+	uint8_t		flags;
+	uint16_t	length;		// Whole frame, header included.
+	uint16_t	sequence;	// Low bits of the fix number, for spotting gaps.
+	uint64_t	time;		// When the fix was published, microseconds since the epoch.
+} TelemetryFrameHeader;
+
+typedef struct
+{
+	_Atomic uint64_t	published;	// Fixes published.
+	_Atomic uint64_t	sent;		// Updates written to clients.
+	_Atomic uint64_t	bytes;		// Bytes of those updates.
+	_Atomic uint64_t	keyframes;	// Binary updates sent as keyframes.
+	_Atomic uint64_t	deltas;		// Binary updates sent as deltas.
+	_Atomic uint64_t	coalesced;	// Fixes a rate-limited client never saw.
+	_Atomic uint64_t	dropped;	// Clients dropped for not keeping up.
+	_Atomic uint64_t	clients;	// Clients connected now.
+	Histogram			latency;	// Publish to send() return, nanoseconds.
+} TelemetryStats;
+
+extern TelemetryStats telemetryStats;
+
+// Makes fix the latest and wakes the server to push it. Safe from any thread.
+void telemetryPublishFix( const GpsPoint *fix );
+
+// Binary frames carry altitude, battery and attitude from the newest
+// sample in history, if there is a recent one. Call before opening the server.
+void telemetrySetNavdataSource( NavdataHistory *history );
+
+// Opens the Android GPS update server on port. Everything it does is
+// non-blocking and driven from one epoll set, whose fd is returned so it
+// can be nested in another event loop. Exits on failure.
+int telemetryServerOpen( const char *port );
+
+// Waits up to timeoutMs (-1 forever) for activity and handles it:
+// new subscribers, published fixes, rate limits, flushing queued output
+// and disconnects.
+void telemetryServerDispatch( int timeoutMs );
+
+// Thread function: opens the server on ANDROID_GPS_UPDATE_PORT and runs it.
+void *telemetryServer( void *arg );
+
+void printTelemetryStats( FILE *out );
+// Exports telemetryStats through the metrics registry.
+void registerTelemetryMetrics();
+
+#endif
@@ -0,0 +1,31 @@
+#include <time.h>
+
+#include "timeutil.h"
+
+static __thread const uint64_t *threadClock = NULL;
+
+static uint64_t readClock( clockid_t clock )
+{
+	struct timespec ts;
+	clock_gettime( clock, &ts );
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+
+uint64_t monotonicNs()
+{
+	if( threadClock != NULL )
+	{
+		return *threadClock;
+	}
+	return readClock( CLOCK_MONOTONIC );
+}
+
+void setThreadClock( const uint64_t *now )
+{
+	threadClock = now;
+}
+
+uint64_t realtimeNs()
+{
+	return readClock( CLOCK_REALTIME );
+}
@@ -0,0 +1,18 @@
+#ifndef _TIME_UTIL_H_
+#define _TIME_UTIL_H_
+
+#include <stdint.h>
+
+#define NSEC_PER_USEC 1000ULL
+#define NSEC_PER_MSEC 1000000ULL
+#define NSEC_PER_SEC 1000000000ULL
+
+// Nanoseconds on CLOCK_MONOTONIC. Use this for intervals and latencies.
+uint64_t monotonicNs();
+// Makes monotonicNs() on the calling thread return *now instead, for
+// simulations that step time themselves. NULL goes back to the real clock.
+void setThreadClock( const uint64_t *now );
+// Nanoseconds on CLOCK_REALTIME. Only needed to line up with kernel timestamps.
+uint64_t realtimeNs();
+
+#endif
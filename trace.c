@@ -0,0 +1,222 @@
+#define _GNU_SOURCE
+
+#include <sys/syscall.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "timeutil.h"
+
+_Atomic int traceEnabled = 0;
+
+typedef struct
+{
+	// Index + 1 of the event held, 0 while it is being written. Lets the
+	// dump tell a whole event from one the writer has lapped mid-copy.
+	_Atomic uint64_t	seq;
+	uint64_t			time;
+	const char			*name;
+	const char			*argNames[2];
+	double				args[2];
+	char				phase;
+} TraceEvent;
+
+typedef struct TraceRing
+{
+	pid_t				tid;
+	char				name[TRACE_NAME_LEN];
+	_Atomic uint64_t	next;		// Events ever written; only the owner writes.
+	TraceEvent			events[TRACE_RING_SIZE];
+} TraceRing;
+
+// Rings are created by their thread on its first event and never freed,
+// so the dump can read a thread's events after it has exited.
+static TraceRing *_Atomic rings[TRACE_MAX_THREADS];
+static _Atomic unsigned int numRings = 0;
+
+static __thread TraceRing *threadRing = NULL;
+static __thread int threadUntraced = 0;
+static __thread char threadName[TRACE_NAME_LEN];
+
+void traceEnable( int enabled )
+{
+	atomic_store( &traceEnabled, enabled );
+}
+
+void traceThreadName( const char *name )
+{
+	snprintf( threadName, sizeof( threadName ), "%s", name );
+	if( threadRing != NULL )
+	{
+		memcpy( threadRing->name, threadName, sizeof( threadName ) );
+	}
+}
+
+static TraceRing *getThreadRing()
+{
+	if( threadRing != NULL || threadUntraced )
+	{
+		return threadRing;
+	}
+
+	unsigned int index = atomic_fetch_add( &numRings, 1 );
+	if( index >= TRACE_MAX_THREADS )
+	{
+		atomic_fetch_sub( &numRings, 1 );
+		threadUntraced = 1;
+		fprintf( stderr, "Trace: more than %d threads, not tracing this one.\n", TRACE_MAX_THREADS );
+		return NULL;
+	}
+
+	TraceRing *ring = calloc( 1, sizeof( TraceRing ) );
+	if( ring == NULL )
+	{
+		fprintf( stderr, "Couldn't allocate trace ring.\n" );
+		exit( EXIT_FAILURE );
+	}
+	ring->tid = syscall( SYS_gettid );
+	memcpy( ring->name, threadName, sizeof( threadName ) );
+
+	// The slot is reserved but the dump only looks at it once it's set.
+	atomic_store_explicit( &rings[index], ring, memory_order_release );
+	threadRing = ring;
+	return ring;
+}
+
+void traceRecord( char phase, const char *name, const char *arg0, double value0, const char *arg1, double value1 )
+{
+	TraceRing *ring = getThreadRing();
+	if( ring == NULL )
+	{
+		return;
+	}
+
+	uint64_t index = atomic_load_explicit( &ring->next, memory_order_relaxed );
+	TraceEvent *event = &ring->events[index & ( TRACE_RING_SIZE - 1 )];
+
+	atomic_store_explicit( &event->seq, 0, memory_order_relaxed );
+	atomic_thread_fence( memory_order_release );
+	event->time = monotonicNs();
+	event->name = name;
+	event->argNames[0] = arg0;
+	event->argNames[1] = arg1;
+	event->args[0] = value0;
+	event->args[1] = value1;
+	event->phase = phase;
+	atomic_store_explicit( &event->seq, index + 1, memory_order_release );
+
+	atomic_store_explicit( &ring->next, index + 1, memory_order_release );
+}
+
+// Copies the event at index, returns 0 if it is still there afterwards.
+static int readEvent( TraceRing *ring, uint64_t index, TraceEvent *copy )
+{
+	TraceEvent *event = &ring->events[index & ( TRACE_RING_SIZE - 1 )];
+
+	if( atomic_load_explicit( &event->seq, memory_order_acquire ) != index + 1 )
+	{
+		return -1;
+	}
+	copy->time = event->time;
+	copy->name = event->name;
+	copy->argNames[0] = event->argNames[0];
+	copy->argNames[1] = event->argNames[1];
+	copy->args[0] = event->args[0];
+	copy->args[1] = event->args[1];
+	copy->phase = event->phase;
+	atomic_thread_fence( memory_order_acquire );
+	return ( atomic_load_explicit( &event->seq, memory_order_relaxed ) == index + 1 ) ? 0 : -1;
+}
+
+static void writeEvent( FILE *out, pid_t pid, pid_t tid, const TraceEvent *event, int *first )
+{
+	fprintf( out, "%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d",
+		*first ? "" : ",", event->name, event->phase, event->time / 1e3, pid, tid );
+	*first = 0;
+
+	if( event->phase == 'i' )
+	{
+		fprintf( out, ",\"s\":\"t\"" );
+	}
+
+	if( event->argNames[0] != NULL || event->argNames[1] != NULL )
+	{
+		fprintf( out, ",\"args\":{" );
+		unsigned int i;
+		for( i = 0; i < 2; i++ )
+		{
+			if( event->argNames[i] != NULL )
+			{
+				fprintf( out, "%s\"%s\":%.15g", ( i > 0 && event->argNames[0] != NULL ) ? "," : "",
+					event->argNames[i], event->args[i] );
+			}
+		}
+		fprintf( out, "}" );
+	}
+	fprintf( out, "}" );
+}
+
+void traceDump( FILE *out )
+{
+	pid_t pid = getpid();
+	int first = 1;
+
+	fprintf( out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[" );
+
+	unsigned int count = atomic_load( &numRings );
+	unsigned int i;
+	for( i = 0; i < count && i < TRACE_MAX_THREADS; i++ )
+	{
+		TraceRing *ring = atomic_load_explicit( &rings[i], memory_order_acquire );
+		if( ring == NULL )
+		{
+			continue;
+		}
+
+		if( ring->name[0] != '\0' )
+		{
+			fprintf( out, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+				first ? "" : ",", pid, ring->tid, ring->name );
+			first = 0;
+		}
+
+		uint64_t end = atomic_load_explicit( &ring->next, memory_order_acquire );
+		uint64_t index = ( end > TRACE_RING_SIZE ) ? end - TRACE_RING_SIZE : 0;
+		for( ; index < end; index++ )
+		{
+			TraceEvent event;
+			if( readEvent( ring, index, &event ) == 0 )
+			{
+				writeEvent( out, pid, ring->tid, &event, &first );
+			}
+		}
+	}
+
+	fprintf( out, "\n]}\n" );
+}
+
+int traceDumpFile()
+{
+	char path[64];
+	snprintf( path, sizeof( path ), "argps-trace-%d.json", getpid() );
+
+	FILE *out = fopen( path, "w" );
+	if( out == NULL )
+	{
+		fprintf( stderr, "Couldn't open %s, errno = %d.\n", path, errno );
+		return -1;
+	}
+
+	traceDump( out );
+	if( fclose( out ) != 0 )
+	{
+		fprintf( stderr, "Couldn't write %s, errno = %d.\n", path, errno );
+		return -1;
+	}
+
+	printf( "Trace written to %s.\n", path );
+	return 0;
+}
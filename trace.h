@@ -0,0 +1,54 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define TRACE_RING_SIZE 8192		// Events kept per thread, a power of two.
+#define TRACE_MAX_THREADS 256		// Threads that get a ring; later ones aren't traced.
+#define TRACE_NAME_LEN 16
+
+// Every trace point expands to one relaxed load of this flag and a branch
+// predicted not taken. Only when it is set does the thread get a ring and
+// pay for a timestamp.
+extern _Atomic int traceEnabled;
+
+// Names and argument names must be string literals, or at least outlive
+// the process: only the pointer is recorded. Arguments are optional, pass
+// NULL and 0 for those not used.
+#define TRACE_EVENT( phase, name, arg0, value0, arg1, value1 ) \
+	do \
+	{ \
+		if( __builtin_expect( atomic_load_explicit( &traceEnabled, memory_order_relaxed ), 0 ) ) \
+		{ \
+			traceRecord( phase, name, arg0, value0, arg1, value1 ); \
+		} \
+	} while( 0 )
+
+// Spans must begin and end on the same thread, properly nested.
+#define TRACE_BEGIN( name ) TRACE_EVENT( 'B', name, NULL, 0, NULL, 0 )
+#define TRACE_END( name ) TRACE_EVENT( 'E', name, NULL, 0, NULL, 0 )
+#define TRACE_END_ARGS( name, arg0, value0, arg1, value1 ) TRACE_EVENT( 'E', name, arg0, value0, arg1, value1 )
+#define TRACE_INSTANT( name, arg0, value0, arg1, value1 ) TRACE_EVENT( 'i', name, arg0, value0, arg1, value1 )
+
+void traceEnable( int enabled );
+
+// Labels the calling thread in the dump. Cheap and allocation free, so
+// thread functions call it whether or not tracing is on.
+void traceThreadName( const char *name );
+
+// Appends an event to the calling thread's ring, overwriting the oldest.
+// Never blocks, the ring has one writer. Use the macros instead.
+void traceRecord( char phase, const char *name, const char *arg0, double value0, const char *arg1, double value1 );
+
+// Writes what every ring still holds as Chrome trace event JSON, for
+// chrome://tracing or ui.perfetto.dev. Safe while threads keep tracing:
+// events overwritten during the copy are skipped.
+void traceDump( FILE *out );
+
+// traceDump() to argps-trace-<pid>.json in the working directory. Returns
+// 0, or -1 if the file couldn't be written.
+int traceDumpFile();
+
+#endif
@@ -8,9 +8,13 @@
 #include <pthread.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <poll.h>
 #include <errno.h>
 
 #include "gpsutil.h"
+#include "metrics.h"
+#include "network.h"
+#include "timeutil.h"
 
 #define SOCKET_ADDRESS "serial_rpigps_data"
 #define MAX_NMEA_SENTENCE_LEN 1024
@@ -25,9 +29,40 @@ void *gpsServer( void *arg );
 
 // Thread globals.
 GpsPoint		gpsFix;
+uint64_t		gpsGeneration;	// Bumped for every new fix, so the server sends each once.
 pthread_mutex_t	gpsMutex;
+pthread_cond_t	gpsCond;		// Signalled with gpsGeneration.
 pthread_t		serialThread;
 pthread_t		serverThread;
+pthread_t		metricsThread;
+
+// Metrics, each written by one thread.
+_Atomic uint64_t	sentences;		// NMEA sentences read from the device.
+_Atomic uint64_t	fixes;			// GPGGA sentences with a position.
+_Atomic uint64_t	noFixes;		// GPGGA sentences without one.
+_Atomic uint64_t	lastFix;		// monotonicNs() of the latest fix, 0 before the first.
+_Atomic uint64_t	clients;		// Connected to the fix socket, 0 or 1.
+_Atomic uint64_t	updatesSent;	// Fixes written to clients.
+
+static double readFixAge( void *arg )
+{
+	uint64_t last = atomic_load_explicit( &lastFix, memory_order_relaxed );
+	if( last == 0 )
+	{
+		return NAN;
+	}
+	return ( monotonicNs() - last ) / (double)NSEC_PER_SEC;
+}
+
+static void registerMetrics()
+{
+	metricsCounter( "usbgps_sentences_total", NULL, "NMEA sentences read from the device.", &sentences );
+	metricsCounter( "usbgps_fixes_total", "valid=\"true\"", "GPGGA sentences, by whether they had a position.", &fixes );
+	metricsCounter( "usbgps_fixes_total", "valid=\"false\"", NULL, &noFixes );
+	metricsGaugeReader( "usbgps_fix_age_seconds", NULL, "Time since the latest fix, NaN before the first.", readFixAge, NULL );
+	metricsGauge( "usbgps_clients", NULL, "Clients connected to the fix socket.", &clients );
+	metricsCounter( "usbgps_updates_sent_total", NULL, "Fixes written to clients.", &updatesSent );
+}
 
 int main( int argc, char **argv )
 {
@@ -43,9 +78,12 @@ int main( int argc, char **argv )
 	pthread_attr_setdetachstate( &attr, PTHREAD_CREATE_JOINABLE );
 
 	pthread_mutex_init( &gpsMutex, NULL );
+	pthread_cond_init( &gpsCond, NULL );
+	registerMetrics();
 
 	pthread_create( &serialThread, &attr, getSerialGps, (void *)argv[1] );
 	pthread_create( &serverThread, &attr, gpsServer, (void *)NULL );
+	pthread_create( &metricsThread, &attr, metricsServer, (void *)USBGPS_METRICS_PORT );
 
 	pthread_attr_destroy( &attr );
 
@@ -85,59 +123,48 @@ int initSerialIO( char *ttyName, struct termios *tio, struct termios *stdio )
 	return ttyfd;
 }
 
+// Converts an NMEA ddmm.mmmm / dddmm.mmmm field into decimal degrees.
+static double nmeaToDegrees( const char *field )
+{
+	double raw = atof( field );
+	double degrees = floor( raw / 100.0 );
+	return degrees + ( raw - degrees * 100.0 ) / 60.0;
+}
+
 GpsPoint parseGpggaSentence( char *sentence )
 {
 	GpsPoint result;
 	result.latitude = NAN;
 	result.longitude = NAN;
 
-	unsigned int i = 0;
-	while( sentence[i++] != ',' );
-	while( sentence[i++] != ',' );
-
-	if( sentence[i] == ',' )
-	{
-		return result;
-	}
-	else
+	// $GPGGA,<time>,<lat>,<N/S>,<lon>,<E/W>,... Field widths vary between
+	// receivers, so split on commas instead of counting characters.
+	char *fields[6];
+	unsigned int n = 0;
+	char *p = sentence;
+	while( n < 6 && p != NULL )
 	{
-		char deg[10];
-		char min[10];
-
-		strncpy( deg, &sentence[i], 2 );
-		strncpy( min, &sentence[i + 2], 7 );
-		i += 9;
-
-		deg[2] = '\0';
-		min[5] = '\0';
-
-		result.latitude = atof( deg ) + atof( min )/ 60.0;
+		fields[n++] = p;
+		p = strchr( p, ',' );
+		if( p != NULL )
+		{
+			p++;
+		}
 	}
 
-	i++;
-	if( sentence[i] == 'S' )
+	if( n < 6 || *fields[2] == ',' || *fields[4] == ',' )
 	{
-		result.latitude = -result.latitude;
+		return result;
 	}
 
-	i += 2;
-	if( sentence[i] != ',' )
+	result.latitude = nmeaToDegrees( fields[2] );
+	if( *fields[3] == 'S' )
 	{
-		char deg[10];
-		char min[10];
-
-		strncpy( deg, &sentence[i], 3 );
-		strncpy( min, &sentence[i + 3], 5 );
-		i += 8;
-
-		deg[3] = '\0';
-		min[5] = '\0';
-
-		result.longitude = atof( deg ) + atof( min ) / 60.0;
+		result.latitude = -result.latitude;
 	}
 
-	i++;
-	if( sentence[i] == 'E' )
+	result.longitude = nmeaToDegrees( fields[4] );
+	if( *fields[5] == 'W' )
 	{
 		result.longitude = -result.longitude;
 	}
@@ -157,33 +184,86 @@ void *getSerialGps( void *arg )
 	int ttyfd = initSerialIO( (char *)arg, &tio, &stdio );
 
 	char nmeaSentence[MAX_NMEA_SENTENCE_LEN];
-	unsigned char c = 0;
 	unsigned int i = 0;
+
+	// Sleep until the device or the keyboard has something, rather than
+	// spinning on the non-blocking fds.
+	struct pollfd pfds[2];
+	pfds[0].fd = ttyfd;
+	pfds[0].events = POLLIN;
+	pfds[1].fd = STDIN_FILENO;
+	pfds[1].events = POLLIN;
+
 	for(;;)
 	{
-		if( read( ttyfd, &c, 1 ) > 0 )
+		if( poll( pfds, 2, -1 ) < 0 )
+		{
+			if( errno == EINTR )
+			{
+				continue;
+			}
+			fprintf( stderr, "poll() failure, errno = %d.\n", errno );
+			exit( EXIT_FAILURE );
+		}
+
+		char buffer[MAX_NMEA_SENTENCE_LEN];
+		ssize_t size = 0;
+		if( pfds[0].revents & ( POLLIN | POLLERR | POLLHUP ) )
 		{
+			size = read( ttyfd, buffer, sizeof( buffer ) );
+			if( size == 0 || ( size < 0 && errno != EAGAIN && errno != EINTR ) )
+			{
+				// A pty reads as EIO once the other end closes.
+				fprintf( stderr, "Lost the serial device, errno = %d.\n", ( size == 0 ) ? 0 : errno );
+				tcsetattr( STDOUT_FILENO, TCSANOW, &oldStdio );
+				exit( EXIT_FAILURE );
+			}
+		}
+
+		ssize_t j;
+		for( j = 0; j < size; j++ )
+		{
+			char c = buffer[j];
 			if( c == '\n' )
 			{
 				nmeaSentence[i] = '\0';
 				i = 0;
+				COUNT( sentences );
 				if( strncmp( nmeaSentence, "$GPGGA", 6 ) == 0 )
 				{
 					GpsPoint location = parseGpggaSentence( nmeaSentence );
+					if( isnan( location.latitude ) )
+					{
+						COUNT( noFixes );
+					}
+					else
+					{
+						COUNT( fixes );
+						atomic_store_explicit( &lastFix, monotonicNs(), memory_order_relaxed );
+					}
 					pthread_mutex_lock( &gpsMutex );
 					gpsFix.latitude = location.latitude;
 					gpsFix.longitude = location.longitude;
+					gpsGeneration++;
+					pthread_cond_broadcast( &gpsCond );
 					pthread_mutex_unlock( &gpsMutex );
 				}
 			}
-			else
+			else if( i < sizeof( nmeaSentence ) - 1 )
 			{
 				nmeaSentence[i++] = c;
 			}
 		}
-		if( read( STDIN_FILENO, &c, 1 ) > 0 )
+
+		if( pfds[1].revents & ( POLLIN | POLLHUP ) )
 		{
-			if( c == 'q' )
+			unsigned char c = 0;
+			ssize_t size = read( STDIN_FILENO, &c, 1 );
+			if( size == 0 )
+			{
+				pfds[1].fd = -1;	// No keyboard, e.g. started from a script.
+			}
+			else if( size > 0 && c == 'q' )
 			{
 				close( ttyfd );
 				tcsetattr( STDOUT_FILENO, TCSANOW, &oldStdio );
@@ -228,20 +308,31 @@ void *gpsServer( void *arg )
 			fprintf( stderr, "Couldn't accept connection, errno = %d.\n", errno );
 			exit( EXIT_FAILURE );
 		}
+		atomic_store_explicit( &clients, 1, memory_order_relaxed );
 
+		// Each fix is written once, as soon as it is parsed. A new client
+		// gets the current one straight away.
+		uint64_t sent = 0;
 		for(;;)
 		{
 			GpsPoint curr;
 			pthread_mutex_lock( &gpsMutex );
+			while( gpsGeneration == sent )
+			{
+				pthread_cond_wait( &gpsCond, &gpsMutex );
+			}
+			sent = gpsGeneration;
 			curr.latitude = gpsFix.latitude;
 			curr.longitude = gpsFix.longitude;
 			pthread_mutex_unlock( &gpsMutex );
 
-			if( write( sessionSocket, (char *)&curr, sizeof( curr ) / sizeof( char ) ) < 0 )
+			if( send( sessionSocket, (char *)&curr, sizeof( curr ) / sizeof( char ), MSG_NOSIGNAL ) < 0 )
 			{
 				close( sessionSocket );
+				atomic_store_explicit( &clients, 0, memory_order_relaxed );
 				break;
 			}
+			COUNT( updatesSent );
 		}
 	}
 
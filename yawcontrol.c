@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <math.h>
+
+#include "yawcontrol.h"
+#include "command.h"
+#include "navdata.h"
+#include "timeutil.h"
+
+double wrapYaw( double milliDegrees )
+{
+	double range = MAX_YAW - MIN_YAW;
+	double wrapped = fmod( milliDegrees - MIN_YAW, range );
+	if( wrapped < 0 )
+	{
+		wrapped += range;
+	}
+
+	return wrapped + MIN_YAW;
+}
+
+// Proportional yaw rate for the given error, clamped to the usable range.
+static float yawRateFor( double error )
+{
+	double rate = error * YAW_GAIN;
+	if( fabs( rate ) > YAW_MAX_RATE )
+	{
+		rate = copysign( YAW_MAX_RATE, rate );
+	}
+	else if( fabs( rate ) < YAW_MIN_RATE )
+	{
+		rate = copysign( YAW_MIN_RATE, rate );
+	}
+
+	return (float)rate;
+}
+
+int yawRotate( NavdataHistory *history, double degrees )
+{
+	NavdataSample sample;
+	uint64_t seen = navdataHistoryCount( history );
+	if( navdataHistoryLatest( history, &sample ) < 0 )
+	{
+		fprintf( stderr, "yawRotate(): no navdata yet.\n" );
+		return -1;
+	}
+
+	double target = wrapYaw( sample.psi + 1000 * degrees );
+	uint64_t deadline = monotonicNs() + YAW_TIMEOUT_MS * NSEC_PER_MSEC;
+	unsigned int settled = 0;
+
+	for(;;)
+	{
+		recordNavdataAge( sample.rxTime );
+
+		double error = wrapYaw( target - sample.psi );
+		if( fabs( error ) < YAW_TOLERANCE )
+		{
+			if( ++settled >= YAW_SETTLE_SAMPLES )
+			{
+				droneHover();
+				return 0;
+			}
+			droneHover();
+		}
+		else
+		{
+			settled = 0;
+			droneMove( 0, 0, 0, yawRateFor( error ) );
+		}
+
+		if( monotonicNs() > deadline )
+		{
+			droneHover();
+			fprintf( stderr, "yawRotate(): gave up %.0f milli-degrees from target.\n", error );
+			return -1;
+		}
+
+		// Sleep until the next sample instead of polling; on a timeout the
+		// latest sample is simply reused and the set point sent again.
+		seen = navdataHistoryWait( history, seen, YAW_NAVDATA_WAIT_MS );
+		navdataHistoryLatest( history, &sample );
+	}
+}
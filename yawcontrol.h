@@ -0,0 +1,27 @@
+#ifndef _YAW_CONTROL_H_
+#define _YAW_CONTROL_H_
+
+#include "navhistory.h"
+
+// Navdata reports yaw (psi) in milli-degrees from -180000 to 180000.
+#define MAX_YAW 180000
+#define MIN_YAW -180000
+
+#define YAW_TOLERANCE 2000			// Milli-degrees. Close enough to call a turn finished.
+#define YAW_SETTLE_SAMPLES 3		// Consecutive samples inside the tolerance before stopping.
+#define YAW_GAIN ( 1.0 / 45000.0 )	// Yaw rate per milli-degree of error: full rate beyond 45 degrees.
+#define YAW_MAX_RATE 0.8			// Same rate as droneRotateLeft()/droneRotateRight().
+#define YAW_MIN_RATE 0.05			// Smaller set points barely move the drone.
+#define YAW_TIMEOUT_MS 5000			// Give up on a turn that hasn't settled by then.
+#define YAW_NAVDATA_WAIT_MS 200		// Longest wait for a navdata sample before re-sending.
+
+// Wraps an angle in milli-degrees into [MIN_YAW, MAX_YAW).
+double wrapYaw( double milliDegrees );
+
+// Turns the drone by the given number of degrees (positive is clockwise)
+// with a proportional controller that runs once per navdata sample, then
+// hovers. Returns 0 once settled, or -1 if there is no navdata or the turn
+// timed out.
+int yawRotate( NavdataHistory *history, double degrees );
+
+#endif